@@ -0,0 +1,322 @@
+/**
+ * @file BandMatrix.hpp
+ *
+ * Copyright 2023 Diego Nieto
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation and/or
+ * other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS” AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef BAND_MATRIX_H
+#define BAND_MATRIX_H
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "Squarematrix.hpp"
+
+/**
+ * @brief Lower and upper bandwidths of a matrix: A(i,j) = 0 when i-j > lower
+ * or j-i > upper
+ */
+struct Bandwidth
+{
+    unsigned int lower;
+    unsigned int upper;
+};
+
+/**
+ * @brief Smallest band holding every entry of a larger than tolerance in
+ * absolute value
+ */
+template <typename T, typename Access>
+Bandwidth detectBandwidth(const SquareMatrix<T, Access> &a, const T tolerance = static_cast<T>(0))
+{
+  Bandwidth bw = { 0, 0 };
+  const unsigned int n = a.getSize();
+  const T *data = a.getDataPtr();
+  for ( unsigned int i=0; i<n; i++ )
+  {
+    for ( unsigned int j=0; j<n; j++ )
+    {
+      if ( std::abs(data[i*n+j]) > tolerance ) {
+        if ( i > j )
+          bw.lower = std::max(bw.lower, i-j);
+        else
+          bw.upper = std::max(bw.upper, j-i);
+      }
+    }
+  }
+  return bw;
+}
+
+/**
+ * @brief Square band matrix in compact storage, O(n*bw) memory
+ *
+ * This is the row-major counterpart of the LAPACK gbtrf layout: row i keeps
+ * columns i-kl .. i+ku+kl in a row of 2*kl+ku+1 elements, element (i,j) at
+ * position j-i+kl. The last kl positions of each row are room for the fill
+ * created by row interchanges.
+ *
+ * lu() runs the Thomas algorithm (no pivoting, O(n)) on diagonally dominant
+ * tridiagonal matrices and a banded LU with partial pivoting, O(n*kl*(kl+ku)),
+ * on the rest. As in LAPACK, the multipliers of L are not moved by later
+ * interchanges, so solve() applies the interchanges step by step.
+ */
+template <typename T, typename Access = DefaultAccess>
+class BandMatrix
+{
+public:
+    BandMatrix(const unsigned int size, const unsigned int lower, const unsigned int upper,
+               MatrixAllocator &allocator = defaultMatrixAllocator()) :
+        _n(size), _kl(lower), _ku(upper), _band(size, 2*lower+upper+1, allocator)
+    {
+        _band.setZero();
+    }
+
+    /**
+     * @brief Band matrix with the entries of a inside the band detected by
+     * detectBandwidth(a)
+     */
+    static BandMatrix fromDense(const SquareMatrix<T, Access> &a);
+
+    unsigned int getSize() const { return _n; }
+    unsigned int getLowerBandwidth() const { return _kl; }
+    unsigned int getUpperBandwidth() const { return _ku; }
+
+    /**
+     * @brief Element (i,j), zero outside the band
+     */
+    T get(const unsigned int i, const unsigned int j) const
+    {
+        Access::check(i, j, _n, _n);
+        if ( !inBand(i, j, _ku+_kl) )
+            return static_cast<T>(0);
+        return _band.get(i, j+_kl-i);
+    }
+
+    /**
+     * @brief Sets element (i,j). Throws INVALID_RANGE outside the band
+     */
+    bool set(const unsigned int i, const unsigned int j, const T value)
+    {
+        if ( i >= _n || j >= _n || !inBand(i, j, _ku) )
+            throw INVALID_RANGE;
+        return _band.set(i, j+_kl-i, value);
+    }
+
+    /**
+     * @brief Compact storage, getSize() rows of 2*kl+ku+1 elements
+     */
+    T *getDataPtr() const { return _band.getDataPtr(); }
+
+    /**
+     * @brief Performs the LU decomposition inplace
+     */
+    void lu();
+
+    /**
+     * @brief Solves A*x = b using the LU decomposition stored inplace
+     */
+    std::vector<T> solve(const std::vector<T> &b) const;
+
+    /**
+     * @brief Solves A*X = B in place for every column of B
+     */
+    void solve(NumericMatrix<T, Access> &B) const;
+
+    /**
+     * @brief Row interchanges of the factorization, LAPACK ipiv style (0-based)
+     */
+    const std::vector<unsigned int> &getPivots() const { return _pivots; }
+
+private:
+    bool inBand(const unsigned int i, const unsigned int j, const unsigned int upper) const
+    {
+        return i <= j+_kl && j <= i+upper;
+    }
+
+    bool isDominantTridiagonal() const;
+
+    /**
+     * @brief Pointer to element (i,j) of the compact storage
+     */
+    T *at(const unsigned int i, const unsigned int j) const
+    {
+        return _band.getDataPtr()+i*_band.getColumnsCount()+(j+_kl-i);
+    }
+
+    /**
+     * @brief Forward and backward substitutions on x
+     */
+    void substitute(T *x, const size_t stride) const;
+
+    unsigned int _n;
+    unsigned int _kl;
+    unsigned int _ku;
+    NumericMatrix<T, Access> _band;
+    std::vector<unsigned int> _pivots;
+};
+
+template <typename T, typename Access>
+BandMatrix<T, Access> BandMatrix<T, Access>::fromDense(const SquareMatrix<T, Access> &a)
+{
+  const Bandwidth bw = detectBandwidth(a);
+  const unsigned int n = a.getSize();
+  BandMatrix band(n, bw.lower, bw.upper);
+  const T *data = a.getDataPtr();
+  for ( unsigned int i=0; i<n; i++ )
+  {
+    const unsigned int j0 = i > bw.lower ? i-bw.lower : 0;
+    const unsigned int j1 = std::min(n-1, i+bw.upper);
+    std::copy(data+i*n+j0, data+i*n+j1+1, band.at(i, j0));
+  }
+  return band;
+}
+
+template <typename T, typename Access>
+bool BandMatrix<T, Access>::isDominantTridiagonal() const
+{
+  if ( _kl != 1 || _ku != 1 )
+    return false;
+  for ( unsigned int i=0; i<_n; i++ )
+  {
+    T offDiagonal = 0;
+    if ( i > 0 )
+      offDiagonal += std::abs(*at(i, i-1));
+    if ( i+1 < _n )
+      offDiagonal += std::abs(*at(i, i+1));
+    if ( std::abs(*at(i, i)) < offDiagonal || *at(i, i) == static_cast<T>(0) )
+      return false;
+  }
+  return true;
+}
+
+template <typename T, typename Access>
+void BandMatrix<T, Access>::lu()
+{
+  const unsigned int n = _n;
+  _pivots.resize(n);
+
+  if ( isDominantTridiagonal() ) {
+    // Thomas algorithm: diagonal dominance makes pivoting unnecessary. Weak
+    // dominance still lets a diagonal cancel, e.g. [[1 1] [1 1]]
+    for ( unsigned int i=0; i<n; i++ )
+    {
+      _pivots[i] = i;
+      if ( i > 0 ) {
+        T *sub = at(i, i-1);
+        *sub /= *at(i-1, i-1);
+        *at(i, i) -= *sub * *at(i-1, i);
+        if ( *at(i, i) == static_cast<T>(0) )
+          throw SINGULAR_MATRIX;
+      }
+    }
+    return;
+  }
+
+  // Iterate through each column
+  for ( unsigned int col=0; col<n; col++ )
+  {
+    const unsigned int lastRow = std::min(n-1, col+_kl);
+    const unsigned int lastCol = std::min(n-1, col+_ku+_kl);
+
+    // Find the absolute max value of the column in the band
+    unsigned int maxValueRow = col;
+    T maxValue = std::abs(*at(col, col));
+    for ( unsigned int row=col+1; row<=lastRow; row++ )
+    {
+      if ( std::abs(*at(row, col)) > maxValue ) {
+        maxValue = std::abs(*at(row, col));
+        maxValueRow = row;
+      }
+    }
+    if ( maxValue == static_cast<T>(0) )
+      throw SINGULAR_MATRIX;
+    _pivots[col] = maxValueRow;
+
+    // Interchange the rows from the diagonal on, L stays in place
+    if ( maxValueRow != col )
+      std::swap_ranges(at(col, col), at(col, lastCol)+1, at(maxValueRow, col));
+
+    const T *pivotRow = at(col, col);
+    for ( unsigned int row=col+1; row<=lastRow; row++ )
+    {
+      T *currRow = at(row, col);
+      // Compute the pivot
+      const T p = static_cast<T>(-currRow[0]/pivotRow[0]);
+      // Update row
+      simd::axpy<T>(lastCol-col, p, pivotRow+1, currRow+1);
+      // Store the pivot for L
+      currRow[0] = -p;
+    }
+  }
+}
+
+template <typename T, typename Access>
+void BandMatrix<T, Access>::substitute(T *x, const size_t stride) const
+{
+  const unsigned int n = _n;
+  // Forward substitution, interchanges applied as they happened
+  for ( unsigned int k=0; k<n; k++ )
+  {
+    if ( _pivots[k] != k )
+      std::swap(x[k*stride], x[_pivots[k]*stride]);
+    const unsigned int lastRow = std::min(n-1, k+_kl);
+    for ( unsigned int row=k+1; row<=lastRow; row++ )
+      x[row*stride] -= *at(row, k)*x[k*stride];
+  }
+
+  // Backward substitution with U, whose rows reach column k+ku+kl
+  for ( unsigned int k=n; k-- > 0; )
+  {
+    const unsigned int lastCol = std::min(n-1, k+_ku+_kl);
+    const T *uRow = at(k, k);
+    T sum = x[k*stride];
+    for ( unsigned int j=k+1; j<=lastCol; j++ )
+      sum -= uRow[j-k]*x[j*stride];
+    x[k*stride] = sum/uRow[0];
+  }
+}
+
+template <typename T, typename Access>
+std::vector<T> BandMatrix<T, Access>::solve(const std::vector<T> &b) const
+{
+  if ( b.size() != _n )
+    throw INVALID_RANGE;
+  std::vector<T> x(b);
+  substitute(x.data(), 1);
+  return x;
+}
+
+template <typename T, typename Access>
+void BandMatrix<T, Access>::solve(NumericMatrix<T, Access> &B) const
+{
+  if ( B.getRowsCount() != _n )
+    throw INVALID_RANGE;
+  const MatrixView<T, Access> b = B.view();
+  for ( unsigned int col=0; col<b.getColumnsCount(); col++ )
+    substitute(b.data()+col, b.getStride());
+}
+
+#endif // BAND_MATRIX_H
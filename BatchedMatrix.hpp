@@ -0,0 +1,247 @@
+/**
+ * @file BatchedMatrix.hpp
+ *
+ * Copyright 2023 Diego Nieto
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation and/or
+ * other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS” AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef BATCHED_MATRIX_H
+#define BATCHED_MATRIX_H
+
+#include <algorithm>
+#include <vector>
+
+#include "MatrixAccess.hpp"
+#include "MatrixAllocator.hpp"
+#include "SimdKernels.hpp"
+#include "TaskScheduler.hpp"
+
+/**
+ * @brief Groups of matrices handled by each task of the parallel methods
+ */
+const unsigned int defaultBatchGrain = 64;
+
+/**
+ * @brief Batch of square matrices of the same size, stored interleaved
+ * (structure of arrays)
+ *
+ * Matrices are kept in groups of lanes = matrixAlignment/sizeof(T): element (i,j) of the
+ * matrices of a group is contiguous, one cache line. lu() and getInverse()
+ * then run the usual algorithms with one matrix per SIMD lane, pivoting
+ * included, and the groups may be split across threads. Lanes past
+ * getBatchCount() hold the identity.
+ */
+template <typename T, typename Access = DefaultAccess>
+class BatchedSquareMatrix
+{
+public:
+    static constexpr unsigned int lanes = sizeof(T) < matrixAlignment ? matrixAlignment/sizeof(T) : 1;
+
+    BatchedSquareMatrix(const unsigned int size, const size_t count) :
+        _n(size), _count(count), _groups((count+lanes-1)/lanes),
+        _data(allocate(_groups*size*size*lanes)),
+        _pivots(allocate(_groups*size*lanes))
+    {
+        std::fill(_data, _data+_groups*_n*_n*lanes, T(0));
+        std::fill(_pivots, _pivots+_groups*_n*lanes, T(0));
+        for ( size_t b=_count; b<_groups*lanes; b++ )
+            for ( unsigned int i=0; i<_n; i++ )
+                _data[offset(b/lanes, i, i)+b%lanes] = T(1);
+    }
+
+    BatchedSquareMatrix(BatchedSquareMatrix &&other) :
+        _n(other._n), _count(other._count), _groups(other._groups),
+        _data(other._data), _pivots(other._pivots)
+    {
+        other._data = nullptr;
+        other._pivots = nullptr;
+        other._count = other._groups = 0;
+    }
+
+    BatchedSquareMatrix(const BatchedSquareMatrix &) = delete;
+    BatchedSquareMatrix &operator=(const BatchedSquareMatrix &) = delete;
+
+    ~BatchedSquareMatrix()
+    {
+        release(_data, _groups*_n*_n*lanes);
+        release(_pivots, _groups*_n*lanes);
+    }
+
+    unsigned int getSize() const { return _n; }
+    size_t getBatchCount() const { return _count; }
+
+    T get(const size_t b, const unsigned int i, const unsigned int j) const
+    {
+        Access::check(i, j, _n, _n);
+        checkBatch(b);
+        return _data[offset(b/lanes, i, j)+b%lanes];
+    }
+
+    bool set(const size_t b, const unsigned int i, const unsigned int j, const T value)
+    {
+        Access::check(i, j, _n, _n);
+        checkBatch(b);
+        _data[offset(b/lanes, i, j)+b%lanes] = value;
+        return true;
+    }
+
+    /**
+     * @brief Copies matrix b from row-major memory of size getSize()^2
+     */
+    void setMatrix(const size_t b, const T *ptr)
+    {
+        checkBatch(b);
+        for ( unsigned int i=0; i<_n; i++ )
+            for ( unsigned int j=0; j<_n; j++ )
+                _data[offset(b/lanes, i, j)+b%lanes] = ptr[i*_n+j];
+    }
+
+    /**
+     * @brief Copies matrix b to row-major memory of size getSize()^2
+     */
+    void getMatrix(const size_t b, T *ptr) const
+    {
+        checkBatch(b);
+        for ( unsigned int i=0; i<_n; i++ )
+            for ( unsigned int j=0; j<_n; j++ )
+                ptr[i*_n+j] = _data[offset(b/lanes, i, j)+b%lanes];
+    }
+
+    /**
+     * @brief Interleaved storage, getSize()^2 * lanes elements per group
+     */
+    T *getDataPtr() { return _data; }
+
+    /**
+     * @brief Performs the LU decomposition with partial pivoting of every
+     * matrix inplace, same layout as SquareMatrix<T>::lu()
+     */
+    void lu() { luGroups(0, _groups); }
+
+    /**
+     * @brief Same as lu() with the groups split across nThreads threads
+     */
+    void luParallel(const unsigned int nThreads)
+    {
+        WorkStealingPool pool(nThreads);
+        luParallel(pool);
+    }
+
+    void luParallel(WorkStealingPool &pool)
+    {
+        forEachChunk(pool, [this](const size_t g0, const size_t g1) { luGroups(g0, g1); });
+    }
+
+    /**
+     * @brief Inverse of every matrix from the LU decompositions stored
+     * inplace. The factorizations are not modified
+     */
+    BatchedSquareMatrix getInverse() const
+    {
+        BatchedSquareMatrix inverse(_n, _count);
+        inverseGroups(inverse, 0, _groups);
+        return inverse;
+    }
+
+    /**
+     * @brief Same as getInverse() with the groups split across the threads
+     * of the pool
+     */
+    BatchedSquareMatrix getInverseParallel(WorkStealingPool &pool) const
+    {
+        BatchedSquareMatrix inverse(_n, _count);
+        forEachChunk(pool, [this, &inverse](const size_t g0, const size_t g1) {
+            inverseGroups(inverse, g0, g1);
+        });
+        return inverse;
+    }
+
+    /**
+     * @brief Row interchanges of the last factorization of matrix b, LAPACK
+     * ipiv style (0-based)
+     */
+    std::vector<unsigned int> getPivots(const size_t b) const
+    {
+        checkBatch(b);
+        std::vector<unsigned int> pivots(_n);
+        for ( unsigned int k=0; k<_n; k++ )
+            pivots[k] = static_cast<unsigned int>(_pivots[(b/lanes*_n+k)*lanes+b%lanes]);
+        return pivots;
+    }
+
+private:
+    static T *allocate(const size_t count)
+    {
+        return static_cast<T *>(defaultMatrixAllocator().allocate(count*sizeof(T)));
+    }
+
+    static void release(T *ptr, const size_t count)
+    {
+        if ( ptr )
+            defaultMatrixAllocator().deallocate(ptr, count*sizeof(T));
+    }
+
+    size_t offset(const size_t group, const unsigned int i, const unsigned int j) const
+    {
+        return ((group*_n+i)*_n+j)*lanes;
+    }
+
+    void checkBatch(const size_t b) const
+    {
+        Access::checkIndex(b, _count);
+    }
+
+    void luGroups(const size_t g0, const size_t g1)
+    {
+        for ( size_t g=g0; g<g1; g++ )
+            simd::batchLu<T>(_n, lanes, _data+offset(g, 0, 0), _pivots+g*_n*lanes);
+    }
+
+    void inverseGroups(BatchedSquareMatrix &inverse, const size_t g0, const size_t g1) const
+    {
+        for ( size_t g=g0; g<g1; g++ )
+            simd::batchInverse<T>(_n, lanes, _data+offset(g, 0, 0), _pivots+g*_n*lanes,
+                                  inverse._data+offset(g, 0, 0));
+    }
+
+    template <typename F>
+    void forEachChunk(WorkStealingPool &pool, F f) const
+    {
+        TaskGraph graph;
+        for ( size_t g=0; g<_groups; g+=defaultBatchGrain )
+        {
+            const size_t g1 = std::min<size_t>(g+defaultBatchGrain, _groups);
+            graph.addTask([f, g, g1]() { f(g, g1); });
+        }
+        pool.run(graph);
+    }
+
+    const unsigned int _n;
+    size_t _count;
+    size_t _groups;
+    T *_data;
+    T *_pivots;
+};
+
+#endif // BATCHED_MATRIX_H
@@ -0,0 +1,306 @@
+/**
+ * @file FixedSquareMatrix.hpp
+ *
+ * Copyright 2023 Diego Nieto
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation and/or
+ * other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS” AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef FIXED_SQUARE_MATRIX_H
+#define FIXED_SQUARE_MATRIX_H
+
+#include <array>
+#include <iostream>
+#include <iomanip>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <string.h>
+
+#include "MatrixAccess.hpp"
+#include "MatrixView.hpp"
+
+namespace fixed_detail {
+
+template <unsigned int Begin, typename F, unsigned int... I>
+constexpr void staticForImpl(F &&f, std::integer_sequence<unsigned int, I...>)
+{
+  (f(std::integral_constant<unsigned int, Begin+I>{}), ...);
+}
+
+/**
+ * @brief Calls f(std::integral_constant<unsigned int, i>) for i in [Begin, End),
+ * so loops with compile-time bounds are unrolled by the compiler
+ */
+template <unsigned int Begin, unsigned int End, typename F>
+constexpr void staticFor(F &&f)
+{
+  if constexpr ( Begin < End )
+    staticForImpl<Begin>(f, std::make_integer_sequence<unsigned int, End-Begin>{});
+}
+
+template <typename T>
+constexpr T absValue(const T value)
+{
+  return value < T(0) ? -value : value;
+}
+
+template <typename T>
+constexpr void swapValues(T &a, T &b)
+{
+  const T tmp = a;
+  a = b;
+  b = tmp;
+}
+
+} // namespace fixed_detail
+
+/**
+ * @brief Square matrix whose size is known at compile time
+ *
+ * The storage lives inside the object (no heap allocation) and the loops of
+ * lu(), solve() and getInverse() are unrolled through templates, so small
+ * matrices compile to straight-line code. All of them are constexpr. The
+ * interface follows SquareMatrix<T>, so call sites can switch between both
+ * with a typedef.
+ */
+template <typename T, unsigned int N, typename Access = DefaultAccess>
+class FixedSquareMatrix
+{
+    static_assert(N > 0, "FixedSquareMatrix needs at least one row");
+
+public:
+    constexpr FixedSquareMatrix() : _matrix{}, _pivots{}
+    {
+        fixed_detail::staticFor<0, N>([&](auto i) { _pivots[i] = i; });
+    }
+
+    /**
+     * @brief Same constructor as SquareMatrix(size). Throws INVALID_RANGE if
+     * size is not N
+     */
+    explicit constexpr FixedSquareMatrix(const int size) : FixedSquareMatrix()
+    {
+        if ( size != static_cast<int>(N) )
+            throw INVALID_RANGE;
+    }
+
+    constexpr unsigned int getSize() const { return N; }
+    constexpr unsigned int getRowsCount() const { return N; }
+    constexpr unsigned int getColumnsCount() const { return N; }
+
+    constexpr T get(const unsigned int i, const unsigned int j) const
+    {
+        Access::check(i, j, N, N);
+        return _matrix[i*N+j];
+    }
+
+    constexpr bool set(const unsigned int i, const unsigned int j, const T value)
+    {
+        Access::check(i, j, N, N);
+        _matrix[i*N+j] = value;
+        return true;
+    }
+
+    T *getDataPtr() { return _matrix.data(); }
+    const T *getDataPtr() const { return _matrix.data(); }
+
+    MatrixView<T, Access> view() { return MatrixView<T, Access>(_matrix.data(), N, N, N); }
+    MatrixView<const T, Access> view() const { return MatrixView<const T, Access>(_matrix.data(), N, N, N); }
+
+    constexpr void setZero()
+    {
+        fixed_detail::staticFor<0, N*N>([&](auto i) { _matrix[i] = T(0); });
+    }
+
+    /**
+     * @brief Set data from a memory pointer
+     *
+     * @param ptr pointer to data
+     * @param size size of the data. Must match N*N
+     */
+    void setData(const T *ptr, const size_t size)
+    {
+        if ( size != N*N )
+            throw INVALID_RANGE;
+        memcpy(_matrix.data(), ptr, size*sizeof(T));
+    }
+
+    void print() const
+    {
+        for ( unsigned int i = 0; i < N; i++ )
+        {
+            for ( unsigned int j = 0; j < N; j++ )
+            {
+                std::cout << std::setprecision(4) << _matrix[i*N+j] << "\t\t\t";
+            }
+            std::cout << std::endl;
+        }
+        std::cout << std::endl;
+    }
+
+    /**
+     * @brief Performs an LU decomposition with partial pivoting inplace, same
+     * layout and pivots as SquareMatrix<T>::lu()
+     */
+    constexpr void lu();
+
+    /**
+     * @brief Solves A*x = b using the LU decomposition stored inplace
+     */
+    constexpr std::array<T, N> solve(const std::array<T, N> &b) const;
+
+    /**
+     * @brief Same as solve(std::array) with the interface of SquareMatrix<T>
+     */
+    std::vector<T> solve(const std::vector<T> &b) const
+    {
+        if ( b.size() != N )
+            throw INVALID_RANGE;
+        std::array<T, N> rhs{};
+        std::copy(b.begin(), b.end(), rhs.begin());
+        const std::array<T, N> x = solve(rhs);
+        return std::vector<T>(x.begin(), x.end());
+    }
+
+    /**
+     * @brief Get the inverse of the matrix from the LU decomposition stored
+     * inplace. The factorization is not modified
+     */
+    constexpr FixedSquareMatrix getInverse() const;
+
+    /**
+     * @brief Row interchanges of the last factorization, LAPACK ipiv style
+     * (0-based). Identity if the matrix has not been factorized
+     */
+    constexpr const std::array<unsigned int, N> &getPivots() const { return _pivots; }
+
+private:
+    constexpr T &at(const unsigned int i, const unsigned int j) { return _matrix[i*N+j]; }
+    constexpr const T &at(const unsigned int i, const unsigned int j) const { return _matrix[i*N+j]; }
+
+    /**
+     * @brief Forward and backward substitutions on the columns of b
+     */
+    template <unsigned int NRHS>
+    constexpr void substitute(std::array<T, N*NRHS> &b) const;
+
+    std::array<T, N*N> _matrix;
+    std::array<unsigned int, N> _pivots;
+};
+
+template <typename T, unsigned int N, typename Access>
+constexpr void FixedSquareMatrix<T, N, Access>::lu()
+{
+  using fixed_detail::staticFor;
+
+  // Iterate through each column
+  staticFor<0, N-1>([&](auto column) {
+    constexpr unsigned int col = decltype(column)::value;
+
+    // Find the absolute max value of the column in the rows range(col:N)
+    unsigned int maxValueRow = col;
+    T maxValue = fixed_detail::absValue(at(col, col));
+    staticFor<col+1, N>([&](auto row) {
+      if ( fixed_detail::absValue(at(row, col)) > maxValue ) {
+        maxValue = fixed_detail::absValue(at(row, col));
+        maxValueRow = row;
+      }
+    });
+    _pivots[col] = maxValueRow;
+
+    // Interchange row (col <-> maxValueRow)
+    if ( maxValueRow != col ) {
+      staticFor<0, N>([&](auto k) { fixed_detail::swapValues(at(col, k), at(maxValueRow, k)); });
+    }
+
+    // Iterate through each row to do zero
+    staticFor<col+1, N>([&](auto row) {
+      // Compute the pivot
+      const T p = static_cast<T>(-at(row, col)/at(col, col));
+      // Update row
+      staticFor<col+1, N>([&](auto k) { at(row, k) += p*at(col, k); });
+      // Store the pivot for L
+      at(row, col) = -p;
+    });
+  });
+  _pivots[N-1] = N-1;
+}
+
+template <typename T, unsigned int N, typename Access>
+template <unsigned int NRHS>
+constexpr void FixedSquareMatrix<T, N, Access>::substitute(std::array<T, N*NRHS> &b) const
+{
+  using fixed_detail::staticFor;
+
+  // Forward substitution with the unit lower triangle
+  staticFor<1, N>([&](auto row) {
+    staticFor<0, row>([&](auto k) {
+      const T l = at(row, k);
+      staticFor<0, NRHS>([&](auto col) { b[row*NRHS+col] -= l*b[k*NRHS+col]; });
+    });
+  });
+
+  // Backward substitution with the upper triangle
+  staticFor<0, N>([&](auto step) {
+    constexpr unsigned int row = N-1-decltype(step)::value;
+    staticFor<row+1, N>([&](auto k) {
+      const T u = at(row, k);
+      staticFor<0, NRHS>([&](auto col) { b[row*NRHS+col] -= u*b[k*NRHS+col]; });
+    });
+    const T p = T(1)/at(row, row);
+    staticFor<0, NRHS>([&](auto col) { b[row*NRHS+col] *= p; });
+  });
+}
+
+template <typename T, unsigned int N, typename Access>
+constexpr std::array<T, N> FixedSquareMatrix<T, N, Access>::solve(const std::array<T, N> &b) const
+{
+  std::array<T, N> x = b;
+  fixed_detail::staticFor<0, N>([&](auto i) { fixed_detail::swapValues(x[i], x[_pivots[i]]); });
+  substitute<1>(x);
+  return x;
+}
+
+template <typename T, unsigned int N, typename Access>
+constexpr FixedSquareMatrix<T, N, Access> FixedSquareMatrix<T, N, Access>::getInverse() const
+{
+  using fixed_detail::staticFor;
+
+  // Solve A * X = I: the identity with the rows interchanged as in the factorization
+  std::array<T, N*N> x{};
+  staticFor<0, N>([&](auto i) { x[i*N+i] = T(1); });
+  staticFor<0, N>([&](auto i) {
+    if ( _pivots[i] != i ) {
+      staticFor<0, N>([&](auto k) { fixed_detail::swapValues(x[i*N+k], x[_pivots[i]*N+k]); });
+    }
+  });
+  substitute<N>(x);
+
+  FixedSquareMatrix inverse;
+  inverse._matrix = x;
+  return inverse;
+}
+
+#endif // FIXED_SQUARE_MATRIX_H
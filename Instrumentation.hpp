@@ -0,0 +1,489 @@
+/**
+ * @file Instrumentation.hpp
+ *
+ * Copyright 2023 Diego Nieto
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation and/or
+ * other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS” AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef INSTRUMENTATION_H
+#define INSTRUMENTATION_H
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#if defined(VLU_INSTRUMENTATION) && defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#define VLU_PERF_EVENTS
+#endif
+
+/**
+ * Instrumentation of the factorizations, compiled in only when
+ * VLU_INSTRUMENTATION is defined (meson -Dinstrumentation=true). The kernels
+ * mark their phases with VLU_PHASE and the public operations with
+ * VLU_OPERATION. Without VLU_INSTRUMENTATION both macros expand to
+ * expressions that do not evaluate their arguments, so the hot paths are
+ * unchanged.
+ *
+ * Every phase accumulates its wall time, calls, bytes moved and nominal flops
+ * into process-wide counters, plus cycles, instructions and cache misses of
+ * the calling thread when the Linux perf_event_open counters are enabled.
+ * When the outermost operation of a thread returns, its observers receive
+ * the difference of the counters over the operation, which includes the work
+ * of the pool threads it used, but also of operations running concurrently
+ * on other threads.
+ */
+
+enum InstrumentationPhase {
+    PHASE_PIVOT_SEARCH,
+    PHASE_ROW_SWAP,
+    PHASE_ELIMINATION,
+    PHASE_FORWARD_SUBSTITUTION,
+    PHASE_BACKWARD_SUBSTITUTION,
+    PHASE_INVERSION,
+    PHASE_COUNT
+};
+
+struct PhaseStatistics
+{
+    uint64_t calls;
+    uint64_t nanoseconds;
+    uint64_t bytes;
+    /** Nominal floating point operations of the algorithm */
+    uint64_t flops;
+    /** Hardware counters, 0 unless enableHardwareCounters() succeeded */
+    uint64_t cycles;
+    uint64_t instructions;
+    uint64_t cacheMisses;
+};
+
+/**
+ * @brief Counters of one operation, passed to the observers
+ */
+struct InstrumentationReport
+{
+    /** Name of the operation, e.g. "lu" or "getInverse" */
+    const char *operation;
+    unsigned int size;
+    /** Wall time of the whole operation */
+    uint64_t nanoseconds;
+    std::array<PhaseStatistics, PHASE_COUNT> phases;
+};
+
+namespace instrumentation {
+
+#ifdef VLU_INSTRUMENTATION
+constexpr bool enabled = true;
+#else
+constexpr bool enabled = false;
+#endif
+
+typedef std::function<void(const InstrumentationReport &)> Observer;
+
+inline const char *getPhaseName(const InstrumentationPhase phase)
+{
+    switch ( phase )
+    {
+    case PHASE_PIVOT_SEARCH: return "pivot search";
+    case PHASE_ROW_SWAP: return "row swaps";
+    case PHASE_ELIMINATION: return "elimination";
+    case PHASE_FORWARD_SUBSTITUTION: return "forward substitution";
+    case PHASE_BACKWARD_SUBSTITUTION: return "backward substitution";
+    case PHASE_INVERSION: return "inversion";
+    default: return "unknown";
+    }
+}
+
+/**
+ * @brief Process-wide counters and observers
+ */
+class Registry
+{
+public:
+    static Registry &instance()
+    {
+        static Registry registry;
+        return registry;
+    }
+
+    void record(const InstrumentationPhase phase, const PhaseStatistics &statistics)
+    {
+        AtomicStatistics &p = _phases[phase];
+        p.calls.fetch_add(statistics.calls, std::memory_order_relaxed);
+        p.nanoseconds.fetch_add(statistics.nanoseconds, std::memory_order_relaxed);
+        p.bytes.fetch_add(statistics.bytes, std::memory_order_relaxed);
+        p.flops.fetch_add(statistics.flops, std::memory_order_relaxed);
+        p.cycles.fetch_add(statistics.cycles, std::memory_order_relaxed);
+        p.instructions.fetch_add(statistics.instructions, std::memory_order_relaxed);
+        p.cacheMisses.fetch_add(statistics.cacheMisses, std::memory_order_relaxed);
+    }
+
+    InstrumentationReport getTotals() const
+    {
+        InstrumentationReport report = {"total", 0, 0, {}};
+        for ( unsigned int i=0; i<PHASE_COUNT; i++ )
+        {
+            const AtomicStatistics &p = _phases[i];
+            report.phases[i] = { p.calls.load(std::memory_order_relaxed),
+                                 p.nanoseconds.load(std::memory_order_relaxed),
+                                 p.bytes.load(std::memory_order_relaxed),
+                                 p.flops.load(std::memory_order_relaxed),
+                                 p.cycles.load(std::memory_order_relaxed),
+                                 p.instructions.load(std::memory_order_relaxed),
+                                 p.cacheMisses.load(std::memory_order_relaxed) };
+            report.nanoseconds += report.phases[i].nanoseconds;
+        }
+        return report;
+    }
+
+    void reset()
+    {
+        for ( AtomicStatistics &p : _phases )
+        {
+            p.calls = 0;
+            p.nanoseconds = 0;
+            p.bytes = 0;
+            p.flops = 0;
+            p.cycles = 0;
+            p.instructions = 0;
+            p.cacheMisses = 0;
+        }
+    }
+
+    int addObserver(Observer observer)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _observers.emplace_back(_nextId, std::move(observer));
+        _hasObservers = true;
+        return _nextId++;
+    }
+
+    void removeObserver(const int id)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        for ( auto it=_observers.begin(); it!=_observers.end(); ++it )
+        {
+            if ( it->first == id ) {
+                _observers.erase(it);
+                break;
+            }
+        }
+        _hasObservers = !_observers.empty();
+    }
+
+    bool hasObservers() const { return _hasObservers.load(std::memory_order_relaxed); }
+
+    /**
+     * @brief Calls every observer on the calling thread. Exceptions thrown by
+     * the observers are ignored
+     */
+    void notify(const InstrumentationReport &report)
+    {
+        std::vector<std::pair<int, Observer>> observers;
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            observers = _observers;
+        }
+        for ( const auto &observer : observers )
+        {
+            try {
+                observer.second(report);
+            } catch (...) {
+            }
+        }
+    }
+
+    std::atomic<bool> hardwareCounters{false};
+
+private:
+    struct AtomicStatistics
+    {
+        std::atomic<uint64_t> calls{0};
+        std::atomic<uint64_t> nanoseconds{0};
+        std::atomic<uint64_t> bytes{0};
+        std::atomic<uint64_t> flops{0};
+        std::atomic<uint64_t> cycles{0};
+        std::atomic<uint64_t> instructions{0};
+        std::atomic<uint64_t> cacheMisses{0};
+    };
+
+    Registry() {}
+
+    std::array<AtomicStatistics, PHASE_COUNT> _phases;
+    std::mutex _mutex;
+    std::vector<std::pair<int, Observer>> _observers;
+    std::atomic<bool> _hasObservers{false};
+    int _nextId = 0;
+};
+
+/**
+ * @brief Cycles, instructions and cache misses of the calling thread, read
+ * as one perf_event_open group. Not available on other systems, or when
+ * perf_event_paranoid forbids it
+ */
+class HardwareCounters
+{
+public:
+    static constexpr unsigned int count = 3;
+
+    static HardwareCounters &local()
+    {
+        thread_local HardwareCounters counters;
+        return counters;
+    }
+
+    bool isOpen() const { return _fds[0] >= 0; }
+
+    bool read(uint64_t values[count]) const
+    {
+#ifdef VLU_PERF_EVENTS
+        struct { uint64_t nr; uint64_t values[count]; } group;
+        if ( !isOpen() || ::read(_fds[0], &group, sizeof(group)) != static_cast<ssize_t>(sizeof(group)) )
+            return false;
+        for ( unsigned int i=0; i<count; i++ )
+            values[i] = group.values[i];
+        return true;
+#else
+        (void)values;
+        return false;
+#endif
+    }
+
+    HardwareCounters(const HardwareCounters &) = delete;
+    HardwareCounters &operator=(const HardwareCounters &) = delete;
+
+private:
+    HardwareCounters() : _fds{-1, -1, -1}
+    {
+#ifdef VLU_PERF_EVENTS
+        const uint64_t events[count] = {
+            PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES
+        };
+        for ( unsigned int i=0; i<count; i++ )
+        {
+            struct perf_event_attr attr = {};
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.size = sizeof(attr);
+            attr.config = events[i];
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            attr.read_format = PERF_FORMAT_GROUP;
+            _fds[i] = static_cast<int>(syscall(__NR_perf_event_open, &attr, 0, -1, i == 0 ? -1 : _fds[0], 0));
+            if ( _fds[i] < 0 ) {
+                close();
+                return;
+            }
+        }
+#endif
+    }
+
+    ~HardwareCounters() { close(); }
+
+    void close()
+    {
+#ifdef VLU_PERF_EVENTS
+        for ( int &fd : _fds )
+        {
+            if ( fd >= 0 )
+                ::close(fd);
+            fd = -1;
+        }
+#endif
+    }
+
+    int _fds[count];
+};
+
+/**
+ * @brief Adds a callback receiving the report of every operation. It runs on
+ * the thread that called the operation, GUIs have to forward it to their own
+ * thread. Never called when the instrumentation is compiled out
+ *
+ * @return id for removeObserver()
+ */
+inline int addObserver(Observer observer)
+{
+    return Registry::instance().addObserver(std::move(observer));
+}
+
+inline void removeObserver(const int id)
+{
+    Registry::instance().removeObserver(id);
+}
+
+/**
+ * @brief Counters accumulated since the start or the last reset()
+ */
+inline InstrumentationReport getTotals()
+{
+    return Registry::instance().getTotals();
+}
+
+inline void reset()
+{
+    Registry::instance().reset();
+}
+
+/**
+ * @brief Turns the hardware counters on or off for the phases recorded from
+ * now on
+ *
+ * @return whether the counters are on, false if the system does not give
+ * access to them or the instrumentation is compiled out
+ */
+inline bool enableHardwareCounters(const bool enable)
+{
+    const bool available = enabled && enable && HardwareCounters::local().isOpen();
+    Registry::instance().hardwareCounters = available;
+    return available;
+}
+
+/**
+ * @brief Records the phase from construction to destruction
+ */
+class PhaseTimer
+{
+public:
+    PhaseTimer(const InstrumentationPhase phase, const uint64_t bytes, const uint64_t flops) :
+    _phase(phase), _bytes(bytes), _flops(flops), _counters(false)
+    {
+        if ( Registry::instance().hardwareCounters.load(std::memory_order_relaxed) )
+            _counters = HardwareCounters::local().read(_startCounters);
+        _start = std::chrono::steady_clock::now();
+    }
+
+    ~PhaseTimer()
+    {
+        const auto end = std::chrono::steady_clock::now();
+        PhaseStatistics statistics = {};
+        statistics.calls = 1;
+        statistics.nanoseconds = static_cast<uint64_t>(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(end-_start).count());
+        statistics.bytes = _bytes;
+        statistics.flops = _flops;
+        uint64_t endCounters[HardwareCounters::count];
+        if ( _counters && HardwareCounters::local().read(endCounters) ) {
+            statistics.cycles = endCounters[0]-_startCounters[0];
+            statistics.instructions = endCounters[1]-_startCounters[1];
+            statistics.cacheMisses = endCounters[2]-_startCounters[2];
+        }
+        Registry::instance().record(_phase, statistics);
+    }
+
+    PhaseTimer(const PhaseTimer &) = delete;
+    PhaseTimer &operator=(const PhaseTimer &) = delete;
+
+private:
+    const InstrumentationPhase _phase;
+    const uint64_t _bytes;
+    const uint64_t _flops;
+    bool _counters;
+    uint64_t _startCounters[HardwareCounters::count];
+    std::chrono::steady_clock::time_point _start;
+};
+
+/**
+ * @brief Public operation. The outermost one of each thread notifies the
+ * observers when it ends
+ */
+class OperationScope
+{
+public:
+    OperationScope(const char *operation, const unsigned int size) :
+    _operation(operation), _size(size), _outermost(depth()++ == 0 && Registry::instance().hasObservers())
+    {
+        if ( _outermost ) {
+            _totals = Registry::instance().getTotals();
+            _start = std::chrono::steady_clock::now();
+        }
+    }
+
+    ~OperationScope()
+    {
+        depth()--;
+        if ( !_outermost )
+            return;
+        const auto end = std::chrono::steady_clock::now();
+        const InstrumentationReport totals = Registry::instance().getTotals();
+        InstrumentationReport report = {_operation, _size, static_cast<uint64_t>(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(end-_start).count()), {}};
+        for ( unsigned int i=0; i<PHASE_COUNT; i++ )
+        {
+            const PhaseStatistics &a = totals.phases[i];
+            const PhaseStatistics &b = _totals.phases[i];
+            report.phases[i] = { a.calls-b.calls, a.nanoseconds-b.nanoseconds, a.bytes-b.bytes,
+                                 a.flops-b.flops, a.cycles-b.cycles, a.instructions-b.instructions,
+                                 a.cacheMisses-b.cacheMisses };
+        }
+        Registry::instance().notify(report);
+    }
+
+    OperationScope(const OperationScope &) = delete;
+    OperationScope &operator=(const OperationScope &) = delete;
+
+private:
+    static unsigned int &depth()
+    {
+        thread_local unsigned int depth = 0;
+        return depth;
+    }
+
+    const char *_operation;
+    const unsigned int _size;
+    const bool _outermost;
+    InstrumentationReport _totals;
+    std::chrono::steady_clock::time_point _start;
+};
+
+} // namespace instrumentation
+
+#define VLU_CONCAT_IMPL(a, b) a##b
+#define VLU_CONCAT(a, b) VLU_CONCAT_IMPL(a, b)
+
+#ifdef VLU_INSTRUMENTATION
+/**
+ * @brief Records the rest of the enclosing block as a phase moving bytes and
+ * doing flops
+ */
+#define VLU_PHASE(phase, bytes, flops) \
+    instrumentation::PhaseTimer VLU_CONCAT(vluPhase, __LINE__)((phase), (bytes), (flops))
+/**
+ * @brief Marks the rest of the enclosing block as a public operation
+ */
+#define VLU_OPERATION(name, size) \
+    instrumentation::OperationScope VLU_CONCAT(vluOperation, __LINE__)((name), (size))
+#else
+// The arguments stay referenced, but are not evaluated
+#define VLU_PHASE(phase, bytes, flops) ((void)sizeof(phase), (void)sizeof(bytes), (void)sizeof(flops))
+#define VLU_OPERATION(name, size) ((void)sizeof(name), (void)sizeof(size))
+#endif
+
+#endif // INSTRUMENTATION_H
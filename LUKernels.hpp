@@ -0,0 +1,347 @@
+/**
+ * @file LUKernels.hpp
+ *
+ * Copyright 2023 Diego Nieto
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation and/or
+ * other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS” AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef LU_KERNELS_H
+#define LU_KERNELS_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+
+#include "Instrumentation.hpp"
+#include "MatrixMultiply.hpp"
+#include "MatrixView.hpp"
+#include "SimdKernels.hpp"
+
+/**
+ * Building blocks of the blocked factorizations. All of them work on
+ * MatrixView blocks, so that they can be applied to any submatrix of a
+ * SquareMatrix without copying it. Inner loops run on the row pointers of the
+ * views through the vectorized kernels of SimdKernels.hpp, the Access policy of
+ * the views only checks whole rows and blocks.
+ */
+namespace kernels {
+
+/**
+ * @brief Columns of C and inner dimension updated per sweep in gemmUpdate.
+ * Keeps a block of B in L2 while the rows of C stream through L1
+ */
+const unsigned int gemmColumnBlock = 256;
+const unsigned int gemmInnerBlock = 256;
+
+/**
+ * @brief Inner dimension from which gemmAccumulate packs its operands. Below
+ * it the traffic on C dominates and packing does not pay off
+ */
+const unsigned int packedMinDepth = 96;
+
+/**
+ * @brief Width under which the recursive kernels stop splitting. It only
+ * amortizes the recursion overhead, it is not tied to any cache size
+ */
+const unsigned int recursionCutoff = 16;
+
+/**
+ * @brief Unblocked LU with partial pivoting of a m x nb panel
+ *
+ * Rows are only interchanged inside the panel columns, the caller is in charge
+ * of applying the interchanges to the rest of the matrix (see laswp).
+ *
+ * @param ipiv receives, for each panel column, the pivot row relative to the
+ * top of the panel
+ */
+template <typename T, typename Access>
+void getf2(const MatrixView<T, Access> &a, unsigned int *ipiv)
+{
+  const unsigned int m = a.getRowsCount();
+  const unsigned int nb = a.getColumnsCount();
+  const unsigned int steps = std::min(m, nb);
+  for ( unsigned int col=0; col<steps; col++ )
+  {
+    unsigned int maxValueRow;
+    {
+      VLU_PHASE(PHASE_PIVOT_SEARCH, (m-col)*sizeof(T), 0);
+      // Find the absolute max value of the column in the rows range(col:m)
+      maxValueRow = col+simd::iamax<T>(m-col, a.row(col)+col, a.getStride());
+    }
+    ipiv[col] = maxValueRow;
+    if ( maxValueRow != col ) {
+      VLU_PHASE(PHASE_ROW_SWAP, 2*nb*sizeof(T), 0);
+      std::swap_ranges(a.row(col), a.row(col)+nb, a.row(maxValueRow));
+    }
+
+    VLU_PHASE(PHASE_ELIMINATION, uint64_t(m-col-1)*(nb-col)*sizeof(T), uint64_t(m-col-1)*(2*(nb-col)-1));
+    const T *pivotRow = a.row(col);
+    for ( unsigned int row=col+1; row<m; row++ )
+    {
+      T *currRow = a.row(row);
+      // Compute the pivot
+      const T p = static_cast<T>(-currRow[col]/pivotRow[col]);
+      // Update row
+      simd::axpy<T>(nb-col-1, p, pivotRow+col+1, currRow+col+1);
+      // Store the pivot for L
+      currRow[col] = -p;
+    }
+  }
+}
+
+/**
+ * @brief Applies the row interchanges ipiv[k1:k2) to every column of a
+ *
+ * @param ipiv pivots expressed as row indices of a
+ */
+template <typename T, typename Access>
+void laswp(const MatrixView<T, Access> &a, const unsigned int k1, const unsigned int k2,
+           const unsigned int *ipiv)
+{
+  const unsigned int ncols = a.getColumnsCount();
+  if ( ncols == 0 )
+    return;
+  for ( unsigned int k=k1; k<k2; k++ )
+  {
+    if ( ipiv[k] != k ) {
+      VLU_PHASE(PHASE_ROW_SWAP, 2*ncols*sizeof(T), 0);
+      std::swap_ranges(a.row(k), a.row(k)+ncols, a.row(ipiv[k]));
+    }
+  }
+}
+
+/**
+ * @brief Solves L*X = B in place, L being the unit lower triangle of l and B
+ * a block with as many rows as l
+ */
+template <typename T, typename U, typename Access>
+void trsmLowerUnit(const MatrixView<U, Access> &l, const MatrixView<T, Access> &b)
+{
+  const unsigned int m = l.getRowsCount();
+  const unsigned int ncols = b.getColumnsCount();
+  for ( unsigned int row=1; row<m; row++ )
+  {
+    T *bRow = b.row(row);
+    const U *lRow = l.row(row);
+    for ( unsigned int k=0; k<row; k++ )
+      simd::axpy<T>(ncols, -lRow[k], b.row(k), bRow);
+  }
+}
+
+/**
+ * @brief Solves U*X = B in place, U being the upper triangle (diagonal
+ * included) of u and B a block with as many rows as u
+ */
+template <typename T, typename U, typename Access>
+void trsmUpper(const MatrixView<U, Access> &u, const MatrixView<T, Access> &b)
+{
+  const unsigned int m = u.getRowsCount();
+  const unsigned int ncols = b.getColumnsCount();
+  for ( int row=static_cast<int>(m)-1; row>=0; row-- )
+  {
+    T *bRow = b.row(row);
+    const U *uRow = u.row(row);
+    for ( unsigned int k=row+1; k<m; k++ )
+      simd::axpy<T>(ncols, -uRow[k], b.row(k), bRow);
+    const T p = static_cast<T>(1)/uRow[row];
+    for ( unsigned int col=0; col<ncols; col++ )
+      bRow[col] *= p;
+  }
+}
+
+/**
+ * @brief Solves L*x = b in place for a single right-hand side, L being the
+ * unit lower triangle of l
+ */
+template <typename T, typename U, typename Access>
+void trsvLowerUnit(const MatrixView<U, Access> &l, T *x)
+{
+  const unsigned int m = l.getRowsCount();
+  for ( unsigned int row=1; row<m; row++ )
+  {
+    x[row] -= simd::dot<T>(row, l.row(row), x);
+  }
+}
+
+/**
+ * @brief Solves U*x = b in place for a single right-hand side, U being the
+ * upper triangle (diagonal included) of u
+ */
+template <typename T, typename U, typename Access>
+void trsvUpper(const MatrixView<U, Access> &u, T *x)
+{
+  const unsigned int m = u.getRowsCount();
+  for ( int row=static_cast<int>(m)-1; row>=0; row-- )
+  {
+    const U *uRow = u.row(row);
+    x[row] = (x[row]-simd::dot<T>(m-row-1, uRow+row+1, x+row+1))/uRow[row];
+  }
+}
+
+/**
+ * @brief C = C + alpha*A*B, with C m x n, A m x kb and B kb x n
+ */
+template <typename T, typename UA, typename UB, typename Access>
+void gemmAccumulate(const MatrixView<T, Access> &c, const MatrixView<UA, Access> &a,
+                    const MatrixView<UB, Access> &b, const T alpha)
+{
+  const unsigned int m = c.getRowsCount();
+  const unsigned int n = c.getColumnsCount();
+  const unsigned int kb = a.getColumnsCount();
+  if ( m == 0 )
+    return;
+  if ( kb >= packedMinDepth && m >= packedMinDepth && n >= packedMinDepth ) {
+    gemmPacked(c, a, b, alpha, static_cast<T>(1));
+    return;
+  }
+  for ( unsigned int col0=0; col0<n; col0+=gemmColumnBlock )
+  {
+    const unsigned int ncols = std::min(gemmColumnBlock, n-col0);
+    for ( unsigned int k0=0; k0<kb; k0+=gemmInnerBlock )
+    {
+      const unsigned int nk = std::min(gemmInnerBlock, kb-k0);
+      simd::gemm<T>(m, ncols, nk, alpha,
+                    a.row(0)+k0, a.getStride(), b.row(k0)+col0, b.getStride(),
+                    c.row(0)+col0, c.getStride());
+    }
+  }
+}
+
+/**
+ * @brief Trailing matrix update C = C - A*B, with C m x n, A m x kb and B kb x n
+ */
+template <typename T, typename UA, typename UB, typename Access>
+void gemmUpdate(const MatrixView<T, Access> &c, const MatrixView<UA, Access> &a,
+                const MatrixView<UB, Access> &b)
+{
+  gemmAccumulate(c, a, b, static_cast<T>(-1));
+}
+
+/**
+ * @brief Blocked version of trsmLowerUnit. Most of the work is done by
+ * gemmUpdate, only the diagonal blocks are solved by substitution
+ */
+template <typename T, typename U, typename Access>
+void trsmLowerUnitBlocked(const MatrixView<U, Access> &l, const MatrixView<T, Access> &b,
+                          const unsigned int blockSize)
+{
+  const unsigned int m = l.getRowsCount();
+  const unsigned int ncols = b.getColumnsCount();
+  for ( unsigned int i0=0; i0<m; i0+=blockSize )
+  {
+    const unsigned int ib = std::min(blockSize, m-i0);
+    // B(i0:i1) -= L(i0:i1, 0:i0) * X(0:i0)
+    gemmUpdate(b.block(i0, 0, ib, ncols), l.block(i0, 0, ib, i0), b.block(0, 0, i0, ncols));
+    trsmLowerUnit(l.block(i0, i0, ib, ib), b.block(i0, 0, ib, ncols));
+  }
+}
+
+/**
+ * @brief Blocked version of trsmUpper, going from the bottom block upwards
+ */
+template <typename T, typename U, typename Access>
+void trsmUpperBlocked(const MatrixView<U, Access> &u, const MatrixView<T, Access> &b,
+                      const unsigned int blockSize)
+{
+  const unsigned int m = u.getRowsCount();
+  const unsigned int ncols = b.getColumnsCount();
+  for ( unsigned int i1=m; i1>0; )
+  {
+    const unsigned int ib = std::min(blockSize, i1);
+    const unsigned int i0 = i1-ib;
+    // B(i0:i1) -= U(i0:i1, i1:m) * X(i1:m)
+    gemmUpdate(b.block(i0, 0, ib, ncols), u.block(i0, i1, ib, m-i1), b.block(i1, 0, m-i1, ncols));
+    trsmUpper(u.block(i0, i0, ib, ib), b.block(i0, 0, ib, ncols));
+    i1 = i0;
+  }
+}
+
+/**
+ * @brief Recursive version of trsmLowerUnit: the rows of L are split in
+ * halves, so the solve works on blocks fitting every cache level without a
+ * block size
+ */
+template <typename T, typename U, typename Access>
+void trsmLowerUnitRecursive(const MatrixView<U, Access> &l, const MatrixView<T, Access> &b)
+{
+  const unsigned int m = l.getRowsCount();
+  const unsigned int ncols = b.getColumnsCount();
+  if ( m <= recursionCutoff ) {
+    trsmLowerUnit(l, b);
+    return;
+  }
+  const unsigned int m1 = m/2;
+  const unsigned int m2 = m-m1;
+  trsmLowerUnitRecursive(l.block(0, 0, m1, m1), b.block(0, 0, m1, ncols));
+  // B2 -= L21 * X1
+  gemmUpdate(b.block(m1, 0, m2, ncols), l.block(m1, 0, m2, m1), b.block(0, 0, m1, ncols));
+  trsmLowerUnitRecursive(l.block(m1, m1, m2, m2), b.block(m1, 0, m2, ncols));
+}
+
+/**
+ * @brief Recursive LU with partial pivoting of a m x n panel, m >= n
+ *
+ * The columns are split in halves: the left half is factorized recursively,
+ * its interchanges and triangular solve are applied to the right half, which
+ * is updated and factorized recursively too. The interchanges of the right
+ * half are finally applied to the left half. Same result as getf2.
+ *
+ * @param ipiv receives, for each column, the pivot row relative to the top
+ * of the panel
+ */
+template <typename T, typename Access>
+void getrfRecursive(const MatrixView<T, Access> &a, unsigned int *ipiv)
+{
+  const unsigned int m = a.getRowsCount();
+  const unsigned int n = a.getColumnsCount();
+  if ( n <= recursionCutoff ) {
+    getf2(a, ipiv);
+    return;
+  }
+  const unsigned int n1 = n/2;
+  const unsigned int n2 = n-n1;
+
+  // [A11; A21] = P1 * [L11; L21] * U11
+  getrfRecursive(a.block(0, 0, m, n1), ipiv);
+
+  // A12 = L11^-1 * P1 * A12, A22 -= L21 * A12
+  const MatrixView<T, Access> right = a.block(0, n1, m, n2);
+  laswp(right, 0, n1, ipiv);
+  {
+    VLU_PHASE(PHASE_ELIMINATION, uint64_t(m)*n2*sizeof(T), uint64_t(n1)*n1*n2+2*uint64_t(m-n1)*n1*n2);
+    trsmLowerUnitRecursive(a.block(0, 0, n1, n1), a.block(0, n1, n1, n2));
+    gemmUpdate(a.block(n1, n1, m-n1, n2), a.block(n1, 0, m-n1, n1), a.block(0, n1, n1, n2));
+  }
+
+  // A22 = P2 * L22 * U22, then the interchanges of P2 are applied to L21
+  getrfRecursive(a.block(n1, n1, m-n1, n2), ipiv+n1);
+  const unsigned int steps2 = std::min(m-n1, n2);
+  laswp(a.block(n1, 0, m-n1, n1), 0, steps2, ipiv+n1);
+  for ( unsigned int k=n1; k<n1+steps2; k++ )
+    ipiv[k] += n1;
+}
+
+} // namespace kernels
+
+#endif // LU_KERNELS_H
@@ -0,0 +1,134 @@
+/**
+ * @file LUTrace.hpp
+ *
+ * Copyright 2023 Diego Nieto
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation and/or
+ * other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS” AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef LU_TRACE_H
+#define LU_TRACE_H
+
+#include <algorithm>
+#include <vector>
+
+#include "MatrixView.hpp"
+#include "SimdKernels.hpp"
+
+/**
+ * Compact trace of the elimination of SquareMatrix::lu(). Step k swaps row k
+ * with the pivot row and subtracts multiplier(i) * U(k, k:n) from every row
+ * i below it, so the n-k-1 multipliers and the n-k elements of the pivot row
+ * describe every cell the step changes: the whole trace takes O(n^2)
+ * elements instead of the O(n^3) of a snapshot per step.
+ */
+
+/**
+ * @brief One step of the elimination as seen by a sink. The pointers are
+ * only valid during LUTraceSink::step()
+ */
+template <typename T>
+struct LUTraceStep
+{
+    /** Column eliminated, from 0 to n-2 */
+    unsigned int step;
+    /** Row interchanged with row step, step if none */
+    unsigned int pivotRow;
+    /** The n-step-1 multipliers of L(step+1:n, step) */
+    const T *multipliers;
+    /** U(step, step:n), the pivot row after the interchange, n-step elements */
+    const T *pivotRowValues;
+};
+
+/**
+ * @brief Receives the trace of SquareMatrix::lu()
+ *
+ * begin() gets the matrix before the elimination, then step() is called
+ * once per eliminated column and end() when the factorization is complete.
+ * A sink may throw to stop the factorization: lu() rethrows the exception
+ * and leaves the matrix without factorization nor pivots and with undefined
+ * elements, as a cancelled operation does.
+ */
+template <typename T>
+class LUTraceSink
+{
+public:
+    virtual ~LUTraceSink() {}
+
+    /**
+     * @param matrix size x size row-major elements
+     */
+    virtual void begin(const unsigned int size, const T *matrix) = 0;
+    virtual void step(const LUTraceStep<T> &step) = 0;
+    virtual void end() {}
+};
+
+/**
+ * @brief Owned copy of a step, as kept by the sinks and read back from
+ * trace files
+ */
+template <typename T>
+struct LUTraceRecord
+{
+    unsigned int step;
+    unsigned int pivotRow;
+    std::vector<T> multipliers;
+    std::vector<T> pivotRowValues;
+
+    LUTraceRecord() : step(0), pivotRow(0) {}
+
+    explicit LUTraceRecord(const LUTraceStep<T> &traceStep, const unsigned int size) :
+    step(traceStep.step), pivotRow(traceStep.pivotRow),
+    multipliers(traceStep.multipliers, traceStep.multipliers+(size-traceStep.step-1)),
+    pivotRowValues(traceStep.pivotRowValues, traceStep.pivotRowValues+(size-traceStep.step))
+    {
+    }
+
+    LUTraceStep<T> getStep() const
+    {
+        return LUTraceStep<T>{step, pivotRow, multipliers.data(), pivotRowValues.data()};
+    }
+};
+
+/**
+ * @brief Applies one traced step to the state of the elimination before it,
+ * giving the same elements as lu() after the step
+ */
+template <typename T, typename Access>
+void applyLUTraceStep(const MatrixView<T, Access> &a, const LUTraceStep<T> &traceStep)
+{
+  const unsigned int n = a.getRowsCount();
+  const unsigned int k = traceStep.step;
+  if ( traceStep.pivotRow != k )
+    std::swap_ranges(a.row(k), a.row(k)+n, a.row(traceStep.pivotRow));
+  std::copy(traceStep.pivotRowValues, traceStep.pivotRowValues+(n-k), a.row(k)+k);
+  for ( unsigned int i=k+1; i<n; i++ )
+  {
+    // Same update as lu() so the elements match to the last bit
+    const T l = traceStep.multipliers[i-k-1];
+    simd::axpy<T>(n-k-1, -l, traceStep.pivotRowValues+1, a.row(i)+k+1);
+    a.row(i)[k] = l;
+  }
+}
+
+#endif // LU_TRACE_H
@@ -6,18 +6,41 @@
 
 QT       += core gui
 
-greaterThan(QT_MAJOR_VERSION, 4): QT += widgets
+greaterThan(QT_MAJOR_VERSION, 4): QT += widgets concurrent
 
 TARGET = LU_factorization
 TEMPLATE = app
+CONFIG += c++17
 
 
 SOURCES += main.cpp\
-        lu_main_window.cpp
+        lu_main_window.cpp \
+        matrix_table_model.cpp
 
 HEADERS  += lu_main_window.h \
+    matrix_table_model.h \
     Matrix.hpp \
+    MatrixAccess.hpp \
+    MatrixAllocator.hpp \
+    MatrixView.hpp \
     NumericMatrix.hpp \
-    Squarematrix.hpp
+    MatrixExpression.hpp \
+    MatrixMultiply.hpp \
+    Squarematrix.hpp \
+    LUKernels.hpp \
+    TaskScheduler.hpp \
+    SimdKernels.hpp \
+    SimdKernelsImpl.hpp \
+    FixedSquareMatrix.hpp \
+    BatchedMatrix.hpp \
+    MixedPrecision.hpp \
+    SparseMatrix.hpp \
+    BandMatrix.hpp \
+    Instrumentation.hpp \
+    MatrixFile.hpp \
+    MatrixMarket.hpp \
+    OutOfCore.hpp \
+    LUTrace.hpp \
+    TraceSinks.hpp
 
 FORMS    += lu_main_window.ui
@@ -31,77 +31,181 @@
 
 #include <iostream>
 #include <iomanip>
+#include <memory>
+#include <utility>
 
-enum Matrix_Errors {
-    INVALID_RANGE = -20
-};
+#include "MatrixAccess.hpp"
+#include "MatrixAllocator.hpp"
+#include "MatrixView.hpp"
 
-template <typename T>
+/**
+ * @brief Row-major dense matrix
+ *
+ * The Access policy (CheckedAccess or UncheckedAccess) decides at compile time
+ * whether get() and set() are range checked. By default it is checked unless
+ * NDEBUG is defined.
+ *
+ * The elements come from a MatrixAllocator, aligned to matrixAlignment. It
+ * must outlive the matrix. They can also live in external storage, such as
+ * a memory-mapped file, which the matrix keeps alive.
+ */
+template <typename T, typename Access = DefaultAccess>
 class Matrix
 {
 protected:
-    const unsigned int _nrows;
-    const unsigned int _ncols;
+    unsigned int _nrows;
+    unsigned int _ncols;
     T *_matrix;
+    MatrixAllocator *_allocator;
+    /**
+     * @brief Owner of the elements when they are not from _allocator
+     */
+    std::shared_ptr<void> _storage;
+    bool _external;
 public:
-    Matrix(const int nrows, const int ncols) :
-    _nrows(nrows), _ncols(ncols)
+    Matrix(const int nrows, const int ncols,
+           MatrixAllocator &allocator = defaultMatrixAllocator()) :
+    _nrows(nrows), _ncols(ncols), _allocator(&allocator), _external(false)
+    {
+        _matrix = static_cast<T *>(_allocator->allocate(sizeof(T)*_nrows*_ncols));
+        std::uninitialized_default_construct_n(_matrix, _nrows*_ncols);
+    }
+
+    /**
+     * @brief Wraps nrows*ncols elements in external storage without copying
+     * them. storage is released with the matrix, copies of it take their
+     * memory from defaultMatrixAllocator()
+     *
+     * @param data row-major elements, aligned to matrixAlignment
+     * @param storage owner of data, may be empty if it outlives the matrix
+     */
+    Matrix(T *data, const int nrows, const int ncols, std::shared_ptr<void> storage) :
+    _nrows(nrows), _ncols(ncols), _matrix(data), _allocator(&defaultMatrixAllocator()),
+    _storage(std::move(storage)), _external(true)
+    {
+    }
+
+    /**
+     * @brief Deep copy, taking its memory from the allocator of other
+     */
+    Matrix(const Matrix &other) :
+    _nrows(other._nrows), _ncols(other._ncols), _allocator(other._allocator), _external(false)
+    {
+        _matrix = static_cast<T *>(_allocator->allocate(sizeof(T)*_nrows*_ncols));
+        std::uninitialized_copy_n(other._matrix, _nrows*_ncols, _matrix);
+    }
+
+    /**
+     * @brief Takes the storage of other, which is left as a 0 x 0 matrix
+     */
+    Matrix(Matrix &&other) noexcept :
+    _nrows(other._nrows), _ncols(other._ncols), _matrix(other._matrix), _allocator(other._allocator),
+    _storage(std::move(other._storage)), _external(other._external)
     {
-        _matrix = new T[_nrows*_ncols];
+        other._external = false;
+        other._nrows = 0;
+        other._ncols = 0;
+        other._matrix = nullptr;
+    }
+
+    /**
+     * @brief Deep copy. The storage is reused when the sizes match
+     */
+    Matrix &operator=(const Matrix &other)
+    {
+        if ( this != &other ) {
+            if ( _nrows*_ncols == other._nrows*other._ncols ) {
+                std::copy(other._matrix, other._matrix+other._nrows*other._ncols, _matrix);
+                _nrows = other._nrows;
+                _ncols = other._ncols;
+            } else {
+                Matrix copy(other);
+                swap(copy);
+            }
+        }
+        return *this;
+    }
+
+    Matrix &operator=(Matrix &&other) noexcept
+    {
+        Matrix moved(std::move(other));
+        swap(moved);
+        return *this;
     }
 
     virtual ~Matrix()
     {
-        delete[] _matrix;
+        if ( _matrix && !_external ) {
+            std::destroy_n(_matrix, _nrows*_ncols);
+            _allocator->deallocate(_matrix, sizeof(T)*_nrows*_ncols);
+        }
+    }
+
+    void swap(Matrix &other) noexcept
+    {
+        std::swap(_nrows, other._nrows);
+        std::swap(_ncols, other._ncols);
+        std::swap(_matrix, other._matrix);
+        std::swap(_allocator, other._allocator);
+        std::swap(_storage, other._storage);
+        std::swap(_external, other._external);
     }
 
-    virtual T get(const unsigned int i, const unsigned int j) const;
-    virtual T* getDataPtr() const;
-    virtual bool set(const unsigned int i, const unsigned int j, const T value);
-    virtual const unsigned int getRowsCount() const;
-    virtual const unsigned int getColumnsCount() const;
+    T get(const unsigned int i, const unsigned int j) const;
+    T* getDataPtr() const;
+    bool set(const unsigned int i, const unsigned int j, const T value);
+    const unsigned int getRowsCount() const;
+    const unsigned int getColumnsCount() const;
     void print() const;
+    MatrixAllocator &getAllocator() const { return *_allocator; }
+
+    /**
+     * @brief Whether the elements live in external storage
+     */
+    bool isExternal() const { return _external; }
+
+    /**
+     * @brief Non-owning view of the whole matrix
+     */
+    MatrixView<T, Access> view() { return MatrixView<T, Access>(_matrix, _nrows, _ncols, _ncols); }
+    MatrixView<const T, Access> view() const { return MatrixView<const T, Access>(_matrix, _nrows, _ncols, _ncols); }
 };
 
-template <typename T>
-T Matrix<T>::get(const unsigned int i, const unsigned int j) const
+template <typename T, typename Access>
+inline T Matrix<T, Access>::get(const unsigned int i, const unsigned int j) const
 {
-    if ( i <_nrows && j < _ncols )
-        return _matrix[i*_ncols+j];
-    else
-        throw INVALID_RANGE;
+    Access::check(i, j, _nrows, _ncols);
+    return _matrix[i*_ncols+j];
 }
 
-template <typename T>
-T* Matrix<T>::getDataPtr() const
+template <typename T, typename Access>
+T* Matrix<T, Access>::getDataPtr() const
 {
     return _matrix;
 }
 
-template <typename T>
-bool Matrix<T>::set(const unsigned int i, const unsigned int j, const T value)
+template <typename T, typename Access>
+inline bool Matrix<T, Access>::set(const unsigned int i, const unsigned int j, const T value)
 {
-    if ( i <_nrows && j < _ncols ) {
-        _matrix[i*_ncols+j] = value;
-        return true;
-    } else
-        throw INVALID_RANGE;
+    Access::check(i, j, _nrows, _ncols);
+    _matrix[i*_ncols+j] = value;
+    return true;
 }
 
-template <typename T>
-const unsigned int Matrix<T>::getRowsCount() const
+template <typename T, typename Access>
+const unsigned int Matrix<T, Access>::getRowsCount() const
 {
     return _nrows;
 }
 
-template <typename T>
-const unsigned int Matrix<T>::getColumnsCount() const
+template <typename T, typename Access>
+const unsigned int Matrix<T, Access>::getColumnsCount() const
 {
     return _ncols;
 }
 
-template <typename T>
-void Matrix<T>::print() const
+template <typename T, typename Access>
+void Matrix<T, Access>::print() const
 {
     for (unsigned int i = 0; i < _nrows; i++)
     {
@@ -0,0 +1,96 @@
+/**
+ * @file MatrixAccess.hpp
+ *
+ * Copyright 2023 Diego Nieto
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation and/or
+ * other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS” AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef MATRIX_ACCESS_H
+#define MATRIX_ACCESS_H
+
+#include <stddef.h>
+
+enum Matrix_Errors {
+    INVALID_RANGE = -20,
+    SINGULAR_MATRIX = -21,
+    NOT_POSITIVE_DEFINITE = -22,
+    FILE_ERROR = -23,
+    INVALID_FORMAT = -24,
+    INVALID_FACTORIZATION = -25,
+    OPERATION_CANCELLED = -26
+};
+
+/**
+ * @brief Access policy throwing INVALID_RANGE on every out of range access
+ */
+struct CheckedAccess
+{
+    static constexpr void check(const unsigned int i, const unsigned int j,
+                                const unsigned int nrows, const unsigned int ncols)
+    {
+        if ( i >= nrows || j >= ncols )
+            throw INVALID_RANGE;
+    }
+
+    static constexpr void checkBlock(const unsigned int i, const unsigned int j,
+                                     const unsigned int nrows, const unsigned int ncols,
+                                     const unsigned int totalRows, const unsigned int totalCols)
+    {
+        if ( i > totalRows || j > totalCols || nrows > totalRows-i || ncols > totalCols-j )
+            throw INVALID_RANGE;
+    }
+
+    static constexpr void checkIndex(const size_t index, const size_t count)
+    {
+        if ( index >= count )
+            throw INVALID_RANGE;
+    }
+};
+
+/**
+ * @brief Access policy without any check, so element access compiles to plain
+ * pointer arithmetic
+ */
+struct UncheckedAccess
+{
+    static constexpr void check(const unsigned int, const unsigned int,
+                                const unsigned int, const unsigned int) {}
+
+    static constexpr void checkBlock(const unsigned int, const unsigned int,
+                                     const unsigned int, const unsigned int,
+                                     const unsigned int, const unsigned int) {}
+
+    static constexpr void checkIndex(const size_t, const size_t) {}
+};
+
+/**
+ * @brief Debug builds keep range checking, release builds (NDEBUG) drop it
+ */
+#ifdef NDEBUG
+typedef UncheckedAccess DefaultAccess;
+#else
+typedef CheckedAccess DefaultAccess;
+#endif
+
+#endif // MATRIX_ACCESS_H
@@ -0,0 +1,311 @@
+/**
+ * @file MatrixAllocator.hpp
+ *
+ * Copyright 2023 Diego Nieto
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation and/or
+ * other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS” AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef MATRIX_ALLOCATOR_H
+#define MATRIX_ALLOCATOR_H
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <new>
+#include <vector>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+/**
+ * @brief Alignment of every block handed out by the allocators, one cache
+ * line and one AVX-512 vector
+ */
+const size_t matrixAlignment = 64;
+
+/**
+ * @brief Strategy used by Matrix to get the memory of its elements
+ *
+ * Blocks must be aligned to matrixAlignment. deallocate() receives the same
+ * size given to allocate().
+ */
+class MatrixAllocator
+{
+public:
+    virtual ~MatrixAllocator() {}
+    virtual void *allocate(const size_t bytes) = 0;
+    virtual void deallocate(void *ptr, const size_t bytes) = 0;
+};
+
+/**
+ * @brief Heap memory aligned to matrixAlignment. It also counts the
+ * allocations it serves, which is handy to check that a loop does not
+ * allocate
+ */
+class AlignedAllocator : public MatrixAllocator
+{
+public:
+    void *allocate(const size_t bytes) override
+    {
+        _allocations.fetch_add(1, std::memory_order_relaxed);
+        _allocatedBytes.fetch_add(bytes, std::memory_order_relaxed);
+        return ::operator new(std::max<size_t>(bytes, 1), std::align_val_t(matrixAlignment));
+    }
+
+    void deallocate(void *ptr, const size_t) override
+    {
+        ::operator delete(ptr, std::align_val_t(matrixAlignment));
+    }
+
+    size_t getAllocationsCount() const { return _allocations.load(std::memory_order_relaxed); }
+    size_t getAllocatedBytes() const { return _allocatedBytes.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<size_t> _allocations{0};
+    std::atomic<size_t> _allocatedBytes{0};
+};
+
+/**
+ * @brief Allocator used when none is given to a matrix
+ */
+inline AlignedAllocator &defaultMatrixAllocator()
+{
+    static AlignedAllocator allocator;
+    return allocator;
+}
+
+/**
+ * @brief Maps large blocks directly and asks the kernel to back them with
+ * transparent huge pages, which cuts TLB misses on big matrices. Blocks
+ * smaller than the threshold, or on systems without madvise, come from
+ * defaultMatrixAllocator()
+ */
+class HugePageAllocator : public MatrixAllocator
+{
+public:
+    static constexpr size_t hugePageSize = size_t(2) << 20;
+
+    explicit HugePageAllocator(const size_t threshold = hugePageSize) :
+        _threshold(threshold) {}
+
+    void *allocate(const size_t bytes) override
+    {
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+        if ( bytes >= _threshold ) {
+            void *ptr = mmap(nullptr, roundUp(bytes), PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if ( ptr == MAP_FAILED )
+                throw std::bad_alloc();
+            // Only a hint, the mapping works with regular pages as well
+            madvise(ptr, roundUp(bytes), MADV_HUGEPAGE);
+            return ptr;
+        }
+#endif
+        return defaultMatrixAllocator().allocate(bytes);
+    }
+
+    void deallocate(void *ptr, const size_t bytes) override
+    {
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+        if ( bytes >= _threshold ) {
+            munmap(ptr, roundUp(bytes));
+            return;
+        }
+#endif
+        defaultMatrixAllocator().deallocate(ptr, bytes);
+    }
+
+private:
+    static size_t roundUp(const size_t bytes)
+    {
+        return (bytes+hugePageSize-1)/hugePageSize*hugePageSize;
+    }
+
+    const size_t _threshold;
+};
+
+/**
+ * @brief Per-thread bump allocator for temporary workspaces
+ *
+ * Blocks must be released in the reverse order of their allocation, as
+ * scoped workspaces are. Memory is kept in chunks that are never returned
+ * while the thread lives; when the arena gets empty and it had to grow to
+ * several chunks, they are merged into one, so after the first iterations a
+ * loop taking the same workspaces does not touch the heap anymore.
+ */
+class ScratchArena
+{
+public:
+    static constexpr size_t defaultChunkSize = size_t(1) << 20;
+
+    ScratchArena() : _current(0) {}
+
+    ScratchArena(const ScratchArena &) = delete;
+    ScratchArena &operator=(const ScratchArena &) = delete;
+
+    ~ScratchArena()
+    {
+        for ( Chunk &chunk : _chunks )
+            defaultMatrixAllocator().deallocate(chunk.base, chunk.size);
+    }
+
+    /**
+     * @brief Arena of the calling thread
+     */
+    static ScratchArena &local()
+    {
+        thread_local ScratchArena arena;
+        return arena;
+    }
+
+    void *allocate(const size_t bytes)
+    {
+        const size_t size = roundUp(bytes);
+        if ( _chunks.empty() || _chunks[_current].size-_chunks[_current].used < size ) {
+            // Chunks after the current one are empty: take the next one if it
+            // is large enough, or add a larger one
+            if ( _current+1 < _chunks.size() && _chunks[_current+1].size >= size ) {
+                _current++;
+            } else {
+                Chunk chunk;
+                const size_t last = _chunks.empty() ? 0 : _chunks.back().size;
+                chunk.size = std::max(std::max(size, defaultChunkSize), 2*last);
+                chunk.base = static_cast<char *>(defaultMatrixAllocator().allocate(chunk.size));
+                chunk.used = 0;
+                _chunks.push_back(chunk);
+                _current = _chunks.size()-1;
+            }
+        }
+        Chunk &chunk = _chunks[_current];
+        void *ptr = chunk.base+chunk.used;
+        chunk.used += size;
+        return ptr;
+    }
+
+    void deallocate(void *ptr, const size_t bytes)
+    {
+        const size_t size = roundUp(bytes);
+        Chunk &chunk = _chunks[_current];
+        assert(chunk.base+chunk.used-size == static_cast<char *>(ptr) && "scratch blocks must be released in LIFO order");
+        (void) ptr;
+        chunk.used -= size;
+
+        // Step back to the previous chunk still in use
+        while ( _current > 0 && _chunks[_current].used == 0 )
+            _current--;
+        if ( _current == 0 && _chunks[0].used == 0 && _chunks.size() > 1 )
+            merge();
+    }
+
+    /**
+     * @brief Bytes reserved by the arena
+     */
+    size_t getCapacity() const
+    {
+        size_t capacity = 0;
+        for ( const Chunk &chunk : _chunks )
+            capacity += chunk.size;
+        return capacity;
+    }
+
+private:
+    struct Chunk
+    {
+        char *base;
+        size_t size;
+        size_t used;
+    };
+
+    static size_t roundUp(const size_t bytes)
+    {
+        return (std::max<size_t>(bytes, 1)+matrixAlignment-1)/matrixAlignment*matrixAlignment;
+    }
+
+    /**
+     * @brief Replaces every chunk by a single one as large as all of them
+     */
+    void merge()
+    {
+        const size_t capacity = getCapacity();
+        for ( Chunk &chunk : _chunks )
+            defaultMatrixAllocator().deallocate(chunk.base, chunk.size);
+        _chunks.resize(1);
+        _chunks[0].size = capacity;
+        _chunks[0].base = static_cast<char *>(defaultMatrixAllocator().allocate(capacity));
+        _chunks[0].used = 0;
+        _current = 0;
+    }
+
+    std::vector<Chunk> _chunks;
+    size_t _current;
+};
+
+/**
+ * @brief Matrices taking their memory from the scratch arena of the calling
+ * thread. They must be destroyed by that thread, in the reverse order of
+ * their creation
+ */
+class ScratchAllocator : public MatrixAllocator
+{
+public:
+    void *allocate(const size_t bytes) override { return ScratchArena::local().allocate(bytes); }
+    void deallocate(void *ptr, const size_t bytes) override { ScratchArena::local().deallocate(ptr, bytes); }
+};
+
+inline ScratchAllocator &scratchMatrixAllocator()
+{
+    static ScratchAllocator allocator;
+    return allocator;
+}
+
+/**
+ * @brief Scoped array of n elements of T from the scratch arena of the
+ * calling thread. Elements are not initialized
+ */
+template <typename T>
+class ScratchBuffer
+{
+public:
+    explicit ScratchBuffer(const size_t n) :
+        _size(n), _data(static_cast<T *>(ScratchArena::local().allocate(n*sizeof(T)))) {}
+
+    ~ScratchBuffer() { ScratchArena::local().deallocate(_data, _size*sizeof(T)); }
+
+    ScratchBuffer(const ScratchBuffer &) = delete;
+    ScratchBuffer &operator=(const ScratchBuffer &) = delete;
+
+    T *data() { return _data; }
+    const T *data() const { return _data; }
+    size_t size() const { return _size; }
+    T &operator[](const size_t i) { return _data[i]; }
+    const T &operator[](const size_t i) const { return _data[i]; }
+
+private:
+    const size_t _size;
+    T *_data;
+};
+
+#endif // MATRIX_ALLOCATOR_H
@@ -0,0 +1,486 @@
+/**
+ * @file MatrixExpression.hpp
+ *
+ * Copyright 2023 Diego Nieto
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation and/or
+ * other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS” AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef MATRIX_EXPRESSION_H
+#define MATRIX_EXPRESSION_H
+
+#include <memory>
+#include <type_traits>
+
+#include "Matrix.hpp"
+#include "LUKernels.hpp"
+
+/**
+ * Lazy arithmetic on matrices. The operators below do not compute anything,
+ * they build a tree of expressions holding views of their operands, which is
+ * evaluated when it is assigned to a NumericMatrix. Element-wise nodes (+, -,
+ * scalar * and transpose) are evaluated together in one pass over the
+ * destination, without intermediate matrices. Products go through
+ * kernels::gemmAccumulate: a product at the top of the expression, or as an
+ * operand of the top + or -, is accumulated straight into the destination,
+ * so R = A*x - b only allocates R. Deeper products are evaluated into a
+ * temporary first.
+ *
+ * The operands must outlive the expression, which is meant to be assigned in
+ * the same statement that builds it.
+ */
+
+/**
+ * @brief Base of every expression node, which E derives from
+ */
+template <typename E>
+class MatrixExpression
+{
+public:
+    const E &derived() const { return static_cast<const E &>(*this); }
+    unsigned int getRowsCount() const { return derived().getRowsCount(); }
+    unsigned int getColumnsCount() const { return derived().getColumnsCount(); }
+};
+
+/**
+ * @brief Leaf of an expression, a view of a Matrix
+ */
+template <typename T, typename Access>
+class MatrixOperand : public MatrixExpression<MatrixOperand<T, Access>>
+{
+public:
+    typedef T Scalar;
+
+    explicit MatrixOperand(const Matrix<T, Access> &matrix) : _view(matrix.view()) {}
+
+    unsigned int getRowsCount() const { return _view.getRowsCount(); }
+    unsigned int getColumnsCount() const { return _view.getColumnsCount(); }
+    T value(const unsigned int i, const unsigned int j) const { return _view.data()[i*_view.getStride()+j]; }
+
+    /**
+     * @brief Whether the expression reads the storage starting at data
+     */
+    bool reads(const T *data) const { return _view.data() == data; }
+
+    /**
+     * @brief Whether the element (i,j) of the expression reads an element
+     * other than (i,j) of the storage starting at data, which can then not
+     * be overwritten during the evaluation
+     */
+    bool aliases(const T *) const { return false; }
+
+    /**
+     * @brief Evaluates the products nested in the expression
+     */
+    void prepare() const {}
+
+    const MatrixView<const T, Access> &view() const { return _view; }
+
+private:
+    MatrixView<const T, Access> _view;
+};
+
+struct AddOperation
+{
+    template <typename T>
+    static T apply(const T a, const T b) { return a + b; }
+};
+
+struct SubtractOperation
+{
+    template <typename T>
+    static T apply(const T a, const T b) { return a - b; }
+};
+
+/**
+ * @brief Element-wise sum or difference of two expressions of the same size
+ */
+template <typename L, typename R, typename Operation>
+class ElementwiseExpression : public MatrixExpression<ElementwiseExpression<L, R, Operation>>
+{
+public:
+    typedef typename L::Scalar Scalar;
+    typedef L Left;
+    typedef R Right;
+    typedef Operation Op;
+
+    ElementwiseExpression(const L &left, const R &right) : _left(left), _right(right)
+    {
+        if ( left.getRowsCount() != right.getRowsCount() ||
+             left.getColumnsCount() != right.getColumnsCount() )
+            throw INVALID_RANGE;
+    }
+
+    unsigned int getRowsCount() const { return _left.getRowsCount(); }
+    unsigned int getColumnsCount() const { return _left.getColumnsCount(); }
+    Scalar value(const unsigned int i, const unsigned int j) const
+    {
+        return Operation::apply(_left.value(i, j), _right.value(i, j));
+    }
+
+    bool reads(const Scalar *data) const { return _left.reads(data) || _right.reads(data); }
+    bool aliases(const Scalar *data) const { return _left.aliases(data) || _right.aliases(data); }
+    void prepare() const { _left.prepare(); _right.prepare(); }
+
+    const L &left() const { return _left; }
+    const R &right() const { return _right; }
+
+private:
+    L _left;
+    R _right;
+};
+
+/**
+ * @brief Expression multiplied by a scalar
+ */
+template <typename E>
+class ScaledExpression : public MatrixExpression<ScaledExpression<E>>
+{
+public:
+    typedef typename E::Scalar Scalar;
+
+    ScaledExpression(const Scalar alpha, const E &expression) : _alpha(alpha), _expression(expression) {}
+
+    unsigned int getRowsCount() const { return _expression.getRowsCount(); }
+    unsigned int getColumnsCount() const { return _expression.getColumnsCount(); }
+    Scalar value(const unsigned int i, const unsigned int j) const { return _alpha*_expression.value(i, j); }
+
+    bool reads(const Scalar *data) const { return _expression.reads(data); }
+    bool aliases(const Scalar *data) const { return _expression.aliases(data); }
+    void prepare() const { _expression.prepare(); }
+
+private:
+    Scalar _alpha;
+    E _expression;
+};
+
+/**
+ * @brief Transpose of an expression
+ */
+template <typename E>
+class TransposedExpression : public MatrixExpression<TransposedExpression<E>>
+{
+public:
+    typedef typename E::Scalar Scalar;
+
+    explicit TransposedExpression(const E &expression) : _expression(expression) {}
+
+    unsigned int getRowsCount() const { return _expression.getColumnsCount(); }
+    unsigned int getColumnsCount() const { return _expression.getRowsCount(); }
+    Scalar value(const unsigned int i, const unsigned int j) const { return _expression.value(j, i); }
+
+    bool reads(const Scalar *data) const { return _expression.reads(data); }
+    bool aliases(const Scalar *data) const { return _expression.reads(data); }
+    void prepare() const { _expression.prepare(); }
+
+private:
+    E _expression;
+};
+
+namespace expression_detail {
+
+template <typename T, typename Access, typename E>
+void assign(const MatrixView<T, Access> &dest, const E &expression);
+
+/**
+ * @brief Storage of an operand of a product. Matrices are used as they are,
+ * any other expression is evaluated into a temporary
+ */
+template <typename T, typename Access, typename E>
+class ProductOperand
+{
+public:
+    explicit ProductOperand(const E &expression) :
+    _matrix(expression.getRowsCount(), expression.getColumnsCount(), scratchMatrixAllocator())
+    {
+        assign(_matrix.view(), expression);
+    }
+
+    MatrixView<const T, Access> view() const { return _matrix.view(); }
+
+private:
+    Matrix<T, Access> _matrix;
+};
+
+template <typename T, typename Access, typename U, typename UAccess>
+class ProductOperand<T, Access, MatrixOperand<U, UAccess>>
+{
+public:
+    explicit ProductOperand(const MatrixOperand<U, UAccess> &operand) :
+    _view(operand.view().data(), operand.getRowsCount(), operand.getColumnsCount(),
+          operand.view().getStride()) {}
+
+    MatrixView<const T, Access> view() const { return _view; }
+
+private:
+    MatrixView<const T, Access> _view;
+};
+
+} // namespace expression_detail
+
+/**
+ * @brief Product alpha*L*R of two expressions
+ */
+template <typename L, typename R>
+class ProductExpression : public MatrixExpression<ProductExpression<L, R>>
+{
+public:
+    typedef typename L::Scalar Scalar;
+
+    ProductExpression(const L &left, const R &right, const Scalar alpha = static_cast<Scalar>(1)) :
+    _left(left), _right(right), _alpha(alpha)
+    {
+        if ( left.getColumnsCount() != right.getRowsCount() )
+            throw INVALID_RANGE;
+    }
+
+    unsigned int getRowsCount() const { return _left.getRowsCount(); }
+    unsigned int getColumnsCount() const { return _right.getColumnsCount(); }
+    Scalar value(const unsigned int i, const unsigned int j) const
+    {
+        return _result->getDataPtr()[i*getColumnsCount()+j];
+    }
+
+    bool reads(const Scalar *data) const { return _left.reads(data) || _right.reads(data); }
+
+    /**
+     * @brief The product is evaluated by prepare() before the destination is
+     * written
+     */
+    bool aliases(const Scalar *) const { return false; }
+
+    void prepare() const
+    {
+        if ( !_result ) {
+            _result = std::make_shared<Matrix<Scalar>>(getRowsCount(), getColumnsCount());
+            accumulateInto(_result->view(), static_cast<Scalar>(0));
+        }
+    }
+
+    /**
+     * @brief dest = beta*dest + alpha*L*R. dest must not be read by L or R
+     */
+    template <typename Access>
+    void accumulateInto(const MatrixView<Scalar, Access> &dest, const Scalar beta) const
+    {
+        const expression_detail::ProductOperand<Scalar, Access, L> left(_left);
+        const expression_detail::ProductOperand<Scalar, Access, R> right(_right);
+        for ( unsigned int i=0; i<dest.getRowsCount(); i++ )
+        {
+            Scalar *row = dest.row(i);
+            for ( unsigned int j=0; j<dest.getColumnsCount(); j++ )
+                row[j] = (beta == static_cast<Scalar>(0)) ? static_cast<Scalar>(0) : beta*row[j];
+        }
+        kernels::gemmAccumulate(dest, left.view(), right.view(), _alpha);
+    }
+
+    const L &left() const { return _left; }
+    const R &right() const { return _right; }
+    Scalar getAlpha() const { return _alpha; }
+
+private:
+    L _left;
+    R _right;
+    Scalar _alpha;
+    mutable std::shared_ptr<Matrix<Scalar>> _result;
+};
+
+namespace expression_detail {
+
+template <typename E>
+struct IsProduct : std::false_type {};
+
+template <typename L, typename R>
+struct IsProduct<ProductExpression<L, R>> : std::true_type {};
+
+template <typename E>
+struct IsElementwise : std::false_type {};
+
+template <typename L, typename R, typename Operation>
+struct IsElementwise<ElementwiseExpression<L, R, Operation>> : std::true_type {};
+
+/**
+ * @brief dest = expression, one element at a time
+ */
+template <typename T, typename Access, typename E>
+void assignElementwise(const MatrixView<T, Access> &dest, const E &expression)
+{
+  for ( unsigned int i=0; i<dest.getRowsCount(); i++ )
+  {
+    T *row = dest.row(i);
+    for ( unsigned int j=0; j<dest.getColumnsCount(); j++ )
+      row[j] = expression.value(i, j);
+  }
+}
+
+/**
+ * @brief Evaluates the expression into dest, which has its size. dest may be
+ * read by the expression
+ */
+template <typename T, typename Access, typename E>
+void assign(const MatrixView<T, Access> &dest, const E &expression)
+{
+  const T *data = dest.data();
+  if constexpr ( IsProduct<E>::value ) {
+    if ( !expression.reads(data) ) {
+      expression.accumulateInto(dest, static_cast<T>(0));
+      return;
+    }
+  }
+  if constexpr ( IsElementwise<E>::value ) {
+    // L*R +- E and E +- L*R: the product goes into dest, and E is added
+    // to it in place
+    typedef typename E::Op Op;
+    if constexpr ( IsProduct<typename E::Left>::value ) {
+      if ( !expression.reads(data) ) {
+        expression.right().prepare();
+        expression.left().accumulateInto(dest, static_cast<T>(0));
+        for ( unsigned int i=0; i<dest.getRowsCount(); i++ )
+        {
+          T *row = dest.row(i);
+          for ( unsigned int j=0; j<dest.getColumnsCount(); j++ )
+            row[j] = Op::apply(row[j], expression.right().value(i, j));
+        }
+        return;
+      }
+    } else if constexpr ( IsProduct<typename E::Right>::value ) {
+      if ( !expression.reads(data) ) {
+        expression.left().prepare();
+        expression.right().accumulateInto(dest, static_cast<T>(0));
+        for ( unsigned int i=0; i<dest.getRowsCount(); i++ )
+        {
+          T *row = dest.row(i);
+          for ( unsigned int j=0; j<dest.getColumnsCount(); j++ )
+            row[j] = Op::apply(expression.left().value(i, j), row[j]);
+        }
+        return;
+      }
+    }
+  }
+
+  expression.prepare();
+  if ( expression.aliases(data) ) {
+    Matrix<T, Access> result(dest.getRowsCount(), dest.getColumnsCount(), scratchMatrixAllocator());
+    assignElementwise(result.view(), expression);
+    assignElementwise(dest, MatrixOperand<T, Access>(result));
+  } else {
+    assignElementwise(dest, expression);
+  }
+}
+
+/**
+ * @brief Expression for an operand of the operators: matrices are wrapped in
+ * a MatrixOperand, expressions are used as they are
+ */
+template <typename T, typename Access>
+MatrixOperand<T, Access> asExpression(const Matrix<T, Access> &matrix)
+{
+  return MatrixOperand<T, Access>(matrix);
+}
+
+template <typename E>
+const E &asExpression(const MatrixExpression<E> &expression)
+{
+  return expression.derived();
+}
+
+template <typename X>
+using ExpressionType = typename std::decay<decltype(asExpression(std::declval<const X &>()))>::type;
+
+} // namespace expression_detail
+
+/**
+ * @brief Evaluates the expression into dest, which is resized if needed
+ */
+template <typename T, typename Access, typename E>
+void evaluateExpression(Matrix<T, Access> &dest, const MatrixExpression<E> &expression)
+{
+  if ( dest.getRowsCount() != expression.getRowsCount() ||
+       dest.getColumnsCount() != expression.getColumnsCount() ) {
+    Matrix<T, Access> result(expression.getRowsCount(), expression.getColumnsCount(),
+                             dest.getAllocator());
+    expression_detail::assign(result.view(), expression.derived());
+    dest.swap(result);
+  } else {
+    expression_detail::assign(dest.view(), expression.derived());
+  }
+}
+
+template <typename L, typename R>
+ElementwiseExpression<expression_detail::ExpressionType<L>, expression_detail::ExpressionType<R>, AddOperation>
+operator+(const L &left, const R &right)
+{
+  return { expression_detail::asExpression(left), expression_detail::asExpression(right) };
+}
+
+template <typename L, typename R>
+ElementwiseExpression<expression_detail::ExpressionType<L>, expression_detail::ExpressionType<R>, SubtractOperation>
+operator-(const L &left, const R &right)
+{
+  return { expression_detail::asExpression(left), expression_detail::asExpression(right) };
+}
+
+template <typename L, typename R>
+ProductExpression<expression_detail::ExpressionType<L>, expression_detail::ExpressionType<R>>
+operator*(const L &left, const R &right)
+{
+  return { expression_detail::asExpression(left), expression_detail::asExpression(right) };
+}
+
+template <typename S, typename X, typename = typename std::enable_if<std::is_arithmetic<S>::value>::type>
+ScaledExpression<expression_detail::ExpressionType<X>> operator*(const S alpha, const X &operand)
+{
+  typedef typename expression_detail::ExpressionType<X>::Scalar Scalar;
+  return { static_cast<Scalar>(alpha), expression_detail::asExpression(operand) };
+}
+
+template <typename X, typename S, typename = typename std::enable_if<std::is_arithmetic<S>::value>::type>
+ScaledExpression<expression_detail::ExpressionType<X>> operator*(const X &operand, const S alpha)
+{
+  return alpha*operand;
+}
+
+/**
+ * @brief Scaled products keep the scalar in the product, which is then still
+ * accumulated into the destination
+ */
+template <typename S, typename L, typename R, typename = typename std::enable_if<std::is_arithmetic<S>::value>::type>
+ProductExpression<L, R> operator*(const S alpha, const ProductExpression<L, R> &product)
+{
+  typedef typename L::Scalar Scalar;
+  return { product.left(), product.right(), static_cast<Scalar>(alpha)*product.getAlpha() };
+}
+
+template <typename L, typename R, typename S, typename = typename std::enable_if<std::is_arithmetic<S>::value>::type>
+ProductExpression<L, R> operator*(const ProductExpression<L, R> &product, const S alpha)
+{
+  return alpha*product;
+}
+
+template <typename X>
+TransposedExpression<expression_detail::ExpressionType<X>> transpose(const X &operand)
+{
+  return TransposedExpression<expression_detail::ExpressionType<X>>(expression_detail::asExpression(operand));
+}
+
+#endif // MATRIX_EXPRESSION_H
@@ -0,0 +1,457 @@
+/**
+ * @file MatrixFile.hpp
+ *
+ * Copyright 2023 Diego Nieto
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation and/or
+ * other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS” AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef MATRIX_FILE_H
+#define MATRIX_FILE_H
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <memory>
+#include <string>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define VLU_MMAP
+#endif
+
+#include "Squarematrix.hpp"
+
+/**
+ * Binary matrix files. A 128 bytes header is followed by the elements,
+ * row-major and aligned to a page so the file can be mapped and wrapped by a
+ * matrix without copying, and by the pivots of the factorization stored in
+ * the elements, if any. Integers and elements use the byte order of the
+ * machine that wrote the file; files from a different byte order are
+ * rejected.
+ */
+
+enum MatrixFileElementType {
+    FILE_FLOAT32 = 1,
+    FILE_FLOAT64 = 2
+};
+
+enum MatrixFileLayout {
+    FILE_ROW_MAJOR = 0,
+    /** Column panels of panelWidth columns one after the other, each one
+     * rows x panelWidth row-major. Written by OutOfCoreMatrix */
+    FILE_COLUMN_PANELS = 1
+};
+
+struct MatrixFileHeader
+{
+    /** "VLUMATRX" */
+    char magic[8];
+    uint32_t version;
+    /** 0x01020304 as written by the machine that wrote the file */
+    uint32_t byteOrder;
+    /** MatrixFileElementType */
+    uint32_t elementType;
+    uint32_t elementSize;
+    /** MatrixFileLayout */
+    uint32_t layout;
+    /** Factorization stored in the elements */
+    uint32_t factorization;
+    uint64_t rows;
+    uint64_t columns;
+    /** Alignment of dataOffset in the file */
+    uint64_t alignment;
+    uint64_t dataOffset;
+    /** int32 pivots, getPivots() for LU and getSymmetricPivots() for LDL' */
+    uint64_t pivotsOffset;
+    uint64_t pivotsCount;
+    /** Columns of each panel for FILE_COLUMN_PANELS, 0 otherwise */
+    uint64_t panelWidth;
+    uint8_t reserved[40];
+};
+
+static_assert(sizeof(MatrixFileHeader) == 128, "the header is part of the file format");
+
+const char matrixFileMagic[8] = {'V', 'L', 'U', 'M', 'A', 'T', 'R', 'X'};
+const uint32_t matrixFileVersion = 1;
+const uint32_t matrixFileByteOrder = 0x01020304;
+const uint64_t matrixFileAlignment = 4096;
+
+template <typename T>
+struct MatrixFileElement;
+
+template <>
+struct MatrixFileElement<float>
+{
+    static constexpr MatrixFileElementType type = FILE_FLOAT32;
+};
+
+template <>
+struct MatrixFileElement<double>
+{
+    static constexpr MatrixFileElementType type = FILE_FLOAT64;
+};
+
+/**
+ * @brief Whole file mapped copy-on-write: the memory can be modified, e.g.
+ * factorized inplace, without changing the file. Pages are read on first
+ * access. Systems without mmap read the file into memory instead
+ */
+class MappedFile
+{
+public:
+    explicit MappedFile(const std::string &path) : _data(nullptr), _size(0)
+    {
+#ifdef VLU_MMAP
+        const int fd = ::open(path.c_str(), O_RDONLY);
+        if ( fd < 0 )
+            throw FILE_ERROR;
+        struct stat status;
+        if ( fstat(fd, &status) != 0 ) {
+            ::close(fd);
+            throw FILE_ERROR;
+        }
+        _size = static_cast<size_t>(status.st_size);
+        if ( _size > 0 ) {
+            void *ptr = mmap(nullptr, _size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+            if ( ptr == MAP_FAILED ) {
+                ::close(fd);
+                throw FILE_ERROR;
+            }
+            _data = static_cast<char *>(ptr);
+        }
+        // The mapping keeps its own reference to the file
+        ::close(fd);
+#else
+        std::ifstream in(path, std::ios::binary | std::ios::ate);
+        if ( !in )
+            throw FILE_ERROR;
+        _size = static_cast<size_t>(in.tellg());
+        _data = static_cast<char *>(defaultMatrixAllocator().allocate(_size));
+        in.seekg(0);
+        if ( !in.read(_data, _size) ) {
+            defaultMatrixAllocator().deallocate(_data, _size);
+            throw FILE_ERROR;
+        }
+#endif
+    }
+
+    ~MappedFile()
+    {
+        if ( _data == nullptr )
+            return;
+#ifdef VLU_MMAP
+        munmap(_data, _size);
+#else
+        defaultMatrixAllocator().deallocate(_data, _size);
+#endif
+    }
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    char *data() const { return _data; }
+    size_t size() const { return _size; }
+
+private:
+    char *_data;
+    size_t _size;
+};
+
+namespace matrix_file_detail {
+
+inline uint64_t alignUp(const uint64_t value, const uint64_t alignment)
+{
+    return (value+alignment-1)/alignment*alignment;
+}
+
+/**
+ * @brief Header of a row-major file without factorization nor pivots
+ */
+template <typename T>
+MatrixFileHeader makeHeader(const unsigned int rows, const unsigned int columns)
+{
+  MatrixFileHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, matrixFileMagic, sizeof(header.magic));
+  header.version = matrixFileVersion;
+  header.byteOrder = matrixFileByteOrder;
+  header.elementType = MatrixFileElement<T>::type;
+  header.elementSize = sizeof(T);
+  header.layout = FILE_ROW_MAJOR;
+  header.factorization = NO_FACTORIZATION;
+  header.rows = rows;
+  header.columns = columns;
+  header.alignment = matrixFileAlignment;
+  header.dataOffset = alignUp(sizeof(header), matrixFileAlignment);
+  return header;
+}
+
+/**
+ * @brief Writes the header, the elements and the pivots to out
+ */
+template <typename T>
+void write(std::ostream &out, const T *data, const unsigned int rows, const unsigned int columns,
+           const Factorization factorization, const std::vector<int> &pivots)
+{
+  MatrixFileHeader header = makeHeader<T>(rows, columns);
+  header.factorization = factorization;
+  const uint64_t dataBytes = uint64_t(rows)*columns*sizeof(T);
+  header.pivotsOffset = alignUp(header.dataOffset+dataBytes, sizeof(int32_t));
+  header.pivotsCount = pivots.size();
+
+  const std::vector<char> padding(header.dataOffset-sizeof(header), 0);
+  out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+  out.write(padding.data(), padding.size());
+  out.write(reinterpret_cast<const char *>(data), dataBytes);
+  out.write(padding.data(), header.pivotsOffset-header.dataOffset-dataBytes);
+  for ( const int pivot : pivots )
+  {
+    const int32_t value = pivot;
+    out.write(reinterpret_cast<const char *>(&value), sizeof(value));
+  }
+  if ( !out )
+    throw FILE_ERROR;
+}
+
+/**
+ * @brief Writes the file next to path and renames it, so a reader never maps
+ * a file being written
+ */
+template <typename T>
+void write(const std::string &path, const T *data, const unsigned int rows, const unsigned int columns,
+           const Factorization factorization, const std::vector<int> &pivots)
+{
+  const std::string tmpPath = path+".tmp";
+  {
+    std::ofstream out(tmpPath, std::ios::binary | std::ios::trunc);
+    try {
+      write(out, data, rows, columns, factorization, pivots);
+      out.close();
+      if ( !out )
+        throw FILE_ERROR;
+    } catch (Matrix_Errors) {
+      out.close();
+      std::remove(tmpPath.c_str());
+      throw;
+    }
+  }
+  if ( std::rename(tmpPath.c_str(), path.c_str()) != 0 ) {
+    std::remove(tmpPath.c_str());
+    throw FILE_ERROR;
+  }
+}
+
+/**
+ * @brief Pivots of the factorization stored in matrix, as saved in the file
+ */
+template <typename T, typename Access>
+std::vector<int> getFilePivots(const SquareMatrix<T, Access> &matrix)
+{
+  std::vector<int> pivots;
+  if ( matrix.getFactorization() == LU_FACTORIZATION )
+    pivots.assign(matrix.getPivots().begin(), matrix.getPivots().end());
+  else if ( matrix.getFactorization() == LDLT_FACTORIZATION )
+    pivots = matrix.getSymmetricPivots();
+  return pivots;
+}
+
+/**
+ * @brief Checks that the header describes a file of fileSize bytes with
+ * elements of type T in the given layout
+ */
+template <typename T>
+void checkHeader(const MatrixFileHeader &header, const uint64_t fileSize, const MatrixFileLayout layout)
+{
+  const uint64_t maxSize = std::numeric_limits<int>::max();
+  if ( memcmp(header.magic, matrixFileMagic, sizeof(header.magic)) != 0 ||
+       header.version != matrixFileVersion || header.byteOrder != matrixFileByteOrder ||
+       header.elementType != static_cast<uint32_t>(MatrixFileElement<T>::type) ||
+       header.elementSize != sizeof(T) || header.layout != static_cast<uint32_t>(layout) ||
+       header.factorization > LDLT_FACTORIZATION ||
+       header.rows > maxSize || header.columns > maxSize ||
+       (layout == FILE_COLUMN_PANELS && (header.panelWidth == 0 || header.panelWidth > maxSize)) ||
+       header.dataOffset < sizeof(MatrixFileHeader) || header.dataOffset%matrixAlignment != 0 ||
+       header.pivotsOffset%sizeof(int32_t) != 0 )
+    throw INVALID_FORMAT;
+  // Panels are stored whole, the last one included
+  const uint64_t columns = layout == FILE_COLUMN_PANELS ?
+    alignUp(header.columns, header.panelWidth) : header.columns;
+  if ( header.dataOffset > fileSize ||
+       (columns != 0 && header.rows > (fileSize-header.dataOffset)/sizeof(T)/columns) ||
+       header.pivotsOffset > fileSize || header.pivotsCount > (fileSize-header.pivotsOffset)/sizeof(int32_t) )
+    throw INVALID_FORMAT;
+}
+
+template <typename T>
+const MatrixFileHeader &checkHeader(const MappedFile &file)
+{
+  if ( file.size() < sizeof(MatrixFileHeader) )
+    throw INVALID_FORMAT;
+  const MatrixFileHeader &header = *reinterpret_cast<const MatrixFileHeader *>(file.data());
+  checkHeader<T>(header, file.size(), FILE_ROW_MAJOR);
+  return header;
+}
+
+} // namespace matrix_file_detail
+
+/**
+ * @brief Writes the elements of matrix to a binary matrix file
+ */
+template <typename T, typename Access>
+void saveMatrix(const std::string &path, const Matrix<T, Access> &matrix)
+{
+  matrix_file_detail::write(path, matrix.getDataPtr(), matrix.getRowsCount(), matrix.getColumnsCount(),
+                            NO_FACTORIZATION, std::vector<int>());
+}
+
+/**
+ * @brief Writes the elements of matrix and the factorization stored in them,
+ * which mapSquareMatrix() restores
+ */
+template <typename T, typename Access>
+void saveMatrix(const std::string &path, const SquareMatrix<T, Access> &matrix)
+{
+  matrix_file_detail::write(path, matrix.getDataPtr(), matrix.getSize(), matrix.getSize(),
+                            matrix.getFactorization(), matrix_file_detail::getFilePivots(matrix));
+}
+
+/**
+ * @brief Same as saveMatrix() writing the file to a stream, e.g. a pipe.
+ * Several matrices can be written one after the other and read back with
+ * readMatrix()
+ */
+template <typename T, typename Access>
+void saveMatrix(std::ostream &out, const Matrix<T, Access> &matrix)
+{
+  matrix_file_detail::write(out, matrix.getDataPtr(), matrix.getRowsCount(), matrix.getColumnsCount(),
+                            NO_FACTORIZATION, std::vector<int>());
+}
+
+template <typename T, typename Access>
+void saveMatrix(std::ostream &out, const SquareMatrix<T, Access> &matrix)
+{
+  matrix_file_detail::write(out, matrix.getDataPtr(), matrix.getSize(), matrix.getSize(),
+                            matrix.getFactorization(), matrix_file_detail::getFilePivots(matrix));
+}
+
+/**
+ * @brief Reads the elements of one binary matrix file from a stream, e.g. a
+ * pipe, and leaves the stream at the end of the file, so matrices saved one
+ * after the other are read in turn. The factorization and pivots, if any,
+ * are skipped
+ *
+ * Throws FILE_ERROR if the stream ends before the file and INVALID_FORMAT if
+ * it is not a matrix file of elements of type T.
+ */
+template <typename T, typename Access = DefaultAccess>
+NumericMatrix<T, Access> readMatrix(std::istream &in, MatrixAllocator &allocator = defaultMatrixAllocator())
+{
+  MatrixFileHeader header;
+  if ( !in.read(reinterpret_cast<char *>(&header), sizeof(header)) )
+    throw FILE_ERROR;
+  // The size of the file is not known: only the fields are checked here and
+  // the stream itself tells whether the data is complete
+  const uint64_t unknownSize = std::numeric_limits<uint64_t>::max();
+  matrix_file_detail::checkHeader<T>(header, unknownSize, FILE_ROW_MAJOR);
+  if ( header.columns != 0 && header.rows > unknownSize/2/sizeof(T)/header.columns )
+    throw INVALID_FORMAT;
+  const uint64_t dataBytes = header.rows*header.columns*sizeof(T);
+  if ( header.pivotsOffset < header.dataOffset+dataBytes )
+    throw INVALID_FORMAT;
+
+  NumericMatrix<T, Access> matrix(header.rows, header.columns, allocator);
+  in.ignore(header.dataOffset-sizeof(header));
+  in.read(reinterpret_cast<char *>(matrix.getDataPtr()), dataBytes);
+  in.ignore(header.pivotsOffset-header.dataOffset-dataBytes);
+  for ( uint64_t i=0; i<header.pivotsCount && in; i++ )
+  {
+    int32_t pivot;
+    in.read(reinterpret_cast<char *>(&pivot), sizeof(pivot));
+  }
+  if ( !in )
+    throw FILE_ERROR;
+  return matrix;
+}
+
+/**
+ * @brief Reads the header of a binary matrix file, e.g. to find out its
+ * element type. Throws FILE_ERROR or INVALID_FORMAT
+ */
+inline MatrixFileHeader readMatrixFileHeader(const std::string &path)
+{
+  MatrixFileHeader header;
+  std::ifstream in(path, std::ios::binary);
+  if ( !in )
+    throw FILE_ERROR;
+  if ( !in.read(reinterpret_cast<char *>(&header), sizeof(header)) ||
+       memcmp(header.magic, matrixFileMagic, sizeof(header.magic)) != 0 )
+    throw INVALID_FORMAT;
+  return header;
+}
+
+/**
+ * @brief Maps a binary matrix file and wraps its elements without copying
+ * them. Changes to the matrix are not written to the file
+ *
+ * Throws FILE_ERROR if the file cannot be mapped and INVALID_FORMAT if it is
+ * not a matrix file of elements of type T.
+ */
+template <typename T, typename Access = DefaultAccess>
+NumericMatrix<T, Access> mapMatrix(const std::string &path)
+{
+  const std::shared_ptr<MappedFile> file = std::make_shared<MappedFile>(path);
+  const MatrixFileHeader &header = matrix_file_detail::checkHeader<T>(*file);
+  return NumericMatrix<T, Access>(reinterpret_cast<T *>(file->data()+header.dataOffset),
+                                  header.rows, header.columns, file);
+}
+
+/**
+ * @brief Same as mapMatrix() for a square matrix, restoring the
+ * factorization saved with it, so solve() can be called right away
+ */
+template <typename T, typename Access = DefaultAccess>
+SquareMatrix<T, Access> mapSquareMatrix(const std::string &path)
+{
+  const std::shared_ptr<MappedFile> file = std::make_shared<MappedFile>(path);
+  const MatrixFileHeader &header = matrix_file_detail::checkHeader<T>(*file);
+  if ( header.rows != header.columns )
+    throw INVALID_FORMAT;
+  const int32_t *filePivots = reinterpret_cast<const int32_t *>(file->data()+header.pivotsOffset);
+  const std::vector<int> pivots(filePivots, filePivots+header.pivotsCount);
+  SquareMatrix<T, Access> matrix(reinterpret_cast<T *>(file->data()+header.dataOffset), header.rows, file);
+  try {
+    matrix.setFactorization(static_cast<Factorization>(header.factorization), pivots);
+  } catch (Matrix_Errors) {
+    throw INVALID_FORMAT;
+  }
+  return matrix;
+}
+
+#endif // MATRIX_FILE_H
@@ -0,0 +1,346 @@
+/**
+ * @file MatrixMarket.hpp
+ *
+ * Copyright 2023 Diego Nieto
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation and/or
+ * other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS” AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef MATRIX_MARKET_H
+#define MATRIX_MARKET_H
+
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <istream>
+#include <limits>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "Squarematrix.hpp"
+#include "SparseMatrix.hpp"
+
+enum MatrixMarketFormat {
+    MARKET_COORDINATE,
+    MARKET_ARRAY
+};
+
+enum MatrixMarketSymmetry {
+    MARKET_GENERAL,
+    MARKET_SYMMETRIC,
+    MARKET_SKEW_SYMMETRIC
+};
+
+/**
+ * @brief Streaming reader of Matrix Market files with real, integer or
+ * pattern elements and general, symmetric or skew-symmetric storage
+ *
+ * The banner and the size line are read on construction, then next() reads
+ * one entry line at a time, so files of any size go straight into their
+ * destination. Throws INVALID_FORMAT on malformed or complex files.
+ */
+class MatrixMarketReader
+{
+public:
+    explicit MatrixMarketReader(std::istream &in) :
+    _in(in), _format(MARKET_COORDINATE), _symmetry(MARKET_GENERAL), _pattern(false),
+    _nrows(0), _ncols(0), _entries(0), _remaining(0), _row(0), _col(0), _hasMirror(false),
+    _mirrorRow(0), _mirrorCol(0), _mirrorValue(0.0)
+    {
+        if ( !std::getline(_in, _line) )
+            throw INVALID_FORMAT;
+        std::istringstream banner(lowercase(_line));
+        std::string marker, object, format, field, symmetry;
+        banner >> marker >> object >> format >> field >> symmetry;
+        if ( marker != "%%matrixmarket" || object != "matrix" )
+            throw INVALID_FORMAT;
+
+        if ( format == "coordinate" )
+            _format = MARKET_COORDINATE;
+        else if ( format == "array" )
+            _format = MARKET_ARRAY;
+        else
+            throw INVALID_FORMAT;
+
+        if ( field == "pattern" && _format == MARKET_COORDINATE )
+            _pattern = true;
+        else if ( field != "real" && field != "double" && field != "integer" )
+            throw INVALID_FORMAT;
+
+        if ( symmetry == "general" )
+            _symmetry = MARKET_GENERAL;
+        else if ( symmetry == "symmetric" )
+            _symmetry = MARKET_SYMMETRIC;
+        else if ( symmetry == "skew-symmetric" )
+            _symmetry = MARKET_SKEW_SYMMETRIC;
+        else
+            throw INVALID_FORMAT;
+
+        // Comments, then the size line
+        if ( !nextLine() )
+            throw INVALID_FORMAT;
+        const char *p = _line.c_str();
+        _nrows = parseIndex(p, std::numeric_limits<int>::max());
+        _ncols = parseIndex(p, std::numeric_limits<int>::max());
+        if ( _format == MARKET_COORDINATE ) {
+            _entries = parseIndex(p, std::numeric_limits<size_t>::max());
+        } else if ( _symmetry == MARKET_GENERAL ) {
+            _entries = static_cast<size_t>(_nrows)*_ncols;
+        } else {
+            // Lower triangle by columns, without the diagonal if skew-symmetric
+            const size_t n = _nrows;
+            _entries = _symmetry == MARKET_SYMMETRIC ? n*(n+1)/2 : n*(n-std::min<size_t>(n, 1))/2;
+        }
+        if ( _symmetry != MARKET_GENERAL && _nrows != _ncols )
+            throw INVALID_FORMAT;
+        _remaining = _entries;
+        _col = 0;
+        _row = _symmetry == MARKET_SKEW_SYMMETRIC ? 1 : 0;
+    }
+
+    unsigned int getRowsCount() const { return _nrows; }
+    unsigned int getColumnsCount() const { return _ncols; }
+    MatrixMarketFormat getFormat() const { return _format; }
+    MatrixMarketSymmetry getSymmetry() const { return _symmetry; }
+
+    /**
+     * @brief Entries stored in the file, before mirroring the symmetric ones
+     */
+    size_t getEntriesCount() const { return _entries; }
+
+    /**
+     * @brief Reads the next entry, 0-based. Entries off the diagonal of
+     * symmetric files are returned a second time mirrored, pattern entries
+     * have value 1
+     *
+     * @return false after the last entry
+     */
+    bool next(unsigned int &row, unsigned int &col, double &value)
+    {
+        if ( _hasMirror ) {
+            _hasMirror = false;
+            row = _mirrorRow;
+            col = _mirrorCol;
+            value = _mirrorValue;
+            return true;
+        }
+        if ( _remaining == 0 )
+            return false;
+        if ( !nextLine() )
+            throw INVALID_FORMAT;
+        _remaining--;
+
+        const char *p = _line.c_str();
+        if ( _format == MARKET_COORDINATE ) {
+            row = parseIndex(p, _nrows)-1;
+            col = parseIndex(p, _ncols)-1;
+            if ( row == static_cast<unsigned int>(-1) || col == static_cast<unsigned int>(-1) )
+                throw INVALID_FORMAT;
+            value = _pattern ? 1.0 : parseValue(p);
+            if ( (_symmetry == MARKET_SYMMETRIC && row < col) || (_symmetry == MARKET_SKEW_SYMMETRIC && row <= col) )
+                throw INVALID_FORMAT;
+        } else {
+            // Column-major order, lower triangle only if symmetric
+            row = _row;
+            col = _col;
+            value = parseValue(p);
+            if ( ++_row == _nrows ) {
+                _col++;
+                _row = _symmetry == MARKET_GENERAL ? 0 : _col + (_symmetry == MARKET_SKEW_SYMMETRIC ? 1 : 0);
+            }
+        }
+
+        if ( _symmetry != MARKET_GENERAL && row != col ) {
+            _hasMirror = true;
+            _mirrorRow = col;
+            _mirrorCol = row;
+            _mirrorValue = _symmetry == MARKET_SYMMETRIC ? value : -value;
+        }
+        return true;
+    }
+
+private:
+    static std::string lowercase(std::string text)
+    {
+        std::transform(text.begin(), text.end(), text.begin(),
+                       [](const unsigned char c) { return static_cast<char>(std::tolower(c)); });
+        return text;
+    }
+
+    /**
+     * @brief Next line that is neither a comment nor blank
+     */
+    bool nextLine()
+    {
+        while ( std::getline(_in, _line) )
+        {
+            const size_t first = _line.find_first_not_of(" \t\r");
+            if ( first != std::string::npos && _line[first] != '%' )
+                return true;
+        }
+        return false;
+    }
+
+    /**
+     * @brief Parses an unsigned integer up to max and moves p after it
+     */
+    template <typename I>
+    static I parseIndex(const char *&p, const I max)
+    {
+        while ( *p == ' ' || *p == '\t' )
+            p++;
+        char *end;
+        const unsigned long long value = std::strtoull(p, &end, 10);
+        if ( end == p || *p == '-' || value > static_cast<unsigned long long>(max) )
+            throw INVALID_FORMAT;
+        p = end;
+        return static_cast<I>(value);
+    }
+
+    static double parseValue(const char *&p)
+    {
+        char *end;
+        const double value = std::strtod(p, &end);
+        if ( end == p )
+            throw INVALID_FORMAT;
+        p = end;
+        return value;
+    }
+
+    std::istream &_in;
+    std::string _line;
+    MatrixMarketFormat _format;
+    MatrixMarketSymmetry _symmetry;
+    bool _pattern;
+    unsigned int _nrows;
+    unsigned int _ncols;
+    size_t _entries;
+    size_t _remaining;
+    /** Position of the next array entry */
+    unsigned int _row;
+    unsigned int _col;
+    bool _hasMirror;
+    unsigned int _mirrorRow;
+    unsigned int _mirrorCol;
+    double _mirrorValue;
+};
+
+namespace matrix_market_detail {
+
+/**
+ * @brief Adds the remaining entries of reader to a zeroed matrix
+ */
+template <typename T, typename Access>
+void fill(MatrixMarketReader &reader, NumericMatrix<T, Access> &matrix)
+{
+  const unsigned int ncols = matrix.getColumnsCount();
+  T *a = matrix.getDataPtr();
+  matrix.setZero();
+  unsigned int row, col;
+  double value;
+  while ( reader.next(row, col, value) )
+    a[static_cast<size_t>(row)*ncols+col] += static_cast<T>(value);
+}
+
+} // namespace matrix_market_detail
+
+/**
+ * @brief Reads a Matrix Market file into a dense matrix. Duplicated
+ * coordinate entries are added up
+ */
+template <typename T, typename Access = DefaultAccess>
+NumericMatrix<T, Access> readMatrixMarket(std::istream &in,
+                                          MatrixAllocator &allocator = defaultMatrixAllocator())
+{
+  MatrixMarketReader reader(in);
+  NumericMatrix<T, Access> matrix(reader.getRowsCount(), reader.getColumnsCount(), allocator);
+  matrix_market_detail::fill(reader, matrix);
+  return matrix;
+}
+
+/**
+ * @brief Same as readMatrixMarket() for square matrices, throws
+ * INVALID_FORMAT if the file is not square
+ */
+template <typename T, typename Access = DefaultAccess>
+SquareMatrix<T, Access> readSquareMatrixMarket(std::istream &in,
+                                               MatrixAllocator &allocator = defaultMatrixAllocator())
+{
+  MatrixMarketReader reader(in);
+  if ( reader.getRowsCount() != reader.getColumnsCount() )
+    throw INVALID_FORMAT;
+  SquareMatrix<T, Access> matrix(reader.getRowsCount(), allocator);
+  matrix_market_detail::fill(reader, matrix);
+  return matrix;
+}
+
+/**
+ * @brief Reads a Matrix Market file into a sparse matrix
+ */
+template <typename T>
+SparseMatrix<T> readSparseMatrixMarket(std::istream &in)
+{
+  MatrixMarketReader reader(in);
+  std::vector<Triplet<T>> triplets;
+  triplets.reserve(reader.getEntriesCount()*(reader.getSymmetry() == MARKET_GENERAL ? 1 : 2));
+  unsigned int row, col;
+  double value;
+  while ( reader.next(row, col, value) )
+  {
+    if ( reader.getFormat() == MARKET_COORDINATE || value != 0.0 )
+      triplets.push_back({row, col, static_cast<T>(value)});
+  }
+  return SparseMatrix<T>(reader.getRowsCount(), reader.getColumnsCount(), triplets);
+}
+
+/**
+ * @brief Writes matrix in Matrix Market array format, with enough digits to
+ * read back the same values
+ *
+ * @param comment written after the banner, each of its lines as a comment
+ */
+template <typename T, typename Access>
+void writeMatrixMarket(std::ostream &out, const Matrix<T, Access> &matrix,
+                       const std::string &comment = std::string())
+{
+  const unsigned int nrows = matrix.getRowsCount();
+  const unsigned int ncols = matrix.getColumnsCount();
+  const T *a = matrix.getDataPtr();
+  const std::streamsize precision = out.precision(std::numeric_limits<T>::max_digits10);
+  out << "%%MatrixMarket matrix array real general\n";
+  std::istringstream lines(comment);
+  std::string line;
+  while ( std::getline(lines, line) )
+    out << "%" << line << "\n";
+  out << nrows << " " << ncols << "\n";
+  for ( unsigned int j=0; j<ncols; j++ )
+    for ( unsigned int i=0; i<nrows; i++ )
+      out << a[static_cast<size_t>(i)*ncols+j] << "\n";
+  out.precision(precision);
+  if ( !out )
+    throw FILE_ERROR;
+}
+
+#endif // MATRIX_MARKET_H
@@ -0,0 +1,216 @@
+/**
+ * @file MatrixMultiply.hpp
+ *
+ * Copyright 2023 Diego Nieto
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation and/or
+ * other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS” AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef MATRIX_MULTIPLY_H
+#define MATRIX_MULTIPLY_H
+
+#include <algorithm>
+#include <cstddef>
+
+#include "Matrix.hpp"
+#include "MatrixAllocator.hpp"
+#include "MatrixView.hpp"
+#include "SimdKernels.hpp"
+#include "TaskScheduler.hpp"
+
+namespace kernels {
+
+/**
+ * @brief Cache blocking of the packed product: a packedRows x packedDepth
+ * block of A is packed to stay in L2, a packedDepth x packedColumns block of
+ * B to stay in L3, and every micro-kernel call streams a sliver of each
+ * through L1
+ */
+const unsigned int packedRows = 120;
+const unsigned int packedDepth = 256;
+const unsigned int packedColumns = 2048;
+
+/**
+ * @brief Copies alpha*A(m x k) into slivers of gemmMicroRows rows, column
+ * after column, the last one padded with zeros
+ */
+template <typename T, typename UA, typename Access>
+void packA(const MatrixView<UA, Access> &a, const T alpha, T *packed)
+{
+  const unsigned int m = a.getRowsCount();
+  const unsigned int k = a.getColumnsCount();
+  const unsigned int mr = simd::gemmMicroRows;
+  for ( unsigned int i0=0; i0<m; i0+=mr )
+  {
+    const unsigned int rows = std::min(mr, m-i0);
+    for ( unsigned int r=0; r<rows; r++ )
+    {
+      const UA *row = a.row(i0+r);
+      for ( unsigned int kk=0; kk<k; kk++ )
+        packed[kk*mr+r] = alpha*row[kk];
+    }
+    for ( unsigned int r=rows; r<mr; r++ )
+      for ( unsigned int kk=0; kk<k; kk++ )
+        packed[kk*mr+r] = static_cast<T>(0);
+    packed += k*mr;
+  }
+}
+
+/**
+ * @brief Copies B(k x n) into slivers of nr columns, row after row, the last
+ * one padded with zeros
+ */
+template <typename T, typename UB, typename Access>
+void packB(const MatrixView<UB, Access> &b, const unsigned int nr, T *packed)
+{
+  const unsigned int k = b.getRowsCount();
+  const unsigned int n = b.getColumnsCount();
+  for ( unsigned int j0=0; j0<n; j0+=nr )
+  {
+    const unsigned int cols = std::min(nr, n-j0);
+    for ( unsigned int kk=0; kk<k; kk++ )
+    {
+      const UB *row = b.row(kk)+j0;
+      std::copy(row, row+cols, packed+kk*nr);
+      std::fill(packed+kk*nr+cols, packed+(kk+1)*nr, static_cast<T>(0));
+    }
+    packed += k*nr;
+  }
+}
+
+/**
+ * @brief C(m x n) += A(m x k) * B(k x n) from a packed block of A and a
+ * packed block of B
+ */
+template <typename T, typename Access>
+void multiplyPacked(const MatrixView<T, Access> &c, const unsigned int k,
+                    const T *packedA, const T *packedB, const unsigned int nr)
+{
+  const unsigned int m = c.getRowsCount();
+  const unsigned int n = c.getColumnsCount();
+  const unsigned int mr = simd::gemmMicroRows;
+  for ( unsigned int j0=0; j0<n; j0+=nr )
+  {
+    const T *b = packedB+static_cast<size_t>(j0/nr)*k*nr;
+    for ( unsigned int i0=0; i0<m; i0+=mr )
+    {
+      simd::gemmMicroKernel<T>(k, packedA+static_cast<size_t>(i0/mr)*k*mr, b,
+                               c.row(i0)+j0, c.getStride(), std::min(mr, m-i0), std::min(nr, n-j0));
+    }
+  }
+}
+
+/**
+ * @brief C = beta*C + alpha*A*B, with C m x n, A m x k and B k x n
+ *
+ * GotoBLAS-style product: B and A are packed block by block into contiguous
+ * slivers for simd::gemmMicroKernel. With a pool, the row blocks of A of
+ * each packed block of B are run as parallel tasks. C must not overlap A or B
+ */
+template <typename T, typename UA, typename UB, typename Access>
+void gemmPacked(const MatrixView<T, Access> &c, const MatrixView<UA, Access> &a,
+                const MatrixView<UB, Access> &b, const T alpha, const T beta,
+                WorkStealingPool *pool = nullptr)
+{
+  const unsigned int m = c.getRowsCount();
+  const unsigned int n = c.getColumnsCount();
+  const unsigned int k = a.getColumnsCount();
+  const unsigned int mr = simd::gemmMicroRows;
+  const unsigned int nr = static_cast<unsigned int>(simd::gemmMicroColumns<T>());
+
+  if ( beta != static_cast<T>(1) ) {
+    for ( unsigned int i=0; i<m; i++ )
+    {
+      T *row = c.row(i);
+      for ( unsigned int j=0; j<n; j++ )
+        row[j] = (beta == static_cast<T>(0)) ? static_cast<T>(0) : beta*row[j];
+    }
+  }
+  if ( m == 0 || n == 0 || k == 0 || alpha == static_cast<T>(0) )
+    return;
+
+  // Smaller row blocks when there are not enough of them for every thread
+  const unsigned int nthreads = pool ? pool->getThreadsCount() : 1;
+  const unsigned int mc = std::min(packedRows, ((m+nthreads-1)/nthreads+mr-1)/mr*mr);
+  const unsigned int ncMax = std::min(packedColumns, (n+nr-1)/nr*nr);
+  ScratchBuffer<T> packedB(static_cast<size_t>(std::min(packedDepth, k))*ncMax);
+
+  for ( unsigned int j0=0; j0<n; j0+=packedColumns )
+  {
+    const unsigned int nc = std::min(packedColumns, n-j0);
+    for ( unsigned int k0=0; k0<k; k0+=packedDepth )
+    {
+      const unsigned int kc = std::min(packedDepth, k-k0);
+      packB(b.block(k0, j0, kc, nc), nr, packedB.data());
+
+      const T *pb = packedB.data();
+      const auto rowBlock = [=](const unsigned int i0) {
+        const unsigned int rows = std::min(mc, m-i0);
+        ScratchBuffer<T> packedA(static_cast<size_t>((rows+mr-1)/mr*mr)*kc);
+        packA(a.block(i0, k0, rows, kc), alpha, packedA.data());
+        multiplyPacked(c.block(i0, j0, rows, nc), kc, packedA.data(), pb, nr);
+      };
+      if ( pool && m > mc ) {
+        TaskGraph graph;
+        for ( unsigned int i0=0; i0<m; i0+=mc )
+          graph.addTask([=] { rowBlock(i0); });
+        pool->run(graph);
+      } else {
+        for ( unsigned int i0=0; i0<m; i0+=mc )
+          rowBlock(i0);
+      }
+    }
+  }
+}
+
+} // namespace kernels
+
+/**
+ * @brief C = beta*C + alpha*A*B with the packed product of
+ * kernels::gemmPacked. Throws INVALID_RANGE if the sizes do not match. C must
+ * not be A or B
+ */
+template <typename T, typename Access>
+void multiply(Matrix<T, Access> &C, const Matrix<T, Access> &A, const Matrix<T, Access> &B,
+              const T alpha = static_cast<T>(1), const T beta = static_cast<T>(0))
+{
+  if ( A.getColumnsCount() != B.getRowsCount() || C.getRowsCount() != A.getRowsCount() ||
+       C.getColumnsCount() != B.getColumnsCount() )
+    throw INVALID_RANGE;
+  kernels::gemmPacked(C.view(), A.view(), B.view(), alpha, beta);
+}
+
+/**
+ * @brief Same as multiply() running the row blocks on the threads of pool
+ */
+template <typename T, typename Access>
+void multiply(Matrix<T, Access> &C, const Matrix<T, Access> &A, const Matrix<T, Access> &B,
+              const T alpha, const T beta, WorkStealingPool &pool)
+{
+  if ( A.getColumnsCount() != B.getRowsCount() || C.getRowsCount() != A.getRowsCount() ||
+       C.getColumnsCount() != B.getColumnsCount() )
+    throw INVALID_RANGE;
+  kernels::gemmPacked(C.view(), A.view(), B.view(), alpha, beta, &pool);
+}
+
+#endif // MATRIX_MULTIPLY_H
@@ -0,0 +1,108 @@
+/**
+ * @file MatrixView.hpp
+ *
+ * Copyright 2023 Diego Nieto
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation and/or
+ * other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS” AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef MATRIX_VIEW_H
+#define MATRIX_VIEW_H
+
+#include <cstddef>
+#include <type_traits>
+
+#include "MatrixAccess.hpp"
+
+/**
+ * @brief Non-owning view of a row-major block of a matrix
+ *
+ * A view is defined by a pointer to its top-left element, its dimensions and
+ * the distance in elements between two consecutive rows (stride). Rows, columns
+ * and blocks of a view are views themselves, so kernels can work on any part
+ * of a matrix without copying it. Element access is range checked according to
+ * the Access policy.
+ */
+template <typename T, typename Access = DefaultAccess>
+class MatrixView
+{
+public:
+    MatrixView(T *data, const unsigned int nrows, const unsigned int ncols, const size_t stride) :
+    _data(data), _nrows(nrows), _ncols(ncols), _stride(stride) {}
+
+    /**
+     * @brief Read-only views can be built from writable ones
+     */
+    template <typename U, typename = typename std::enable_if<std::is_same<const U, T>::value>::type>
+    MatrixView(const MatrixView<U, Access> &other) :
+    _data(other.data()), _nrows(other.getRowsCount()), _ncols(other.getColumnsCount()),
+    _stride(other.getStride()) {}
+
+    T &operator()(const unsigned int i, const unsigned int j) const
+    {
+        Access::check(i, j, _nrows, _ncols);
+        return _data[i*_stride+j];
+    }
+
+    /**
+     * @brief Pointer to the first element of row i
+     */
+    T *row(const unsigned int i) const
+    {
+        Access::check(i, 0, _nrows, 1);
+        return _data+i*_stride;
+    }
+
+    MatrixView rowView(const unsigned int i) const
+    {
+        return block(i, 0, 1, _ncols);
+    }
+
+    MatrixView columnView(const unsigned int j) const
+    {
+        return block(0, j, _nrows, 1);
+    }
+
+    /**
+     * @brief View of the nrows x ncols block starting at (i, j)
+     */
+    MatrixView block(const unsigned int i, const unsigned int j,
+                     const unsigned int nrows, const unsigned int ncols) const
+    {
+        Access::checkBlock(i, j, nrows, ncols, _nrows, _ncols);
+        return MatrixView(_data+i*_stride+j, nrows, ncols, _stride);
+    }
+
+    T *data() const { return _data; }
+    unsigned int getRowsCount() const { return _nrows; }
+    unsigned int getColumnsCount() const { return _ncols; }
+    size_t getStride() const { return _stride; }
+
+private:
+    T *_data;
+    unsigned int _nrows;
+    unsigned int _ncols;
+    size_t _stride;
+};
+
+#endif // MATRIX_VIEW_H
@@ -0,0 +1,200 @@
+/**
+ * @file MixedPrecision.hpp
+ *
+ * Copyright 2023 Diego Nieto
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation and/or
+ * other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS” AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef MIXED_PRECISION_H
+#define MIXED_PRECISION_H
+
+#include <cmath>
+#include <limits>
+#include <memory>
+#include <vector>
+
+#include "Squarematrix.hpp"
+
+/**
+ * @brief Outcome of MixedPrecisionSolver::solve
+ */
+struct RefinementInfo
+{
+    /** Refinement steps done in double */
+    unsigned int iterations;
+    /** Normwise backward error |b-Ax| / (|A||x| + |b|) of the returned x */
+    double backwardError;
+    /** Whether the solution comes from the double precision factorization */
+    bool fellBack;
+};
+
+/**
+ * @brief Solves A*x = b to double precision accuracy with a float LU
+ *
+ * The matrix is factorized in float, half the memory traffic and twice the
+ * SIMD lanes of double. Every solution is then refined: the residual is
+ * computed against the double matrix and the correction is solved with the
+ * float factors. When the refinement stalls (the matrix is too ill
+ * conditioned for float) or the matrix does not fit in float, A is
+ * factorized in double once and used from then on.
+ *
+ * The matrix given to the constructor is referenced, not copied, so it must
+ * outlive the solver.
+ */
+template <typename Access = DefaultAccess>
+class MixedPrecisionSolver
+{
+public:
+    static constexpr unsigned int defaultMaxIterations = 30;
+
+    explicit MixedPrecisionSolver(const SquareMatrix<double, Access> &a,
+                                  const unsigned int maxIterations = defaultMaxIterations);
+
+    /**
+     * @brief Solves A*x = b
+     *
+     * @param b right-hand side, of size getSize()
+     * @param x receives the solution
+     */
+    RefinementInfo solve(const std::vector<double> &b, std::vector<double> &x);
+
+    unsigned int getSize() const { return _a.getSize(); }
+
+    /**
+     * @brief Whether the double precision factorization is in use
+     */
+    bool hasFallenBack() const { return _double != nullptr; }
+
+private:
+    /**
+     * @brief |b-Ax|_inf / (|A|_inf |x|_inf + |b|_inf), r receives b-Ax
+     */
+    double residual(const std::vector<double> &b, const std::vector<double> &x,
+                    std::vector<double> &r) const;
+
+    void fallBack();
+
+    const SquareMatrix<double, Access> &_a;
+    const unsigned int _maxIterations;
+    double _normA;
+    SquareMatrix<float, Access> _single;
+    std::unique_ptr<SquareMatrix<double, Access>> _double;
+};
+
+template <typename Access>
+MixedPrecisionSolver<Access>::MixedPrecisionSolver(const SquareMatrix<double, Access> &a,
+                                                   const unsigned int maxIterations) :
+  _a(a), _maxIterations(maxIterations), _normA(0), _single(a.getSize())
+{
+  const unsigned int n = a.getSize();
+  const double *src = a.getDataPtr();
+  float *dst = _single.getDataPtr();
+  bool fitsFloat = true;
+  for ( unsigned int i=0; i<n; i++ )
+  {
+    double rowSum = 0;
+    for ( unsigned int j=0; j<n; j++ )
+    {
+      const double value = src[i*n+j];
+      rowSum += std::abs(value);
+      if ( std::abs(value) > std::numeric_limits<float>::max() )
+        fitsFloat = false;
+      dst[i*n+j] = static_cast<float>(value);
+    }
+    _normA = std::max(_normA, rowSum);
+  }
+
+  if ( fitsFloat )
+    _single.luRecursive();
+  else
+    fallBack();
+}
+
+template <typename Access>
+double MixedPrecisionSolver<Access>::residual(const std::vector<double> &b, const std::vector<double> &x,
+                                              std::vector<double> &r) const
+{
+  const unsigned int n = getSize();
+  double normR = 0, normX = 0, normB = 0;
+  for ( unsigned int i=0; i<n; i++ )
+  {
+    r[i] = b[i]-simd::dot<double>(n, _a.getDataPtr()+i*n, x.data());
+    normR = std::max(normR, std::abs(r[i]));
+    normX = std::max(normX, std::abs(x[i]));
+    normB = std::max(normB, std::abs(b[i]));
+  }
+  const double scale = _normA*normX+normB;
+  return scale > 0 ? normR/scale : normR;
+}
+
+template <typename Access>
+void MixedPrecisionSolver<Access>::fallBack()
+{
+  _double.reset(new SquareMatrix<double, Access>(_a));
+  _double->luRecursive();
+}
+
+template <typename Access>
+RefinementInfo MixedPrecisionSolver<Access>::solve(const std::vector<double> &b, std::vector<double> &x)
+{
+  const unsigned int n = getSize();
+  if ( b.size() != n )
+    throw INVALID_RANGE;
+
+  RefinementInfo info = { 0, 0, false };
+  std::vector<double> r(n);
+  if ( !_double ) {
+    // Same stopping test as LAPACK dsgesv
+    const double tolerance = std::numeric_limits<double>::epsilon()*std::sqrt(static_cast<double>(n));
+    std::vector<float> correction(b.begin(), b.end());
+    correction = _single.solve(correction);
+    x.assign(correction.begin(), correction.end());
+
+    double previous = std::numeric_limits<double>::infinity();
+    while ( true )
+    {
+      info.backwardError = residual(b, x, r);
+      if ( info.backwardError <= tolerance && std::isfinite(info.backwardError) )
+        return info;
+      // Stalled: each step must at least halve the error
+      if ( info.iterations == _maxIterations || !(info.backwardError < 0.5*previous) )
+        break;
+      previous = info.backwardError;
+
+      correction.assign(r.begin(), r.end());
+      correction = _single.solve(correction);
+      for ( unsigned int i=0; i<n; i++ )
+        x[i] += correction[i];
+      info.iterations++;
+    }
+    fallBack();
+  }
+
+  x = _double->solve(b);
+  info.backwardError = residual(b, x, r);
+  info.fellBack = true;
+  return info;
+}
+
+#endif // MIXED_PRECISION_H
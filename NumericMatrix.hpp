@@ -30,19 +30,45 @@
 #define NUMERIC_MATRIX_H
 
 #include "Matrix.hpp"
+#include "MatrixExpression.hpp"
 
-template <typename T>
-class NumericMatrix : public Matrix<T>
+template <typename T, typename Access = DefaultAccess>
+class NumericMatrix : public Matrix<T, Access>
 {
 public:
-    NumericMatrix(const int nrows, const int ncols) :
-       Matrix<T>(nrows,ncols) {}
+    NumericMatrix(const int nrows, const int ncols,
+                  MatrixAllocator &allocator = defaultMatrixAllocator()) :
+       Matrix<T, Access>(nrows,ncols,allocator) {}
+
+    /**
+     * @brief Wraps external storage without copying it, see Matrix
+     */
+    NumericMatrix(T *data, const int nrows, const int ncols, std::shared_ptr<void> storage) :
+       Matrix<T, Access>(data, nrows, ncols, std::move(storage)) {}
+
+    /**
+     * @brief Evaluates an expression of matrices, see MatrixExpression.hpp
+     */
+    template <typename E>
+    NumericMatrix(const MatrixExpression<E> &expression,
+                  MatrixAllocator &allocator = defaultMatrixAllocator()) :
+       Matrix<T, Access>(expression.getRowsCount(), expression.getColumnsCount(), allocator)
+    {
+        evaluateExpression(*this, expression);
+    }
+
+    template <typename E>
+    NumericMatrix &operator=(const MatrixExpression<E> &expression)
+    {
+        evaluateExpression(*this, expression);
+        return *this;
+    }
 
     void setZero();
 };
 
-template <typename T>
-void NumericMatrix<T>::setZero()
+template <typename T, typename Access>
+void NumericMatrix<T, Access>::setZero()
 {
     for ( unsigned int i=0; i<this->_nrows; i++ )
     {
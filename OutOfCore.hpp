@@ -0,0 +1,498 @@
+/**
+ * @file OutOfCore.hpp
+ *
+ * Copyright 2023 Diego Nieto
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation and/or
+ * other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS” AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef OUT_OF_CORE_H
+#define OUT_OF_CORE_H
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <fstream>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "MatrixFile.hpp"
+
+/**
+ * @brief File read and written at explicit offsets, which several threads
+ * can do at the same time. Throws FILE_ERROR on failure
+ */
+class BlockFile
+{
+public:
+    /**
+     * @param create whether to create (or truncate) the file instead of
+     * opening an existing one
+     */
+    BlockFile(const std::string &path, const bool create)
+    {
+#ifdef VLU_MMAP
+        _fd = ::open(path.c_str(), create ? O_RDWR | O_CREAT | O_TRUNC : O_RDWR, 0644);
+        if ( _fd < 0 )
+            throw FILE_ERROR;
+#else
+        if ( create )
+            std::ofstream(path, std::ios::binary | std::ios::trunc);
+        _stream.open(path, std::ios::in | std::ios::out | std::ios::binary);
+        if ( !_stream )
+            throw FILE_ERROR;
+#endif
+    }
+
+    ~BlockFile()
+    {
+#ifdef VLU_MMAP
+        ::close(_fd);
+#endif
+    }
+
+    BlockFile(const BlockFile &) = delete;
+    BlockFile &operator=(const BlockFile &) = delete;
+
+    void read(const uint64_t offset, void *data, const size_t bytes) const
+    {
+#ifdef VLU_MMAP
+        char *p = static_cast<char *>(data);
+        for ( size_t done=0; done<bytes; )
+        {
+            const ssize_t n = pread(_fd, p+done, bytes-done, offset+done);
+            if ( n <= 0 && !(n < 0 && errno == EINTR) )
+                throw FILE_ERROR;
+            done += n > 0 ? n : 0;
+        }
+#else
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stream.seekg(offset);
+        if ( !_stream.read(static_cast<char *>(data), bytes) )
+            throw FILE_ERROR;
+#endif
+    }
+
+    void write(const uint64_t offset, const void *data, const size_t bytes)
+    {
+#ifdef VLU_MMAP
+        const char *p = static_cast<const char *>(data);
+        for ( size_t done=0; done<bytes; )
+        {
+            const ssize_t n = pwrite(_fd, p+done, bytes-done, offset+done);
+            if ( n <= 0 && !(n < 0 && errno == EINTR) )
+                throw FILE_ERROR;
+            done += n > 0 ? n : 0;
+        }
+#else
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stream.seekp(offset);
+        if ( !_stream.write(static_cast<const char *>(data), bytes) )
+            throw FILE_ERROR;
+#endif
+    }
+
+    uint64_t size() const
+    {
+#ifdef VLU_MMAP
+        struct stat status;
+        if ( fstat(_fd, &status) != 0 )
+            throw FILE_ERROR;
+        return status.st_size;
+#else
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stream.seekg(0, std::ios::end);
+        return static_cast<uint64_t>(_stream.tellg());
+#endif
+    }
+
+    /**
+     * @brief Grows the file, the new bytes read as zeros
+     */
+    void resize(const uint64_t bytes)
+    {
+#ifdef VLU_MMAP
+        if ( ftruncate(_fd, bytes) != 0 )
+            throw FILE_ERROR;
+#else
+        if ( bytes > size() ) {
+            const char zero = 0;
+            write(bytes-1, &zero, 1);
+        }
+#endif
+    }
+
+private:
+#ifdef VLU_MMAP
+    int _fd;
+#else
+    mutable std::fstream _stream;
+    mutable std::mutex _mutex;
+#endif
+};
+
+/**
+ * @brief Square matrix stored in a file, for systems larger than the memory
+ *
+ * The file is a binary matrix file (see MatrixFile.hpp) in FILE_COLUMN_PANELS
+ * layout: panels of getPanelWidth() columns, each one made of square tiles
+ * stacked vertically, so a panel, or its rows from the diagonal down, is a
+ * single read. lu() holds panelsInMemory panels in memory and solve() two,
+ * the panel width is chosen so they fit in the memory budget.
+ *
+ * lu() is left-looking: each panel is read once, updated with the panels on
+ * its left, factorized and written back, so the finished panels are never
+ * rewritten. Hence L is kept as LINPACK does, every panel in the row order of
+ * its own factorization, and solve() applies the interchanges panel by
+ * panel. The factorization is saved in the file and read back when it is
+ * opened again.
+ */
+template <typename T, typename Access = DefaultAccess>
+class OutOfCoreMatrix
+{
+public:
+    /**
+     * @brief Panels held by lu(): the one being factorized, the next one
+     * being read or the previous one being written, and two panels of L, one
+     * being used while the next one is read
+     */
+    static constexpr unsigned int panelsInMemory = 4;
+
+    /**
+     * @brief Creates a size x size matrix of zeros in the file path, with
+     * the widest panels that keep lu() within memoryBudget bytes. Throws
+     * INVALID_RANGE if not even panels of one column fit
+     */
+    static OutOfCoreMatrix create(const std::string &path, const unsigned int size, const size_t memoryBudget);
+
+    /**
+     * @brief Opens a matrix created earlier, factorized or not. Throws
+     * FILE_ERROR or INVALID_FORMAT
+     */
+    explicit OutOfCoreMatrix(const std::string &path);
+
+    unsigned int getSize() const { return static_cast<unsigned int>(_header.rows); }
+    unsigned int getPanelWidth() const { return static_cast<unsigned int>(_header.panelWidth); }
+    Factorization getFactorization() const { return static_cast<Factorization>(_header.factorization); }
+
+    /**
+     * @brief Row interchanges of lu(), same meaning as in SquareMatrix but
+     * applied to the panel being factorized only
+     */
+    const std::vector<unsigned int> &getPivots() const { return _pivots; }
+
+    /**
+     * @brief Writes block at (row, col). A factorization stored in the file
+     * is discarded
+     */
+    void writeBlock(const unsigned int row, const unsigned int col, const MatrixView<const T, Access> &block);
+
+    /**
+     * @brief Reads the elements at (row, col) into block, which gives the
+     * factors as stored after lu()
+     */
+    void readBlock(const unsigned int row, const unsigned int col, const MatrixView<T, Access> &block) const;
+
+    /**
+     * @brief Performs a left-looking blocked LU decomposition in the file
+     *
+     * The next panel is read and the previous one written while the current
+     * one is updated, and the panels of L are read one ahead of their use.
+     */
+    void lu();
+
+    /**
+     * @brief Solves A*x = b with the factorization in the file, reading each
+     * panel twice, one ahead of its use
+     */
+    std::vector<T> solve(const std::vector<T> &b) const;
+
+private:
+    OutOfCoreMatrix(std::unique_ptr<BlockFile> file, const MatrixFileHeader &header) :
+    _file(std::move(file)), _header(header) {}
+
+    unsigned int getPanelsCount() const { return (getSize()+getPanelWidth()-1)/getPanelWidth(); }
+
+    uint64_t getOffset(const unsigned int panel, const unsigned int row) const
+    {
+        return _header.dataOffset + (uint64_t(panel)*getSize()+row)*getPanelWidth()*sizeof(T);
+    }
+
+    /**
+     * @brief Reads or writes rows [firstRow, firstRow+rows) of a panel from
+     * or to a getSize() x getPanelWidth() buffer
+     */
+    void readPanel(const unsigned int panel, const unsigned int firstRow, const unsigned int rows, T *buffer) const
+    {
+        const size_t width = getPanelWidth();
+        _file->read(getOffset(panel, firstRow), buffer+firstRow*width, size_t(rows)*width*sizeof(T));
+    }
+
+    void writePanel(const unsigned int panel, const T *buffer)
+    {
+        _file->write(getOffset(panel, 0), buffer, size_t(getSize())*getPanelWidth()*sizeof(T));
+    }
+
+    /**
+     * @brief Stores the factorization and its pivots in the file
+     */
+    void saveFactorization(const Factorization factorization, const std::vector<unsigned int> &pivots);
+
+    std::unique_ptr<BlockFile> _file;
+    MatrixFileHeader _header;
+    std::vector<unsigned int> _pivots;
+};
+
+template <typename T, typename Access>
+OutOfCoreMatrix<T, Access> OutOfCoreMatrix<T, Access>::create(const std::string &path, const unsigned int size,
+                                                              const size_t memoryBudget)
+{
+  const size_t panelColumnBytes = size_t(panelsInMemory)*size*sizeof(T);
+  if ( size == 0 || memoryBudget < panelColumnBytes )
+    throw INVALID_RANGE;
+  const unsigned int width = static_cast<unsigned int>(std::min<size_t>(memoryBudget/panelColumnBytes, size));
+
+  MatrixFileHeader header = matrix_file_detail::makeHeader<T>(size, size);
+  header.layout = FILE_COLUMN_PANELS;
+  header.panelWidth = width;
+  header.pivotsOffset = header.dataOffset +
+    uint64_t(size)*matrix_file_detail::alignUp(size, width)*sizeof(T);
+
+  std::unique_ptr<BlockFile> file(new BlockFile(path, true));
+  file->resize(header.pivotsOffset+uint64_t(size)*sizeof(int32_t));
+  file->write(0, &header, sizeof(header));
+  return OutOfCoreMatrix(std::move(file), header);
+}
+
+template <typename T, typename Access>
+OutOfCoreMatrix<T, Access>::OutOfCoreMatrix(const std::string &path) :
+_file(new BlockFile(path, false))
+{
+  const uint64_t fileSize = _file->size();
+  if ( fileSize < sizeof(_header) )
+    throw INVALID_FORMAT;
+  _file->read(0, &_header, sizeof(_header));
+  matrix_file_detail::checkHeader<T>(_header, fileSize, FILE_COLUMN_PANELS);
+  if ( _header.rows != _header.columns || _header.pivotsCount > _header.rows ||
+       (_header.factorization != NO_FACTORIZATION && _header.factorization != LU_FACTORIZATION) )
+    throw INVALID_FORMAT;
+
+  std::vector<int32_t> pivots(_header.pivotsCount);
+  _file->read(_header.pivotsOffset, pivots.data(), pivots.size()*sizeof(int32_t));
+  for ( unsigned int i=0; i<pivots.size(); i++ )
+  {
+    if ( pivots[i] < static_cast<int32_t>(i) || pivots[i] >= static_cast<int32_t>(getSize()) )
+      throw INVALID_FORMAT;
+    _pivots.push_back(pivots[i]);
+  }
+}
+
+template <typename T, typename Access>
+void OutOfCoreMatrix<T, Access>::saveFactorization(const Factorization factorization,
+                                                   const std::vector<unsigned int> &pivots)
+{
+  const std::vector<int32_t> filePivots(pivots.begin(), pivots.end());
+  _file->write(_header.pivotsOffset, filePivots.data(), filePivots.size()*sizeof(int32_t));
+  _header.factorization = factorization;
+  _header.pivotsCount = pivots.size();
+  _file->write(0, &_header, sizeof(_header));
+  _pivots = pivots;
+}
+
+template <typename T, typename Access>
+void OutOfCoreMatrix<T, Access>::writeBlock(const unsigned int row, const unsigned int col,
+                                            const MatrixView<const T, Access> &block)
+{
+  const unsigned int n = getSize();
+  const unsigned int nb = getPanelWidth();
+  if ( row > n || col > n || block.getRowsCount() > n-row || block.getColumnsCount() > n-col )
+    throw INVALID_RANGE;
+  if ( getFactorization() != NO_FACTORIZATION )
+    saveFactorization(NO_FACTORIZATION, std::vector<unsigned int>());
+
+  // One write per row and panel
+  const unsigned int colEnd = col+block.getColumnsCount();
+  for ( unsigned int c0=col; c0<colEnd; )
+  {
+    const unsigned int panel = c0/nb;
+    const unsigned int c1 = std::min(colEnd, (panel+1)*nb);
+    for ( unsigned int i=0; i<block.getRowsCount(); i++ )
+      _file->write(getOffset(panel, row+i)+(c0-panel*nb)*sizeof(T), block.row(i)+(c0-col), (c1-c0)*sizeof(T));
+    c0 = c1;
+  }
+}
+
+template <typename T, typename Access>
+void OutOfCoreMatrix<T, Access>::readBlock(const unsigned int row, const unsigned int col,
+                                           const MatrixView<T, Access> &block) const
+{
+  const unsigned int n = getSize();
+  const unsigned int nb = getPanelWidth();
+  if ( row > n || col > n || block.getRowsCount() > n-row || block.getColumnsCount() > n-col )
+    throw INVALID_RANGE;
+
+  const unsigned int colEnd = col+block.getColumnsCount();
+  for ( unsigned int c0=col; c0<colEnd; )
+  {
+    const unsigned int panel = c0/nb;
+    const unsigned int c1 = std::min(colEnd, (panel+1)*nb);
+    for ( unsigned int i=0; i<block.getRowsCount(); i++ )
+      _file->read(getOffset(panel, row+i)+(c0-panel*nb)*sizeof(T), block.row(i)+(c0-col), (c1-c0)*sizeof(T));
+    c0 = c1;
+  }
+}
+
+template <typename T, typename Access>
+void OutOfCoreMatrix<T, Access>::lu()
+{
+  const unsigned int n = getSize();
+  const unsigned int nb = getPanelWidth();
+  const unsigned int npanels = getPanelsCount();
+  VLU_OPERATION("luOutOfCore", n);
+  // The file holds a partial factorization until the end
+  saveFactorization(NO_FACTORIZATION, std::vector<unsigned int>());
+  std::vector<unsigned int> pivots(n);
+
+  NumericMatrix<T, Access> current(n, nb);
+  NumericMatrix<T, Access> other(n, nb);
+  NumericMatrix<T, Access> lower0(n, nb);
+  NumericMatrix<T, Access> lower1(n, nb);
+  NumericMatrix<T, Access> *a = &current;
+  NumericMatrix<T, Access> *previous = &other;
+  NumericMatrix<T, Access> *lower[2] = {&lower0, &lower1};
+
+  std::future<void> readNext = std::async(std::launch::async, [=] { readPanel(0, 0, n, a->getDataPtr()); });
+  std::future<void> writePrevious;
+  for ( unsigned int j=0; j<npanels; j++ )
+  {
+    const unsigned int j0 = j*nb;
+    const unsigned int jb = std::min(nb, n-j0);
+    readNext.get();
+    const MatrixView<T, Access> panel = a->view().block(0, 0, n, jb);
+
+    // Panels of L on the left, from the file except the previous one, which
+    // is still in memory
+    std::future<void> readLower;
+    auto startReading = [&](const unsigned int k) {
+      NumericMatrix<T, Access> *buffer = lower[k%2];
+      readLower = std::async(std::launch::async, [=] { readPanel(k, k*nb, n-k*nb, buffer->getDataPtr()); });
+    };
+    if ( j >= 2 )
+      startReading(0);
+    for ( unsigned int k=0; k<j; k++ )
+    {
+      const unsigned int k0 = k*nb;
+      const unsigned int k1 = k0+nb;
+      const T *data = previous->getDataPtr();
+      if ( k+1 < j ) {
+        readLower.get();
+        data = lower[k%2]->getDataPtr();
+        if ( k+2 < j )
+          startReading(k+1);
+      }
+      const MatrixView<const T, Access> l(data, n, nb, nb);
+
+      // A(k0:k1, :) = L11^-1 * P * A(k0:k1, :), A(k1:n, :) -= L21 * A(k0:k1, :)
+      kernels::laswp(panel, k0, k1, pivots.data());
+      VLU_PHASE(PHASE_ELIMINATION, uint64_t(n-k0)*(nb+jb)*sizeof(T),
+                uint64_t(nb)*nb*jb+2*uint64_t(n-k1)*nb*jb);
+      kernels::trsmLowerUnit(l.block(k0, 0, nb, nb), panel.block(k0, 0, nb, jb));
+      kernels::gemmUpdate(panel.block(k1, 0, n-k1, jb), l.block(k1, 0, n-k1, nb), panel.block(k0, 0, nb, jb));
+    }
+
+    kernels::getrfRecursive(panel.block(j0, 0, n-j0, jb), pivots.data()+j0);
+    for ( unsigned int r=j0; r<j0+jb; r++ )
+      pivots[r] += j0;
+
+    // Write the panel while the next one is read into the other buffer
+    if ( writePrevious.valid() )
+      writePrevious.get();
+    writePrevious = std::async(std::launch::async, [=] { writePanel(j, a->getDataPtr()); });
+    std::swap(a, previous);
+    if ( j+1 < npanels )
+      readNext = std::async(std::launch::async, [=] { readPanel(j+1, 0, n, a->getDataPtr()); });
+  }
+  writePrevious.get();
+  saveFactorization(LU_FACTORIZATION, pivots);
+}
+
+template <typename T, typename Access>
+std::vector<T> OutOfCoreMatrix<T, Access>::solve(const std::vector<T> &b) const
+{
+  const unsigned int n = getSize();
+  const unsigned int nb = getPanelWidth();
+  const unsigned int npanels = getPanelsCount();
+  if ( b.size() != n )
+    throw INVALID_RANGE;
+  VLU_OPERATION("solveOutOfCore", n);
+
+  std::vector<T> x(b);
+  NumericMatrix<T, Access> buffer0(n, nb);
+  NumericMatrix<T, Access> buffer1(n, nb);
+  NumericMatrix<T, Access> *buffers[2] = {&buffer0, &buffer1};
+
+  // P * L * y = b, L below the diagonal of each panel
+  std::future<void> read = std::async(std::launch::async, [=] { readPanel(0, 0, n, buffers[0]->getDataPtr()); });
+  for ( unsigned int k=0; k<npanels; k++ )
+  {
+    const unsigned int k0 = k*nb;
+    const unsigned int kb = std::min(nb, n-k0);
+    read.get();
+    if ( k+1 < npanels ) {
+      NumericMatrix<T, Access> *next = buffers[(k+1)%2];
+      read = std::async(std::launch::async, [=] { readPanel(k+1, k0+nb, n-k0-nb, next->getDataPtr()); });
+    }
+    const MatrixView<const T, Access> l(buffers[k%2]->getDataPtr(), n, kb, nb);
+    for ( unsigned int r=k0; r<std::min<size_t>(k0+kb, _pivots.size()); r++ )
+      std::swap(x[r], x[_pivots[r]]);
+    VLU_PHASE(PHASE_FORWARD_SUBSTITUTION, uint64_t(n-k0)*kb*sizeof(T), 2*uint64_t(n-k0)*kb);
+    kernels::trsvLowerUnit(l.block(k0, 0, kb, kb), x.data()+k0);
+    for ( unsigned int i=k0+kb; i<n; i++ )
+      x[i] -= simd::dot<T>(kb, l.row(i), x.data()+k0);
+  }
+
+  // U * x = y, U above the diagonal of each panel
+  read = std::async(std::launch::async, [=] { readPanel(npanels-1, 0, n, buffers[0]->getDataPtr()); });
+  for ( unsigned int k=npanels; k-- > 0; )
+  {
+    const unsigned int k0 = k*nb;
+    const unsigned int kb = std::min(nb, n-k0);
+    const unsigned int slot = (npanels-1-k)%2;
+    read.get();
+    if ( k > 0 ) {
+      NumericMatrix<T, Access> *next = buffers[(slot+1)%2];
+      read = std::async(std::launch::async, [=] { readPanel(k-1, 0, k0, next->getDataPtr()); });
+    }
+    const MatrixView<const T, Access> u(buffers[slot]->getDataPtr(), n, kb, nb);
+    VLU_PHASE(PHASE_BACKWARD_SUBSTITUTION, uint64_t(k0+kb)*kb*sizeof(T), 2*uint64_t(k0+kb)*kb);
+    kernels::trsvUpper(u.block(k0, 0, kb, kb), x.data()+k0);
+    for ( unsigned int i=0; i<k0; i++ )
+      x[i] -= simd::dot<T>(kb, u.row(i), x.data()+k0);
+  }
+  return x;
+}
+
+#endif // OUT_OF_CORE_H
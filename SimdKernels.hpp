@@ -0,0 +1,571 @@
+/**
+ * @file SimdKernels.hpp
+ *
+ * Copyright 2023 Diego Nieto
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation and/or
+ * other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS” AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef SIMD_KERNELS_H
+#define SIMD_KERNELS_H
+
+#include <atomic>
+#include <cmath>
+#include <cstddef>
+#include <limits>
+#include <type_traits>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define VLU_SIMD_X86
+#include <immintrin.h>
+#endif
+
+/**
+ * Vectorized AXPY, dot product, argmax of absolute values and GEMM kernels.
+ * They are compiled for several instruction sets in the same binary and the
+ * widest one supported by the CPU is picked at runtime (see getIsa()), so the
+ * same executable runs on every generation of x86 nodes.
+ */
+namespace simd {
+
+enum Isa {
+    ISA_SCALAR = 0,
+    ISA_SSE2,
+    ISA_AVX2,
+    ISA_AVX512
+};
+
+/**
+ * @brief Rows of C computed by gemmMicroKernel, the columns are two vectors
+ * of the instruction set (KernelTable::gemmMicroColumns)
+ */
+static constexpr size_t gemmMicroRows = 6;
+
+namespace scalar {
+
+template <typename T>
+struct Ops
+{
+    typedef T V;
+    typedef int I;
+    static const size_t width = 1;
+
+    static V set1(const T a) { return a; }
+    static V load(const T *p) { return *p; }
+    static void store(T *p, const V v) { *p = v; }
+    static V add(const V a, const V b) { return a+b; }
+    static V sub(const V a, const V b) { return a-b; }
+    static V mul(const V a, const V b) { return a*b; }
+    static V div(const V a, const V b) { return a/b; }
+    static V fmadd(const V a, const V b, const V c) { return a*b+c; }
+    static V abs(const V a) { return std::abs(a); }
+    static V iota() { return T(0); }
+    static V selectEq(const V x, const V y, const V a, const V b) { return x == y ? b : a; }
+    static bool canGather(const size_t) { return true; }
+    static I makeIndex(const size_t) { return 0; }
+    static V gather(const T *p, const size_t, const I) { return *p; }
+    static void updateMax(const V v, const V index, V &maxValue, V &maxIndex)
+    {
+        if ( v > maxValue ) {
+            maxValue = v;
+            maxIndex = index;
+        }
+    }
+};
+
+#include "SimdKernelsImpl.hpp"
+
+} // namespace scalar
+
+#ifdef VLU_SIMD_X86
+
+namespace sse2 {
+
+template <typename T> struct Ops;
+
+template <>
+struct Ops<double>
+{
+    typedef __m128d V;
+    typedef int I;
+    static const size_t width = 2;
+
+    static V set1(const double a) { return _mm_set1_pd(a); }
+    static V load(const double *p) { return _mm_loadu_pd(p); }
+    static void store(double *p, const V v) { _mm_storeu_pd(p, v); }
+    static V add(const V a, const V b) { return _mm_add_pd(a, b); }
+    static V sub(const V a, const V b) { return _mm_sub_pd(a, b); }
+    static V mul(const V a, const V b) { return _mm_mul_pd(a, b); }
+    static V div(const V a, const V b) { return _mm_div_pd(a, b); }
+    static V fmadd(const V a, const V b, const V c) { return _mm_add_pd(_mm_mul_pd(a, b), c); }
+    static V abs(const V a) { return _mm_andnot_pd(_mm_set1_pd(-0.0), a); }
+    static V iota() { return _mm_set_pd(1.0, 0.0); }
+    static V selectEq(const V x, const V y, const V a, const V b)
+    {
+        const V equal = _mm_cmpeq_pd(x, y);
+        return _mm_or_pd(_mm_and_pd(equal, b), _mm_andnot_pd(equal, a));
+    }
+    static bool canGather(const size_t) { return true; }
+    static I makeIndex(const size_t) { return 0; }
+    static V gather(const double *p, const size_t s, const I) { return _mm_set_pd(p[s], p[0]); }
+    static void updateMax(const V v, const V index, V &maxValue, V &maxIndex)
+    {
+        const V greater = _mm_cmpgt_pd(v, maxValue);
+        maxValue = _mm_or_pd(_mm_and_pd(greater, v), _mm_andnot_pd(greater, maxValue));
+        maxIndex = _mm_or_pd(_mm_and_pd(greater, index), _mm_andnot_pd(greater, maxIndex));
+    }
+};
+
+template <>
+struct Ops<float>
+{
+    typedef __m128 V;
+    typedef int I;
+    static const size_t width = 4;
+
+    static V set1(const float a) { return _mm_set1_ps(a); }
+    static V load(const float *p) { return _mm_loadu_ps(p); }
+    static void store(float *p, const V v) { _mm_storeu_ps(p, v); }
+    static V add(const V a, const V b) { return _mm_add_ps(a, b); }
+    static V sub(const V a, const V b) { return _mm_sub_ps(a, b); }
+    static V mul(const V a, const V b) { return _mm_mul_ps(a, b); }
+    static V div(const V a, const V b) { return _mm_div_ps(a, b); }
+    static V fmadd(const V a, const V b, const V c) { return _mm_add_ps(_mm_mul_ps(a, b), c); }
+    static V abs(const V a) { return _mm_andnot_ps(_mm_set1_ps(-0.0f), a); }
+    static V iota() { return _mm_set_ps(3.0f, 2.0f, 1.0f, 0.0f); }
+    static V selectEq(const V x, const V y, const V a, const V b)
+    {
+        const V equal = _mm_cmpeq_ps(x, y);
+        return _mm_or_ps(_mm_and_ps(equal, b), _mm_andnot_ps(equal, a));
+    }
+    static bool canGather(const size_t) { return true; }
+    static I makeIndex(const size_t) { return 0; }
+    static V gather(const float *p, const size_t s, const I) { return _mm_set_ps(p[3*s], p[2*s], p[s], p[0]); }
+    static void updateMax(const V v, const V index, V &maxValue, V &maxIndex)
+    {
+        const V greater = _mm_cmpgt_ps(v, maxValue);
+        maxValue = _mm_or_ps(_mm_and_ps(greater, v), _mm_andnot_ps(greater, maxValue));
+        maxIndex = _mm_or_ps(_mm_and_ps(greater, index), _mm_andnot_ps(greater, maxIndex));
+    }
+};
+
+#include "SimdKernelsImpl.hpp"
+
+} // namespace sse2
+
+#pragma GCC push_options
+#pragma GCC target("avx2,fma")
+#ifdef __clang__
+#pragma clang attribute push(__attribute__((target("avx2,fma"))), apply_to = function)
+#endif
+
+namespace avx2 {
+
+template <typename T> struct Ops;
+
+template <>
+struct Ops<double>
+{
+    typedef __m256d V;
+    typedef __m256i I;
+    static const size_t width = 4;
+
+    static V set1(const double a) { return _mm256_set1_pd(a); }
+    static V load(const double *p) { return _mm256_loadu_pd(p); }
+    static void store(double *p, const V v) { _mm256_storeu_pd(p, v); }
+    static V add(const V a, const V b) { return _mm256_add_pd(a, b); }
+    static V sub(const V a, const V b) { return _mm256_sub_pd(a, b); }
+    static V mul(const V a, const V b) { return _mm256_mul_pd(a, b); }
+    static V div(const V a, const V b) { return _mm256_div_pd(a, b); }
+    static V fmadd(const V a, const V b, const V c) { return _mm256_fmadd_pd(a, b, c); }
+    static V abs(const V a) { return _mm256_andnot_pd(_mm256_set1_pd(-0.0), a); }
+    static V iota() { return _mm256_set_pd(3.0, 2.0, 1.0, 0.0); }
+    static V selectEq(const V x, const V y, const V a, const V b)
+    {
+        return _mm256_blendv_pd(a, b, _mm256_cmp_pd(x, y, _CMP_EQ_OQ));
+    }
+    static bool canGather(const size_t) { return true; }
+    static I makeIndex(const size_t s)
+    {
+        return _mm256_set_epi64x(3*s, 2*s, s, 0);
+    }
+    static V gather(const double *p, const size_t, const I index) { return _mm256_i64gather_pd(p, index, 8); }
+    static void updateMax(const V v, const V index, V &maxValue, V &maxIndex)
+    {
+        const V greater = _mm256_cmp_pd(v, maxValue, _CMP_GT_OQ);
+        maxValue = _mm256_blendv_pd(maxValue, v, greater);
+        maxIndex = _mm256_blendv_pd(maxIndex, index, greater);
+    }
+};
+
+template <>
+struct Ops<float>
+{
+    typedef __m256 V;
+    typedef __m256i I;
+    static const size_t width = 8;
+
+    static V set1(const float a) { return _mm256_set1_ps(a); }
+    static V load(const float *p) { return _mm256_loadu_ps(p); }
+    static void store(float *p, const V v) { _mm256_storeu_ps(p, v); }
+    static V add(const V a, const V b) { return _mm256_add_ps(a, b); }
+    static V sub(const V a, const V b) { return _mm256_sub_ps(a, b); }
+    static V mul(const V a, const V b) { return _mm256_mul_ps(a, b); }
+    static V div(const V a, const V b) { return _mm256_div_ps(a, b); }
+    static V fmadd(const V a, const V b, const V c) { return _mm256_fmadd_ps(a, b, c); }
+    static V abs(const V a) { return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a); }
+    static V iota() { return _mm256_set_ps(7.0f, 6.0f, 5.0f, 4.0f, 3.0f, 2.0f, 1.0f, 0.0f); }
+    static V selectEq(const V x, const V y, const V a, const V b)
+    {
+        return _mm256_blendv_ps(a, b, _mm256_cmp_ps(x, y, _CMP_EQ_OQ));
+    }
+    static bool canGather(const size_t s) { return s < (size_t(1) << 31)/width; }
+    static I makeIndex(const size_t stride)
+    {
+        const int s = static_cast<int>(stride);
+        return _mm256_set_epi32(7*s, 6*s, 5*s, 4*s, 3*s, 2*s, s, 0);
+    }
+    static V gather(const float *p, const size_t, const I index) { return _mm256_i32gather_ps(p, index, 4); }
+    static void updateMax(const V v, const V index, V &maxValue, V &maxIndex)
+    {
+        const V greater = _mm256_cmp_ps(v, maxValue, _CMP_GT_OQ);
+        maxValue = _mm256_blendv_ps(maxValue, v, greater);
+        maxIndex = _mm256_blendv_ps(maxIndex, index, greater);
+    }
+};
+
+#include "SimdKernelsImpl.hpp"
+
+} // namespace avx2
+
+#ifdef __clang__
+#pragma clang attribute pop
+#endif
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx512f,avx2,fma")
+#ifdef __clang__
+#pragma clang attribute push(__attribute__((target("avx512f,avx2,fma"))), apply_to = function)
+#endif
+
+namespace avx512 {
+
+template <typename T> struct Ops;
+
+template <>
+struct Ops<double>
+{
+    typedef __m512d V;
+    typedef __m512i I;
+    static const size_t width = 8;
+
+    static V set1(const double a) { return _mm512_set1_pd(a); }
+    static V load(const double *p) { return _mm512_loadu_pd(p); }
+    static void store(double *p, const V v) { _mm512_storeu_pd(p, v); }
+    static V add(const V a, const V b) { return _mm512_add_pd(a, b); }
+    static V sub(const V a, const V b) { return _mm512_sub_pd(a, b); }
+    static V mul(const V a, const V b) { return _mm512_mul_pd(a, b); }
+    static V div(const V a, const V b) { return _mm512_div_pd(a, b); }
+    static V fmadd(const V a, const V b, const V c) { return _mm512_fmadd_pd(a, b, c); }
+    static V abs(const V a) { return _mm512_abs_pd(a); }
+    static V iota() { return _mm512_set_pd(7.0, 6.0, 5.0, 4.0, 3.0, 2.0, 1.0, 0.0); }
+    static V selectEq(const V x, const V y, const V a, const V b)
+    {
+        return _mm512_mask_blend_pd(_mm512_cmp_pd_mask(x, y, _CMP_EQ_OQ), a, b);
+    }
+    static bool canGather(const size_t) { return true; }
+    static I makeIndex(const size_t s)
+    {
+        return _mm512_set_epi64(7*s, 6*s, 5*s, 4*s, 3*s, 2*s, s, 0);
+    }
+    static V gather(const double *p, const size_t, const I index)
+    {
+        return _mm512_mask_i64gather_pd(_mm512_setzero_pd(), 0xFF, index, p, 8);
+    }
+    static void updateMax(const V v, const V index, V &maxValue, V &maxIndex)
+    {
+        const __mmask8 greater = _mm512_cmp_pd_mask(v, maxValue, _CMP_GT_OQ);
+        maxValue = _mm512_mask_blend_pd(greater, maxValue, v);
+        maxIndex = _mm512_mask_blend_pd(greater, maxIndex, index);
+    }
+};
+
+template <>
+struct Ops<float>
+{
+    typedef __m512 V;
+    typedef __m512i I;
+    static const size_t width = 16;
+
+    static V set1(const float a) { return _mm512_set1_ps(a); }
+    static V load(const float *p) { return _mm512_loadu_ps(p); }
+    static void store(float *p, const V v) { _mm512_storeu_ps(p, v); }
+    static V add(const V a, const V b) { return _mm512_add_ps(a, b); }
+    static V sub(const V a, const V b) { return _mm512_sub_ps(a, b); }
+    static V mul(const V a, const V b) { return _mm512_mul_ps(a, b); }
+    static V div(const V a, const V b) { return _mm512_div_ps(a, b); }
+    static V fmadd(const V a, const V b, const V c) { return _mm512_fmadd_ps(a, b, c); }
+    static V abs(const V a) { return _mm512_abs_ps(a); }
+    static V iota()
+    {
+        return _mm512_set_ps(15.0f, 14.0f, 13.0f, 12.0f, 11.0f, 10.0f, 9.0f, 8.0f,
+                             7.0f, 6.0f, 5.0f, 4.0f, 3.0f, 2.0f, 1.0f, 0.0f);
+    }
+    static V selectEq(const V x, const V y, const V a, const V b)
+    {
+        return _mm512_mask_blend_ps(_mm512_cmp_ps_mask(x, y, _CMP_EQ_OQ), a, b);
+    }
+    static bool canGather(const size_t s) { return s < (size_t(1) << 31)/width; }
+    static I makeIndex(const size_t stride)
+    {
+        const int s = static_cast<int>(stride);
+        return _mm512_set_epi32(15*s, 14*s, 13*s, 12*s, 11*s, 10*s, 9*s, 8*s,
+                                7*s, 6*s, 5*s, 4*s, 3*s, 2*s, s, 0);
+    }
+    static V gather(const float *p, const size_t, const I index)
+    {
+        return _mm512_mask_i32gather_ps(_mm512_setzero_ps(), 0xFFFF, index, p, 4);
+    }
+    static void updateMax(const V v, const V index, V &maxValue, V &maxIndex)
+    {
+        const __mmask16 greater = _mm512_cmp_ps_mask(v, maxValue, _CMP_GT_OQ);
+        maxValue = _mm512_mask_blend_ps(greater, maxValue, v);
+        maxIndex = _mm512_mask_blend_ps(greater, maxIndex, index);
+    }
+};
+
+#include "SimdKernelsImpl.hpp"
+
+} // namespace avx512
+
+#ifdef __clang__
+#pragma clang attribute pop
+#endif
+#pragma GCC pop_options
+
+#endif // VLU_SIMD_X86
+
+/**
+ * @brief Widest instruction set supported by the CPU (and the OS)
+ */
+inline Isa detectIsa()
+{
+#ifdef VLU_SIMD_X86
+    __builtin_cpu_init();
+    if ( __builtin_cpu_supports("avx512f") )
+        return ISA_AVX512;
+    if ( __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") )
+        return ISA_AVX2;
+    if ( __builtin_cpu_supports("sse2") )
+        return ISA_SSE2;
+#endif
+    return ISA_SCALAR;
+}
+
+inline std::atomic<int> &activeIsa()
+{
+    static std::atomic<int> isa(detectIsa());
+    return isa;
+}
+
+/**
+ * @brief Instruction set used by the kernels
+ */
+inline Isa getIsa()
+{
+    return static_cast<Isa>(activeIsa().load(std::memory_order_relaxed));
+}
+
+/**
+ * @brief Forces the kernels to a narrower instruction set, e.g. to compare them
+ * in a benchmark. Requests wider than detectIsa() are clamped
+ *
+ * @return the instruction set actually selected
+ */
+inline Isa setIsa(const Isa isa)
+{
+    const Isa selected = isa > detectIsa() ? detectIsa() : isa;
+    activeIsa().store(selected);
+    return selected;
+}
+
+inline const char *getIsaName(const Isa isa)
+{
+    switch ( isa )
+    {
+    case ISA_SSE2: return "sse2";
+    case ISA_AVX2: return "avx2";
+    case ISA_AVX512: return "avx512";
+    default: return "scalar";
+    }
+}
+
+template <typename T>
+struct KernelTable
+{
+    void (*axpy)(size_t, T, const T *, T *);
+    T (*dot)(size_t, const T *, const T *);
+    size_t (*iamax)(size_t, const T *, size_t);
+    void (*gemm)(size_t, size_t, size_t, T, const T *, size_t, const T *, size_t, T *, size_t);
+    void (*batchLu)(size_t, size_t, T *, T *);
+    void (*batchInverse)(size_t, size_t, const T *, const T *, T *);
+    void (*gemmMicroKernel)(size_t, const T *, const T *, T *, size_t, size_t, size_t);
+    size_t gemmMicroColumns;
+};
+
+/**
+ * @brief Kernels of the active instruction set. Types other than float and
+ * double always get the scalar ones
+ */
+template <typename T>
+const KernelTable<T> &getKernelTable()
+{
+    static const KernelTable<T> scalarTable = {
+        scalar::axpy<T>, scalar::dot<T>, scalar::iamax<T>, scalar::gemm<T>,
+        scalar::batchLu<T>, scalar::batchInverse<T>,
+        scalar::gemmMicroKernel<T>, 2*scalar::Ops<T>::width
+    };
+    return scalarTable;
+}
+
+#ifdef VLU_SIMD_X86
+
+template <typename T>
+const KernelTable<T> &getSimdKernelTable()
+{
+    static const KernelTable<T> tables[] = {
+        { scalar::axpy<T>, scalar::dot<T>, scalar::iamax<T>, scalar::gemm<T>,
+          scalar::batchLu<T>, scalar::batchInverse<T>,
+          scalar::gemmMicroKernel<T>, 2*scalar::Ops<T>::width },
+        { sse2::axpy<T>, sse2::dot<T>, sse2::iamax<T>, sse2::gemm<T>,
+          sse2::batchLu<T>, sse2::batchInverse<T>,
+          sse2::gemmMicroKernel<T>, 2*sse2::Ops<T>::width },
+        { avx2::axpy<T>, avx2::dot<T>, avx2::iamax<T>, avx2::gemm<T>,
+          avx2::batchLu<T>, avx2::batchInverse<T>,
+          avx2::gemmMicroKernel<T>, 2*avx2::Ops<T>::width },
+        { avx512::axpy<T>, avx512::dot<T>, avx512::iamax<T>, avx512::gemm<T>,
+          avx512::batchLu<T>, avx512::batchInverse<T>,
+          avx512::gemmMicroKernel<T>, 2*avx512::Ops<T>::width },
+    };
+    return tables[getIsa()];
+}
+
+template <>
+inline const KernelTable<double> &getKernelTable<double>()
+{
+    return getSimdKernelTable<double>();
+}
+
+template <>
+inline const KernelTable<float> &getKernelTable<float>()
+{
+    return getSimdKernelTable<float>();
+}
+
+#endif // VLU_SIMD_X86
+
+/**
+ * @brief y += alpha*x
+ */
+template <typename T>
+inline void axpy(const size_t n, const T alpha, const T *x, T *y)
+{
+    getKernelTable<T>().axpy(n, alpha, x, y);
+}
+
+/**
+ * @brief Dot product of x and y
+ */
+template <typename T>
+inline T dot(const size_t n, const T *x, const T *y)
+{
+    return getKernelTable<T>().dot(n, x, y);
+}
+
+/**
+ * @brief Index of the first element with the largest absolute value among
+ * x[0], x[stride], ..., x[(n-1)*stride]
+ */
+template <typename T>
+inline size_t iamax(const size_t n, const T *x, const size_t stride)
+{
+    return getKernelTable<T>().iamax(n, x, stride);
+}
+
+/**
+ * @brief C(m x n) += alpha * A(m x k) * B(k x n), all of them row-major
+ */
+template <typename T>
+inline void gemm(const size_t m, const size_t n, const size_t k, const T alpha,
+                 const T *a, const size_t lda, const T *b, const size_t ldb,
+                 T *c, const size_t ldc)
+{
+    getKernelTable<T>().gemm(m, n, k, alpha, a, lda, b, ldb, c, ldc);
+}
+
+/**
+ * @brief LU with partial pivoting of a group of `lanes` interleaved n x n
+ * matrices, one matrix per lane: element (i,j) of matrix l is at
+ * a[(i*n+j)*lanes+l]. lanes must be a multiple of 64/sizeof(T). The pivot
+ * rows are stored interleaved in ipiv[k*lanes+l], as T
+ */
+template <typename T>
+inline void batchLu(const size_t n, const size_t lanes, T *a, T *ipiv)
+{
+    getKernelTable<T>().batchLu(n, lanes, a, ipiv);
+}
+
+/**
+ * @brief Inverses of a group of interleaved matrices factorized by batchLu()
+ */
+template <typename T>
+inline void batchInverse(const size_t n, const size_t lanes, const T *lu, const T *ipiv, T *inv)
+{
+    getKernelTable<T>().batchInverse(n, lanes, lu, ipiv, inv);
+}
+
+/**
+ * @brief C(m x n) += A * B with m <= gemmMicroRows and n <=
+ * gemmMicroColumns(), A and B packed as in gemmMicroKernel of
+ * SimdKernelsImpl.hpp
+ */
+template <typename T>
+inline void gemmMicroKernel(const size_t k, const T *a, const T *b, T *c, const size_t ldc,
+                            const size_t m, const size_t n)
+{
+    getKernelTable<T>().gemmMicroKernel(k, a, b, c, ldc, m, n);
+}
+
+/**
+ * @brief Width of the packed panels of B taken by gemmMicroKernel
+ */
+template <typename T>
+inline size_t gemmMicroColumns()
+{
+    return getKernelTable<T>().gemmMicroColumns;
+}
+
+} // namespace simd
+
+#endif // SIMD_KERNELS_H
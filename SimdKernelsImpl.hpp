@@ -0,0 +1,403 @@
+/**
+ * @file SimdKernelsImpl.hpp
+ *
+ * Copyright 2023 Diego Nieto
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation and/or
+ * other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS” AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Generic vector kernels, written once on top of an Ops<T> traits class that
+ * wraps the intrinsics of one instruction set. SimdKernels.hpp includes this
+ * file once per instruction set, inside the namespace and the target pragma of
+ * that instruction set, so there is deliberately no include guard. Every Ops<T>
+ * provides:
+ *
+ *   V, I              vector and gather index types
+ *   width             elements per vector
+ *   set1, load, store broadcast and unaligned memory access
+ *   add, sub, mul, div,
+ *   fmadd, abs        arithmetic, fmadd(a, b, c) = a*b+c
+ *   iota              vector holding 0, 1, ..., width-1
+ *   makeIndex, gather load width elements separated by a stride
+ *   updateMax         lane-wise argmax step, keeping the first maximum
+ *   selectEq          selectEq(x, y, a, b) = x == y ? b : a, lane-wise
+ */
+
+template <typename T>
+void axpy(const size_t n, const T alpha, const T *x, T *y)
+{
+  typedef Ops<T> O;
+  const size_t w = O::width;
+  const typename O::V va = O::set1(alpha);
+  size_t i = 0;
+  for ( ; i+2*w<=n; i+=2*w )
+  {
+    O::store(y+i, O::fmadd(va, O::load(x+i), O::load(y+i)));
+    O::store(y+i+w, O::fmadd(va, O::load(x+i+w), O::load(y+i+w)));
+  }
+  for ( ; i+w<=n; i+=w )
+    O::store(y+i, O::fmadd(va, O::load(x+i), O::load(y+i)));
+  for ( ; i<n; i++ )
+    y[i] += alpha*x[i];
+}
+
+template <typename T>
+T dot(const size_t n, const T *x, const T *y)
+{
+  typedef Ops<T> O;
+  const size_t w = O::width;
+  typename O::V acc0 = O::set1(0);
+  typename O::V acc1 = O::set1(0);
+  size_t i = 0;
+  for ( ; i+2*w<=n; i+=2*w )
+  {
+    acc0 = O::fmadd(O::load(x+i), O::load(y+i), acc0);
+    acc1 = O::fmadd(O::load(x+i+w), O::load(y+i+w), acc1);
+  }
+  for ( ; i+w<=n; i+=w )
+    acc0 = O::fmadd(O::load(x+i), O::load(y+i), acc0);
+
+  T lanes[O::width];
+  O::store(lanes, O::add(acc0, acc1));
+  T sum = 0;
+  for ( size_t l=0; l<w; l++ )
+    sum += lanes[l];
+  for ( ; i<n; i++ )
+    sum += x[i]*y[i];
+  return sum;
+}
+
+template <typename T>
+size_t iamax(const size_t n, const T *x, const size_t stride)
+{
+  typedef Ops<T> O;
+  const size_t w = O::width;
+  size_t best = 0;
+  T bestValue = n > 0 ? std::abs(x[0]) : T(0);
+  size_t i = 1;
+
+  // Lane indices are kept as T, exact as long as n fits in the mantissa
+  if ( n >= 2*w && n < (size_t(1) << std::numeric_limits<T>::digits) && O::canGather(stride) ) {
+    const typename O::I index = O::makeIndex(stride);
+    typename O::V maxValue = O::abs(O::gather(x, stride, index));
+    typename O::V maxIndex = O::iota();
+    typename O::V currIndex = O::add(maxIndex, O::set1(static_cast<T>(w)));
+    const typename O::V step = O::set1(static_cast<T>(w));
+    for ( i=w; i+w<=n; i+=w )
+    {
+      O::updateMax(O::abs(O::gather(x+i*stride, stride, index)), currIndex, maxValue, maxIndex);
+      currIndex = O::add(currIndex, step);
+    }
+
+    // Reduce the lanes: largest value, and the smallest index on ties
+    T values[O::width];
+    T indices[O::width];
+    O::store(values, maxValue);
+    O::store(indices, maxIndex);
+    bestValue = values[0];
+    best = static_cast<size_t>(indices[0]);
+    for ( size_t l=1; l<w; l++ )
+    {
+      const size_t idx = static_cast<size_t>(indices[l]);
+      if ( values[l] > bestValue || (values[l] == bestValue && idx < best) ) {
+        bestValue = values[l];
+        best = idx;
+      }
+    }
+  }
+
+  for ( ; i<n; i++ )
+  {
+    if ( std::abs(x[i*stride]) > bestValue ) {
+      bestValue = std::abs(x[i*stride]);
+      best = i;
+    }
+  }
+  return best;
+}
+
+/**
+ * C(m x n) += alpha * A(m x k) * B(k x n), register blocked on 4 rows of C by
+ * two vectors of columns.
+ */
+template <typename T>
+void gemm(const size_t m, const size_t n, const size_t k, const T alpha,
+          const T *a, const size_t lda, const T *b, const size_t ldb,
+          T *c, const size_t ldc)
+{
+  typedef Ops<T> O;
+  typedef typename O::V V;
+  const size_t w = O::width;
+
+  size_t i = 0;
+  for ( ; i+4<=m; i+=4 )
+  {
+    const T *a0 = a+i*lda;
+    const T *a1 = a0+lda;
+    const T *a2 = a1+lda;
+    const T *a3 = a2+lda;
+    T *c0 = c+i*ldc;
+    T *c1 = c0+ldc;
+    T *c2 = c1+ldc;
+    T *c3 = c2+ldc;
+    size_t j = 0;
+    for ( ; j+2*w<=n; j+=2*w )
+    {
+      V c00 = O::load(c0+j), c01 = O::load(c0+j+w);
+      V c10 = O::load(c1+j), c11 = O::load(c1+j+w);
+      V c20 = O::load(c2+j), c21 = O::load(c2+j+w);
+      V c30 = O::load(c3+j), c31 = O::load(c3+j+w);
+      for ( size_t kk=0; kk<k; kk++ )
+      {
+        const V b0 = O::load(b+kk*ldb+j);
+        const V b1 = O::load(b+kk*ldb+j+w);
+        V ak = O::set1(alpha*a0[kk]);
+        c00 = O::fmadd(ak, b0, c00); c01 = O::fmadd(ak, b1, c01);
+        ak = O::set1(alpha*a1[kk]);
+        c10 = O::fmadd(ak, b0, c10); c11 = O::fmadd(ak, b1, c11);
+        ak = O::set1(alpha*a2[kk]);
+        c20 = O::fmadd(ak, b0, c20); c21 = O::fmadd(ak, b1, c21);
+        ak = O::set1(alpha*a3[kk]);
+        c30 = O::fmadd(ak, b0, c30); c31 = O::fmadd(ak, b1, c31);
+      }
+      O::store(c0+j, c00); O::store(c0+j+w, c01);
+      O::store(c1+j, c10); O::store(c1+j+w, c11);
+      O::store(c2+j, c20); O::store(c2+j+w, c21);
+      O::store(c3+j, c30); O::store(c3+j+w, c31);
+    }
+    for ( ; j+w<=n; j+=w )
+    {
+      V c00 = O::load(c0+j), c10 = O::load(c1+j), c20 = O::load(c2+j), c30 = O::load(c3+j);
+      for ( size_t kk=0; kk<k; kk++ )
+      {
+        const V b0 = O::load(b+kk*ldb+j);
+        c00 = O::fmadd(O::set1(alpha*a0[kk]), b0, c00);
+        c10 = O::fmadd(O::set1(alpha*a1[kk]), b0, c10);
+        c20 = O::fmadd(O::set1(alpha*a2[kk]), b0, c20);
+        c30 = O::fmadd(O::set1(alpha*a3[kk]), b0, c30);
+      }
+      O::store(c0+j, c00); O::store(c1+j, c10); O::store(c2+j, c20); O::store(c3+j, c30);
+    }
+    for ( ; j<n; j++ )
+    {
+      T s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+      for ( size_t kk=0; kk<k; kk++ )
+      {
+        const T bk = b[kk*ldb+j];
+        s0 += a0[kk]*bk; s1 += a1[kk]*bk; s2 += a2[kk]*bk; s3 += a3[kk]*bk;
+      }
+      c0[j] += alpha*s0; c1[j] += alpha*s1; c2[j] += alpha*s2; c3[j] += alpha*s3;
+    }
+  }
+
+  // Remaining rows, one at a time
+  for ( ; i<m; i++ )
+  {
+    const T *ai = a+i*lda;
+    T *ci = c+i*ldc;
+    for ( size_t kk=0; kk<k; kk++ )
+      axpy(n, alpha*ai[kk], b+kk*ldb, ci);
+  }
+}
+
+/**
+ * Micro-kernel of the packed product: C(m x n) += A * B, with m <=
+ * gemmMicroRows and n <= 2*width. A holds the gemmMicroRows elements of each
+ * of its k columns contiguously, B the 2*width elements of each of its k rows,
+ * both padded with zeros. The 6 x 2 vectors of C stay in registers along k
+ */
+template <typename T>
+void gemmMicroKernel(const size_t k, const T *a, const T *b, T *c, const size_t ldc,
+                     const size_t m, const size_t n)
+{
+  typedef Ops<T> O;
+  typedef typename O::V V;
+  const size_t w = O::width;
+  static_assert(gemmMicroRows == 6, "the micro-kernel is unrolled on 6 rows");
+
+  V c00 = O::set1(0), c01 = O::set1(0), c10 = O::set1(0), c11 = O::set1(0);
+  V c20 = O::set1(0), c21 = O::set1(0), c30 = O::set1(0), c31 = O::set1(0);
+  V c40 = O::set1(0), c41 = O::set1(0), c50 = O::set1(0), c51 = O::set1(0);
+  for ( size_t kk=0; kk<k; kk++ )
+  {
+    const V b0 = O::load(b);
+    const V b1 = O::load(b+w);
+    V ai = O::set1(a[0]);
+    c00 = O::fmadd(ai, b0, c00); c01 = O::fmadd(ai, b1, c01);
+    ai = O::set1(a[1]);
+    c10 = O::fmadd(ai, b0, c10); c11 = O::fmadd(ai, b1, c11);
+    ai = O::set1(a[2]);
+    c20 = O::fmadd(ai, b0, c20); c21 = O::fmadd(ai, b1, c21);
+    ai = O::set1(a[3]);
+    c30 = O::fmadd(ai, b0, c30); c31 = O::fmadd(ai, b1, c31);
+    ai = O::set1(a[4]);
+    c40 = O::fmadd(ai, b0, c40); c41 = O::fmadd(ai, b1, c41);
+    ai = O::set1(a[5]);
+    c50 = O::fmadd(ai, b0, c50); c51 = O::fmadd(ai, b1, c51);
+    a += gemmMicroRows;
+    b += 2*w;
+  }
+
+  if ( m == gemmMicroRows && n == 2*w ) {
+    T *c0 = c;
+    O::store(c0, O::add(O::load(c0), c00)); O::store(c0+w, O::add(O::load(c0+w), c01));
+    c0 += ldc;
+    O::store(c0, O::add(O::load(c0), c10)); O::store(c0+w, O::add(O::load(c0+w), c11));
+    c0 += ldc;
+    O::store(c0, O::add(O::load(c0), c20)); O::store(c0+w, O::add(O::load(c0+w), c21));
+    c0 += ldc;
+    O::store(c0, O::add(O::load(c0), c30)); O::store(c0+w, O::add(O::load(c0+w), c31));
+    c0 += ldc;
+    O::store(c0, O::add(O::load(c0), c40)); O::store(c0+w, O::add(O::load(c0+w), c41));
+    c0 += ldc;
+    O::store(c0, O::add(O::load(c0), c50)); O::store(c0+w, O::add(O::load(c0+w), c51));
+    return;
+  }
+
+  // Edge of C: the tile goes through memory
+  T tile[gemmMicroRows*2*O::width];
+  O::store(tile, c00); O::store(tile+w, c01);
+  O::store(tile+2*w, c10); O::store(tile+3*w, c11);
+  O::store(tile+4*w, c20); O::store(tile+5*w, c21);
+  O::store(tile+6*w, c30); O::store(tile+7*w, c31);
+  O::store(tile+8*w, c40); O::store(tile+9*w, c41);
+  O::store(tile+10*w, c50); O::store(tile+11*w, c51);
+  for ( size_t i=0; i<m; i++ )
+    for ( size_t j=0; j<n; j++ )
+      c[i*ldc+j] += tile[i*2*w+j];
+}
+
+/**
+ * Lane-wise interchange of row k with the row given by rows in every lane,
+ * element (i,j) at m[(i*n+j)*lanes]. Branchless: every candidate row below k
+ * is blended
+ */
+template <typename T>
+void batchSwapRows(const size_t n, const size_t lanes, const size_t k,
+                   const typename Ops<T>::V rows, T *m)
+{
+  typedef Ops<T> O;
+  typedef typename O::V V;
+  for ( size_t i=k+1; i<n; i++ )
+  {
+    const V row = O::set1(static_cast<T>(i));
+    for ( size_t j=0; j<n; j++ )
+    {
+      const V top = O::load(m+(k*n+j)*lanes);
+      const V other = O::load(m+(i*n+j)*lanes);
+      O::store(m+(k*n+j)*lanes, O::selectEq(rows, row, top, other));
+      O::store(m+(i*n+j)*lanes, O::selectEq(rows, row, other, top));
+    }
+  }
+}
+
+/**
+ * LU with partial pivoting of lanes interleaved matrices, one per lane. Each
+ * vector of lanes is factorized on its own, so the elimination only touches
+ * the cache lines of its own matrices
+ */
+template <typename T>
+void batchLu(const size_t n, const size_t lanes, T *a, T *ipiv)
+{
+  typedef Ops<T> O;
+  typedef typename O::V V;
+  const size_t w = O::width;
+
+  for ( size_t l=0; l<lanes; l+=w )
+  {
+    T *al = a+l;
+    for ( size_t k=0; k<n; k++ )
+    {
+      // Pivot search, every lane on its own
+      V maxValue = O::abs(O::load(al+(k*n+k)*lanes));
+      V maxIndex = O::set1(static_cast<T>(k));
+      for ( size_t i=k+1; i<n; i++ )
+        O::updateMax(O::abs(O::load(al+(i*n+k)*lanes)), O::set1(static_cast<T>(i)), maxValue, maxIndex);
+      O::store(ipiv+k*lanes+l, maxIndex);
+
+      batchSwapRows<T>(n, lanes, k, maxIndex, al);
+
+      // Elimination below the pivot, multipliers stored in place for L
+      const V pivot = O::load(al+(k*n+k)*lanes);
+      for ( size_t i=k+1; i<n; i++ )
+      {
+        const V p = O::div(O::load(al+(i*n+k)*lanes), pivot);
+        O::store(al+(i*n+k)*lanes, p);
+        const V minusP = O::sub(O::set1(0), p);
+        for ( size_t j=k+1; j<n; j++ )
+          O::store(al+(i*n+j)*lanes, O::fmadd(minusP, O::load(al+(k*n+j)*lanes), O::load(al+(i*n+j)*lanes)));
+      }
+    }
+  }
+}
+
+/**
+ * Inverses of lanes interleaved matrices factorized by batchLu(): solves
+ * L*U*X = P with forward and backward substitutions, one matrix per lane
+ */
+template <typename T>
+void batchInverse(const size_t n, const size_t lanes, const T *lu, const T *ipiv, T *inv)
+{
+  typedef Ops<T> O;
+  typedef typename O::V V;
+  const size_t w = O::width;
+
+  for ( size_t l=0; l<lanes; l+=w )
+  {
+    const T *al = lu+l;
+    T *xl = inv+l;
+
+    // Identity with the rows interchanged as in the factorization
+    for ( size_t i=0; i<n; i++ )
+      for ( size_t j=0; j<n; j++ )
+        O::store(xl+(i*n+j)*lanes, O::set1(i == j ? T(1) : T(0)));
+    for ( size_t k=0; k+1<n; k++ )
+      batchSwapRows<T>(n, lanes, k, O::load(ipiv+k*lanes+l), xl);
+
+    // Forward substitution with the unit lower triangle
+    for ( size_t i=1; i<n; i++ )
+    {
+      for ( size_t k=0; k<i; k++ )
+      {
+        const V minusL = O::sub(O::set1(0), O::load(al+(i*n+k)*lanes));
+        for ( size_t j=0; j<n; j++ )
+          O::store(xl+(i*n+j)*lanes, O::fmadd(minusL, O::load(xl+(k*n+j)*lanes), O::load(xl+(i*n+j)*lanes)));
+      }
+    }
+
+    // Backward substitution with the upper triangle
+    for ( size_t i=n; i-- > 0; )
+    {
+      for ( size_t k=i+1; k<n; k++ )
+      {
+        const V minusU = O::sub(O::set1(0), O::load(al+(i*n+k)*lanes));
+        for ( size_t j=0; j<n; j++ )
+          O::store(xl+(i*n+j)*lanes, O::fmadd(minusU, O::load(xl+(k*n+j)*lanes), O::load(xl+(i*n+j)*lanes)));
+      }
+      const V p = O::div(O::set1(1), O::load(al+(i*n+i)*lanes));
+      for ( size_t j=0; j<n; j++ )
+        O::store(xl+(i*n+j)*lanes, O::mul(O::load(xl+(i*n+j)*lanes), p));
+    }
+  }
+}
@@ -0,0 +1,735 @@
+/**
+ * @file SparseMatrix.hpp
+ *
+ * Copyright 2023 Diego Nieto
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation and/or
+ * other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS” AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef SPARSE_MATRIX_H
+#define SPARSE_MATRIX_H
+
+#include <algorithm>
+#include <cmath>
+#include <utility>
+#include <vector>
+
+#include "NumericMatrix.hpp"
+
+/**
+ * @brief Entry (row, column, value) used to build a SparseMatrix
+ */
+template <typename T>
+struct Triplet
+{
+    unsigned int row;
+    unsigned int col;
+    T value;
+};
+
+/**
+ * @brief Compressed sparse row storage, see SparseMatrix::toCsr()
+ */
+template <typename T>
+struct CsrStorage
+{
+    std::vector<unsigned int> rowPointers;
+    std::vector<unsigned int> columnIndices;
+    std::vector<T> values;
+};
+
+/**
+ * @brief Sparse matrix in compressed sparse column (CSC) storage
+ *
+ * The row indices of column j are rowIndices[columnPointers[j] ..
+ * columnPointers[j+1]), sorted, and values holds the matching entries. Only
+ * the values can be changed after construction, the pattern is fixed.
+ */
+template <typename T>
+class SparseMatrix
+{
+public:
+    /**
+     * @brief Builds the matrix from triplets in any order. Duplicated
+     * entries are added up
+     */
+    SparseMatrix(const unsigned int nrows, const unsigned int ncols,
+                 const std::vector<Triplet<T>> &triplets);
+
+    unsigned int getRowsCount() const { return _nrows; }
+    unsigned int getColumnsCount() const { return _ncols; }
+    size_t getNonZerosCount() const { return _values.size(); }
+
+    /**
+     * @brief Element (i,j), zero when it is not stored
+     */
+    T get(const unsigned int i, const unsigned int j) const;
+
+    const std::vector<unsigned int> &getColumnPointers() const { return _columnPointers; }
+    const std::vector<unsigned int> &getRowIndices() const { return _rowIndices; }
+    const std::vector<T> &getValues() const { return _values; }
+    std::vector<T> &getValues() { return _values; }
+
+    /**
+     * @brief Same matrix in compressed sparse row storage
+     */
+    CsrStorage<T> toCsr() const;
+
+    /**
+     * @brief y = A*x
+     */
+    std::vector<T> multiply(const std::vector<T> &x) const;
+
+private:
+    unsigned int _nrows;
+    unsigned int _ncols;
+    std::vector<unsigned int> _columnPointers;
+    std::vector<unsigned int> _rowIndices;
+    std::vector<T> _values;
+};
+
+template <typename T>
+SparseMatrix<T>::SparseMatrix(const unsigned int nrows, const unsigned int ncols,
+                              const std::vector<Triplet<T>> &triplets) :
+  _nrows(nrows), _ncols(ncols), _columnPointers(ncols+1, 0)
+{
+  // Count the entries of every column, then place them (counting sort)
+  for ( const Triplet<T> &t : triplets )
+  {
+    if ( t.row >= nrows || t.col >= ncols )
+      throw INVALID_RANGE;
+    _columnPointers[t.col+1]++;
+  }
+  for ( unsigned int j=0; j<ncols; j++ )
+    _columnPointers[j+1] += _columnPointers[j];
+
+  std::vector<unsigned int> next(_columnPointers.begin(), _columnPointers.end()-1);
+  std::vector<std::pair<unsigned int, T>> entries(triplets.size());
+  for ( const Triplet<T> &t : triplets )
+    entries[next[t.col]++] = std::make_pair(t.row, t.value);
+
+  // Sort every column by row and merge the duplicates
+  _rowIndices.reserve(entries.size());
+  _values.reserve(entries.size());
+  unsigned int start = 0;
+  for ( unsigned int j=0; j<ncols; j++ )
+  {
+    const unsigned int end = _columnPointers[j+1];
+    std::sort(entries.begin()+start, entries.begin()+end,
+              [](const std::pair<unsigned int, T> &a, const std::pair<unsigned int, T> &b) {
+                  return a.first < b.first;
+              });
+    _columnPointers[j] = static_cast<unsigned int>(_rowIndices.size());
+    for ( unsigned int p=start; p<end; p++ )
+    {
+      if ( p > start && entries[p].first == _rowIndices.back() ) {
+        _values.back() += entries[p].second;
+      } else {
+        _rowIndices.push_back(entries[p].first);
+        _values.push_back(entries[p].second);
+      }
+    }
+    start = end;
+  }
+  _columnPointers[ncols] = static_cast<unsigned int>(_rowIndices.size());
+}
+
+template <typename T>
+T SparseMatrix<T>::get(const unsigned int i, const unsigned int j) const
+{
+  if ( i >= _nrows || j >= _ncols )
+    throw INVALID_RANGE;
+  const auto begin = _rowIndices.begin()+_columnPointers[j];
+  const auto end = _rowIndices.begin()+_columnPointers[j+1];
+  const auto it = std::lower_bound(begin, end, i);
+  return it != end && *it == i ? _values[it-_rowIndices.begin()] : static_cast<T>(0);
+}
+
+template <typename T>
+CsrStorage<T> SparseMatrix<T>::toCsr() const
+{
+  CsrStorage<T> csr;
+  csr.rowPointers.assign(_nrows+1, 0);
+  csr.columnIndices.resize(_values.size());
+  csr.values.resize(_values.size());
+  for ( const unsigned int row : _rowIndices )
+    csr.rowPointers[row+1]++;
+  for ( unsigned int i=0; i<_nrows; i++ )
+    csr.rowPointers[i+1] += csr.rowPointers[i];
+
+  // Going through the columns in order keeps every row sorted
+  std::vector<unsigned int> next(csr.rowPointers.begin(), csr.rowPointers.end()-1);
+  for ( unsigned int j=0; j<_ncols; j++ )
+  {
+    for ( unsigned int p=_columnPointers[j]; p<_columnPointers[j+1]; p++ )
+    {
+      const unsigned int q = next[_rowIndices[p]]++;
+      csr.columnIndices[q] = j;
+      csr.values[q] = _values[p];
+    }
+  }
+  return csr;
+}
+
+template <typename T>
+std::vector<T> SparseMatrix<T>::multiply(const std::vector<T> &x) const
+{
+  if ( x.size() != _ncols )
+    throw INVALID_RANGE;
+  std::vector<T> y(_nrows, static_cast<T>(0));
+  for ( unsigned int j=0; j<_ncols; j++ )
+    for ( unsigned int p=_columnPointers[j]; p<_columnPointers[j+1]; p++ )
+      y[_rowIndices[p]] += _values[p]*x[j];
+  return y;
+}
+
+/**
+ * @brief Column orderings available in SparseLU::analyze
+ */
+enum ColumnOrdering {
+    NATURAL_ORDERING,
+    MINIMUM_DEGREE_ORDERING
+};
+
+/**
+ * @brief Columns bucketed by degree in doubly linked lists, as minimum degree
+ * orderings keep them: constant time updates and a moving minimum
+ */
+class DegreeLists
+{
+public:
+    explicit DegreeLists(const unsigned int n) :
+        _head(n+1, none), _next(n, none), _prev(n, none), _minimum(0) {}
+
+    void insert(const unsigned int i, const unsigned int degree)
+    {
+        _prev[i] = none;
+        _next[i] = _head[degree];
+        if ( _head[degree] != none )
+            _prev[_head[degree]] = i;
+        _head[degree] = i;
+        _minimum = std::min(_minimum, degree);
+    }
+
+    void remove(const unsigned int i, const unsigned int degree)
+    {
+        if ( _prev[i] != none )
+            _next[_prev[i]] = _next[i];
+        else
+            _head[degree] = _next[i];
+        if ( _next[i] != none )
+            _prev[_next[i]] = _prev[i];
+    }
+
+    /**
+     * @brief Removes and returns a column of minimum degree. Must not be empty
+     */
+    unsigned int popMinimum()
+    {
+        while ( _head[_minimum] == none )
+            _minimum++;
+        const unsigned int i = _head[_minimum];
+        remove(i, _minimum);
+        return i;
+    }
+
+private:
+    static constexpr unsigned int none = static_cast<unsigned int>(-1);
+
+    std::vector<unsigned int> _head;
+    std::vector<unsigned int> _next;
+    std::vector<unsigned int> _prev;
+    unsigned int _minimum;
+};
+
+/**
+ * @brief Default relative threshold for partial pivoting in SparseLU
+ */
+const double defaultPivotThreshold = 0.1;
+
+/**
+ * @brief Sparse LU decomposition P*A*Q = L*U of a square SparseMatrix
+ *
+ * analyze() computes a fill-reducing column ordering Q (minimum degree on
+ * the pattern of A'A). factorize() runs a left-looking (Gilbert-Peierls) LU:
+ * every column of L and U comes from a sparse triangular solve whose
+ * pattern is found by a depth-first search, so the work is proportional to
+ * the floating point operations. Rows are chosen by threshold partial
+ * pivoting: the diagonal entry is kept while it is at least threshold times
+ * the largest candidate, which preserves the ordering. refactor() reuses the
+ * ordering, the pivots and the patterns of L and U when only the values of A
+ * change.
+ */
+template <typename T>
+class SparseLU
+{
+public:
+    explicit SparseLU(const double pivotThreshold = defaultPivotThreshold) :
+        _threshold(pivotThreshold), _n(0), _factorized(false) {}
+
+    /**
+     * @brief Symbolic analysis: column ordering of a
+     */
+    void analyze(const SparseMatrix<T> &a, const ColumnOrdering ordering = MINIMUM_DEGREE_ORDERING);
+
+    /**
+     * @brief Numeric factorization of a, which must have been analyzed (if
+     * not, it is analyzed with the default ordering). Throws SINGULAR_MATRIX
+     * when a column has no candidate pivot
+     */
+    void factorize(const SparseMatrix<T> &a);
+
+    /**
+     * @brief Factorizes a matrix with the same pattern as the last one
+     * factorized, reusing its pivots and the patterns of L and U. Falls back
+     * to factorize() when the pattern differs or a reused pivot gets too
+     * small
+     */
+    void refactor(const SparseMatrix<T> &a);
+
+    /**
+     * @brief Solves A*x = b with the factorization
+     */
+    std::vector<T> solve(const std::vector<T> &b) const;
+
+    /**
+     * @brief Solves A*X = B in place for every column of B
+     */
+    template <typename Access>
+    void solve(NumericMatrix<T, Access> &B) const;
+
+    unsigned int getSize() const { return _n; }
+
+    /**
+     * @brief Entries stored in L and U, unit diagonal of L included
+     */
+    size_t getNonZerosCount() const { return _lValues.size()+_uValues.size(); }
+
+    /**
+     * @brief Column ordering Q: column k of the factors is column
+     * getColumnOrder()[k] of A
+     */
+    const std::vector<unsigned int> &getColumnOrder() const { return _q; }
+
+private:
+    /**
+     * @brief Pattern of L \ A(:,col) at step k, in topological order, stored
+     * in stack[top..n). Returns top
+     */
+    unsigned int reach(const SparseMatrix<T> &a, const unsigned int col, const unsigned int k,
+                       std::vector<unsigned int> &stack);
+
+    /**
+     * @brief Solves L*U*x = b in place, b and x in the permuted orders
+     */
+    void solveInPlace(std::vector<T> &x) const;
+
+    bool samePattern(const SparseMatrix<T> &a) const
+    {
+        return a.getColumnPointers() == _aPointers && a.getRowIndices() == _aRows;
+    }
+
+    double _threshold;
+    unsigned int _n;
+    bool _factorized;
+    std::vector<unsigned int> _q;
+    /** Step at which each row of A was chosen as pivot, -1 if not yet */
+    std::vector<int> _pinv;
+    /** L and U in CSC. The unit diagonal is the first entry of every column
+     * of L and the pivot the last one of every column of U */
+    std::vector<unsigned int> _lPointers, _lRows;
+    std::vector<T> _lValues;
+    std::vector<unsigned int> _uPointers, _uRows;
+    std::vector<T> _uValues;
+    /** Pattern of the last matrix factorized, checked by refactor */
+    std::vector<unsigned int> _aPointers, _aRows;
+    /** Depth-first search workspace */
+    std::vector<unsigned int> _visited, _dfsNext;
+};
+
+template <typename T>
+void SparseLU<T>::analyze(const SparseMatrix<T> &a, const ColumnOrdering ordering)
+{
+  if ( a.getRowsCount() != a.getColumnsCount() )
+    throw INVALID_RANGE;
+  _n = a.getColumnsCount();
+  _factorized = false;
+  _q.resize(_n);
+  for ( unsigned int k=0; k<_n; k++ )
+    _q[k] = k;
+  if ( ordering == NATURAL_ORDERING || _n == 0 )
+    return;
+
+  // Graph of A'A: two columns are adjacent when they share a row. Rows much
+  // denser than the average would make it a clique and are left out, as COLAMD
+  // does
+  const CsrStorage<T> csr = a.toCsr();
+  const unsigned int denseRow = std::max(16u, static_cast<unsigned int>(10*std::sqrt(static_cast<double>(_n))));
+  std::vector<std::vector<unsigned int>> adjacency(_n);
+  for ( unsigned int i=0; i<_n; i++ )
+  {
+    const unsigned int begin = csr.rowPointers[i];
+    const unsigned int end = csr.rowPointers[i+1];
+    if ( end-begin > denseRow )
+      continue;
+    for ( unsigned int p=begin; p<end; p++ )
+      for ( unsigned int r=begin; r<end; r++ )
+        if ( r != p )
+          adjacency[csr.columnIndices[p]].push_back(csr.columnIndices[r]);
+  }
+
+  // Minimum degree on the quotient graph: an eliminated column becomes an
+  // element holding its neighbours, instead of turning them into a clique.
+  // Degrees are the approximate external degrees of AMD
+  std::vector<std::vector<unsigned int>> elements(_n);
+  std::vector<std::vector<unsigned int>> members(_n);
+  std::vector<unsigned int> degree(_n);
+  std::vector<bool> eliminated(_n, false);
+  std::vector<bool> absorbed(_n, false);
+  std::vector<unsigned int> mark(_n, 0);
+  std::vector<unsigned int> external(_n, 0);
+  std::vector<unsigned int> externalMark(_n, 0);
+  unsigned int stamp = 0;
+  DegreeLists lists(_n);
+  for ( unsigned int j=0; j<_n; j++ )
+  {
+    std::sort(adjacency[j].begin(), adjacency[j].end());
+    adjacency[j].erase(std::unique(adjacency[j].begin(), adjacency[j].end()), adjacency[j].end());
+    degree[j] = std::min(static_cast<unsigned int>(adjacency[j].size()), _n-1);
+    lists.insert(j, degree[j]);
+  }
+
+  for ( unsigned int k=0; k<_n; k++ )
+  {
+    const unsigned int p = lists.popMinimum();
+    _q[k] = p;
+    eliminated[p] = true;
+
+    // New element: the neighbours of p, direct or through its elements,
+    // which are absorbed
+    stamp++;
+    std::vector<unsigned int> lp;
+    for ( const unsigned int v : adjacency[p] )
+    {
+      if ( !eliminated[v] && mark[v] != stamp ) {
+        mark[v] = stamp;
+        lp.push_back(v);
+      }
+    }
+    for ( const unsigned int e : elements[p] )
+    {
+      if ( absorbed[e] )
+        continue;
+      for ( const unsigned int v : members[e] )
+      {
+        if ( !eliminated[v] && mark[v] != stamp ) {
+          mark[v] = stamp;
+          lp.push_back(v);
+        }
+      }
+      absorbed[e] = true;
+      std::vector<unsigned int>().swap(members[e]);
+    }
+    std::vector<unsigned int>().swap(adjacency[p]);
+    std::vector<unsigned int>().swap(elements[p]);
+
+    // Prune the lists of the members: absorbed elements go away and so do
+    // the columns now reachable through p. |Le \ Lp| of the other elements
+    // is counted on the way
+    for ( const unsigned int u : lp )
+    {
+      std::vector<unsigned int> &elems = elements[u];
+      elems.erase(std::remove_if(elems.begin(), elems.end(),
+                                 [&](const unsigned int e) { return absorbed[e]; }), elems.end());
+      for ( const unsigned int e : elems )
+      {
+        if ( externalMark[e] != stamp ) {
+          externalMark[e] = stamp;
+          external[e] = static_cast<unsigned int>(members[e].size());
+        }
+        external[e]--;
+      }
+      std::vector<unsigned int> &vars = adjacency[u];
+      vars.erase(std::remove_if(vars.begin(), vars.end(),
+                                [&](const unsigned int v) { return eliminated[v] || mark[v] == stamp; }), vars.end());
+    }
+
+    const unsigned int lpSize = static_cast<unsigned int>(lp.size());
+    for ( const unsigned int u : lp )
+    {
+      unsigned int d = static_cast<unsigned int>(adjacency[u].size())+lpSize-1;
+      for ( const unsigned int e : elements[u] )
+        d += external[e];
+      d = std::min(d, degree[u]+lpSize-1);
+      d = std::min(d, _n-k-1);
+      lists.remove(u, degree[u]);
+      degree[u] = d;
+      lists.insert(u, d);
+      elements[u].push_back(p);
+    }
+    members[p] = std::move(lp);
+  }
+}
+
+template <typename T>
+unsigned int SparseLU<T>::reach(const SparseMatrix<T> &a, const unsigned int col, const unsigned int k,
+                                std::vector<unsigned int> &stack)
+{
+  // Depth-first search from every row of A(:,col) through the columns of L
+  // already computed (rows that are not pivots yet have no children). Rows
+  // are written from the end of stack in reverse post-order, which is a
+  // topological order; the search stack grows from the beginning of the
+  // same array, a row is never in both
+  const std::vector<unsigned int> &ap = a.getColumnPointers();
+  const std::vector<unsigned int> &ai = a.getRowIndices();
+  const unsigned int stamp = k+1;
+  unsigned int top = _n;
+  for ( unsigned int p=ap[col]; p<ap[col+1]; p++ )
+  {
+    if ( _visited[ai[p]] == stamp )
+      continue;
+    int head = 0;
+    stack[0] = ai[p];
+    while ( head >= 0 )
+    {
+      const unsigned int row = stack[head];
+      const int step = _pinv[row];
+      if ( _visited[row] != stamp ) {
+        _visited[row] = stamp;
+        _dfsNext[head] = step < 0 ? 0 : _lPointers[step];
+      }
+      bool finished = true;
+      if ( step >= 0 ) {
+        for ( unsigned int q=_dfsNext[head]; q<_lPointers[step+1]; q++ )
+        {
+          if ( _visited[_lRows[q]] != stamp ) {
+            _dfsNext[head] = q+1;
+            stack[++head] = _lRows[q];
+            finished = false;
+            break;
+          }
+        }
+      }
+      if ( finished ) {
+        head--;
+        stack[--top] = row;
+      }
+    }
+  }
+  return top;
+}
+
+template <typename T>
+void SparseLU<T>::factorize(const SparseMatrix<T> &a)
+{
+  if ( a.getRowsCount() != a.getColumnsCount() )
+    throw INVALID_RANGE;
+  if ( _q.size() != a.getColumnsCount() )
+    analyze(a);
+
+  const unsigned int n = _n;
+  const std::vector<unsigned int> &ap = a.getColumnPointers();
+  const std::vector<unsigned int> &ai = a.getRowIndices();
+  const std::vector<T> &av = a.getValues();
+  _factorized = false;
+  _pinv.assign(n, -1);
+  _visited.assign(n, 0);
+  _dfsNext.resize(n);
+  _lPointers.assign(1, 0);
+  _uPointers.assign(1, 0);
+  _lRows.clear();
+  _lValues.clear();
+  _uRows.clear();
+  _uValues.clear();
+  std::vector<unsigned int> stack(n);
+  std::vector<T> x(n, static_cast<T>(0));
+
+  for ( unsigned int k=0; k<n; k++ )
+  {
+    const unsigned int col = _q[k];
+    const unsigned int top = reach(a, col, k, stack);
+
+    // x = L \ A(:,col), following the topological order
+    for ( unsigned int p=ap[col]; p<ap[col+1]; p++ )
+      x[ai[p]] = av[p];
+    for ( unsigned int px=top; px<n; px++ )
+    {
+      const unsigned int row = stack[px];
+      const int step = _pinv[row];
+      if ( step < 0 )
+        continue;
+      const T value = x[row];
+      for ( unsigned int q=_lPointers[step]+1; q<_lPointers[step+1]; q++ )
+        x[_lRows[q]] -= _lValues[q]*value;
+    }
+
+    // Rows already pivoted go to U, the others are pivot candidates
+    unsigned int pivotRow = n;
+    T maxValue = 0;
+    for ( unsigned int px=top; px<n; px++ )
+    {
+      const unsigned int row = stack[px];
+      if ( _pinv[row] >= 0 ) {
+        _uRows.push_back(static_cast<unsigned int>(_pinv[row]));
+        _uValues.push_back(x[row]);
+      } else if ( pivotRow == n || std::abs(x[row]) > maxValue ) {
+        maxValue = std::abs(x[row]);
+        pivotRow = row;
+      }
+    }
+    if ( pivotRow == n || maxValue == static_cast<T>(0) )
+      throw SINGULAR_MATRIX;
+    // Threshold partial pivoting: keep the diagonal when it is large enough
+    if ( _pinv[col] < 0 && _visited[col] == k+1 && std::abs(x[col]) >= _threshold*maxValue )
+      pivotRow = col;
+
+    const T pivot = x[pivotRow];
+    _pinv[pivotRow] = static_cast<int>(k);
+    _uRows.push_back(k);
+    _uValues.push_back(pivot);
+    _uPointers.push_back(static_cast<unsigned int>(_uRows.size()));
+    _lRows.push_back(pivotRow);
+    _lValues.push_back(static_cast<T>(1));
+    for ( unsigned int px=top; px<n; px++ )
+    {
+      const unsigned int row = stack[px];
+      if ( _pinv[row] < 0 ) {
+        _lRows.push_back(row);
+        _lValues.push_back(x[row]/pivot);
+      }
+      x[row] = static_cast<T>(0);
+    }
+    _lPointers.push_back(static_cast<unsigned int>(_lRows.size()));
+  }
+
+  // Rows of L in pivot order, so that L is lower triangular
+  for ( unsigned int &row : _lRows )
+    row = static_cast<unsigned int>(_pinv[row]);
+  _aPointers = ap;
+  _aRows = ai;
+  _factorized = true;
+}
+
+template <typename T>
+void SparseLU<T>::refactor(const SparseMatrix<T> &a)
+{
+  if ( !_factorized || !samePattern(a) ) {
+    factorize(a);
+    return;
+  }
+
+  const unsigned int n = _n;
+  const std::vector<unsigned int> &ap = a.getColumnPointers();
+  const std::vector<unsigned int> &ai = a.getRowIndices();
+  const std::vector<T> &av = a.getValues();
+  std::vector<T> x(n, static_cast<T>(0));
+  for ( unsigned int k=0; k<n; k++ )
+  {
+    // Same sparse triangular solve, on the stored patterns and in pivot order
+    const unsigned int col = _q[k];
+    for ( unsigned int p=ap[col]; p<ap[col+1]; p++ )
+      x[_pinv[ai[p]]] = av[p];
+    const unsigned int uLast = _uPointers[k+1]-1;
+    for ( unsigned int p=_uPointers[k]; p<uLast; p++ )
+    {
+      const unsigned int step = _uRows[p];
+      const T value = x[step];
+      _uValues[p] = value;
+      x[step] = static_cast<T>(0);
+      for ( unsigned int q=_lPointers[step]+1; q<_lPointers[step+1]; q++ )
+        x[_lRows[q]] -= _lValues[q]*value;
+    }
+
+    // The old pivot must still pass the threshold test
+    const T pivot = x[k];
+    x[k] = static_cast<T>(0);
+    T maxValue = std::abs(pivot);
+    for ( unsigned int q=_lPointers[k]+1; q<_lPointers[k+1]; q++ )
+      maxValue = std::max(maxValue, static_cast<T>(std::abs(x[_lRows[q]])));
+    if ( pivot == static_cast<T>(0) || std::abs(pivot) < _threshold*maxValue ) {
+      factorize(a);
+      return;
+    }
+    _uValues[uLast] = pivot;
+    for ( unsigned int q=_lPointers[k]+1; q<_lPointers[k+1]; q++ )
+    {
+      _lValues[q] = x[_lRows[q]]/pivot;
+      x[_lRows[q]] = static_cast<T>(0);
+    }
+  }
+}
+
+template <typename T>
+void SparseLU<T>::solveInPlace(std::vector<T> &x) const
+{
+  const unsigned int n = _n;
+  for ( unsigned int j=0; j<n; j++ )
+  {
+    const T value = x[j];
+    for ( unsigned int q=_lPointers[j]+1; q<_lPointers[j+1]; q++ )
+      x[_lRows[q]] -= _lValues[q]*value;
+  }
+  for ( unsigned int j=n; j-- > 0; )
+  {
+    const unsigned int last = _uPointers[j+1]-1;
+    x[j] /= _uValues[last];
+    const T value = x[j];
+    for ( unsigned int q=_uPointers[j]; q<last; q++ )
+      x[_uRows[q]] -= _uValues[q]*value;
+  }
+}
+
+template <typename T>
+std::vector<T> SparseLU<T>::solve(const std::vector<T> &b) const
+{
+  if ( !_factorized || b.size() != _n )
+    throw INVALID_RANGE;
+  std::vector<T> x(_n);
+  for ( unsigned int i=0; i<_n; i++ )
+    x[_pinv[i]] = b[i];
+  solveInPlace(x);
+  std::vector<T> result(_n);
+  for ( unsigned int k=0; k<_n; k++ )
+    result[_q[k]] = x[k];
+  return result;
+}
+
+template <typename T>
+template <typename Access>
+void SparseLU<T>::solve(NumericMatrix<T, Access> &B) const
+{
+  if ( !_factorized || B.getRowsCount() != _n )
+    throw INVALID_RANGE;
+  const MatrixView<T, Access> b = B.view();
+  std::vector<T> x(_n);
+  for ( unsigned int col=0; col<b.getColumnsCount(); col++ )
+  {
+    for ( unsigned int i=0; i<_n; i++ )
+      x[_pinv[i]] = b.row(i)[col];
+    solveInPlace(x);
+    for ( unsigned int k=0; k<_n; k++ )
+      b.row(_q[k])[col] = x[k];
+  }
+}
+
+#endif // SPARSE_MATRIX_H
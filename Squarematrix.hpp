@@ -31,10 +31,17 @@
 
 #include <cmath>
 #include <array>
+#include <functional>
+#include <memory>
+#include <vector>
+#include <algorithm>
 
 #include <string.h>
 
 #include "NumericMatrix.hpp"
+#include "LUKernels.hpp"
+#include "LUTrace.hpp"
+#include "TaskScheduler.hpp"
 
 
 // #define DEBUG
@@ -46,27 +53,275 @@
 #define DBG_CMD(x)
 #endif
 
-template <typename T>
-class SquareMatrix : public NumericMatrix<T> {
+/**
+ * @brief Strategy used by lu() to interchange rows while pivoting
+ */
+enum RowInterchanges {
+    SWAP_ROWS,
+    INDIRECT_ROWS
+};
+
+/**
+ * @brief Factorization stored inplace in a SquareMatrix, which decides how
+ * solve() and getInverse() read it. A matrix that has not been factorized is
+ * read as an LU decomposition without interchanges
+ */
+enum Factorization {
+    NO_FACTORIZATION,
+    LU_FACTORIZATION,
+    CHOLESKY_FACTORIZATION,
+    LDLT_FACTORIZATION
+};
+
+/**
+ * @brief Called by long operations with the fraction of their work done so
+ * far. Returning false cancels the operation, which throws
+ * OPERATION_CANCELLED and leaves the matrix without factorization and with
+ * undefined elements
+ */
+typedef std::function<bool(double)> ProgressCallback;
+
+/**
+ * @brief Default number of columns factorized per panel in luBlocked
+ */
+const unsigned int defaultBlockSize = 64;
+
+/**
+ * @brief Default size of the square tiles scheduled by luParallel
+ */
+const unsigned int defaultTileSize = 128;
+
+/**
+ * @brief Largest multiplier an update of the LU factors may produce before
+ * they are recomputed with partial pivoting, see SquareMatrix::update
+ */
+const double updateGrowthLimit = 100.0;
+
+template <typename T, typename Access = DefaultAccess>
+class SquareMatrix : public NumericMatrix<T, Access> {
 public:
-    SquareMatrix(const int size) :
-      NumericMatrix<T>(size, size)
+    SquareMatrix(const int size, MatrixAllocator &allocator = defaultMatrixAllocator()) :
+      NumericMatrix<T, Access>(size, size, allocator), _factorization(NO_FACTORIZATION), _updateCount(0)
     {
 
     }
-    const unsigned int getSize() { return this->getRowsCount(); }
+
+    /**
+     * @brief Wraps external storage without copying it, see Matrix. Use
+     * setFactorization() if it holds factors computed earlier
+     */
+    SquareMatrix(T *data, const int size, std::shared_ptr<void> storage) :
+      NumericMatrix<T, Access>(data, size, size, std::move(storage)), _factorization(NO_FACTORIZATION), _updateCount(0)
+    {
+
+    }
+
+    /**
+     * @brief Evaluates a square expression of matrices, see
+     * MatrixExpression.hpp. Throws INVALID_RANGE if it is not square
+     */
+    template <typename E>
+    SquareMatrix(const MatrixExpression<E> &expression,
+                 MatrixAllocator &allocator = defaultMatrixAllocator()) :
+      NumericMatrix<T, Access>(checkSquare(expression), expression.getColumnsCount(), allocator),
+      _factorization(NO_FACTORIZATION), _updateCount(0)
+    {
+        evaluateExpression(*this, expression);
+    }
+
+    /**
+     * @brief Evaluates a square expression of matrices. The factorization
+     * stored inplace, if any, is discarded
+     */
+    template <typename E>
+    SquareMatrix &operator=(const MatrixExpression<E> &expression)
+    {
+        checkSquare(expression);
+        evaluateExpression(*this, expression);
+        _pivots.clear();
+        _symmetricPivots.clear();
+        _factorization = NO_FACTORIZATION;
+        _updateCount = 0;
+        return *this;
+    }
+
+    const unsigned int getSize() const { return this->getRowsCount(); }
 
     /**
      * @brief Performs an LU decomposition of the given matrix inplace
      *
+     * @param mode how rows are interchanged while pivoting. INDIRECT_ROWS
+     * swaps row pointers during the elimination and moves each row to its
+     * final place once at the end
+     * @param trace receives the pivot, the interchange and the changed cells
+     * of every step, see LUTrace.hpp. Nothing is recorded without it
+     */
+    void lu(const RowInterchanges mode = SWAP_ROWS, LUTraceSink<T> *trace = nullptr);
+
+    /**
+     * @brief Performs a blocked right-looking LU decomposition inplace
+     *
+     * Each step factorizes a panel of blockSize columns, applies its row
+     * interchanges to the rest of the matrix, solves the U block row and
+     * updates the trailing matrix with a single matrix product. The result is
+     * the same as lu() up to rounding.
+     *
+     * @param blockSize number of columns of each panel
+     * @param progress called after every panel, may cancel the factorization
+     * until the last one
+     */
+    void luBlocked(const unsigned int blockSize = defaultBlockSize,
+                   const ProgressCallback &progress = ProgressCallback());
+
+    /**
+     * @brief Performs a recursive (cache-oblivious) LU decomposition inplace
+     *
+     * The columns are split in halves recursively, so every level of the
+     * memory hierarchy is used without tuning a block size. Same result as
+     * lu() up to rounding.
+     */
+    void luRecursive();
+
+    /**
+     * @brief Performs a tiled LU decomposition inplace using several threads
+     *
+     * The matrix is split in tiles and every step of the factorization is
+     * expressed as tasks (panel factorization, row interchanges plus
+     * triangular solve of a tile column, and tile updates) scheduled on a
+     * work-stealing pool as soon as their dependencies are met. Therefore the
+     * panel of step k+1 is factorized while the updates of step k are still
+     * running. The result is the same as lu() up to rounding.
+     *
+     * @param nThreads number of threads, 0 means one per hardware thread
+     * @param tileSize rows and columns of each tile
+     */
+    void luParallel(const unsigned int nThreads, const unsigned int tileSize = defaultTileSize);
+
+    /**
+     * @brief Same as luParallel(nThreads, tileSize) but running on an existing pool
+     */
+    void luParallel(WorkStealingPool &pool, const unsigned int tileSize = defaultTileSize);
+
+    /**
+     * @brief Whether |A(i,j) - A(j,i)| <= tolerance for every pair. It stops
+     * at the first mismatch, so non-symmetric matrices are usually rejected
+     * after a few elements
+     */
+    bool isSymmetric(const T tolerance = static_cast<T>(0)) const;
+
+    /**
+     * @brief Performs a Cholesky decomposition A = L*L' inplace for symmetric
+     * positive definite matrices
+     *
+     * Only the lower triangle is read and written (L overwrites it), half the
+     * flops of lu(). Throws NOT_POSITIVE_DEFINITE when a pivot is not positive.
+     */
+    void cholesky();
+
+    /**
+     * @brief Performs a Bunch-Kaufman decomposition A = P*L*D*L'*P' inplace
+     * for symmetric indefinite matrices
+     *
+     * D is block diagonal with 1x1 and 2x2 blocks. Only the lower triangle is
+     * read and written, as in LAPACK sytrf: L below the diagonal blocks, D on
+     * them, and the interchanges in getSymmetricPivots().
+     */
+    void ldlt();
+
+    /**
+     * @brief Factorization stored inplace
+     */
+    Factorization getFactorization() const { return _factorization; }
+
+    /**
+     * @brief Declares that the matrix already holds a factorization computed
+     * earlier, e.g. read back from a file, so it can be solved without
+     * factorizing again
+     *
+     * @param pivots getPivots() for LU, getSymmetricPivots() for LDL' and
+     * empty otherwise. Throws INVALID_RANGE if they are not valid
+     * interchanges
+     */
+    void setFactorization(const Factorization factorization, const std::vector<int> &pivots);
+
+    /**
+     * @brief Updates the LU factorization stored inplace to the one of
+     * A + x*y' in O(n^2) instead of factorizing again (Bennett's algorithm)
+     *
+     * The update keeps the row interchanges of the factorization, so it
+     * watches the multipliers of L: when one exceeds updateGrowthLimit, the
+     * updated matrix is rebuilt from the factors and factorized again with
+     * partial pivoting. A matrix that has not been factorized is just
+     * updated. Throws INVALID_RANGE on size mismatch and
+     * INVALID_FACTORIZATION for Cholesky and LDL' factorizations.
+     */
+    void update(const std::vector<T> &x, const std::vector<T> &y);
+
+    /**
+     * @brief Same as update(x, y) for A + X*Y', X and Y being n x k, in a
+     * single pass over the factors
+     */
+    void update(const NumericMatrix<T, Access> &X, const NumericMatrix<T, Access> &Y);
+
+    /**
+     * @brief Replaces row i, respectively column j, of the factorized
+     * matrix by values with a rank-1 update
+     */
+    void replaceRow(const unsigned int i, const std::vector<T> &values);
+    void replaceColumn(const unsigned int j, const std::vector<T> &values);
+
+    /**
+     * @brief Rank-1 updates applied to the factors since they were last
+     * computed from scratch
+     */
+    unsigned int getUpdateCount() const { return _updateCount; }
+
+    /**
+     * @brief Get the inverse of the given matrix from the LU decomposition
+     * stored inplace. The factorization is not modified
+     *
+     * The result takes its memory from the allocator of this matrix.
+     */
+    SquareMatrix getInverse() const;
+
+    /**
+     * @brief Same as getInverse() writing the inverse into an existing matrix
+     * of the same size, so a loop of inversions can reuse its storage
+     */
+    void getInverse(SquareMatrix &inverse) const;
+
+    /**
+     * @brief Replaces the factorization stored inplace by the inverse of the
+     * matrix. LU and Cholesky need only O(n) extra memory, LDL' a scratch copy
+     * of the factors. The pivots are cleared
+     *
+     * @param progress called along the inversion, may cancel it until the
+     * final call with 1.0
+     */
+    void invert(const ProgressCallback &progress = ProgressCallback());
+
+    /**
+     * @brief Solves A*x = b using the LU decomposition stored inplace
+     *
+     * It applies the row interchanges of the factorization and performs the
+     * forward and backward substitutions, so lu() (or any of its variants)
+     * must have been called before. The factorization is not modified.
+     *
+     * @param b right-hand side, of size getSize()
+     * @return the solution x
      */
-    void lu();
+    std::vector<T> solve(const std::vector<T> &b) const;
 
     /**
-     * @brief Get the inverse of the given matrix
+     * @brief Solves A*X = B for several right-hand sides using the LU
+     * decomposition stored inplace
+     *
+     * The substitutions are blocked so most of the work is done by matrix
+     * products.
      *
+     * @param B getSize() x nrhs matrix, overwritten with the solution X
      */
-    SquareMatrix<T> getInverse();
+    void solve(NumericMatrix<T, Access> &B) const;
 
     /**
      * @brief Set data from a memory pointer
@@ -76,218 +331,1222 @@ public:
      */
     void setData(T *ptr, size_t size);
 
+    /**
+     * @brief Row interchanges of the last factorization, LAPACK ipiv style
+     * (0-based): at step i row i was interchanged with row getPivots()[i]
+     *
+     * Empty if the matrix has not been factorized
+     */
+    const std::vector<unsigned int> &getPivots() const { return _pivots; }
+
+    /**
+     * @brief Interchanges of the last ldlt(), LAPACK sytrf style (0-based):
+     * p >= 0 at step k means rows and columns k and p were interchanged with
+     * a 1x1 block, -(p+1) on steps k and k+1 that k+1 and p were with a 2x2
+     * block
+     */
+    const std::vector<int> &getSymmetricPivots() const { return _symmetricPivots; }
+
 private:
     /**
      * @brief Given a startRow, it iterates forward looking for the max
-     * absolute value of a column in a rows range
+     * absolute value of a column in a rows range and interchanges that row
+     * with startRow
      *
+     * @param rows pointer to the data of every row
+     * @param mode whether the data or only the row pointers are interchanged
      */
-    void permute(const unsigned int startRow);
+    void permute(const unsigned int startRow, T **rows,
+                 const RowInterchanges mode);
 
     /**
-     * @brief Make the matrix identity by setting ones in the diagonal
+     * @brief Moves every row to the position given by the row pointers
+     *
+     * @param rows rows[i] points to the data that must end up in row i
      */
-    void makeIdentity();
+    void reorderRows(T *const *rows);
 
-    std::unique_ptr<SquareMatrix<T>> _permutationMatrix;
+    template <typename E>
+    static unsigned int checkSquare(const MatrixExpression<E> &expression)
+    {
+        if ( expression.getRowsCount() != expression.getColumnsCount() )
+            throw INVALID_RANGE;
+        return expression.getRowsCount();
+    }
+
+    void invertLu(const ProgressCallback &progress);
+
+    /**
+     * @brief Calls progress, if any, and cancels the current operation when
+     * it returns false
+     */
+    void reportProgress(const ProgressCallback &progress, const double done);
+
+    /**
+     * @brief Forgets the factorization of an operation stopped halfway, whose
+     * elements are undefined
+     */
+    void clearFactorization();
+
+    void invertCholesky();
+
+    /**
+     * @brief Original row at each position of the factorized matrix, i.e.
+     * row i of P*A is row getPermutation()[i] of A
+     */
+    std::vector<unsigned int> getPermutation() const;
+
+    /**
+     * @brief A + X*Y' with X and Y n x k, in the rows order of A. Both are
+     * overwritten
+     */
+    void applyUpdate(const MatrixView<T, Access> &X, const MatrixView<T, Access> &Y);
+
+    /**
+     * @brief Factorizes P*A' again with partial pivoting when an update stops
+     * being stable at step from. P*A' is L*U, the factors being updated up to
+     * from, plus X*Y' on the rows and columns left
+     */
+    void refactor(const MatrixView<T, Access> &X, const MatrixView<T, Access> &Y, const unsigned int from);
+
+    /**
+     * @brief Solves A * X = B inplace with the Cholesky or LDL' factors
+     */
+    void solveCholesky(const MatrixView<T, Access> &b) const;
+    void solveLdlt(const MatrixView<T, Access> &b) const;
+
+    /**
+     * @brief Row interchanged with row i at step i of the factorization
+     */
+    std::vector<unsigned int> _pivots;
+    std::vector<int> _symmetricPivots;
+    Factorization _factorization;
+    unsigned int _updateCount;
 };
 
-template <typename T>
-void SquareMatrix<T>::permute(const unsigned int startRow)
+template <typename T, typename Access>
+void SquareMatrix<T, Access>::permute(const unsigned int startRow, T **rows,
+                              const RowInterchanges mode)
 {
-  T maxValue = static_cast<double>(std::abs(this->get(startRow, startRow)));
   unsigned int maxValueRow = startRow;
 
   // Find the absolute max value of a column in a rows range(startRow:nRows)
-  for ( unsigned int currRow=startRow+1; currRow<getSize(); currRow++ )
   {
-    if ( std::abs(this->get(currRow, startRow)) > maxValue ) {
-      maxValue = std::abs(this->get(currRow, startRow));
-      maxValueRow = currRow;
+    VLU_PHASE(PHASE_PIVOT_SEARCH, (getSize()-startRow)*sizeof(T), 0);
+    if ( mode == SWAP_ROWS ) {
+      // Rows are in place, the column is strided by the row length
+      maxValueRow += simd::iamax<T>(getSize()-startRow, rows[startRow]+startRow, getSize());
+    } else {
+      T maxValue = std::abs(rows[startRow][startRow]);
+      for ( unsigned int currRow=startRow+1; currRow<getSize(); currRow++ )
+      {
+        if ( std::abs(rows[currRow][startRow]) > maxValue ) {
+          maxValue = std::abs(rows[currRow][startRow]);
+          maxValueRow = currRow;
+        }
+      }
     }
   }
 
+  _pivots[startRow] = maxValueRow;
+
   // Interchange row (startRow <-> maxValueRow)
   if ( maxValueRow != startRow ) {
-    T tmp;
-    for ( unsigned int k=0; k<getSize(); k++ )
+    VLU_PHASE(PHASE_ROW_SWAP, mode == INDIRECT_ROWS ? 2*sizeof(T *) : 2*getSize()*sizeof(T), 0);
+    if ( mode == INDIRECT_ROWS )
+      std::swap(rows[startRow], rows[maxValueRow]);
+    else
+      std::swap_ranges(rows[startRow], rows[startRow]+getSize(), rows[maxValueRow]);
+  }
+}
+
+template <typename T, typename Access>
+void SquareMatrix<T, Access>::reorderRows(T *const *rows)
+{
+  const unsigned int n = getSize();
+  T *a = this->_matrix;
+  ScratchBuffer<T> tmp(n);
+  ScratchBuffer<bool> placed(n);
+  std::fill(placed.data(), placed.data()+n, false);
+
+  // Follow each cycle of the permutation so every row is moved only once
+  for ( unsigned int start=0; start<n; start++ )
+  {
+    if ( placed[start] || rows[start] == a+start*n )
+      continue;
+    std::copy(a+start*n, a+(start+1)*n, tmp.data());
+    unsigned int dst = start;
+    while ( true )
+    {
+      placed[dst] = true;
+      const unsigned int src = static_cast<unsigned int>((rows[dst]-a)/n);
+      if ( src == start ) {
+        std::copy(tmp.data(), tmp.data()+n, a+dst*n);
+        break;
+      }
+      std::copy(a+src*n, a+(src+1)*n, a+dst*n);
+      dst = src;
+    }
+  }
+}
+
+template <typename T, typename Access>
+void SquareMatrix<T, Access>::lu(const RowInterchanges mode, LUTraceSink<T> *trace)
+{
+  VLU_OPERATION("lu", getSize());
+  _factorization = LU_FACTORIZATION;
+  _updateCount = 0;
+  _pivots.resize(getSize());
+  if ( getSize() == 0 )
+    return;
+  _pivots[getSize()-1] = getSize()-1;
+
+  ScratchBuffer<T *> rows(getSize());
+  for ( unsigned int row=0; row<getSize(); row++ )
+    rows[row] = this->_matrix+row*getSize();
+  ScratchBuffer<T> multipliers(trace != nullptr ? getSize() : 0);
+
+  // A sink may stop the elimination by throwing, which leaves no
+  // factorization behind as a cancelled operation does
+  try {
+    if ( trace != nullptr )
+      trace->begin(getSize(), this->_matrix);
+
+    // Iterate through each column
+    for ( unsigned int col=0; col<getSize()-1; col++ )
     {
-      tmp = this->get(startRow, k);
-      this->set(startRow, k, this->get(maxValueRow, k));
-      this->set(maxValueRow, k, tmp);
-      tmp = _permutationMatrix->get(startRow, k);
-      _permutationMatrix->set(startRow, k, _permutationMatrix->get(maxValueRow, k));
-      _permutationMatrix->set(maxValueRow, k, tmp);
+        permute(col, rows.data(), mode);
+        const uint64_t m = getSize()-col-1;
+        VLU_PHASE(PHASE_ELIMINATION, m*(m+1)*sizeof(T), m*(2*m+1));
+        const T *pivotRow = rows[col];
+        // Iterate through each row to do zero
+        for ( unsigned int row=col+1; row<getSize(); row++ )
+        {
+            T *currRow = rows[row];
+            // Compute the pivot
+            T p = static_cast<T>(-currRow[col]/pivotRow[col]);
+            // Update row
+            simd::axpy<T>(getSize()-col-1, p, pivotRow+col+1, currRow+col+1);
+            // Store the pivot for L
+            currRow[col] = -p;
+        }
+        if ( trace != nullptr ) {
+            // The multipliers are strided, the pivot row is contiguous
+            for ( unsigned int row=col+1; row<getSize(); row++ )
+              multipliers[row-col-1] = rows[row][col];
+            trace->step(LUTraceStep<T>{col, _pivots[col], multipliers.data(), pivotRow+col});
+        }
     }
+
+    if ( mode == INDIRECT_ROWS ) {
+      VLU_PHASE(PHASE_ROW_SWAP, uint64_t(getSize())*getSize()*sizeof(T), 0);
+      reorderRows(rows.data());
+    }
+    if ( trace != nullptr )
+      trace->end();
+  } catch (...) {
+    clearFactorization();
+    throw;
   }
 }
 
-/**
- * @brief Make the matrix identity by setting ones in the diagonal
- */
-template<typename T>
-void SquareMatrix<T>::makeIdentity()
+template <typename T, typename Access>
+void SquareMatrix<T, Access>::luBlocked(const unsigned int blockSize, const ProgressCallback &progress)
+{
+  const unsigned int n = getSize();
+  const unsigned int nb = std::max(1u, blockSize);
+  const MatrixView<T, Access> a = this->view();
+  VLU_OPERATION("luBlocked", n);
+  _factorization = LU_FACTORIZATION;
+  _updateCount = 0;
+  _pivots.resize(n);
+
+  for ( unsigned int k0=0; k0<n; k0+=nb )
+  {
+    const unsigned int kb = std::min(nb, n-k0);
+    const unsigned int k1 = k0+kb;
+
+    // Factorize the panel A(k0:n, k0:k1)
+    kernels::getf2(a.block(k0, k0, n-k0, kb), &_pivots[k0]);
+    for ( unsigned int k=k0; k<k1; k++ )
+      _pivots[k] += k0;
+
+    // Apply the interchanges to the columns at the left and at the right of the panel
+    kernels::laswp(a.block(0, 0, n, k0), k0, k1, _pivots.data());
+    kernels::laswp(a.block(0, k1, n, n-k1), k0, k1, _pivots.data());
+
+    if ( k1 < n ) {
+      VLU_PHASE(PHASE_ELIMINATION, uint64_t(n-k0)*(n-k1)*sizeof(T),
+                uint64_t(kb)*kb*(n-k1)+2*uint64_t(n-k1)*kb*(n-k1));
+      // U block row: A(k0:k1, k1:n) = L11^-1 * A(k0:k1, k1:n)
+      kernels::trsmLowerUnit(a.block(k0, k0, kb, kb), a.block(k0, k1, kb, n-k1));
+      // Trailing update: A(k1:n, k1:n) -= L21 * U12
+      kernels::gemmUpdate(a.block(k1, k1, n-k1, n-k1), a.block(k1, k0, n-k1, kb), a.block(k0, k1, kb, n-k1));
+    }
+    // The work left is the factorization of the trailing matrix
+    const double left = static_cast<double>(n-k1)/n;
+    if ( k1 < n )
+      reportProgress(progress, 1.0-left*left*left);
+  }
+  // The factorization is complete, too late to cancel it
+  if ( progress )
+    progress(1.0);
+}
+
+template <typename T, typename Access>
+void SquareMatrix<T, Access>::luRecursive()
+{
+  VLU_OPERATION("luRecursive", getSize());
+  _factorization = LU_FACTORIZATION;
+  _updateCount = 0;
+  _pivots.resize(getSize());
+  kernels::getrfRecursive(this->view(), _pivots.data());
+}
+
+template <typename T, typename Access>
+void SquareMatrix<T, Access>::luParallel(const unsigned int nThreads, const unsigned int tileSize)
+{
+  WorkStealingPool pool(nThreads);
+  luParallel(pool, tileSize);
+}
+
+template <typename T, typename Access>
+void SquareMatrix<T, Access>::luParallel(WorkStealingPool &pool, const unsigned int tileSize)
+{
+  const unsigned int n = getSize();
+  const unsigned int nb = std::max(1u, tileSize);
+  const unsigned int ntiles = (n+nb-1)/nb;
+  const MatrixView<T, Access> a = this->view();
+  VLU_OPERATION("luParallel", n);
+  _factorization = LU_FACTORIZATION;
+  _updateCount = 0;
+  _pivots.resize(n);
+  unsigned int *ipiv = _pivots.data();
+  if ( n == 0 )
+    return;
+
+  auto tileStart = [=](const unsigned int t) { return t*nb; };
+  auto tileWidth = [=](const unsigned int t) { return std::min(nb, n-t*nb); };
+
+  TaskGraph graph;
+  // Last task writing each tile, row-major over the tiles grid
+  std::vector<TaskGraph::TaskId> lastWriter(ntiles*ntiles);
+  std::vector<bool> written(ntiles*ntiles, false);
+  auto dependsOnTile = [&](const TaskGraph::TaskId task, const unsigned int i, const unsigned int j) {
+    if ( written[i*ntiles+j] )
+      graph.addDependency(lastWriter[i*ntiles+j], task);
+  };
+  auto writesTile = [&](const TaskGraph::TaskId task, const unsigned int i, const unsigned int j) {
+    lastWriter[i*ntiles+j] = task;
+    written[i*ntiles+j] = true;
+  };
+
+  for ( unsigned int k=0; k<ntiles; k++ )
+  {
+    const unsigned int k0 = tileStart(k);
+    const unsigned int kb = tileWidth(k);
+
+    // Panel: factorize the tile column k from the diagonal down
+    const TaskGraph::TaskId panel = graph.addTask([=] {
+      kernels::getf2(a.block(k0, k0, n-k0, kb), ipiv+k0);
+      for ( unsigned int r=k0; r<k0+kb; r++ )
+        ipiv[r] += k0;
+    });
+    for ( unsigned int i=k; i<ntiles; i++ )
+    {
+      dependsOnTile(panel, i, k);
+      writesTile(panel, i, k);
+    }
+
+    for ( unsigned int j=k+1; j<ntiles; j++ )
+    {
+      const unsigned int j0 = tileStart(j);
+      const unsigned int jb = tileWidth(j);
+
+      // Apply the panel interchanges to the tile column j and solve its U tile
+      const TaskGraph::TaskId solve = graph.addTask([=] {
+        kernels::laswp(a.block(0, j0, n, jb), k0, k0+kb, ipiv);
+        VLU_PHASE(PHASE_ELIMINATION, uint64_t(kb)*jb*sizeof(T), uint64_t(kb)*kb*jb);
+        kernels::trsmLowerUnit(a.block(k0, k0, kb, kb), a.block(k0, j0, kb, jb));
+      });
+      graph.addDependency(panel, solve);
+      for ( unsigned int i=k; i<ntiles; i++ )
+      {
+        dependsOnTile(solve, i, j);
+        writesTile(solve, i, j);
+      }
+
+      // Update the tiles below: A(i,j) -= L(i,k) * U(k,j)
+      for ( unsigned int i=k+1; i<ntiles; i++ )
+      {
+        const unsigned int i0 = tileStart(i);
+        const unsigned int ib = tileWidth(i);
+        const TaskGraph::TaskId update = graph.addTask([=] {
+          VLU_PHASE(PHASE_ELIMINATION, uint64_t(ib)*jb*sizeof(T), 2*uint64_t(ib)*kb*jb);
+          kernels::gemmUpdate(a.block(i0, j0, ib, jb), a.block(i0, k0, ib, kb), a.block(k0, j0, kb, jb));
+        });
+        graph.addDependency(panel, update);
+        dependsOnTile(update, i, j);
+        writesTile(update, i, j);
+      }
+    }
+  }
+
+  // The interchanges of the later steps have to be applied to the L part of
+  // each tile column. Every other task precedes the last panel.
+  const TaskGraph::TaskId lastPanel = lastWriter[(ntiles-1)*ntiles+ntiles-1];
+  for ( unsigned int j=0; j+1<ntiles; j++ )
+  {
+    const unsigned int j0 = tileStart(j);
+    const unsigned int jb = tileWidth(j);
+    const TaskGraph::TaskId finalize = graph.addTask([=] {
+      kernels::laswp(a.block(0, j0, n, jb), j0+jb, n, ipiv);
+    });
+    graph.addDependency(lastPanel, finalize);
+  }
+
+  pool.run(graph);
+}
+
+template <typename T, typename Access>
+bool SquareMatrix<T, Access>::isSymmetric(const T tolerance) const
 {
-  this->setZero();
-  for (unsigned rowcol = 0; rowcol < this->getSize(); rowcol++ )
+  const unsigned int n = getSize();
+  const MatrixView<const T, Access> a = this->view();
+  const unsigned int tile = 32;
+
+  // Compare tile (i,j) with tile (j,i) so that both stay in cache
+  for ( unsigned int i0=0; i0<n; i0+=tile )
   {
-    this->set(rowcol, rowcol, static_cast<T>(1.0f));
+    const unsigned int i1 = std::min(i0+tile, n);
+    for ( unsigned int j0=0; j0<=i0; j0+=tile )
+    {
+      for ( unsigned int i=i0; i<i1; i++ )
+      {
+        const unsigned int j1 = std::min(j0+tile, i);
+        for ( unsigned int j=j0; j<j1; j++ )
+        {
+          const T diff = a.row(i)[j] - a.row(j)[i];
+          if ( diff > tolerance || -diff > tolerance )
+            return false;
+        }
+      }
+    }
+  }
+  return true;
+}
+
+template <typename T, typename Access>
+void SquareMatrix<T, Access>::cholesky()
+{
+  const unsigned int n = getSize();
+  const MatrixView<T, Access> a = this->view();
+  _pivots.clear();
+  _symmetricPivots.clear();
+  _factorization = CHOLESKY_FACTORIZATION;
+  _updateCount = 0;
+  VLU_OPERATION("cholesky", n);
+  VLU_PHASE(PHASE_ELIMINATION, uint64_t(n)*(n+1)/2*sizeof(T), uint64_t(n)*n*n/3);
+
+  // Row-wise Cholesky-Crout: l(i,j) = (a(i,j) - L(i,0:j) . L(j,0:j)) / l(j,j),
+  // both operands contiguous rows of the lower triangle
+  for ( unsigned int i=0; i<n; i++ )
+  {
+    T *currRow = a.row(i);
+    for ( unsigned int j=0; j<i; j++ )
+      currRow[j] = (currRow[j] - simd::dot<T>(j, currRow, a.row(j)))/a.row(j)[j];
+    const T d = currRow[i] - simd::dot<T>(i, currRow, currRow);
+    if ( !(d > static_cast<T>(0)) ) {
+      _factorization = NO_FACTORIZATION;
+      throw NOT_POSITIVE_DEFINITE;
+    }
+    currRow[i] = std::sqrt(d);
   }
 }
 
-template <typename T>
-void SquareMatrix<T>::lu()
+template <typename T, typename Access>
+void SquareMatrix<T, Access>::ldlt()
 {
-  _permutationMatrix = std::make_unique<SquareMatrix<T>>(getSize());
-  _permutationMatrix->makeIdentity();
+  const unsigned int n = getSize();
+  const MatrixView<T, Access> a = this->view();
+  // Bound on the element growth, (1 + sqrt(17)) / 8
+  const T alpha = static_cast<T>((1.0 + std::sqrt(17.0))/8.0);
+  ScratchBuffer<T> colk(n);
+  ScratchBuffer<T> colk1(n);
+  _pivots.clear();
+  _symmetricPivots.assign(n, 0);
+  _factorization = LDLT_FACTORIZATION;
+  _updateCount = 0;
+  VLU_OPERATION("ldlt", n);
 
-  // Iterate through each column
-  for ( unsigned int col=0; col<getSize()-1; col++ )
+  for ( unsigned int k=0; k<n; )
   {
-      permute(col);
-      // Iterate through each row to do zero
-      for ( unsigned int row=col+1; row<getSize(); row++ )
+    // Largest element below the diagonal of column k
+    const T absakk = std::abs(a.row(k)[k]);
+    unsigned int imax = k;
+    T colmax = static_cast<T>(0);
+    {
+      VLU_PHASE(PHASE_PIVOT_SEARCH, (n-k)*sizeof(T), 0);
+      for ( unsigned int i=k+1; i<n; i++ )
       {
-          // Compute the pivot
-          T p = static_cast<T>(-static_cast<T>(this->get(row, col))/static_cast<T>(this->get(col, col)));
-          // Update row
-          for ( unsigned int k=col; k<getSize(); k++ )
-          {
-              this->set(row, k, this->get(row, k)+p*this->get(col, k));
-          }
-          // Store the pivot for L
-          this->set(row, col, -p);
+        if ( std::abs(a.row(i)[k]) > colmax ) {
+          colmax = std::abs(a.row(i)[k]);
+          imax = i;
+        }
       }
+    }
+    if ( absakk == static_cast<T>(0) && colmax == static_cast<T>(0) ) {
+      _factorization = NO_FACTORIZATION;
+      throw SINGULAR_MATRIX;
+    }
+
+    unsigned int kstep = 1;
+    unsigned int kp = k;
+    if ( absakk < alpha*colmax ) {
+      VLU_PHASE(PHASE_PIVOT_SEARCH, (n-k)*sizeof(T), 0);
+      // Largest element of row and column imax off the diagonal
+      T rowmax = static_cast<T>(0);
+      for ( unsigned int j=k; j<imax; j++ )
+        rowmax = std::max(rowmax, std::abs(a.row(imax)[j]));
+      for ( unsigned int i=imax+1; i<n; i++ )
+        rowmax = std::max(rowmax, std::abs(a.row(i)[imax]));
+
+      if ( absakk*rowmax >= alpha*colmax*colmax ) {
+        kp = k;
+      } else if ( std::abs(a.row(imax)[imax]) >= alpha*rowmax ) {
+        kp = imax;
+      } else {
+        kp = imax;
+        kstep = 2;
+      }
+    }
+
+    // Symmetric interchange of kk and kp in the trailing lower triangle
+    const unsigned int kk = k+kstep-1;
+    if ( kp != kk ) {
+      VLU_PHASE(PHASE_ROW_SWAP, 2*(n-kk)*sizeof(T), 0);
+      for ( unsigned int i=kp+1; i<n; i++ )
+        std::swap(a.row(i)[kk], a.row(i)[kp]);
+      for ( unsigned int j=kk+1; j<kp; j++ )
+        std::swap(a.row(j)[kk], a.row(kp)[j]);
+      std::swap(a.row(kk)[kk], a.row(kp)[kp]);
+      if ( kstep == 2 )
+        std::swap(a.row(k+1)[k], a.row(kp)[k]);
+    }
+
+    const uint64_t trailing = n-k-kstep;
+    VLU_PHASE(PHASE_ELIMINATION, trailing*(trailing+1)/2*sizeof(T), kstep*trailing*(trailing+1));
+    if ( kstep == 1 ) {
+      // A(k+1:n,k+1:n) -= x * x' / d with x = A(k+1:n,k), row by row
+      const T r1 = static_cast<T>(static_cast<T>(1.0f)/a.row(k)[k]);
+      for ( unsigned int i=k+1; i<n; i++ )
+        colk[i] = a.row(i)[k];
+      for ( unsigned int i=k+1; i<n; i++ )
+      {
+        simd::axpy<T>(i-k, -r1*colk[i], colk.data()+k+1, a.row(i)+k+1);
+        a.row(i)[k] = r1*colk[i];
+      }
+      _symmetricPivots[k] = kp;
+    } else {
+      // Columns k and k+1 of L are W * D-1, with W the two columns of A.
+      // D is scaled by d21 to avoid overflow
+      const T d21 = a.row(k+1)[k];
+      const T d11 = a.row(k+1)[k+1]/d21;
+      const T d22 = a.row(k)[k]/d21;
+      const T t = static_cast<T>(static_cast<T>(1.0f)/(d11*d22 - static_cast<T>(1)));
+      const T s = t/d21;
+      for ( unsigned int i=k+2; i<n; i++ )
+      {
+        const T wk = a.row(i)[k];
+        const T wk1 = a.row(i)[k+1];
+        colk[i] = s*(d11*wk - wk1);
+        colk1[i] = s*(d22*wk1 - wk);
+      }
+      // A(k+2:n,k+2:n) -= W * [L(:,k) L(:,k+1)]'
+      for ( unsigned int i=k+2; i<n; i++ )
+      {
+        simd::axpy<T>(i-k-1, -a.row(i)[k], colk.data()+k+2, a.row(i)+k+2);
+        simd::axpy<T>(i-k-1, -a.row(i)[k+1], colk1.data()+k+2, a.row(i)+k+2);
+      }
+      for ( unsigned int i=k+2; i<n; i++ )
+      {
+        a.row(i)[k] = colk[i];
+        a.row(i)[k+1] = colk1[i];
+      }
+      _symmetricPivots[k] = -static_cast<int>(kp)-1;
+      _symmetricPivots[k+1] = -static_cast<int>(kp)-1;
+    }
+    k += kstep;
+  }
+}
+
+template <typename T, typename Access>
+SquareMatrix<T, Access> SquareMatrix<T, Access>::getInverse() const
+{
+  SquareMatrix inverse(getSize(), *this->_allocator);
+  getInverse(inverse);
+  return inverse;
+}
+
+template <typename T, typename Access>
+void SquareMatrix<T, Access>::getInverse(SquareMatrix &inverse) const
+{
+  if ( inverse.getSize() != getSize() )
+    throw INVALID_RANGE;
+  VLU_OPERATION("getInverse", getSize());
+
+  std::copy(this->_matrix, this->_matrix+getSize()*getSize(), inverse._matrix);
+  inverse._pivots = _pivots;
+  inverse._symmetricPivots = _symmetricPivots;
+  inverse._factorization = _factorization;
+  inverse.invert();
+}
+
+template <typename T, typename Access>
+void SquareMatrix<T, Access>::invert(const ProgressCallback &progress)
+{
+  VLU_OPERATION("invert", getSize());
+  switch ( _factorization )
+  {
+  case CHOLESKY_FACTORIZATION:
+    invertCholesky();
+    break;
+  case LDLT_FACTORIZATION:
+    {
+      // Solve A * X = I with a copy of the factors, instrumented as the
+      // substitutions of solveLdlt
+      const unsigned int n = getSize();
+      SquareMatrix factors(n, scratchMatrixAllocator());
+      std::copy(this->_matrix, this->_matrix+n*n, factors._matrix);
+      factors._symmetricPivots = _symmetricPivots;
+      this->setZero();
+      for ( unsigned int i=0; i<n; i++ )
+        this->_matrix[i*n+i] = static_cast<T>(1);
+      factors.solveLdlt(this->view());
+    }
+    break;
+  default:
+    invertLu(progress);
+    break;
   }
+  // The inverse is complete, too late to cancel it
+  if ( progress )
+    progress(1.0);
+  _pivots.clear();
+  _symmetricPivots.clear();
+  _factorization = NO_FACTORIZATION;
+  _updateCount = 0;
 }
 
-template <typename T>
-SquareMatrix<T> SquareMatrix<T>::getInverse()
+template <typename T, typename Access>
+void SquareMatrix<T, Access>::invertLu(const ProgressCallback &progress)
 {
   DBG (" printing original LU: ");
   DBG_CMD (this->print());
 
-  // Perform backward substitution. U will do the following transformation:
-  SquareMatrix<T> Uinverse(getSize());
-  Uinverse.makeIdentity();
-  //   U   |  UInv
-  // u u u | 1 0 0      1 0 0 | u-1 u-1 u-1
-  // 0 u u | 0 1 0  ->  0 1 0 |  0  u-1 u-1
-  // 0 0 u | 0 0 1      0 0 1 |  0   0  u-1
-  for ( int row = getSize()-1; row >= 0; row-- )
+  const unsigned int n = getSize();
+  const MatrixView<T, Access> a = this->view();
+  ScratchBuffer<T> work(n);
+  VLU_PHASE(PHASE_INVERSION, uint64_t(n)*n*sizeof(T), uint64_t(n)*n*n*4/3);
+
+  // Invert U inplace from the last row up. Row i of U-1 is the combination
+  // of the rows of U-1 below it given by row i of U, scaled by -1/u(i,i):
+  // u u u      u-1 u-1 u-1
+  // 0 u u  ->   0  u-1 u-1
+  // 0 0 u       0   0  u-1
+  for ( unsigned int row=n; row-- > 0; )
   {
-    T p = static_cast<T>(static_cast<T>(1.0f)/this->get(row, row));
-    // Multiply all the row by the pivot in both matrix
-    for ( unsigned int col = row; col < this->getSize(); col++ )
-    {
-      this->set(row, col, this->get(row, col)*p);
-      Uinverse.set(row, col, Uinverse.get(row, col)*p);
+    T *currRow = a.row(row);
+    const T p = static_cast<T>(static_cast<T>(1.0f)/currRow[row]);
+    std::copy(currRow+row+1, currRow+n, work.data()+row+1);
+    std::fill(currRow+row+1, currRow+n, static_cast<T>(0));
+    for ( unsigned int k=row+1; k<n; k++ )
+      simd::axpy<T>(n-k, -p*work[k], a.row(k)+k, currRow+k);
+    currRow[row] = p;
+    // A quarter of the flops, mostly in the rows at the top
+    if ( row%defaultBlockSize == 0 ) {
+      const double left = static_cast<double>(row)/n;
+      reportProgress(progress, 0.25*(1.0-left*left*left));
     }
-    DBG (" row is " << row);
-    // Make zeros the colum of the row-1 to row=0
-    for ( int rowInUpdate = row-1; rowInUpdate >= 0; rowInUpdate-- )
+  }
+  DBG (" printing inverse U-1 and L: " );
+  DBG_CMD (this->print());
+
+  // Solve X*L = U-1 for X = U-1*L-1, one block of columns at a time from the
+  // right as in LAPACK getri. The multipliers of the block are moved to the
+  // workspace before it is overwritten. The columns on its right are final,
+  // so most of the work is one product with them
+  const unsigned int nb = defaultBlockSize;
+  ScratchBuffer<T> multipliers(static_cast<size_t>(n)*nb);
+  for ( unsigned int end=n; end>0; )
+  {
+    const unsigned int col0 = (end-1)/nb*nb;
+    const unsigned int jb = end-col0;
+    const MatrixView<T, Access> w(multipliers.data(), n-col0, jb, jb);
+    for ( unsigned int row=col0; row<n; row++ )
     {
-        DBG (" in update " << rowInUpdate );
-        const T localPivot = -this->get(rowInUpdate, row);
-        // Update all the columns at the right of the(rowInUpdate, row) in both matrix
-        for ( unsigned int kcol=row; kcol<getSize(); kcol++)
-        {
-          this->set(rowInUpdate, kcol, localPivot*this->get(row, kcol)+this->get(rowInUpdate, kcol));
-          const auto updatedValue = localPivot*Uinverse.get(row, kcol)+Uinverse.get(rowInUpdate, kcol);
-          DBG (
-              " BACKWARD row " << row
-              << " in update " << rowInUpdate
-              << " local pivot " << localPivot
-              << " inverse.get(row, row) " << Uinverse.get(row, kcol)
-              << " inverse.get(rowInUpdate, row) " << Uinverse.get(rowInUpdate, kcol)
-              << " result  " << updatedValue
-          );
-          Uinverse.set(rowInUpdate, kcol, updatedValue);
+      for ( unsigned int c=0; c<jb; c++ )
+      {
+        T &l = a.row(row)[col0+c];
+        if ( row > col0+c ) {
+          w.row(row-col0)[c] = l;
+          l = static_cast<T>(0);
+        } else {
+          w.row(row-col0)[c] = static_cast<T>(0);
         }
+      }
+    }
+    if ( end < n ) {
+      kernels::gemmAccumulate(a.block(0, col0, n, jb), a.block(0, end, n, n-end),
+                              w.block(end-col0, 0, n-end, jb), static_cast<T>(-1));
+    }
+    for ( unsigned int row=0; row<n; row++ )
+    {
+      T *x = a.row(row)+col0;
+      for ( unsigned int c=jb; c-- > 0; )
+        for ( unsigned int k=c+1; k<jb; k++ )
+          x[c] -= x[k]*w.row(k)[c];
+    }
+    end = col0;
+    const double left = static_cast<double>(end)/n;
+    if ( end > 0 )
+      reportProgress(progress, 0.25+0.75*(1.0-left*left));
+  }
+  DBG (" printing inverse without permutation: " );
+  DBG_CMD (this->print());
+
+  // A-1 = (LU)-1 * p. Multiplying by p on the right interchanges the
+  // columns, in the reverse order of the factorization
+  for ( unsigned int col=_pivots.size(); col-- > 0; )
+  {
+    const unsigned int pivot = _pivots[col];
+    if ( pivot != col ) {
+      for ( unsigned int row=0; row<n; row++ )
+        std::swap(a.row(row)[col], a.row(row)[pivot]);
+    }
+  }
+  DBG (" printing A inversed and permuted: " );
+  DBG_CMD (this->print());
+}
+
+template <typename T, typename Access>
+void SquareMatrix<T, Access>::reportProgress(const ProgressCallback &progress, const double done)
+{
+  if ( progress && !progress(done) ) {
+    clearFactorization();
+    throw OPERATION_CANCELLED;
+  }
+}
+
+template <typename T, typename Access>
+void SquareMatrix<T, Access>::clearFactorization()
+{
+  _factorization = NO_FACTORIZATION;
+  _pivots.clear();
+  _symmetricPivots.clear();
+  _updateCount = 0;
+}
+
+template <typename T, typename Access>
+void SquareMatrix<T, Access>::invertCholesky()
+{
+  const unsigned int n = getSize();
+  const MatrixView<T, Access> a = this->view();
+  ScratchBuffer<T> work(n);
+  VLU_PHASE(PHASE_INVERSION, uint64_t(n)*n*sizeof(T), uint64_t(n)*n*n);
+
+  // Invert L inplace from the first row down. Row i of L-1 is the
+  // combination of the rows of L-1 above it given by row i of L, scaled by
+  // -1/l(i,i)
+  for ( unsigned int row=0; row<n; row++ )
+  {
+    T *currRow = a.row(row);
+    const T p = static_cast<T>(static_cast<T>(1.0f)/currRow[row]);
+    std::copy(currRow, currRow+row, work.data());
+    std::fill(currRow, currRow+row, static_cast<T>(0));
+    for ( unsigned int k=0; k<row; k++ )
+      simd::axpy<T>(k+1, -p*work[k], a.row(k), currRow);
+    currRow[row] = p;
+  }
+
+  // A-1 = L-T * L-1. The lower part of row i only needs the rows of L-1 from
+  // i on, so the rows are overwritten from the first one down
+  for ( unsigned int row=0; row<n; row++ )
+  {
+    T *currRow = a.row(row);
+    const T p = currRow[row];
+    for ( unsigned int j=0; j<=row; j++ )
+      currRow[j] *= p;
+    for ( unsigned int k=row+1; k<n; k++ )
+      simd::axpy<T>(row+1, a.row(k)[row], a.row(k), currRow);
+  }
+
+  for ( unsigned int row=0; row<n; row++ )
+    for ( unsigned int col=row+1; col<n; col++ )
+      a.row(row)[col] = a.row(col)[row];
+}
+
+template <typename T, typename Access>
+std::vector<unsigned int> SquareMatrix<T, Access>::getPermutation() const
+{
+  std::vector<unsigned int> permutation(getSize());
+  for ( unsigned int i=0; i<getSize(); i++ )
+    permutation[i] = i;
+  for ( unsigned int i=0; i<_pivots.size(); i++ )
+    std::swap(permutation[i], permutation[_pivots[i]]);
+  return permutation;
+}
+
+template <typename T, typename Access>
+void SquareMatrix<T, Access>::update(const std::vector<T> &x, const std::vector<T> &y)
+{
+  const unsigned int n = getSize();
+  if ( x.size() != n || y.size() != n )
+    throw INVALID_RANGE;
+  ScratchBuffer<T> xs(n);
+  ScratchBuffer<T> ys(n);
+  std::copy(x.begin(), x.end(), xs.data());
+  std::copy(y.begin(), y.end(), ys.data());
+  applyUpdate(MatrixView<T, Access>(xs.data(), n, 1, 1), MatrixView<T, Access>(ys.data(), n, 1, 1));
+}
+
+template <typename T, typename Access>
+void SquareMatrix<T, Access>::update(const NumericMatrix<T, Access> &X, const NumericMatrix<T, Access> &Y)
+{
+  const unsigned int n = getSize();
+  const unsigned int k = X.getColumnsCount();
+  if ( X.getRowsCount() != n || Y.getRowsCount() != n || Y.getColumnsCount() != k )
+    throw INVALID_RANGE;
+  ScratchBuffer<T> xs(size_t(n)*k);
+  ScratchBuffer<T> ys(size_t(n)*k);
+  std::copy(X.getDataPtr(), X.getDataPtr()+size_t(n)*k, xs.data());
+  std::copy(Y.getDataPtr(), Y.getDataPtr()+size_t(n)*k, ys.data());
+  applyUpdate(MatrixView<T, Access>(xs.data(), n, k, k), MatrixView<T, Access>(ys.data(), n, k, k));
+}
+
+template <typename T, typename Access>
+void SquareMatrix<T, Access>::replaceRow(const unsigned int i, const std::vector<T> &values)
+{
+  const unsigned int n = getSize();
+  if ( i >= n || values.size() != n )
+    throw INVALID_RANGE;
+  ScratchBuffer<T> x(n);
+  ScratchBuffer<T> y(n);
+  std::fill(x.data(), x.data()+n, static_cast<T>(0));
+  x[i] = static_cast<T>(1);
+
+  // y = values - A(i,:), A(i,:) being L(p,:)*U for the position p of row i
+  const MatrixView<const T, Access> a = this->view();
+  std::fill(y.data(), y.data()+n, static_cast<T>(0));
+  if ( _factorization == LU_FACTORIZATION ) {
+    const std::vector<unsigned int> permutation = getPermutation();
+    const unsigned int p = static_cast<unsigned int>(
+      std::find(permutation.begin(), permutation.end(), i)-permutation.begin());
+    for ( unsigned int t=0; t<p; t++ )
+      simd::axpy<T>(n-t, a.row(p)[t], a.row(t)+t, y.data()+t);
+    for ( unsigned int j=p; j<n; j++ )
+      y[j] += a.row(p)[j];
+  } else if ( _factorization == NO_FACTORIZATION ) {
+    std::copy(a.row(i), a.row(i)+n, y.data());
+  }
+  for ( unsigned int j=0; j<n; j++ )
+    y[j] = values[j]-y[j];
+  applyUpdate(MatrixView<T, Access>(x.data(), n, 1, 1), MatrixView<T, Access>(y.data(), n, 1, 1));
+}
+
+template <typename T, typename Access>
+void SquareMatrix<T, Access>::replaceColumn(const unsigned int j, const std::vector<T> &values)
+{
+  const unsigned int n = getSize();
+  if ( j >= n || values.size() != n )
+    throw INVALID_RANGE;
+  ScratchBuffer<T> x(n);
+  ScratchBuffer<T> y(n);
+  std::fill(y.data(), y.data()+n, static_cast<T>(0));
+  y[j] = static_cast<T>(1);
+
+  // x = values - A(:,j), row p of P*A(:,j) being L(p,:)*U(:,j)
+  const MatrixView<const T, Access> a = this->view();
+  if ( _factorization == LU_FACTORIZATION ) {
+    const std::vector<unsigned int> permutation = getPermutation();
+    ScratchBuffer<T> column(j+1);
+    for ( unsigned int t=0; t<=j; t++ )
+      column[t] = a.row(t)[j];
+    for ( unsigned int p=0; p<n; p++ )
+    {
+      const unsigned int m = std::min(p, j+1);
+      const T current = simd::dot<T>(m, a.row(p), column.data()) + (p <= j ? column[p] : static_cast<T>(0));
+      x[permutation[p]] = values[permutation[p]]-current;
     }
+  } else {
+    for ( unsigned int p=0; p<n; p++ )
+      x[p] = values[p] - (_factorization == NO_FACTORIZATION ? a.row(p)[j] : static_cast<T>(0));
+  }
+  applyUpdate(MatrixView<T, Access>(x.data(), n, 1, 1), MatrixView<T, Access>(y.data(), n, 1, 1));
+}
+
+template <typename T, typename Access>
+void SquareMatrix<T, Access>::applyUpdate(const MatrixView<T, Access> &X, const MatrixView<T, Access> &Y)
+{
+  const unsigned int n = getSize();
+  const unsigned int k = X.getColumnsCount();
+  const MatrixView<T, Access> a = this->view();
+  VLU_OPERATION("update", n);
+  if ( _factorization == NO_FACTORIZATION ) {
+    // Nothing to keep up to date
+    for ( unsigned int i=0; i<n; i++ )
+      for ( unsigned int j=0; j<n; j++ )
+        a.row(i)[j] += simd::dot<T>(k, X.row(i), Y.row(j));
+    return;
   }
-  DBG (" printing inverse U-1: " );
-  DBG_CMD (Uinverse.print());
+  if ( _factorization != LU_FACTORIZATION )
+    throw INVALID_FACTORIZATION;
 
-  // Perform forward subtitution
-  SquareMatrix<T> Linverse(getSize());
-  Linverse.makeIdentity();
-  //   L   |  LInv
-  // 1 0 0 | 1 0 0      1 0 0 |  1  0   0
-  // l 1 0 | 0 1 0  ->  0 1 0 | l-1  1  0
-  // l l 1 | 0 0 1      0 0 1 | l-1 l-1 1
-  for ( unsigned int rowcol = 0; rowcol < getSize(); rowcol++ )
+  // P*A' = L*U + (P*X)*Y'
+  kernels::laswp(X, 0, _pivots.size(), _pivots.data());
+  ScratchBuffer<T> beta(k);
+  const T limit = static_cast<T>(updateGrowthLimit);
+  unsigned int unstableStep = n;
   {
-    // Make zeros the colum of the rowcol-1 to rowcol=0
-    for ( unsigned int rowcolInUpdate = rowcol+1; rowcolInUpdate < getSize(); rowcolInUpdate++ )
+    VLU_PHASE(PHASE_ELIMINATION, uint64_t(n)*n*sizeof(T), 2*uint64_t(n)*n*k);
+    for ( unsigned int s=0; s<n && unstableStep == n; s++ )
     {
-        DBG ( " in update " << rowcolInUpdate );
-        const T localPivot = -this->get(rowcolInUpdate, rowcol);
-        // Update all the columns at the left of the(rowcolInUpdate, rowcol) in both matrix
-        for ( unsigned int kcol=0; kcol<rowcolInUpdate; kcol++)
+      T *uRow = a.row(s);
+      const T *xs = X.row(s);
+      const T *ys = Y.row(s);
+
+      // New pivot after each vector, and its multiplier
+      T pivot = uRow[s];
+      for ( unsigned int r=0; r<k; r++ )
+      {
+        pivot += xs[r]*ys[r];
+        beta[r] = ys[r]/pivot;
+      }
+
+      // Check the multipliers of L before writing anything, the factorization
+      // from step s on is rebuilt if they grow too much
+      T growth = static_cast<T>(0);
+      for ( unsigned int i=s+1; i<n; i++ )
+      {
+        T l = a.row(i)[s];
+        const T *xi = X.row(i);
+        for ( unsigned int r=0; r<k; r++ )
+          l += beta[r]*(xi[r]-xs[r]*l);
+        growth = std::max(growth, std::abs(l));
+      }
+      if ( !(growth <= limit) || !(std::abs(pivot) > static_cast<T>(0)) || !std::isfinite(pivot) ) {
+        unstableStep = s;
+        continue;
+      }
+
+      // Row s of U: u' = u + x(s)*y', then y -= beta*u'
+      uRow[s] = pivot;
+      for ( unsigned int j=s+1; j<n; j++ )
+      {
+        T *yj = Y.row(j);
+        for ( unsigned int r=0; r<k; r++ )
+        {
+          uRow[j] += xs[r]*yj[r];
+          yj[r] -= beta[r]*uRow[j];
+        }
+      }
+      // Column s of L: x -= x(s)*l, then l' = l + beta*x
+      for ( unsigned int i=s+1; i<n; i++ )
+      {
+        T &l = a.row(i)[s];
+        T *xi = X.row(i);
+        for ( unsigned int r=0; r<k; r++ )
         {
-          this->set(rowcolInUpdate, kcol, localPivot*this->get(rowcol, kcol)+this->get(rowcolInUpdate, kcol));
-          const auto updatedValue = localPivot*Linverse.get(rowcol, kcol)+Linverse.get(rowcolInUpdate, kcol);
-          DBG (
-             " FORWARD rowcol " << rowcol
-              << " in update " << rowcolInUpdate
-              << " local pivot " << localPivot
-              << " inverse.get(rowcol, rowcol) " << Linverse.get(rowcol, kcol)
-              << " inverse.get(rowcolInUpdate, rowcol) " << Linverse.get(rowcolInUpdate, kcol)
-              << " result  " << updatedValue
-          );
-          Linverse.set(rowcolInUpdate, kcol, updatedValue);
+          xi[r] -= xs[r]*l;
+          l += beta[r]*xi[r];
         }
+      }
     }
   }
-  DBG (" printing inverse L-1: " );
-  DBG_CMD (Linverse.print());
+  if ( unstableStep < n )
+    refactor(X, Y, unstableStep);
+  else
+    _updateCount += k;
+}
 
-  // Get A-1 => Multiply A-1=U-1*L-1*p (only U-1*L-1 below)
-  SquareMatrix<T> Ainverse(getSize());
-  for (unsigned int i=0; i<getSize(); i++)
+template <typename T, typename Access>
+void SquareMatrix<T, Access>::refactor(const MatrixView<T, Access> &X, const MatrixView<T, Access> &Y,
+                                       const unsigned int from)
+{
+  const unsigned int n = getSize();
+  const unsigned int k = X.getColumnsCount();
+  const MatrixView<T, Access> a = this->view();
   {
-    for (unsigned int j=0; j<getSize(); j++)
+    SquareMatrix lower(n, scratchMatrixAllocator());
+    SquareMatrix upper(n, scratchMatrixAllocator());
+    for ( unsigned int i=0; i<n; i++ )
     {
-      T local = 0;
-      for (unsigned int k=0; k<getSize(); k++)
+      for ( unsigned int j=0; j<n; j++ )
       {
-        local += Uinverse.get(i, k) * Linverse.get(k, j);
+        lower._matrix[i*n+j] = j < i ? a.row(i)[j] : static_cast<T>(i == j);
+        upper._matrix[i*n+j] = j >= i ? a.row(i)[j] : static_cast<T>(0);
       }
-      Ainverse.set(i, j, local);
     }
+    multiply(*this, lower, upper);
+  }
+  if ( from < n ) {
+    NumericMatrix<T, Access> yt(k, n-from, scratchMatrixAllocator());
+    for ( unsigned int r=0; r<k; r++ )
+      for ( unsigned int j=from; j<n; j++ )
+        yt.getDataPtr()[r*(n-from)+j-from] = Y.row(j)[r];
+    kernels::gemmAccumulate(a.block(from, from, n-from, n-from), X.block(from, 0, n-from, k),
+                            yt.view(), static_cast<T>(1));
   }
-  DBG (" printing inverse without permutation: " );
-  DBG_CMD (Ainverse.print());
 
-  // Get A-1 => Multiply A-1=(UL)-1 * p (the remaining multiplication)
-  SquareMatrix<T> AinversePermuted(getSize());
-  if (_permutationMatrix != nullptr)
+  // Q*P*A' = L*U, Q*P written again as interchanges
+  std::vector<unsigned int> permutation = getPermutation();
+  std::vector<unsigned int> interchanges(n);
+  kernels::getrfRecursive(a, interchanges.data());
+  for ( unsigned int i=0; i<n; i++ )
+    std::swap(permutation[i], permutation[interchanges[i]]);
+  std::vector<unsigned int> position(n);
+  for ( unsigned int i=0; i<n; i++ )
+    position[i] = i;
+  std::vector<unsigned int> current(position);
+  _pivots.resize(n);
+  for ( unsigned int i=0; i<n; i++ )
   {
-    DBG (" printing permutation matrix: " );
-    DBG_CMD (_permutationMatrix->print());
-    for (unsigned int i=0; i<getSize(); i++)
+    // Bring the row that ends at i from where the previous interchanges left it
+    const unsigned int p = position[permutation[i]];
+    _pivots[i] = p;
+    std::swap(current[i], current[p]);
+    position[current[i]] = i;
+    position[current[p]] = p;
+  }
+  _updateCount = 0;
+}
+
+template <typename T, typename Access>
+std::vector<T> SquareMatrix<T, Access>::solve(const std::vector<T> &b) const
+{
+  const unsigned int n = getSize();
+  if ( b.size() != n )
+    throw INVALID_RANGE;
+
+  VLU_OPERATION("solve", n);
+  const uint64_t triangleBytes = uint64_t(n)*(n+1)/2*sizeof(T);
+  const uint64_t triangleFlops = uint64_t(n)*n;
+  std::vector<T> x(b);
+  if ( _factorization == CHOLESKY_FACTORIZATION ) {
+    // L * y = b with dot products along the rows of L, then L' * x = y
+    // with axpys along them
+    const MatrixView<const T, Access> a = this->view();
     {
-      for (unsigned int j=0; j<getSize(); j++)
-      {
-        T local = 0;
-        for (unsigned int k=0; k<getSize(); k++)
+      VLU_PHASE(PHASE_FORWARD_SUBSTITUTION, triangleBytes, triangleFlops);
+      for ( unsigned int i=0; i<n; i++ )
+        x[i] = (x[i] - simd::dot<T>(i, a.row(i), x.data()))/a.row(i)[i];
+    }
+    VLU_PHASE(PHASE_BACKWARD_SUBSTITUTION, triangleBytes, triangleFlops);
+    for ( unsigned int i=n; i-- > 0; )
+    {
+      x[i] /= a.row(i)[i];
+      simd::axpy<T>(i, -x[i], a.row(i), x.data());
+    }
+    return x;
+  }
+  if ( _factorization == LDLT_FACTORIZATION ) {
+    solveLdlt(MatrixView<T, Access>(x.data(), n, 1, 1));
+    return x;
+  }
+
+  {
+    VLU_PHASE(PHASE_ROW_SWAP, 2*_pivots.size()*sizeof(T), 0);
+    for ( unsigned int i=0; i<_pivots.size(); i++ )
+      std::swap(x[i], x[_pivots[i]]);
+  }
+  {
+    VLU_PHASE(PHASE_FORWARD_SUBSTITUTION, triangleBytes, triangleFlops);
+    kernels::trsvLowerUnit(this->view(), x.data());
+  }
+  VLU_PHASE(PHASE_BACKWARD_SUBSTITUTION, triangleBytes, triangleFlops);
+  kernels::trsvUpper(this->view(), x.data());
+  return x;
+}
+
+template <typename T, typename Access>
+void SquareMatrix<T, Access>::solve(NumericMatrix<T, Access> &B) const
+{
+  const unsigned int n = getSize();
+  if ( B.getRowsCount() != n )
+    throw INVALID_RANGE;
+
+  const MatrixView<T, Access> b = B.view();
+  VLU_OPERATION("solve", n);
+  if ( _factorization == CHOLESKY_FACTORIZATION ) {
+    solveCholesky(b);
+    return;
+  }
+  if ( _factorization == LDLT_FACTORIZATION ) {
+    solveLdlt(b);
+    return;
+  }
+
+  const uint64_t bytes = (uint64_t(n)*(n+1)/2+uint64_t(n)*b.getColumnsCount())*sizeof(T);
+  const uint64_t flops = uint64_t(n)*n*b.getColumnsCount();
+  kernels::laswp(b, 0, _pivots.size(), _pivots.data());
+  {
+    VLU_PHASE(PHASE_FORWARD_SUBSTITUTION, bytes, flops);
+    kernels::trsmLowerUnitBlocked(this->view(), b, defaultBlockSize);
+  }
+  VLU_PHASE(PHASE_BACKWARD_SUBSTITUTION, bytes, flops);
+  kernels::trsmUpperBlocked(this->view(), b, defaultBlockSize);
+}
+
+template <typename T, typename Access>
+void SquareMatrix<T, Access>::solveCholesky(const MatrixView<T, Access> &b) const
+{
+  const unsigned int n = getSize();
+  const unsigned int m = b.getColumnsCount();
+  const MatrixView<const T, Access> a = this->view();
+
+  const uint64_t bytes = (uint64_t(n)*(n+1)/2+uint64_t(n)*m)*sizeof(T);
+  const uint64_t flops = uint64_t(n)*n*m;
+
+  // L * Y = B and L' * X = Y, updating whole rows of B
+  {
+    VLU_PHASE(PHASE_FORWARD_SUBSTITUTION, bytes, flops);
+    for ( unsigned int i=0; i<n; i++ )
+    {
+      for ( unsigned int k=0; k<i; k++ )
+        simd::axpy<T>(m, -a.row(i)[k], b.row(k), b.row(i));
+      const T p = static_cast<T>(static_cast<T>(1.0f)/a.row(i)[i]);
+      for ( unsigned int j=0; j<m; j++ )
+        b.row(i)[j] *= p;
+    }
+  }
+  VLU_PHASE(PHASE_BACKWARD_SUBSTITUTION, bytes, flops);
+  for ( unsigned int i=n; i-- > 0; )
+  {
+    const T p = static_cast<T>(static_cast<T>(1.0f)/a.row(i)[i]);
+    for ( unsigned int j=0; j<m; j++ )
+      b.row(i)[j] *= p;
+    for ( unsigned int k=0; k<i; k++ )
+      simd::axpy<T>(m, -a.row(i)[k], b.row(i), b.row(k));
+  }
+}
+
+template <typename T, typename Access>
+void SquareMatrix<T, Access>::solveLdlt(const MatrixView<T, Access> &b) const
+{
+  const unsigned int n = getSize();
+  const unsigned int m = b.getColumnsCount();
+  const MatrixView<const T, Access> a = this->view();
+  const std::vector<int> &ipiv = _symmetricPivots;
+
+  const auto swapRows = [&](const unsigned int i, const unsigned int j) {
+    if ( i != j )
+      std::swap_ranges(b.row(i), b.row(i)+m, b.row(j));
+  };
+
+  const uint64_t bytes = (uint64_t(n)*(n+1)/2+uint64_t(n)*m)*sizeof(T);
+  const uint64_t flops = uint64_t(n)*n*m;
+
+  {
+    VLU_PHASE(PHASE_FORWARD_SUBSTITUTION, bytes, flops);
+    // P * L * D * Y = B, one diagonal block at a time
+    for ( unsigned int k=0; k<n; )
+    {
+      if ( ipiv[k] >= 0 ) {
+        swapRows(k, ipiv[k]);
+        for ( unsigned int i=k+1; i<n; i++ )
+          simd::axpy<T>(m, -a.row(i)[k], b.row(k), b.row(i));
+        const T p = static_cast<T>(static_cast<T>(1.0f)/a.row(k)[k]);
+        for ( unsigned int j=0; j<m; j++ )
+          b.row(k)[j] *= p;
+        k++;
+      } else {
+        swapRows(k+1, -ipiv[k]-1);
+        for ( unsigned int i=k+2; i<n; i++ )
+        {
+          simd::axpy<T>(m, -a.row(i)[k], b.row(k), b.row(i));
+          simd::axpy<T>(m, -a.row(i)[k+1], b.row(k+1), b.row(i));
+        }
+        // D block [d11 d21; d21 d22] scaled by d21 to avoid overflow
+        const T d21 = a.row(k+1)[k];
+        const T d11 = a.row(k)[k]/d21;
+        const T d22 = a.row(k+1)[k+1]/d21;
+        const T denom = d11*d22 - static_cast<T>(1);
+        for ( unsigned int j=0; j<m; j++ )
         {
-          local += Ainverse.get(i, k) * _permutationMatrix->get(k, j);
+          const T b1 = b.row(k)[j]/d21;
+          const T b2 = b.row(k+1)[j]/d21;
+          b.row(k)[j] = (d22*b1 - b2)/denom;
+          b.row(k+1)[j] = (d11*b2 - b1)/denom;
         }
-        AinversePermuted.set(i, j, local);
+        k += 2;
       }
     }
-    DBG (" printing A inversed and permuted: " );
-    DBG_CMD (AinversePermuted.print());
-    Ainverse.setData(AinversePermuted.getDataPtr(), getSize()*getSize());
   }
 
-  return Ainverse;
+  VLU_PHASE(PHASE_BACKWARD_SUBSTITUTION, bytes, flops);
+  // L' * P' * X = Y, from the last block up
+  for ( unsigned int k=n; k-- > 0; )
+  {
+    for ( unsigned int i=k+1; i<n; i++ )
+      simd::axpy<T>(m, -a.row(i)[k], b.row(i), b.row(k));
+    if ( ipiv[k] >= 0 ) {
+      swapRows(k, ipiv[k]);
+    } else {
+      for ( unsigned int i=k+1; i<n; i++ )
+        simd::axpy<T>(m, -a.row(i)[k-1], b.row(i), b.row(k-1));
+      swapRows(k, -ipiv[k]-1);
+      k--;
+    }
+  }
+}
+
+template <typename T, typename Access>
+void SquareMatrix<T, Access>::setFactorization(const Factorization factorization,
+                                               const std::vector<int> &pivots)
+{
+  const unsigned int n = getSize();
+  std::vector<unsigned int> luPivots;
+  std::vector<int> symmetricPivots;
+  switch ( factorization )
+  {
+  case LU_FACTORIZATION:
+    if ( pivots.size() > n )
+      throw INVALID_RANGE;
+    for ( unsigned int i=0; i<pivots.size(); i++ )
+    {
+      if ( pivots[i] < static_cast<int>(i) || pivots[i] >= static_cast<int>(n) )
+        throw INVALID_RANGE;
+      luPivots.push_back(pivots[i]);
+    }
+    break;
+  case LDLT_FACTORIZATION:
+    if ( pivots.size() != n )
+      throw INVALID_RANGE;
+    for ( unsigned int k=0; k<n; )
+    {
+      // 1x1 blocks interchange k with a later row, 2x2 blocks k+1
+      const int p = pivots[k] >= 0 ? pivots[k] : -pivots[k]-1;
+      const unsigned int kstep = pivots[k] >= 0 ? 1 : 2;
+      if ( k+kstep > n || (kstep == 2 && pivots[k+1] != pivots[k]) ||
+           p < static_cast<int>(k+kstep-1) || p >= static_cast<int>(n) )
+        throw INVALID_RANGE;
+      k += kstep;
+    }
+    symmetricPivots = pivots;
+    break;
+  default:
+    if ( !pivots.empty() )
+      throw INVALID_RANGE;
+    break;
+  }
+  _pivots.swap(luPivots);
+  _symmetricPivots.swap(symmetricPivots);
+  _factorization = factorization;
+  _updateCount = 0;
 }
 
-template <typename T>
-void SquareMatrix<T>::setData(T *ptr, size_t size)
+template <typename T, typename Access>
+void SquareMatrix<T, Access>::setData(T *ptr, size_t size)
 {
     if (size == this->_ncols * this->_nrows) {
         memcpy(this->_matrix, ptr, size*sizeof(T));
@@ -0,0 +1,387 @@
+/**
+ * @file TaskScheduler.hpp
+ *
+ * Copyright 2023 Diego Nieto
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation and/or
+ * other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS” AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef TASK_SCHEDULER_H
+#define TASK_SCHEDULER_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * @brief Dependency graph of tasks. A task becomes ready once every task it
+ * depends on has finished
+ */
+class TaskGraph
+{
+public:
+    typedef unsigned int TaskId;
+
+    /**
+     * @brief Adds a task to the graph
+     *
+     * @return identifier to be used to declare dependencies
+     */
+    TaskId addTask(std::function<void()> work)
+    {
+        _work.push_back(std::move(work));
+        _successors.emplace_back();
+        _dependencies.push_back(0);
+        return static_cast<TaskId>(_work.size()-1);
+    }
+
+    /**
+     * @brief Declares that task after can not start until task before has finished
+     */
+    void addDependency(const TaskId before, const TaskId after)
+    {
+        _successors[before].push_back(after);
+        _dependencies[after]++;
+    }
+
+    size_t size() const { return _work.size(); }
+
+private:
+    friend class WorkStealingPool;
+
+    std::vector<std::function<void()>> _work;
+    std::vector<std::vector<TaskId>> _successors;
+    std::vector<unsigned int> _dependencies;
+};
+
+/**
+ * @brief Pool of threads running a TaskGraph
+ *
+ * Every worker owns a queue of ready tasks. Tasks released by a worker are
+ * pushed to its own queue and taken back LIFO to keep data in cache, while
+ * idle workers steal the oldest tasks from the other queues.
+ */
+class WorkStealingPool
+{
+public:
+    /**
+     * @param nThreads number of threads running the tasks, including the one
+     * calling run(). 0 means one per hardware thread
+     */
+    explicit WorkStealingPool(unsigned int nThreads = 0) :
+    _nthreads(nThreads == 0 ? hardwareThreads() : nThreads),
+    _graph(nullptr), _generation(0), _stop(false),
+    _remaining(0), _queued(0), _active(0), _aborted(false)
+    {
+        for ( unsigned int i=0; i<_nthreads; i++ )
+            _queues.push_back(std::make_unique<WorkQueue>());
+        for ( unsigned int i=1; i<_nthreads; i++ )
+            _workers.emplace_back(&WorkStealingPool::workerLoop, this, i);
+    }
+
+    ~WorkStealingPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _stop = true;
+        }
+        _wake.notify_all();
+        for ( auto &worker : _workers )
+            worker.join();
+    }
+
+    WorkStealingPool(const WorkStealingPool &) = delete;
+    WorkStealingPool &operator=(const WorkStealingPool &) = delete;
+
+    unsigned int getThreadsCount() const { return _nthreads; }
+
+    static unsigned int hardwareThreads()
+    {
+        const unsigned int n = std::thread::hardware_concurrency();
+        return n == 0 ? 1 : n;
+    }
+
+    /**
+     * @brief Runs every task of the graph and waits for them. The calling
+     * thread takes part in the execution. If a task throws, the remaining
+     * tasks are skipped and the first exception is rethrown here
+     */
+    void run(TaskGraph &graph)
+    {
+        const size_t ntasks = graph.size();
+        if ( ntasks == 0 )
+            return;
+
+        _pending.reset(new std::atomic<unsigned int>[ntasks]);
+        for ( size_t t=0; t<ntasks; t++ )
+            _pending[t].store(graph._dependencies[t], std::memory_order_relaxed);
+        _remaining.store(ntasks);
+        _aborted.store(false);
+        _exception = nullptr;
+
+        // Distribute the initially ready tasks among the workers
+        unsigned int target = 0;
+        for ( size_t t=0; t<ntasks; t++ )
+        {
+            if ( graph._dependencies[t] == 0 ) {
+                push(target, static_cast<TaskGraph::TaskId>(t));
+                target = (target+1) % _nthreads;
+            }
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _graph = &graph;
+            _active = _nthreads;
+            _generation++;
+        }
+        _wake.notify_all();
+
+        participate(0);
+
+        // Wait for the workers to leave the graph before releasing it
+        std::unique_lock<std::mutex> lock(_mutex);
+        _done.wait(lock, [this] { return _active == 0; });
+        _graph = nullptr;
+        _pending.reset();
+        lock.unlock();
+
+        if ( _exception )
+            std::rethrow_exception(_exception);
+    }
+
+private:
+    struct WorkQueue {
+        std::mutex mutex;
+        std::deque<TaskGraph::TaskId> tasks;
+    };
+
+    void workerLoop(const unsigned int index)
+    {
+        unsigned long seen = 0;
+        while ( true )
+        {
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                _wake.wait(lock, [&] { return _stop || _generation != seen; });
+                if ( _stop )
+                    return;
+                seen = _generation;
+            }
+            participate(index);
+        }
+    }
+
+    void participate(const unsigned int index)
+    {
+        TaskGraph::TaskId task;
+        while ( _remaining.load() > 0 )
+        {
+            if ( pop(index, task) || steal(index, task) ) {
+                execute(index, task);
+            } else {
+                std::unique_lock<std::mutex> lock(_mutex);
+                _ready.wait_for(lock, std::chrono::milliseconds(1),
+                                [this] { return _queued.load() > 0 || _remaining.load() == 0; });
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(_mutex);
+        if ( --_active == 0 )
+            _done.notify_all();
+    }
+
+    void execute(const unsigned int index, const TaskGraph::TaskId task)
+    {
+        if ( !_aborted.load(std::memory_order_relaxed) ) {
+            try {
+                _graph->_work[task]();
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(_mutex);
+                if ( !_exception )
+                    _exception = std::current_exception();
+                _aborted.store(true);
+            }
+        }
+
+        // Release the successors, they are most likely to reuse our data
+        for ( const auto successor : _graph->_successors[task] )
+        {
+            if ( _pending[successor].fetch_sub(1) == 1 )
+                push(index, successor);
+        }
+
+        if ( _remaining.fetch_sub(1) == 1 ) {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _ready.notify_all();
+        }
+    }
+
+    void push(const unsigned int index, const TaskGraph::TaskId task)
+    {
+        {
+            std::lock_guard<std::mutex> lock(_queues[index]->mutex);
+            _queues[index]->tasks.push_back(task);
+        }
+        _queued.fetch_add(1);
+        _ready.notify_one();
+    }
+
+    bool pop(const unsigned int index, TaskGraph::TaskId &task)
+    {
+        std::lock_guard<std::mutex> lock(_queues[index]->mutex);
+        if ( _queues[index]->tasks.empty() )
+            return false;
+        task = _queues[index]->tasks.back();
+        _queues[index]->tasks.pop_back();
+        _queued.fetch_sub(1);
+        return true;
+    }
+
+    bool steal(const unsigned int index, TaskGraph::TaskId &task)
+    {
+        for ( unsigned int i=1; i<_nthreads; i++ )
+        {
+            WorkQueue &victim = *_queues[(index+i) % _nthreads];
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            if ( !victim.tasks.empty() ) {
+                task = victim.tasks.front();
+                victim.tasks.pop_front();
+                _queued.fetch_sub(1);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    const unsigned int _nthreads;
+    std::vector<std::unique_ptr<WorkQueue>> _queues;
+    std::vector<std::thread> _workers;
+
+    std::mutex _mutex;
+    std::condition_variable _wake;
+    std::condition_variable _ready;
+    std::condition_variable _done;
+
+    TaskGraph *_graph;
+    unsigned long _generation;
+    bool _stop;
+    std::unique_ptr<std::atomic<unsigned int>[]> _pending;
+    std::atomic<size_t> _remaining;
+    std::atomic<size_t> _queued;
+    unsigned int _active;
+    std::atomic<bool> _aborted;
+    std::exception_ptr _exception;
+};
+
+/**
+ * @brief FIFO queue of at most capacity elements shared by the stages of a
+ * pipeline. push() blocks while the queue is full, so a fast producer waits
+ * for its consumers instead of buffering without limit
+ */
+template <typename T>
+class BoundedQueue
+{
+public:
+    explicit BoundedQueue(const size_t capacity) :
+    _capacity(capacity == 0 ? 1 : capacity), _closed(false)
+    {
+    }
+
+    BoundedQueue(const BoundedQueue &) = delete;
+    BoundedQueue &operator=(const BoundedQueue &) = delete;
+
+    size_t getCapacity() const { return _capacity; }
+
+    size_t size() const
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _items.size();
+    }
+
+    /**
+     * @brief Waits for room and appends value
+     *
+     * @return false, dropping value, if the queue was closed
+     */
+    bool push(T value)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _notFull.wait(lock, [this] { return _closed || _items.size() < _capacity; });
+        if ( _closed )
+            return false;
+        _items.push_back(std::move(value));
+        lock.unlock();
+        _notEmpty.notify_one();
+        return true;
+    }
+
+    /**
+     * @brief Waits for an element and moves it to value
+     *
+     * @return false once the queue is closed and empty
+     */
+    bool pop(T &value)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _notEmpty.wait(lock, [this] { return _closed || !_items.empty(); });
+        if ( _items.empty() )
+            return false;
+        value = std::move(_items.front());
+        _items.pop_front();
+        lock.unlock();
+        _notFull.notify_one();
+        return true;
+    }
+
+    /**
+     * @brief No more elements are accepted. The ones already queued can still
+     * be popped, then pop() returns false
+     */
+    void close()
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _closed = true;
+        }
+        _notFull.notify_all();
+        _notEmpty.notify_all();
+    }
+
+private:
+    const size_t _capacity;
+    mutable std::mutex _mutex;
+    std::condition_variable _notFull;
+    std::condition_variable _notEmpty;
+    std::deque<T> _items;
+    bool _closed;
+};
+
+#endif // TASK_SCHEDULER_H
@@ -0,0 +1,290 @@
+/**
+ * @file TraceSinks.hpp
+ *
+ * Copyright 2023 Diego Nieto
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation and/or
+ * other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS” AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef TRACE_SINKS_H
+#define TRACE_SINKS_H
+
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <limits>
+#include <string>
+#include <vector>
+
+#include "LUTrace.hpp"
+#include "MatrixFile.hpp"
+#include "Squarematrix.hpp"
+
+/**
+ * @brief Keeps the last capacity steps of the trace in memory, e.g. for a
+ * window to scrub through them
+ *
+ * The steps that fall out of the buffer are applied to a base copy of the
+ * matrix, so every state from the oldest step kept on can be rebuilt.
+ */
+template <typename T>
+class RingBufferTraceSink : public LUTraceSink<T>
+{
+public:
+    explicit RingBufferTraceSink(const unsigned int capacity) :
+    _capacity(capacity == 0 ? 1 : capacity), _size(0), _baseStep(0), _complete(false)
+    {
+    }
+
+    void begin(const unsigned int size, const T *matrix) override
+    {
+        _size = size;
+        _base.assign(matrix, matrix+static_cast<size_t>(size)*size);
+        _baseStep = 0;
+        _steps.clear();
+        _complete = false;
+    }
+
+    void step(const LUTraceStep<T> &traceStep) override
+    {
+        if ( _steps.size() == _capacity ) {
+            applyLUTraceStep(MatrixView<T, UncheckedAccess>(_base.data(), _size, _size, _size),
+                             _steps.front().getStep());
+            _steps.pop_front();
+            _baseStep++;
+        }
+        _steps.emplace_back(traceStep, _size);
+    }
+
+    void end() override { _complete = true; }
+
+    unsigned int getSize() const { return _size; }
+
+    bool isComplete() const { return _complete; }
+
+    /**
+     * @brief First state that can be rebuilt, i.e. number of steps dropped
+     */
+    unsigned int getFirstStep() const { return _baseStep; }
+
+    /**
+     * @brief Number of steps received since begin()
+     */
+    unsigned int getStepCount() const { return _baseStep+static_cast<unsigned int>(_steps.size()); }
+
+    /**
+     * @brief Step still in the buffer. Throws INVALID_RANGE otherwise
+     */
+    const LUTraceRecord<T> &getStep(const unsigned int step) const
+    {
+        if ( step < _baseStep || step >= getStepCount() )
+            throw INVALID_RANGE;
+        return _steps[step-_baseStep];
+    }
+
+    /**
+     * @brief Writes into state the elements after the first steps steps of
+     * the elimination, from getFirstStep() to getStepCount(). Throws
+     * INVALID_RANGE if that state can not be rebuilt
+     */
+    template <typename Access>
+    void getState(const unsigned int steps, SquareMatrix<T, Access> &state) const
+    {
+        if ( steps < _baseStep || steps > getStepCount() || state.getSize() != _size )
+            throw INVALID_RANGE;
+        std::copy(_base.begin(), _base.end(), state.getDataPtr());
+        const MatrixView<T, Access> a = state.view();
+        for ( unsigned int k=_baseStep; k<steps; k++ )
+            applyLUTraceStep(a, _steps[k-_baseStep].getStep());
+    }
+
+private:
+    const size_t _capacity;
+    unsigned int _size;
+    std::vector<T> _base;
+    unsigned int _baseStep;
+    std::deque<LUTraceRecord<T>> _steps;
+    bool _complete;
+};
+
+/**
+ * Trace files: a 64 bytes header, the matrix before the elimination
+ * row-major, then for each step its index and pivot row as uint32 followed
+ * by its multipliers and pivot row elements. Steps are appended as the
+ * factorization goes, so the sink needs no memory for them.
+ */
+struct LUTraceFileHeader
+{
+    /** "VLUTRACE" */
+    char magic[8];
+    uint32_t version;
+    /** 0x01020304 as written by the machine that wrote the file */
+    uint32_t byteOrder;
+    /** MatrixFileElementType */
+    uint32_t elementType;
+    uint32_t elementSize;
+    uint64_t size;
+    uint8_t reserved[32];
+};
+
+static_assert(sizeof(LUTraceFileHeader) == 64, "the header is part of the file format");
+
+const char traceFileMagic[8] = {'V', 'L', 'U', 'T', 'R', 'A', 'C', 'E'};
+const uint32_t traceFileVersion = 1;
+
+/**
+ * @brief Streams the trace to a file, to be replayed by LUTraceReader.
+ * Throws FILE_ERROR if the file can not be written
+ */
+template <typename T>
+class FileTraceSink : public LUTraceSink<T>
+{
+public:
+    explicit FileTraceSink(const std::string &path) :
+    _out(path, std::ios::binary | std::ios::trunc), _size(0)
+    {
+        if ( !_out )
+            throw FILE_ERROR;
+    }
+
+    void begin(const unsigned int size, const T *matrix) override
+    {
+        LUTraceFileHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, traceFileMagic, sizeof(header.magic));
+        header.version = traceFileVersion;
+        header.byteOrder = matrixFileByteOrder;
+        header.elementType = MatrixFileElement<T>::type;
+        header.elementSize = sizeof(T);
+        header.size = size;
+        _size = size;
+        _out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        _out.write(reinterpret_cast<const char *>(matrix), static_cast<size_t>(size)*size*sizeof(T));
+        check();
+    }
+
+    void step(const LUTraceStep<T> &traceStep) override
+    {
+        const uint32_t indices[2] = {traceStep.step, traceStep.pivotRow};
+        const unsigned int count = _size-traceStep.step;
+        _out.write(reinterpret_cast<const char *>(indices), sizeof(indices));
+        _out.write(reinterpret_cast<const char *>(traceStep.multipliers), (count-1)*sizeof(T));
+        _out.write(reinterpret_cast<const char *>(traceStep.pivotRowValues), count*sizeof(T));
+        check();
+    }
+
+    void end() override
+    {
+        _out.flush();
+        check();
+    }
+
+private:
+    void check()
+    {
+        if ( !_out )
+            throw FILE_ERROR;
+    }
+
+    std::ofstream _out;
+    unsigned int _size;
+};
+
+/**
+ * @brief Reads a trace file written by FileTraceSink one step at a time.
+ * Throws FILE_ERROR if it can not be read and INVALID_FORMAT if it is not a
+ * trace of elements of type T
+ */
+template <typename T>
+class LUTraceReader
+{
+public:
+    explicit LUTraceReader(const std::string &path) :
+    _in(path, std::ios::binary), _size(0), _nextStep(0)
+    {
+        if ( !_in )
+            throw FILE_ERROR;
+        LUTraceFileHeader header;
+        if ( !_in.read(reinterpret_cast<char *>(&header), sizeof(header)) ||
+             memcmp(header.magic, traceFileMagic, sizeof(header.magic)) != 0 ||
+             header.version != traceFileVersion || header.byteOrder != matrixFileByteOrder ||
+             header.elementType != static_cast<uint32_t>(MatrixFileElement<T>::type) ||
+             header.elementSize != sizeof(T) ||
+             header.size > static_cast<uint64_t>(std::numeric_limits<int>::max()) )
+            throw INVALID_FORMAT;
+        _size = header.size;
+        _initial.resize(static_cast<size_t>(_size)*_size);
+        if ( !_in.read(reinterpret_cast<char *>(_initial.data()), _initial.size()*sizeof(T)) )
+            throw FILE_ERROR;
+    }
+
+    unsigned int getSize() const { return _size; }
+
+    /**
+     * @brief Writes the matrix before the elimination into matrix
+     */
+    template <typename Access>
+    void getInitial(SquareMatrix<T, Access> &matrix) const
+    {
+        if ( matrix.getSize() != _size )
+            throw INVALID_RANGE;
+        std::copy(_initial.begin(), _initial.end(), matrix.getDataPtr());
+    }
+
+    /**
+     * @brief Reads the next step
+     *
+     * @return false at the end of the trace
+     */
+    bool next(LUTraceRecord<T> &record)
+    {
+        if ( _size == 0 || _nextStep == _size-1 )
+            return false;
+        uint32_t indices[2];
+        if ( !_in.read(reinterpret_cast<char *>(indices), sizeof(indices)) ) {
+            // Trace of a factorization stopped by its sink
+            return false;
+        }
+        if ( indices[0] != _nextStep || indices[1] < _nextStep || indices[1] >= _size )
+            throw INVALID_FORMAT;
+        const unsigned int count = _size-_nextStep;
+        record.step = indices[0];
+        record.pivotRow = indices[1];
+        record.multipliers.resize(count-1);
+        record.pivotRowValues.resize(count);
+        if ( !_in.read(reinterpret_cast<char *>(record.multipliers.data()), (count-1)*sizeof(T)) ||
+             !_in.read(reinterpret_cast<char *>(record.pivotRowValues.data()), count*sizeof(T)) )
+            throw FILE_ERROR;
+        _nextStep++;
+        return true;
+    }
+
+private:
+    std::ifstream _in;
+    unsigned int _size;
+    std::vector<T> _initial;
+    unsigned int _nextStep;
+};
+
+#endif // TRACE_SINKS_H
@@ -0,0 +1,495 @@
+#include <benchmark/benchmark.h>
+
+#include "Squarematrix.hpp"
+#include "BatchedMatrix.hpp"
+#include "MatrixMultiply.hpp"
+#include "MixedPrecision.hpp"
+
+#include <stddef.h>
+#include <math.h>
+
+#include <algorithm>
+#include <limits>
+#include <random>
+#include <vector>
+
+/*
+ * Every benchmark takes the matrix size as first argument and, when it
+ * factorizes, the conditioning of the input as second one. Besides the time
+ * they report:
+ *
+ *   GFLOPS          nominal flops of the operation per second
+ *   bytes_allocated bytes asked to the matrix allocators per iteration
+ *   backward_error  |b-Ax|_inf / (|A|_inf |x|_inf + |b|_inf) of a solve with
+ *                   the result, or |AX-I|_inf / (|A|_inf |X|_inf) for inverses
+ *
+ * Run with --benchmark_out=results.json --benchmark_out_format=json to keep
+ * the results, `meson test --benchmark` does it in the build directory.
+ */
+
+template <typename T>
+using BenchmarkMatrix = SquareMatrix<T, UncheckedAccess>;
+
+enum Conditioning {
+  WELL_CONDITIONED = 0,
+  ILL_CONDITIONED = 1
+};
+
+/*
+ * Uniform random entries in [-1, 1], condition number around n. Ill
+ * conditioned inputs scale the columns geometrically down to sqrt(epsilon),
+ * which raises the condition number by 1/sqrt(epsilon)
+ */
+template <typename T>
+static void fillMatrix(BenchmarkMatrix<T> &matrix, const Conditioning conditioning, unsigned int seed)
+{
+  const unsigned int n = matrix.getSize();
+  std::mt19937 generator(seed);
+  std::uniform_real_distribution<T> distribution(-1.0, 1.0);
+  const double smallest = std::sqrt(std::numeric_limits<T>::epsilon());
+  for (unsigned int i = 0; i < n; i++)
+  {
+    for (unsigned int j = 0; j < n; j++)
+    {
+      double scale = 1.0;
+      if (conditioning == ILL_CONDITIONED && n > 1)
+      {
+        scale = std::pow(smallest, static_cast<double>(j)/(n-1));
+      }
+      matrix.set(i, j, static_cast<T>(scale*distribution(generator)));
+    }
+  }
+}
+
+template <typename T>
+static double normInf(const BenchmarkMatrix<T> &matrix)
+{
+  double norm = 0.0;
+  for (unsigned int i = 0; i < matrix.getSize(); i++)
+  {
+    double sum = 0.0;
+    for (unsigned int j = 0; j < matrix.getSize(); j++)
+    {
+      sum += std::abs(static_cast<double>(matrix.get(i, j)));
+    }
+    norm = std::max(norm, sum);
+  }
+  return norm;
+}
+
+template <typename T>
+static double backwardError(const BenchmarkMatrix<T> &a, const std::vector<T> &x, const std::vector<T> &b)
+{
+  double residual = 0.0;
+  double xNorm = 0.0;
+  double bNorm = 0.0;
+  for (unsigned int i = 0; i < a.getSize(); i++)
+  {
+    double r = b[i];
+    for (unsigned int j = 0; j < a.getSize(); j++)
+    {
+      r -= static_cast<double>(a.get(i, j))*x[j];
+    }
+    residual = std::max(residual, std::abs(r));
+    xNorm = std::max(xNorm, std::abs(static_cast<double>(x[i])));
+    bNorm = std::max(bNorm, std::abs(static_cast<double>(b[i])));
+  }
+  return residual/(normInf(a)*xNorm + bNorm);
+}
+
+/*
+ * Backward error of solving with the factorization stored in factors, for a
+ * right-hand side with solution made of ones
+ */
+template <typename T>
+static double solveError(const BenchmarkMatrix<T> &a, const BenchmarkMatrix<T> &factors)
+{
+  std::vector<T> b(a.getSize(), static_cast<T>(0));
+  for (unsigned int i = 0; i < a.getSize(); i++)
+  {
+    for (unsigned int j = 0; j < a.getSize(); j++)
+    {
+      b[i] += a.get(i, j);
+    }
+  }
+  return backwardError(a, factors.solve(b), b);
+}
+
+template <typename T>
+static double inverseError(const BenchmarkMatrix<T> &a, const BenchmarkMatrix<T> &inverse)
+{
+  const unsigned int n = a.getSize();
+  BenchmarkMatrix<T> product(n);
+  multiply(product, a, inverse);
+  double error = 0.0;
+  for (unsigned int i = 0; i < n; i++)
+  {
+    double sum = 0.0;
+    for (unsigned int j = 0; j < n; j++)
+    {
+      sum += std::abs(static_cast<double>(product.get(i, j)) - (i == j ? 1.0 : 0.0));
+    }
+    error = std::max(error, sum);
+  }
+  return error/(normInf(a)*normInf(inverse));
+}
+
+/*
+ * Bytes taken from the allocator of the matrices under test and from the
+ * default one since the benchmark started
+ */
+class AllocationCounter
+{
+public:
+  explicit AllocationCounter(const AlignedAllocator &allocator) :
+    _allocator(allocator),
+    _start(allocator.getAllocatedBytes() + defaultMatrixAllocator().getAllocatedBytes()) {}
+
+  size_t getBytes() const
+  {
+    return _allocator.getAllocatedBytes() + defaultMatrixAllocator().getAllocatedBytes() - _start;
+  }
+
+private:
+  const AlignedAllocator &_allocator;
+  const size_t _start;
+};
+
+static void setCounters(benchmark::State &state, const double flops, const size_t bytes, const double error)
+{
+  state.counters["GFLOPS"] = benchmark::Counter(flops*1e-9, benchmark::Counter::kIsIterationInvariantRate);
+  state.counters["bytes_allocated"] = benchmark::Counter(static_cast<double>(bytes), benchmark::Counter::kAvgIterations);
+  state.counters["backward_error"] = error;
+}
+
+static double luFlops(const double n)
+{
+  return 2.0/3.0*n*n*n;
+}
+
+/*
+ * Factorizes a copy of the input on every iteration, the copy is O(n^2)
+ * against the O(n^3) factorization
+ */
+template <typename T, typename Factorize>
+static void runLu(benchmark::State &state, Factorize factorize)
+{
+  const unsigned int n = static_cast<unsigned int>(state.range(0));
+  AlignedAllocator allocator;
+  BenchmarkMatrix<T> a(n, allocator);
+  fillMatrix(a, static_cast<Conditioning>(state.range(1)), n);
+  BenchmarkMatrix<T> factors(n, allocator);
+
+  AllocationCounter counter(allocator);
+  for (auto _ : state)
+  {
+    std::copy(a.getDataPtr(), a.getDataPtr()+n*n, factors.getDataPtr());
+    factorize(factors);
+    benchmark::ClobberMemory();
+  }
+  setCounters(state, luFlops(n), counter.getBytes(), solveError(a, factors));
+}
+
+template <typename T>
+static void BM_Lu(benchmark::State &state)
+{
+  runLu<T>(state, [](BenchmarkMatrix<T> &m) { m.lu(); });
+}
+
+template <typename T>
+static void BM_LuBlocked(benchmark::State &state)
+{
+  runLu<T>(state, [](BenchmarkMatrix<T> &m) { m.luBlocked(); });
+}
+
+template <typename T>
+static void BM_LuRecursive(benchmark::State &state)
+{
+  runLu<T>(state, [](BenchmarkMatrix<T> &m) { m.luRecursive(); });
+}
+
+template <typename T>
+static void BM_LuParallel(benchmark::State &state)
+{
+  static WorkStealingPool pool;
+  runLu<T>(state, [](BenchmarkMatrix<T> &m) { m.luParallel(pool); });
+}
+
+/*
+ * Blocked LU with the kernels of one instruction set, given as third argument
+ */
+template <typename T>
+static void BM_LuIsa(benchmark::State &state)
+{
+  const simd::Isa previous = simd::getIsa();
+  const simd::Isa isa = static_cast<simd::Isa>(state.range(2));
+  if (simd::setIsa(isa) != isa)
+  {
+    simd::setIsa(previous);
+    state.SkipWithError("instruction set not supported");
+    return;
+  }
+  state.SetLabel(simd::getIsaName(isa));
+  runLu<T>(state, [](BenchmarkMatrix<T> &m) { m.luBlocked(); });
+  simd::setIsa(previous);
+}
+
+template <typename T>
+static void BM_GetInverse(benchmark::State &state)
+{
+  const unsigned int n = static_cast<unsigned int>(state.range(0));
+  AlignedAllocator allocator;
+  BenchmarkMatrix<T> a(n, allocator);
+  fillMatrix(a, static_cast<Conditioning>(state.range(1)), n);
+  BenchmarkMatrix<T> factors(a);
+  factors.luRecursive();
+
+  AllocationCounter counter(allocator);
+  BenchmarkMatrix<T> inverse(0, allocator);
+  for (auto _ : state)
+  {
+    inverse = factors.getInverse();
+    benchmark::ClobberMemory();
+  }
+  const size_t bytes = counter.getBytes();
+  setCounters(state, 4.0/3.0*n*static_cast<double>(n)*n, bytes, inverseError(a, inverse));
+}
+
+template <typename T>
+static void BM_SetZero(benchmark::State &state)
+{
+  const unsigned int n = static_cast<unsigned int>(state.range(0));
+  BenchmarkMatrix<T> a(n);
+  for (auto _ : state)
+  {
+    a.setZero();
+    benchmark::ClobberMemory();
+  }
+  state.SetBytesProcessed(state.iterations()*n*n*sizeof(T));
+}
+
+template <typename T>
+static void BM_Solve(benchmark::State &state)
+{
+  const unsigned int n = static_cast<unsigned int>(state.range(0));
+  AlignedAllocator allocator;
+  BenchmarkMatrix<T> a(n, allocator);
+  fillMatrix(a, static_cast<Conditioning>(state.range(1)), n);
+  BenchmarkMatrix<T> factors(a);
+  factors.luRecursive();
+  std::vector<T> b(n, static_cast<T>(1));
+
+  AllocationCounter counter(allocator);
+  std::vector<T> x;
+  for (auto _ : state)
+  {
+    x = factors.solve(b);
+    benchmark::DoNotOptimize(x.data());
+  }
+  setCounters(state, 2.0*n*n, counter.getBytes(), backwardError(a, x, b));
+}
+
+/*
+ * Solve with as many right-hand sides as the second argument
+ */
+template <typename T>
+static void BM_SolveMatrix(benchmark::State &state)
+{
+  const unsigned int n = static_cast<unsigned int>(state.range(0));
+  const unsigned int nrhs = static_cast<unsigned int>(state.range(1));
+  AlignedAllocator allocator;
+  BenchmarkMatrix<T> a(n, allocator);
+  fillMatrix(a, WELL_CONDITIONED, n);
+  BenchmarkMatrix<T> factors(a);
+  factors.luRecursive();
+  NumericMatrix<T, UncheckedAccess> b(n, nrhs, allocator);
+  NumericMatrix<T, UncheckedAccess> x(n, nrhs, allocator);
+  std::fill(b.getDataPtr(), b.getDataPtr()+n*nrhs, static_cast<T>(1));
+
+  AllocationCounter counter(allocator);
+  for (auto _ : state)
+  {
+    x = b;
+    factors.solve(x);
+    benchmark::ClobberMemory();
+  }
+  std::vector<T> x0(n);
+  for (unsigned int i = 0; i < n; i++)
+  {
+    x0[i] = x.get(i, 0);
+  }
+  setCounters(state, 2.0*n*n*nrhs, counter.getBytes(), backwardError(a, x0, std::vector<T>(n, static_cast<T>(1))));
+}
+
+template <typename T>
+static void runMultiply(benchmark::State &state, WorkStealingPool *pool)
+{
+  const unsigned int n = static_cast<unsigned int>(state.range(0));
+  AlignedAllocator allocator;
+  BenchmarkMatrix<T> a(n, allocator);
+  BenchmarkMatrix<T> b(n, allocator);
+  BenchmarkMatrix<T> c(n, allocator);
+  fillMatrix(a, WELL_CONDITIONED, n);
+  fillMatrix(b, WELL_CONDITIONED, n+1);
+
+  AllocationCounter counter(allocator);
+  for (auto _ : state)
+  {
+    if (pool)
+    {
+      multiply(c, a, b, static_cast<T>(1), static_cast<T>(0), *pool);
+    }
+    else
+    {
+      multiply(c, a, b);
+    }
+    benchmark::ClobberMemory();
+  }
+  state.counters["GFLOPS"] = benchmark::Counter(2e-9*n*static_cast<double>(n)*n,
+                                                benchmark::Counter::kIsIterationInvariantRate);
+  state.counters["bytes_allocated"] = benchmark::Counter(static_cast<double>(counter.getBytes()),
+                                                         benchmark::Counter::kAvgIterations);
+}
+
+template <typename T>
+static void BM_Multiply(benchmark::State &state)
+{
+  runMultiply<T>(state, nullptr);
+}
+
+template <typename T>
+static void BM_MultiplyParallel(benchmark::State &state)
+{
+  static WorkStealingPool pool;
+  runMultiply<T>(state, &pool);
+}
+
+template <typename T>
+static void BM_MultiplyIsa(benchmark::State &state)
+{
+  const simd::Isa previous = simd::getIsa();
+  const simd::Isa isa = static_cast<simd::Isa>(state.range(1));
+  if (simd::setIsa(isa) != isa)
+  {
+    simd::setIsa(previous);
+    state.SkipWithError("instruction set not supported");
+    return;
+  }
+  state.SetLabel(simd::getIsaName(isa));
+  runMultiply<T>(state, nullptr);
+  simd::setIsa(previous);
+}
+
+/*
+ * LU of a batch of small matrices, reported in matrices per second. The
+ * second argument is the number of matrices, which are loaded into the batch
+ * outside of the timed region
+ */
+template <typename T>
+static void BM_BatchedLu(benchmark::State &state)
+{
+  const unsigned int n = static_cast<unsigned int>(state.range(0));
+  const size_t count = static_cast<size_t>(state.range(1));
+  BenchmarkMatrix<T> a(n);
+  BatchedSquareMatrix<T, UncheckedAccess> source(n, count);
+  for (size_t b = 0; b < count; b++)
+  {
+    fillMatrix(a, WELL_CONDITIONED, static_cast<unsigned int>(b));
+    source.setMatrix(b, a.getDataPtr());
+  }
+
+  const size_t start = defaultMatrixAllocator().getAllocatedBytes();
+  for (auto _ : state)
+  {
+    state.PauseTiming();
+    BatchedSquareMatrix<T, UncheckedAccess> batch(n, count);
+    for (size_t b = 0; b < count; b++)
+    {
+      source.getMatrix(b, a.getDataPtr());
+      batch.setMatrix(b, a.getDataPtr());
+    }
+    state.ResumeTiming();
+    batch.lu();
+    benchmark::DoNotOptimize(batch.get(0, 0, 0));
+  }
+  state.SetItemsProcessed(state.iterations()*count);
+  state.counters["GFLOPS"] = benchmark::Counter(luFlops(n)*count*1e-9,
+                                                benchmark::Counter::kIsIterationInvariantRate);
+  state.counters["bytes_allocated"] = benchmark::Counter(
+    static_cast<double>(defaultMatrixAllocator().getAllocatedBytes()-start), benchmark::Counter::kAvgIterations);
+}
+
+/*
+ * Float factorization refined to double precision, against BM_Solve plus
+ * BM_Lu in double
+ */
+static void BM_MixedPrecision(benchmark::State &state)
+{
+  const unsigned int n = static_cast<unsigned int>(state.range(0));
+  AlignedAllocator allocator;
+  BenchmarkMatrix<double> a(n, allocator);
+  fillMatrix(a, static_cast<Conditioning>(state.range(1)), n);
+  std::vector<double> b(n, 1.0);
+  std::vector<double> x(n);
+
+  AllocationCounter counter(allocator);
+  RefinementInfo info = {0, 0.0, false};
+  for (auto _ : state)
+  {
+    MixedPrecisionSolver<UncheckedAccess> solver(a);
+    info = solver.solve(b, x);
+    benchmark::DoNotOptimize(x.data());
+  }
+  setCounters(state, luFlops(n), counter.getBytes(), info.backwardError);
+  state.counters["refinement_steps"] = info.iterations;
+  state.counters["fell_back"] = info.fellBack;
+}
+
+#define FACTORIZATION_BENCHMARK(name, maxSize) \
+  BENCHMARK_TEMPLATE(name, float)->RangeMultiplier(4)->Ranges({{4, maxSize}, {0, 1}}) \
+    ->ArgNames({"n", "ill"})->Unit(benchmark::kMicrosecond); \
+  BENCHMARK_TEMPLATE(name, double)->RangeMultiplier(4)->Ranges({{4, maxSize}, {0, 1}}) \
+    ->ArgNames({"n", "ill"})->Unit(benchmark::kMicrosecond)
+
+FACTORIZATION_BENCHMARK(BM_Lu, 1024);
+FACTORIZATION_BENCHMARK(BM_LuBlocked, 4096);
+FACTORIZATION_BENCHMARK(BM_LuRecursive, 4096);
+FACTORIZATION_BENCHMARK(BM_LuParallel, 4096);
+FACTORIZATION_BENCHMARK(BM_GetInverse, 2048);
+FACTORIZATION_BENCHMARK(BM_Solve, 4096);
+
+BENCHMARK_TEMPLATE(BM_LuIsa, float)->ArgsProduct({{256, 1024}, {0}, {0, 1, 2, 3}})
+  ->ArgNames({"n", "ill", "isa"})->Unit(benchmark::kMicrosecond);
+BENCHMARK_TEMPLATE(BM_LuIsa, double)->ArgsProduct({{256, 1024}, {0}, {0, 1, 2, 3}})
+  ->ArgNames({"n", "ill", "isa"})->Unit(benchmark::kMicrosecond);
+
+BENCHMARK_TEMPLATE(BM_SetZero, float)->RangeMultiplier(4)->Range(4, 4096)->ArgName("n");
+BENCHMARK_TEMPLATE(BM_SetZero, double)->RangeMultiplier(4)->Range(4, 4096)->ArgName("n");
+
+BENCHMARK_TEMPLATE(BM_SolveMatrix, float)->ArgsProduct({{64, 256, 1024}, {16, 256}})
+  ->ArgNames({"n", "nrhs"})->Unit(benchmark::kMicrosecond);
+BENCHMARK_TEMPLATE(BM_SolveMatrix, double)->ArgsProduct({{64, 256, 1024}, {16, 256}})
+  ->ArgNames({"n", "nrhs"})->Unit(benchmark::kMicrosecond);
+
+BENCHMARK_TEMPLATE(BM_Multiply, float)->RangeMultiplier(4)->Range(4, 4096)->ArgName("n")
+  ->Unit(benchmark::kMicrosecond);
+BENCHMARK_TEMPLATE(BM_Multiply, double)->RangeMultiplier(4)->Range(4, 4096)->ArgName("n")
+  ->Unit(benchmark::kMicrosecond);
+BENCHMARK_TEMPLATE(BM_MultiplyParallel, float)->RangeMultiplier(4)->Range(256, 4096)->ArgName("n")
+  ->Unit(benchmark::kMicrosecond)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_MultiplyParallel, double)->RangeMultiplier(4)->Range(256, 4096)->ArgName("n")
+  ->Unit(benchmark::kMicrosecond)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_MultiplyIsa, float)->ArgsProduct({{256, 1024}, {0, 1, 2, 3}})
+  ->ArgNames({"n", "isa"})->Unit(benchmark::kMicrosecond);
+BENCHMARK_TEMPLATE(BM_MultiplyIsa, double)->ArgsProduct({{256, 1024}, {0, 1, 2, 3}})
+  ->ArgNames({"n", "isa"})->Unit(benchmark::kMicrosecond);
+
+BENCHMARK_TEMPLATE(BM_BatchedLu, float)->ArgsProduct({{4, 8, 16}, {4096}})
+  ->ArgNames({"n", "count"})->Unit(benchmark::kMicrosecond);
+BENCHMARK_TEMPLATE(BM_BatchedLu, double)->ArgsProduct({{4, 8, 16}, {4096}})
+  ->ArgNames({"n", "count"})->Unit(benchmark::kMicrosecond);
+
+BENCHMARK(BM_MixedPrecision)->RangeMultiplier(4)->Ranges({{64, 4096}, {0, 1}})
+  ->ArgNames({"n", "ill"})->Unit(benchmark::kMicrosecond);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,464 @@
+#include "Squarematrix.hpp"
+#include "MatrixFile.hpp"
+#include "MatrixMarket.hpp"
+#include "TaskScheduler.hpp"
+
+#include <stdlib.h>
+
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <new>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*
+ * Command line driver factorizing, inverting or solving many matrices in a
+ * pipeline of three stages connected by bounded queues:
+ *
+ *   reader   reads the inputs one matrix at a time and groups them in batches
+ *   workers  run the operation on every matrix of a batch
+ *   writer   writes the results in input order, with the timings of each job
+ *
+ * A full queue blocks the stage feeding it, so at most queue-depth batches
+ * wait in front of the workers and the reader never gets far ahead of them.
+ * Inputs hold one or more matrices in Matrix Market format or in the binary
+ * format of saveMatrix(), detected from their first bytes; results are
+ * written in the same formats, so they can be fed back to the driver.
+ */
+
+typedef std::chrono::steady_clock Clock;
+
+enum Operation {
+  OPERATION_LU,
+  OPERATION_INVERSE,
+  OPERATION_SOLVE
+};
+
+enum OutputFormat {
+  OUTPUT_TEXT,
+  OUTPUT_BINARY
+};
+
+struct Options
+{
+  Operation operation = OPERATION_LU;
+  OutputFormat format = OUTPUT_TEXT;
+  unsigned int workers = WorkStealingPool::hardwareThreads();
+  unsigned int batch = 1;
+  unsigned int queueDepth = 0;
+  std::string output = "-";
+  std::string timings;
+  std::vector<std::string> inputs;
+};
+
+struct Job
+{
+  size_t index;
+  std::string source;
+  std::unique_ptr<NumericMatrix<double>> matrix;
+  double readSeconds;
+  Clock::time_point queued;
+};
+
+struct Result
+{
+  size_t index;
+  std::string source;
+  unsigned int rows;
+  unsigned int columns;
+  /** Factors for lu, inverse for inverse */
+  std::unique_ptr<SquareMatrix<double>> square;
+  /** Solutions for solve */
+  std::unique_ptr<NumericMatrix<double>> solution;
+  std::string error;
+  double readSeconds;
+  double waitSeconds;
+  double computeSeconds;
+};
+
+typedef std::vector<Job> JobBatch;
+typedef std::vector<Result> ResultBatch;
+
+static double seconds(const Clock::time_point begin, const Clock::time_point end)
+{
+  return std::chrono::duration<double>(end-begin).count();
+}
+
+static const char *getErrorName(const Matrix_Errors error)
+{
+  switch ( error )
+  {
+    case INVALID_RANGE: return "invalid size";
+    case SINGULAR_MATRIX: return "singular matrix";
+    case NOT_POSITIVE_DEFINITE: return "not positive definite";
+    case FILE_ERROR: return "read or write error";
+    case INVALID_FORMAT: return "invalid format";
+    case INVALID_FACTORIZATION: return "invalid factorization";
+    case OPERATION_CANCELLED: return "cancelled";
+  }
+  return "unknown error";
+}
+
+static const char *const outOfMemory = "out of memory";
+
+static void printUsage(std::ostream &out)
+{
+  out << "usage: visualLU-cli [options] [input...]\n"
+         "\n"
+         "Reads the matrices of every input (a file, or - for the standard input, the\n"
+         "default) in Matrix Market or binary format and writes one result per matrix.\n"
+         "\n"
+         "  --op lu|inverse|solve  operation, lu by default. solve takes n x (n+k)\n"
+         "                         matrices [A B] and writes the n x k solution of A*X = B\n"
+         "  --workers N            worker threads, one per hardware thread by default\n"
+         "  --batch N              matrices handed to a worker at a time, 1 by default\n"
+         "  --queue-depth N        batches waiting for the workers and for the writer,\n"
+         "                         twice the workers by default\n"
+         "  -o, --output FILE      results, - (standard output) by default\n"
+         "  --format text|binary   Matrix Market (default) or binary results\n"
+         "  --timings FILE         per job timings, standard error by default\n"
+         "  -h, --help             this help\n";
+}
+
+static unsigned int parseCount(const std::string &option, const std::string &value)
+{
+  char *end;
+  const unsigned long count = strtoul(value.c_str(), &end, 10);
+  if ( value.empty() || *end != '\0' || value[0] == '-' || count == 0 || count > 1u<<20 ) {
+    std::cerr << "visualLU-cli: invalid value for " << option << ": " << value << "\n";
+    exit(2);
+  }
+  return static_cast<unsigned int>(count);
+}
+
+static Options parseOptions(const int argc, char *argv[])
+{
+  Options options;
+  for ( int i=1; i<argc; i++ )
+  {
+    const std::string arg = argv[i];
+    if ( arg == "-h" || arg == "--help" ) {
+      printUsage(std::cout);
+      exit(0);
+    }
+    if ( arg.size() < 2 || arg[0] != '-' ) {
+      options.inputs.push_back(arg);
+      continue;
+    }
+    if ( i+1 == argc ) {
+      std::cerr << "visualLU-cli: missing value for " << arg << "\n";
+      exit(2);
+    }
+    const std::string value = argv[++i];
+    if ( arg == "--op" ) {
+      if ( value == "lu" )
+        options.operation = OPERATION_LU;
+      else if ( value == "inverse" )
+        options.operation = OPERATION_INVERSE;
+      else if ( value == "solve" )
+        options.operation = OPERATION_SOLVE;
+      else {
+        std::cerr << "visualLU-cli: unknown operation " << value << "\n";
+        exit(2);
+      }
+    } else if ( arg == "--format" ) {
+      if ( value == "text" )
+        options.format = OUTPUT_TEXT;
+      else if ( value == "binary" )
+        options.format = OUTPUT_BINARY;
+      else {
+        std::cerr << "visualLU-cli: unknown format " << value << "\n";
+        exit(2);
+      }
+    } else if ( arg == "--workers" ) {
+      options.workers = parseCount(arg, value);
+    } else if ( arg == "--batch" ) {
+      options.batch = parseCount(arg, value);
+    } else if ( arg == "--queue-depth" ) {
+      options.queueDepth = parseCount(arg, value);
+    } else if ( arg == "-o" || arg == "--output" ) {
+      options.output = value;
+    } else if ( arg == "--timings" ) {
+      options.timings = value;
+    } else {
+      std::cerr << "visualLU-cli: unknown option " << arg << "\n";
+      printUsage(std::cerr);
+      exit(2);
+    }
+  }
+  if ( options.inputs.empty() )
+    options.inputs.push_back("-");
+  if ( options.queueDepth == 0 )
+    options.queueDepth = 2*options.workers;
+  return options;
+}
+
+/*
+ * Reader stage. Returns false if an input could not be read entirely
+ */
+static bool readInputs(const Options &options, BoundedQueue<JobBatch> &jobs)
+{
+  bool ok = true;
+  size_t index = 0;
+  JobBatch batch;
+  for ( const std::string &input : options.inputs )
+  {
+    std::ifstream file;
+    if ( input != "-" ) {
+      file.open(input, std::ios::binary);
+      if ( !file ) {
+        std::cerr << "visualLU-cli: " << input << ": " << getErrorName(FILE_ERROR) << "\n";
+        ok = false;
+        continue;
+      }
+    }
+    std::istream &in = input == "-" ? std::cin : file;
+    const std::string name = input == "-" ? "stdin" : input;
+    for ( unsigned int position=0; ; position++ )
+    {
+      // Matrix Market text ends with a newline, binary files follow each other
+      in >> std::ws;
+      const int first = in.peek();
+      if ( first == std::char_traits<char>::eof() )
+        break;
+      Job job;
+      job.index = index;
+      job.source = name+"#"+std::to_string(position);
+      const Clock::time_point begin = Clock::now();
+      try {
+        if ( first == matrixFileMagic[0] )
+          job.matrix.reset(new NumericMatrix<double>(readMatrix<double>(in)));
+        else if ( first == '%' )
+          job.matrix.reset(new NumericMatrix<double>(readMatrixMarket<double>(in)));
+        else
+          throw INVALID_FORMAT;
+      } catch (Matrix_Errors error) {
+        // The position of the next matrix is unknown
+        std::cerr << "visualLU-cli: " << job.source << ": " << getErrorName(error) << "\n";
+        ok = false;
+        break;
+      } catch (const std::bad_alloc &) {
+        // The header may announce a matrix far larger than the file
+        std::cerr << "visualLU-cli: " << job.source << ": " << outOfMemory << "\n";
+        ok = false;
+        break;
+      } catch (const std::exception &exception) {
+        std::cerr << "visualLU-cli: " << job.source << ": " << exception.what() << "\n";
+        ok = false;
+        break;
+      }
+      job.queued = Clock::now();
+      job.readSeconds = seconds(begin, job.queued);
+      batch.push_back(std::move(job));
+      index++;
+      if ( batch.size() == options.batch ) {
+        jobs.push(std::move(batch));
+        batch.clear();
+      }
+    }
+  }
+  if ( !batch.empty() )
+    jobs.push(std::move(batch));
+  return ok;
+}
+
+static void runJob(const Operation operation, Job &job, Result &result)
+{
+  const NumericMatrix<double> &matrix = *job.matrix;
+  const unsigned int n = matrix.getRowsCount();
+  if ( operation == OPERATION_SOLVE ? matrix.getColumnsCount() <= n : matrix.getColumnsCount() != n )
+    throw INVALID_RANGE;
+
+  // Only the square part goes to the factorization
+  std::unique_ptr<SquareMatrix<double>> square(new SquareMatrix<double>(n));
+  for ( unsigned int i=0; i<n; i++ )
+    std::copy(matrix.getDataPtr()+size_t(i)*matrix.getColumnsCount(),
+              matrix.getDataPtr()+size_t(i)*matrix.getColumnsCount()+n,
+              square->getDataPtr()+size_t(i)*n);
+  square->luRecursive();
+  if ( operation != OPERATION_LU ) {
+    // The factorization goes through singular matrices, whose inverse or
+    // solutions would only be made of infinities
+    for ( unsigned int i=0; i<n; i++ )
+      if ( square->getDataPtr()[size_t(i)*n+i] == 0.0 )
+        throw SINGULAR_MATRIX;
+  }
+  if ( operation == OPERATION_INVERSE ) {
+    square->invert();
+  } else if ( operation == OPERATION_SOLVE ) {
+    const unsigned int nrhs = matrix.getColumnsCount()-n;
+    result.solution.reset(new NumericMatrix<double>(n, nrhs));
+    for ( unsigned int i=0; i<n; i++ )
+      std::copy(matrix.getDataPtr()+size_t(i)*matrix.getColumnsCount()+n,
+                matrix.getDataPtr()+size_t(i+1)*matrix.getColumnsCount(),
+                result.solution->getDataPtr()+size_t(i)*nrhs);
+    square->solve(*result.solution);
+    return;
+  }
+  result.square = std::move(square);
+}
+
+/*
+ * Worker stage
+ */
+static void runJobs(const Operation operation, BoundedQueue<JobBatch> &jobs, BoundedQueue<ResultBatch> &results)
+{
+  JobBatch batch;
+  while ( jobs.pop(batch) )
+  {
+    ResultBatch done(batch.size());
+    for ( size_t i=0; i<batch.size(); i++ )
+    {
+      Job &job = batch[i];
+      Result &result = done[i];
+      const Clock::time_point begin = Clock::now();
+      result.index = job.index;
+      result.source = job.source;
+      result.rows = job.matrix->getRowsCount();
+      result.columns = job.matrix->getColumnsCount();
+      result.readSeconds = job.readSeconds;
+      result.waitSeconds = seconds(job.queued, begin);
+      try {
+        runJob(operation, job, result);
+      } catch (Matrix_Errors error) {
+        result.error = getErrorName(error);
+      } catch (const std::bad_alloc &) {
+        result.error = outOfMemory;
+      } catch (const std::exception &exception) {
+        result.error = exception.what();
+      }
+      if ( !result.error.empty() ) {
+        result.square.reset();
+        result.solution.reset();
+      }
+      // The input is not needed anymore, release it before the writer runs
+      job.matrix.reset();
+      result.computeSeconds = seconds(begin, Clock::now());
+    }
+    results.push(std::move(done));
+  }
+}
+
+static void writeResult(const Options &options, const Result &result, std::ostream &out)
+{
+  if ( options.format == OUTPUT_BINARY ) {
+    if ( result.square )
+      saveMatrix(out, *result.square);
+    else
+      saveMatrix(out, *result.solution);
+    return;
+  }
+  std::ostringstream comment;
+  comment << " job " << result.index << " " << result.source << "\n";
+  if ( result.square && result.square->getFactorization() == LU_FACTORIZATION ) {
+    comment << " pivots";
+    for ( const unsigned int pivot : result.square->getPivots() )
+      comment << " " << pivot;
+    comment << "\n";
+  }
+  if ( result.square )
+    writeMatrixMarket(out, *result.square, comment.str());
+  else
+    writeMatrixMarket(out, *result.solution, comment.str());
+}
+
+/*
+ * Writer stage: results leave in input order, the ones finished early wait
+ * for those before them. Returns false if a job failed
+ */
+static bool writeResults(const Options &options, BoundedQueue<ResultBatch> &results,
+                         std::ostream &out, std::ostream &timings)
+{
+  bool ok = true;
+  bool writeFailed = false;
+  size_t next = 0;
+  std::map<size_t, Result> pending;
+  timings << "job\tsource\trows\tcolumns\tread_s\twait_s\tcompute_s\tstatus\n";
+  ResultBatch batch;
+  while ( results.pop(batch) )
+  {
+    for ( Result &result : batch )
+      pending.emplace(result.index, std::move(result));
+    for ( auto it=pending.find(next); it!=pending.end(); it=pending.find(++next) )
+    {
+      const Result &result = it->second;
+      if ( result.error.empty() ) {
+        // After a write error the results are still drained so the other
+        // stages can finish
+        try {
+          if ( !writeFailed )
+            writeResult(options, result, out);
+        } catch (Matrix_Errors error) {
+          std::cerr << "visualLU-cli: " << options.output << ": " << getErrorName(error) << "\n";
+          writeFailed = true;
+          ok = false;
+        }
+      } else {
+        std::cerr << "visualLU-cli: " << result.source << ": " << result.error << "\n";
+        ok = false;
+      }
+      timings << result.index << "\t" << result.source << "\t" << result.rows << "\t" << result.columns
+              << "\t" << result.readSeconds << "\t" << result.waitSeconds << "\t" << result.computeSeconds
+              << "\t" << (result.error.empty() ? "ok" : result.error) << "\n";
+      pending.erase(it);
+    }
+  }
+  out.flush();
+  return ok;
+}
+
+int main(int argc, char *argv[])
+{
+  const Options options = parseOptions(argc, argv);
+
+  std::ofstream outputFile;
+  if ( options.output != "-" ) {
+    outputFile.open(options.output, std::ios::binary | std::ios::trunc);
+    if ( !outputFile ) {
+      std::cerr << "visualLU-cli: " << options.output << ": " << getErrorName(FILE_ERROR) << "\n";
+      return 1;
+    }
+  }
+  std::ofstream timingsFile;
+  if ( !options.timings.empty() && options.timings != "-" ) {
+    timingsFile.open(options.timings, std::ios::trunc);
+    if ( !timingsFile ) {
+      std::cerr << "visualLU-cli: " << options.timings << ": " << getErrorName(FILE_ERROR) << "\n";
+      return 1;
+    }
+  }
+  std::ostream &out = options.output == "-" ? std::cout : outputFile;
+  std::ostream &timings = options.timings.empty() ? std::cerr :
+    options.timings == "-" ? std::cout : timingsFile;
+  std::ios::sync_with_stdio(false);
+
+  BoundedQueue<JobBatch> jobs(options.queueDepth);
+  BoundedQueue<ResultBatch> results(options.queueDepth);
+  const Clock::time_point begin = Clock::now();
+
+  bool readOk = true;
+  std::thread reader([&] {
+    readOk = readInputs(options, jobs);
+    jobs.close();
+  });
+  std::vector<std::thread> workers;
+  for ( unsigned int i=0; i<options.workers; i++ )
+    workers.emplace_back(runJobs, options.operation, std::ref(jobs), std::ref(results));
+  std::thread closer([&] {
+    for ( std::thread &worker : workers )
+      worker.join();
+    results.close();
+  });
+  const bool writeOk = writeResults(options, results, out, timings);
+  closer.join();
+  reader.join();
+
+  timings << "# " << options.workers << " workers, wall time " << seconds(begin, Clock::now()) << " s\n";
+  timings.flush();
+  return readOk && writeOk && out ? 0 : 1;
+}
@@ -1,11 +1,38 @@
 #include "lu_main_window.h"
 #include "ui_lu_main_window.h"
 #include "Squarematrix.hpp"
+#include <QtConcurrent>
 #include <sstream>
 
+/*
+ * Records every step of the elimination, reporting the progress and
+ * stopping the factorization when it is cancelled
+ */
+class WindowTraceSink : public RingBufferTraceSink<NumericType>
+{
+public:
+    WindowTraceSink(const unsigned int size, const ProgressCallback &progress) :
+    RingBufferTraceSink<NumericType>(size), _progress(progress)
+    {
+    }
+
+    void step(const LUTraceStep<NumericType> &traceStep) override
+    {
+        RingBufferTraceSink<NumericType>::step(traceStep);
+        const double left = static_cast<double>(getSize()-traceStep.step-1)/getSize();
+        if ( !_progress(1.0-left*left*left) )
+            throw OPERATION_CANCELLED;
+    }
+
+private:
+    ProgressCallback _progress;
+};
+
 LU_main_window::LU_main_window(QWidget *parent) :
     QMainWindow(parent),
-    ui(new Ui::LU_main_window)
+    ui(new Ui::LU_main_window),
+    _operation(OPERATION_FACTORIZE),
+    _cancelRequested(false)
 {
     ui->setupUi(this);
     setWindowTitle("Visual LU factorization");
@@ -14,33 +41,79 @@ LU_main_window::LU_main_window(QWidget *parent) :
 
 LU_main_window::~LU_main_window()
 {
+    // The worker reports to the widgets, it must be done before they go
+    _cancelRequested = true;
+    _watcher.waitForFinished();
+    instrumentation::removeObserver(_instrumentationObserver);
+    ui->tableViewMatrix->setModel(NULL);
+    delete _matrix;
+    delete _replay;
     delete ui;
 }
 
 void LU_main_window::restart()
 {
-    // QtTableWidget initialization
-    ui->tableWidgetMatrix->setRowCount(ui->spinSize->value());
-    ui->tableWidgetMatrix->setColumnCount(ui->spinSize->value());
-
-
-    // Matrix initialization
-
+    // Matrix initialization, shown by the model without copying it
+    clearTrace();
+    _model->setMatrix(NULL);
     if ( _matrix != NULL ) {
         delete _matrix;
         _matrix = NULL;
     }
     _matrix = new SquareMatrix<NumericType>(ui->spinSize->value());
+    _matrix->setZero();
+    _model->setMatrix(_matrix);
 }
 
 void LU_main_window::initialize()
 {
     _matrix = NULL;
+    _replay = NULL;
+    _model = new MatrixTableModel(this);
+    ui->tableViewMatrix->setModel(_model);
+    connect(&_watcher, &QFutureWatcher<OperationResult>::finished, this, &LU_main_window::operationFinished);
+    setBusy(false);
+    clearTrace();
 
     // SpinSize initialization (only once)
     ui->spinSize->setMaximum(maxSize);
     ui->spinSize->setMinimum(minSize);
     ui->spinSize->setValue(defaultSize);
+    if ( _matrix == NULL )
+        restart();
+
+    // Phase summary of the last factorization. The observer may be called
+    // from any thread, so the label is updated through the event loop
+    if ( instrumentation::enabled ) {
+        instrumentation::enableHardwareCounters(true);
+        QLabel *label = ui->labelInstrumentation;
+        _instrumentationObserver = instrumentation::addObserver([label](const InstrumentationReport &report) {
+            QMetaObject::invokeMethod(label, "setText", Qt::QueuedConnection,
+                                      Q_ARG(QString, formatReport(report)));
+        });
+    } else {
+        _instrumentationObserver = -1;
+        ui->labelInstrumentation->setText("Build with -Dinstrumentation=true to profile the factorization");
+    }
+}
+
+QString LU_main_window::formatReport(const InstrumentationReport &report)
+{
+    std::ostringstream buffer;
+    buffer << report.operation << " " << report.size << "x" << report.size << ": "
+           << report.nanoseconds/1000.0 << " us\n";
+    for ( unsigned int i=0; i<PHASE_COUNT; i++ )
+    {
+        const PhaseStatistics &phase = report.phases[i];
+        if ( phase.calls == 0 )
+            continue;
+        buffer << "\n" << instrumentation::getPhaseName(static_cast<InstrumentationPhase>(i)) << ":\n"
+               << "  " << phase.calls << " calls, " << phase.nanoseconds/1000.0 << " us\n"
+               << "  " << phase.bytes << " bytes, " << phase.flops << " flops\n";
+        if ( phase.cycles != 0 )
+            buffer << "  " << phase.cycles << " cycles, " << phase.cacheMisses << " misses\n";
+    }
+    return QString::fromStdString(buffer.str());
 }
 
 void LU_main_window::changeSize(const unsigned int size)
@@ -54,83 +127,200 @@ void LU_main_window::on_spinSize_valueChanged(const QString &arg1)
     changeSize(arg1.toInt());
 }
 
-bool LU_main_window::readMatrix(QTableWidget &table, SquareMatrix<NumericType> &matrix)
+void LU_main_window::setBusy(const bool busy)
 {
-    matrix.setZero();
+    ui->spinSize->setEnabled(!busy);
+    ui->pushButtonFill->setEnabled(!busy);
+    ui->pushButtonFactorize->setEnabled(!busy);
+    ui->pushButtonInvert->setEnabled(!busy);
+    ui->pushButtonCancel->setEnabled(busy);
+    ui->checkBoxTrace->setEnabled(!busy);
+    _model->setReadOnly(busy);
+    if ( busy )
+        ui->progressBar->setValue(0);
+}
 
-    // Read values from widgets
-    NumericType tmp;
-    for ( unsigned int i=0; i<static_cast<unsigned int>(table.rowCount()); i++ )
-    {
-        for ( unsigned int j=0; j<static_cast<unsigned int>(table.columnCount()); j++ )
-        {
-            try {
-                if ( table.item(i,j) != NULL ) {
-                    tmp = table.item(i,j)->text().toDouble();
-                    matrix.set(i,j,tmp);
-                } else
-                    throw -20;
-            } catch (int) {
-                ui->statusBar->showMessage("Please, initialize the matrix");
-                return false;
+void LU_main_window::startOperation(const WindowOperation operation)
+{
+    if ( _watcher.isRunning() )
+        return;
+
+    // The worker computes on a copy, so the table keeps showing the matrix
+    // meanwhile and a cancelled operation leaves it untouched
+    clearTrace();
+    std::shared_ptr<SquareMatrix<NumericType> > matrix = std::make_shared<SquareMatrix<NumericType> >(*_matrix);
+    const bool record = operation == OPERATION_FACTORIZE && ui->checkBoxTrace->isChecked() &&
+        matrix->getSize() <= maxTraceSize;
+    _operation = operation;
+    _cancelRequested = false;
+    setBusy(true);
+    ui->statusBar->showMessage(operation == OPERATION_FACTORIZE ? "Factorizing..." : "Inverting...");
+
+    QProgressBar *progressBar = ui->progressBar;
+    std::atomic<bool> *cancelRequested = &_cancelRequested;
+    _watcher.setFuture(QtConcurrent::run([matrix, operation, record, progressBar, cancelRequested]() {
+        OperationResult result;
+        result.matrix = matrix;
+        result.error = 0;
+
+        // The inversion reuses the factors shown in the table, if any. The
+        // factorization takes a third of the flops of a whole inversion
+        const bool factorize = operation == OPERATION_FACTORIZE || matrix->getFactorization() != LU_FACTORIZATION;
+        const double factorizeShare = operation == OPERATION_FACTORIZE ? 1.0 : factorize ? 1.0/3.0 : 0.0;
+        int percent = -1;
+        const auto progress = [&percent, progressBar, cancelRequested](const double start, const double share) {
+            return [&percent, progressBar, cancelRequested, start, share](const double done) {
+                const int current = static_cast<int>(100.0*(start+share*done));
+                if ( current != percent ) {
+                    percent = current;
+                    QMetaObject::invokeMethod(progressBar, "setValue", Qt::QueuedConnection, Q_ARG(int, current));
+                }
+                return !cancelRequested->load();
+            };
+        };
+        try {
+            if ( record ) {
+                // The unblocked elimination, one traced step per column
+                std::shared_ptr<WindowTraceSink> trace =
+                    std::make_shared<WindowTraceSink>(matrix->getSize(), progress(0.0, 1.0));
+                matrix->lu(SWAP_ROWS, trace.get());
+                result.trace = trace;
+            } else if ( factorize ) {
+                matrix->luBlocked(defaultBlockSize, progress(0.0, factorizeShare));
             }
+            if ( operation == OPERATION_INVERT ) {
+                // The factorization goes through singular matrices
+                const unsigned int n = matrix->getSize();
+                for ( unsigned int i=0; i<n; i++ )
+                    if ( matrix->getDataPtr()[static_cast<size_t>(i)*n+i] == 0.0 )
+                        throw SINGULAR_MATRIX;
+                matrix->invert(progress(factorizeShare, 1.0-factorizeShare));
+            }
+        } catch (Matrix_Errors error) {
+            result.error = error;
         }
-    }
+        return result;
+    }));
+}
 
-    ui->statusBar->showMessage("Matrix readed");
-    return true;
+void LU_main_window::operationFinished()
+{
+    OperationResult result = _watcher.result();
+    setBusy(false);
+    switch ( result.error )
+    {
+    case 0:
+        *_matrix = std::move(*result.matrix);
+        _model->refresh();
+        ui->progressBar->setValue(100);
+        ui->statusBar->showMessage(_operation == OPERATION_FACTORIZE ? "Matrix factorized" : "Matrix inverted");
+        if ( result.trace ) {
+            // The slider starts at the end of the elimination, i.e. the factors
+            _trace = result.trace;
+            ui->sliderStep->blockSignals(true);
+            ui->sliderStep->setRange(0, _trace->getStepCount());
+            ui->sliderStep->setValue(_trace->getStepCount());
+            ui->sliderStep->blockSignals(false);
+            ui->sliderStep->setEnabled(true);
+        }
+        break;
+    case OPERATION_CANCELLED:
+        ui->statusBar->showMessage("Cancelled, the matrix is unchanged");
+        break;
+    case SINGULAR_MATRIX:
+        ui->statusBar->showMessage("The matrix is singular");
+        break;
+    default:
+        ui->statusBar->showMessage(QString("Operation failed (error %1)").arg(result.error));
+        break;
+    }
 }
 
 void LU_main_window::on_pushButtonFactorize_clicked()
 {
-    if (readMatrix(*(ui->tableWidgetMatrix), *_matrix) ) {
-        // Factorize
-        _matrix->lu();
-        ui->statusBar->showMessage("Matrix factorized");
+    startOperation(OPERATION_FACTORIZE);
+}
 
-        updateQTableWidgetFromMatrix(*(ui->tableWidgetMatrix), *_matrix);
-    }
+void LU_main_window::on_pushButtonInvert_clicked()
+{
+    startOperation(OPERATION_INVERT);
 }
 
-void LU_main_window::fillMatrix(QTableWidget *qtableWidget)
+void LU_main_window::on_pushButtonCancel_clicked()
 {
-    unsigned int nrows = qtableWidget->rowCount();
-    unsigned int ncols = qtableWidget->columnCount();
+    _cancelRequested = true;
+    ui->statusBar->showMessage("Cancelling...");
+}
 
-    std::ostringstream buffer;
-    int totalValue;
+void LU_main_window::fillMatrix(SquareMatrix<NumericType> &matrix)
+{
+    const unsigned int n = matrix.getSize();
+    NumericType *a = matrix.getDataPtr();
 
-    for ( unsigned int i=0; i<nrows; i++ )
+    matrix.setFactorization(NO_FACTORIZATION, std::vector<int>());
+    for ( unsigned int i=0; i<n; i++ )
     {
-        for ( unsigned int j=0; j<ncols; j++ )
+        for ( unsigned int j=0; j<n; j++ )
         {
-            QTableWidgetItem *newItem = new QTableWidgetItem();
-            totalValue = 1+(i*ncols+j);
-            std::ostringstream buffer;
-            buffer << totalValue;
-            newItem->setText(buffer.str().c_str());
-            qtableWidget->setItem(i, j, newItem);
+            a[static_cast<size_t>(i)*n+j] = 1+(static_cast<size_t>(i)*n+j);
         }
     }
 }
 
-void LU_main_window::updateQTableWidgetFromMatrix(QTableWidget &qTableWidget, Matrix<NumericType> &matrix)
+void LU_main_window::on_pushButtonFill_clicked()
 {
-    for ( unsigned int i=0; i<static_cast<unsigned int>(qTableWidget.rowCount()); i++ )
-    {
-        for ( unsigned int j=0; j<static_cast<unsigned int>(qTableWidget.columnCount()); j++ )
-        {
-            // Update C values
-            std::ostringstream buffer;
-            buffer << matrix.get(i, j);
-            QTableWidgetItem *newItem = new QTableWidgetItem();
-            newItem->setText(buffer.str().c_str());
-            qTableWidget.setItem(i, j, newItem);
-        }
-    }
+    clearTrace();
+    fillMatrix(*_matrix);
+    _model->refresh();
+    ui->statusBar->showMessage("Matrix filled");
 }
 
-void LU_main_window::on_pushButtonFill_clicked()
+void LU_main_window::showMatrix(SquareMatrix<NumericType> *matrix)
+{
+    // Switching matrices resets the view, the same one is only refreshed
+    if ( _model->getMatrix() != matrix )
+        _model->setMatrix(matrix);
+    else
+        _model->refresh();
+    _model->setReadOnly(matrix != _matrix);
+}
+
+void LU_main_window::clearTrace()
+{
+    _trace.reset();
+    ui->sliderStep->blockSignals(true);
+    ui->sliderStep->setRange(0, 0);
+    ui->sliderStep->blockSignals(false);
+    ui->sliderStep->setEnabled(false);
+    if ( _model->getMatrix() == _replay && _matrix != NULL )
+        showMatrix(_matrix);
+}
+
+void LU_main_window::on_sliderStep_valueChanged(int value)
 {
-    fillMatrix(ui->tableWidgetMatrix);
+    if ( !_trace )
+        return;
+    const unsigned int steps = static_cast<unsigned int>(value);
+    if ( steps == _trace->getStepCount() ) {
+        showMatrix(_matrix);
+        ui->statusBar->showMessage("Matrix factorized");
+        return;
+    }
+
+    // Rebuilt from the matrix before the elimination and the recorded steps
+    if ( _replay == NULL || _replay->getSize() != _trace->getSize() ) {
+        if ( _model->getMatrix() == _replay )
+            _model->setMatrix(NULL);
+        delete _replay;
+        _replay = new SquareMatrix<NumericType>(_trace->getSize());
+    }
+    _trace->getState(steps, *_replay);
+    showMatrix(_replay);
+    if ( steps == 0 ) {
+        ui->statusBar->showMessage("Before the elimination");
+    } else {
+        const LUTraceRecord<NumericType> &step = _trace->getStep(steps-1);
+        ui->statusBar->showMessage(QString("Step %1 of %2: pivot row %3")
+                                   .arg(steps).arg(_trace->getStepCount()).arg(step.pivotRow));
+    }
 }
@@ -2,18 +2,43 @@
 #define LU_MAIN_WINDOW_H
 
 #include <QMainWindow>
+#include <QFutureWatcher>
+#include <atomic>
+#include <memory>
 #include "Squarematrix.hpp"
-#include <QTableWidget>
+#include "TraceSinks.hpp"
+#include "matrix_table_model.h"
 
-const unsigned char defaultSize = 3;
-const unsigned char minSize = 3;
-const unsigned char maxSize = 8;
-typedef double NumericType;
+const unsigned int defaultSize = 3;
+const unsigned int minSize = 3;
+const unsigned int maxSize = 4000;
+/** Largest matrix whose elimination is recorded to be replayed */
+const unsigned int maxTraceSize = 500;
 
 namespace Ui {
 class LU_main_window;
 }
 
+/**
+ * @brief Operation run on a copy of the matrix by a worker thread
+ */
+enum WindowOperation {
+    OPERATION_FACTORIZE,
+    OPERATION_INVERT
+};
+
+/**
+ * @brief Outcome of a background operation: the computed matrix, or the
+ * error it threw (0 on success)
+ */
+struct OperationResult
+{
+    std::shared_ptr<SquareMatrix<NumericType> > matrix;
+    /** Steps of the factorization, if they were recorded */
+    std::shared_ptr<RingBufferTraceSink<NumericType> > trace;
+    int error;
+};
+
 class LU_main_window : public QMainWindow
 {
     Q_OBJECT
@@ -24,21 +49,40 @@ public:
     void initialize();
     void restart();
     void changeSize(const unsigned int size);
-    bool readMatrix(QTableWidget &table, SquareMatrix<NumericType> &matrix);
-    void updateQTableWidgetFromMatrix(QTableWidget &qTableWidget, Matrix<NumericType> &matrix);
-    void fillMatrix(QTableWidget *qtableWidget);
+    void fillMatrix(SquareMatrix<NumericType> &matrix);
+    void startOperation(const WindowOperation operation);
+    void setBusy(const bool busy);
+    void showMatrix(SquareMatrix<NumericType> *matrix);
+    void clearTrace();
+    static QString formatReport(const InstrumentationReport &report);
 
 private slots:
     void on_spinSize_valueChanged(const QString &arg1);
 
     void on_pushButtonFactorize_clicked();
 
+    void on_pushButtonInvert_clicked();
+
+    void on_pushButtonCancel_clicked();
+
     void on_pushButtonFill_clicked();
 
+    void on_sliderStep_valueChanged(int value);
+
+    void operationFinished();
+
 private:
     Ui::LU_main_window *ui;
     SquareMatrix<NumericType> *_matrix;
+    MatrixTableModel *_model;
+    /** State of the elimination shown while scrubbing through the trace */
+    SquareMatrix<NumericType> *_replay;
+    std::shared_ptr<RingBufferTraceSink<NumericType> > _trace;
+    QFutureWatcher<OperationResult> _watcher;
+    WindowOperation _operation;
+    std::atomic<bool> _cancelRequested;
     bool _initialized;
+    int _instrumentationObserver;
 };
 
 #endif // LU_MAIN_WINDOW_H
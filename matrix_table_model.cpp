@@ -0,0 +1,83 @@
+#include "matrix_table_model.h"
+
+MatrixTableModel::MatrixTableModel(QObject *parent) :
+    QAbstractTableModel(parent),
+    _matrix(NULL),
+    _readOnly(false)
+{
+}
+
+void MatrixTableModel::setMatrix(SquareMatrix<NumericType> *matrix)
+{
+    beginResetModel();
+    _matrix = matrix;
+    endResetModel();
+}
+
+void MatrixTableModel::refresh()
+{
+    if ( _matrix == NULL || _matrix->getSize() == 0 )
+        return;
+    emit dataChanged(index(0, 0), index(_matrix->getSize()-1, _matrix->getSize()-1));
+}
+
+void MatrixTableModel::setReadOnly(const bool readOnly)
+{
+    _readOnly = readOnly;
+}
+
+int MatrixTableModel::rowCount(const QModelIndex &parent) const
+{
+    return parent.isValid() || _matrix == NULL ? 0 : _matrix->getSize();
+}
+
+int MatrixTableModel::columnCount(const QModelIndex &parent) const
+{
+    return parent.isValid() || _matrix == NULL ? 0 : _matrix->getSize();
+}
+
+QVariant MatrixTableModel::data(const QModelIndex &index, int role) const
+{
+    if ( _matrix == NULL || !index.isValid() )
+        return QVariant();
+
+    // Straight from the buffer, the view only asks for the visible cells
+    const NumericType value = _matrix->getDataPtr()[static_cast<size_t>(index.row())*_matrix->getSize()+index.column()];
+    switch ( role )
+    {
+    case Qt::DisplayRole:
+        return QString::number(value, 'g', 6);
+    case Qt::EditRole:
+        return value;
+    case Qt::TextAlignmentRole:
+        return static_cast<int>(Qt::AlignRight | Qt::AlignVCenter);
+    default:
+        return QVariant();
+    }
+}
+
+bool MatrixTableModel::setData(const QModelIndex &index, const QVariant &value, int role)
+{
+    if ( _matrix == NULL || _readOnly || !index.isValid() || role != Qt::EditRole )
+        return false;
+    bool ok;
+    const NumericType number = value.toDouble(&ok);
+    if ( !ok )
+        return false;
+
+    // The elements are the matrix again, not its factors
+    _matrix->setFactorization(NO_FACTORIZATION, std::vector<int>());
+    _matrix->set(index.row(), index.column(), number);
+    emit dataChanged(index, index);
+    return true;
+}
+
+Qt::ItemFlags MatrixTableModel::flags(const QModelIndex &index) const
+{
+    if ( !index.isValid() )
+        return Qt::NoItemFlags;
+    Qt::ItemFlags itemFlags = Qt::ItemIsSelectable | Qt::ItemIsEnabled;
+    if ( !_readOnly )
+        itemFlags |= Qt::ItemIsEditable;
+    return itemFlags;
+}
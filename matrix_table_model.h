@@ -0,0 +1,50 @@
+#ifndef MATRIX_TABLE_MODEL_H
+#define MATRIX_TABLE_MODEL_H
+
+#include <QAbstractTableModel>
+#include "Squarematrix.hpp"
+
+typedef double NumericType;
+
+/**
+ * @brief Table model reading and writing the elements of a SquareMatrix in
+ * place. The view only asks for the visible cells, so no item is stored per
+ * element and large matrices are shown without copying them
+ */
+class MatrixTableModel : public QAbstractTableModel
+{
+    Q_OBJECT
+
+public:
+    explicit MatrixTableModel(QObject *parent = 0);
+
+    /**
+     * @brief Shows matrix, which must outlive the model or be replaced
+     * before being deleted. NULL shows an empty table
+     */
+    void setMatrix(SquareMatrix<NumericType> *matrix);
+    SquareMatrix<NumericType> *getMatrix() const { return _matrix; }
+
+    /**
+     * @brief Tells the views that every element may have changed, e.g. after
+     * factorizing the matrix
+     */
+    void refresh();
+
+    /**
+     * @brief Rejects the edits while the matrix is being computed
+     */
+    void setReadOnly(const bool readOnly);
+
+    int rowCount(const QModelIndex &parent = QModelIndex()) const override;
+    int columnCount(const QModelIndex &parent = QModelIndex()) const override;
+    QVariant data(const QModelIndex &index, int role = Qt::DisplayRole) const override;
+    bool setData(const QModelIndex &index, const QVariant &value, int role = Qt::EditRole) override;
+    Qt::ItemFlags flags(const QModelIndex &index) const override;
+
+private:
+    SquareMatrix<NumericType> *_matrix;
+    bool _readOnly;
+};
+
+#endif // MATRIX_TABLE_MODEL_H
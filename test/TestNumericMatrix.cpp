@@ -1,17 +1,43 @@
 #include <gtest/gtest.h>
 
 #include "Squarematrix.hpp"
+#include "FixedSquareMatrix.hpp"
+#include "BatchedMatrix.hpp"
+#include "MixedPrecision.hpp"
+#include "SparseMatrix.hpp"
+#include "BandMatrix.hpp"
+#include "Instrumentation.hpp"
+#include "MatrixFile.hpp"
+#include "MatrixMarket.hpp"
+#include "OutOfCore.hpp"
+#include "TraceSinks.hpp"
 
 #include <stddef.h>
+#include <string.h>
 #include <math.h>
 
 #include <array>
 #include <numeric>
 #include <iostream>
 #include <memory>
+#include <random>
+#include <sstream>
 
 typedef double NumericType;
 
+static void fillRandom(SquareMatrix<NumericType> &matrix, unsigned int seed)
+{
+  std::mt19937 generator(seed);
+  std::uniform_real_distribution<NumericType> distribution(-1.0, 1.0);
+  for (unsigned int i = 0; i < matrix.getSize(); i++)
+  {
+    for (unsigned int j = 0; j < matrix.getSize(); j++)
+    {
+      matrix.set(i, j, distribution(generator));
+    }
+  }
+}
+
 TEST(NumericMatrix, setZero)
 {
   const size_t matrixSize = 3;
@@ -236,6 +262,1499 @@ TEST(NumericMatrix, InverseA2)
 
 }
 
+TEST(NumericMatrix, LUBlocked1)
+{
+  const size_t matrixSize = 3;
+  std::unique_ptr<SquareMatrix<NumericType>> matrix = std::make_unique<SquareMatrix<NumericType>>(matrixSize);
+
+  NumericType A[] = {
+    1, 2, 2,
+    4, 4, 2,
+    4, 6, 4
+  };
+
+  matrix->setData(A, 9);
+  matrix->luBlocked(2);
+
+  EXPECT_NEAR(4, matrix->get(0, 0), 0.00001);
+  EXPECT_NEAR(4, matrix->get(0, 1), 0.00001);
+  EXPECT_NEAR(2, matrix->get(0, 2), 0.00001);
+  EXPECT_NEAR(1, matrix->get(1, 0), 0.00001);
+  EXPECT_NEAR(2, matrix->get(1, 1), 0.00001);
+  EXPECT_NEAR(2, matrix->get(1, 2), 0.00001);
+  EXPECT_NEAR(0.25, matrix->get(2, 0), 0.00001);
+  EXPECT_NEAR(0.5, matrix->get(2, 1), 0.00001);
+  EXPECT_NEAR(0.5, matrix->get(2, 2), 0.00001);
+
+  auto inverse = matrix->getInverse();
+  EXPECT_NEAR(1, inverse.get(0, 0), 0.00001);
+  EXPECT_NEAR(1, inverse.get(0, 1), 0.00001);
+  EXPECT_NEAR(-1, inverse.get(0, 2), 0.00001);
+  EXPECT_NEAR(-2, inverse.get(1, 0), 0.00001);
+  EXPECT_NEAR(-1, inverse.get(1, 1), 0.00001);
+  EXPECT_NEAR(1.5, inverse.get(1, 2), 0.00001);
+  EXPECT_NEAR(2, inverse.get(2, 0), 0.00001);
+  EXPECT_NEAR(0.5, inverse.get(2, 1), 0.00001);
+  EXPECT_NEAR(-1, inverse.get(2, 2), 0.00001);
+}
+
+TEST(NumericMatrix, LUBlockedMatchesLU)
+{
+  const size_t matrixSize = 150;
+
+  for (unsigned int blockSize : {1, 7, 32, 64, 200})
+  {
+    SquareMatrix<NumericType> reference(matrixSize);
+    SquareMatrix<NumericType> blocked(matrixSize);
+    fillRandom(reference, 1);
+    fillRandom(blocked, 1);
+
+    reference.lu();
+    blocked.luBlocked(blockSize);
+
+    for (unsigned int i = 0; i < matrixSize; i++)
+    {
+      for (unsigned int j = 0; j < matrixSize; j++)
+      {
+        EXPECT_NEAR(reference.get(i, j), blocked.get(i, j), 1e-10);
+      }
+    }
+  }
+}
+
+TEST(NumericMatrix, LUParallelMatchesLU)
+{
+  const size_t matrixSize = 150;
+
+  for (unsigned int nThreads : {1, 2, 4})
+  {
+    for (unsigned int tileSize : {7, 32, 150})
+    {
+      SquareMatrix<NumericType> reference(matrixSize);
+      SquareMatrix<NumericType> parallel(matrixSize);
+      fillRandom(reference, 2);
+      fillRandom(parallel, 2);
+
+      reference.lu();
+      parallel.luParallel(nThreads, tileSize);
+
+      for (unsigned int i = 0; i < matrixSize; i++)
+      {
+        for (unsigned int j = 0; j < matrixSize; j++)
+        {
+          EXPECT_NEAR(reference.get(i, j), parallel.get(i, j), 1e-10);
+        }
+      }
+    }
+  }
+}
+
+TEST(NumericMatrix, OutOfCoreLu)
+{
+  // Panels of 16 columns, the last one of 6
+  const unsigned int matrixSize = 70;
+  const std::string path = ::testing::TempDir()+"vlu_out_of_core.bin";
+  const size_t budget = OutOfCoreMatrix<NumericType>::panelsInMemory*matrixSize*sizeof(NumericType)*16;
+  EXPECT_THROW(OutOfCoreMatrix<NumericType>::create(path, matrixSize, 1000), Matrix_Errors);
+  OutOfCoreMatrix<NumericType> outOfCore = OutOfCoreMatrix<NumericType>::create(path, matrixSize, budget);
+  EXPECT_EQ(16u, outOfCore.getPanelWidth());
+
+  SquareMatrix<NumericType> matrix(matrixSize);
+  fillRandom(matrix, 29);
+  const MatrixView<const NumericType, DefaultAccess> view = matrix.view();
+  outOfCore.writeBlock(0, 0, view.block(0, 0, matrixSize, 21));
+  outOfCore.writeBlock(0, 21, view.block(0, 21, matrixSize, matrixSize-21));
+  SquareMatrix<NumericType> read(matrixSize);
+  outOfCore.readBlock(0, 0, read.view());
+  for (unsigned int i = 0; i < matrixSize*matrixSize; i++)
+  {
+    EXPECT_EQ(matrix.getDataPtr()[i], read.getDataPtr()[i]);
+  }
+
+  std::vector<NumericType> b(matrixSize);
+  for (unsigned int i = 0; i < matrixSize; i++)
+  {
+    b[i] = static_cast<NumericType>(i%7)-3.0;
+  }
+  outOfCore.lu();
+  matrix.luBlocked(16);
+  EXPECT_EQ(matrix.getPivots(), outOfCore.getPivots());
+
+  // Same U as in memory, L in the row order of each panel
+  outOfCore.readBlock(0, 0, read.view());
+  for (unsigned int i = 0; i < matrixSize; i++)
+  {
+    for (unsigned int j = i; j < matrixSize; j++)
+    {
+      EXPECT_NEAR(matrix.get(i, j), read.get(i, j), 1e-10);
+    }
+  }
+  const std::vector<NumericType> expected = matrix.solve(b);
+  const std::vector<NumericType> x = outOfCore.solve(b);
+  for (unsigned int i = 0; i < matrixSize; i++)
+  {
+    EXPECT_NEAR(expected[i], x[i], 1e-9);
+  }
+
+  // The factorization is read back from the file
+  const OutOfCoreMatrix<NumericType> reopened(path);
+  EXPECT_EQ(LU_FACTORIZATION, reopened.getFactorization());
+  EXPECT_EQ(outOfCore.getPivots(), reopened.getPivots());
+  EXPECT_EQ(x, reopened.solve(b));
+  EXPECT_THROW(mapMatrix<NumericType>(path), Matrix_Errors);
+  std::remove(path.c_str());
+}
+
+TEST(NumericMatrix, ProgressAndCancel)
+{
+  const unsigned int matrixSize = 300;
+  SquareMatrix<NumericType> original(matrixSize);
+  fillRandom(original, 41);
+
+  // The fractions grow up to the end of the operation
+  std::vector<double> fractions;
+  auto record = [&fractions](const double done) {
+    fractions.push_back(done);
+    return true;
+  };
+  SquareMatrix<NumericType> inverse(original);
+  inverse.luBlocked(64, record);
+  ASSERT_EQ(5u, fractions.size());
+  EXPECT_DOUBLE_EQ(1.0, fractions.back());
+  EXPECT_TRUE(std::is_sorted(fractions.begin(), fractions.end()));
+  fractions.clear();
+  inverse.invert(record);
+  EXPECT_TRUE(std::is_sorted(fractions.begin(), fractions.end()));
+  EXPECT_DOUBLE_EQ(1.0, fractions.back());
+  SquareMatrix<NumericType> expected(original);
+  expected.lu();
+  expected.invert();
+  for (unsigned int i = 0; i < matrixSize*matrixSize; i++)
+  {
+    EXPECT_NEAR(expected.getDataPtr()[i], inverse.getDataPtr()[i], 1e-9);
+  }
+
+  // Cancelled operations throw and leave no factorization behind
+  auto cancel = [](const double done) { return done < 0.5; };
+  SquareMatrix<NumericType> cancelled(original);
+  try {
+    cancelled.luBlocked(64, cancel);
+    FAIL();
+  } catch (Matrix_Errors error) {
+    EXPECT_EQ(OPERATION_CANCELLED, error);
+  }
+  EXPECT_EQ(NO_FACTORIZATION, cancelled.getFactorization());
+  EXPECT_TRUE(cancelled.getPivots().empty());
+  cancelled = original;
+  cancelled.luBlocked();
+  EXPECT_THROW(cancelled.invert(cancel), Matrix_Errors);
+  EXPECT_EQ(NO_FACTORIZATION, cancelled.getFactorization());
+
+  // A complete result is kept even if the final report asks to cancel
+  auto late = [](const double done) { return done < 1.0; };
+  cancelled = original;
+  cancelled.luBlocked(64, late);
+  EXPECT_EQ(LU_FACTORIZATION, cancelled.getFactorization());
+  cancelled.invert(late);
+  for (unsigned int i = 0; i < matrixSize*matrixSize; i++)
+  {
+    EXPECT_NEAR(expected.getDataPtr()[i], cancelled.getDataPtr()[i], 1e-9);
+  }
+}
+
+TEST(NumericMatrix, SolveVector)
+{
+  const size_t matrixSize = 120;
+  SquareMatrix<NumericType> matrix(matrixSize);
+  fillRandom(matrix, 3);
+
+  // b = A * x for a known x
+  std::vector<NumericType> x(matrixSize), b(matrixSize, 0);
+  std::iota(x.begin(), x.end(), 1);
+  for (unsigned int i = 0; i < matrixSize; i++)
+  {
+    for (unsigned int j = 0; j < matrixSize; j++)
+    {
+      b[i] += matrix.get(i, j) * x[j];
+    }
+  }
+
+  matrix.luBlocked(16);
+  std::vector<NumericType> solution = matrix.solve(b);
+
+  ASSERT_EQ(solution.size(), matrixSize);
+  for (unsigned int i = 0; i < matrixSize; i++)
+  {
+    EXPECT_NEAR(x[i], solution[i], 1e-8);
+  }
+}
+
+TEST(NumericMatrix, SolveMultipleRHS)
+{
+  const size_t matrixSize = 150;
+  const size_t nrhs = 90;
+  SquareMatrix<NumericType> matrix(matrixSize);
+  fillRandom(matrix, 4);
+
+  NumericMatrix<NumericType> X(matrixSize, nrhs);
+  NumericMatrix<NumericType> B(matrixSize, nrhs);
+  B.setZero();
+  for (unsigned int i = 0; i < matrixSize; i++)
+  {
+    for (unsigned int j = 0; j < nrhs; j++)
+    {
+      X.set(i, j, static_cast<NumericType>(i) - static_cast<NumericType>(j));
+    }
+  }
+  for (unsigned int i = 0; i < matrixSize; i++)
+  {
+    for (unsigned int k = 0; k < matrixSize; k++)
+    {
+      for (unsigned int j = 0; j < nrhs; j++)
+      {
+        B.set(i, j, B.get(i, j) + matrix.get(i, k) * X.get(k, j));
+      }
+    }
+  }
+
+  matrix.lu();
+  matrix.solve(B);
+
+  for (unsigned int i = 0; i < matrixSize; i++)
+  {
+    for (unsigned int j = 0; j < nrhs; j++)
+    {
+      EXPECT_NEAR(X.get(i, j), B.get(i, j), 1e-8);
+    }
+  }
+}
+
+TEST(NumericMatrix, Pivots)
+{
+  const size_t matrixSize = 3;
+  SquareMatrix<NumericType> matrix(matrixSize);
+
+  NumericType A[] = {
+    1, 2, 2,
+    4, 4, 2,
+    4, 6, 4
+  };
+
+  matrix.setData(A, 9);
+  EXPECT_TRUE(matrix.getPivots().empty());
+
+  matrix.lu();
+
+  const std::vector<unsigned int> expected = {1, 2, 2};
+  EXPECT_EQ(expected, matrix.getPivots());
+}
+
+TEST(NumericMatrix, LUIndirectRowsMatchesLU)
+{
+  const size_t matrixSize = 120;
+  SquareMatrix<NumericType> reference(matrixSize);
+  SquareMatrix<NumericType> indirect(matrixSize);
+  SquareMatrix<NumericType> blocked(matrixSize);
+  fillRandom(reference, 5);
+  fillRandom(indirect, 5);
+  fillRandom(blocked, 5);
+
+  reference.lu();
+  indirect.lu(INDIRECT_ROWS);
+  blocked.luBlocked(16);
+
+  EXPECT_EQ(reference.getPivots(), indirect.getPivots());
+  EXPECT_EQ(reference.getPivots(), blocked.getPivots());
+  for (unsigned int i = 0; i < matrixSize; i++)
+  {
+    for (unsigned int j = 0; j < matrixSize; j++)
+    {
+      EXPECT_EQ(reference.get(i, j), indirect.get(i, j));
+    }
+  }
+}
+
+/*
+ * Sink stopping the factorization after a given number of steps
+ */
+class StoppingTraceSink : public LUTraceSink<NumericType>
+{
+public:
+  explicit StoppingTraceSink(const unsigned int steps) : _steps(steps) {}
+  void begin(const unsigned int, const NumericType *) override {}
+  void step(const LUTraceStep<NumericType> &traceStep) override
+  {
+    if (traceStep.step+1 == _steps)
+    {
+      throw OPERATION_CANCELLED;
+    }
+  }
+
+private:
+  unsigned int _steps;
+};
+
+TEST(NumericMatrix, LUTrace)
+{
+  const unsigned int matrixSize = 40;
+  SquareMatrix<NumericType> original(matrixSize);
+  fillRandom(original, 43);
+  SquareMatrix<NumericType> state(matrixSize);
+
+  // Every state of the elimination is rebuilt to the last bit
+  for (const RowInterchanges mode : {SWAP_ROWS, INDIRECT_ROWS})
+  {
+    RingBufferTraceSink<NumericType> ring(matrixSize);
+    SquareMatrix<NumericType> factors(original);
+    factors.lu(mode, &ring);
+    EXPECT_TRUE(ring.isComplete());
+    ASSERT_EQ(matrixSize-1, ring.getStepCount());
+    EXPECT_EQ(0u, ring.getFirstStep());
+    ring.getState(0, state);
+    EXPECT_EQ(0, memcmp(original.getDataPtr(), state.getDataPtr(), matrixSize*matrixSize*sizeof(NumericType)));
+    ring.getState(matrixSize-1, state);
+    EXPECT_EQ(0, memcmp(factors.getDataPtr(), state.getDataPtr(), matrixSize*matrixSize*sizeof(NumericType)));
+    for (unsigned int k = 0; k < matrixSize-1; k++)
+    {
+      EXPECT_EQ(factors.getPivots()[k], ring.getStep(k).pivotRow);
+    }
+  }
+  SquareMatrix<NumericType> stopped(original);
+  StoppingTraceSink stopper(7);
+  EXPECT_THROW(stopped.lu(SWAP_ROWS, &stopper), Matrix_Errors);
+  EXPECT_EQ(NO_FACTORIZATION, stopped.getFactorization());
+  EXPECT_TRUE(stopped.getPivots().empty());
+  RingBufferTraceSink<NumericType> ring(3);
+  SquareMatrix<NumericType> factors(original);
+  factors.lu(SWAP_ROWS, &ring);
+  EXPECT_EQ(matrixSize-4, ring.getFirstStep());
+  EXPECT_THROW(ring.getState(7, state), Matrix_Errors);
+  EXPECT_THROW(ring.getStep(0), Matrix_Errors);
+  ring.getState(matrixSize-1, state);
+  EXPECT_EQ(0, memcmp(factors.getDataPtr(), state.getDataPtr(), matrixSize*matrixSize*sizeof(NumericType)));
+  RingBufferTraceSink<NumericType> all(matrixSize);
+  SquareMatrix<NumericType> again(original);
+  again.lu(SWAP_ROWS, &all);
+  all.getState(7, state);
+  EXPECT_EQ(0, memcmp(stopped.getDataPtr(), state.getDataPtr(), matrixSize*matrixSize*sizeof(NumericType)));
+
+  // Streamed to a file and replayed step by step
+  const std::string path = ::testing::TempDir()+"vlu_trace.bin";
+  {
+    FileTraceSink<NumericType> file(path);
+    SquareMatrix<NumericType> streamed(original);
+    streamed.lu(SWAP_ROWS, &file);
+  }
+  LUTraceReader<NumericType> reader(path);
+  ASSERT_EQ(matrixSize, reader.getSize());
+  reader.getInitial(state);
+  LUTraceRecord<NumericType> record;
+  unsigned int steps = 0;
+  while (reader.next(record))
+  {
+    applyLUTraceStep(state.view(), record.getStep());
+    steps++;
+  }
+  EXPECT_EQ(matrixSize-1, steps);
+  EXPECT_EQ(0, memcmp(factors.getDataPtr(), state.getDataPtr(), matrixSize*matrixSize*sizeof(NumericType)));
+  std::remove(path.c_str());
+  EXPECT_THROW(LUTraceReader<NumericType>(path+".missing"), Matrix_Errors);
+}
+
+TEST(NumericMatrix, AccessPolicy)
+{
+  SquareMatrix<NumericType, CheckedAccess> checked(3);
+  EXPECT_THROW(checked.get(3, 0), Matrix_Errors);
+  EXPECT_THROW(checked.set(0, 3, 1), Matrix_Errors);
+  EXPECT_THROW(checked.view().block(1, 1, 3, 1), Matrix_Errors);
+  BatchedSquareMatrix<NumericType, CheckedAccess> batch(3, 2);
+  EXPECT_THROW(batch.get(2, 0, 0), Matrix_Errors);
+
+  NumericType A[] = {
+    1, 2, 2,
+    4, 4, 2,
+    4, 6, 4
+  };
+  SquareMatrix<NumericType, UncheckedAccess> unchecked(3);
+  unchecked.setData(A, 9);
+  unchecked.lu();
+  EXPECT_NEAR(4, unchecked.get(0, 0), 0.00001);
+  EXPECT_NEAR(0.5, unchecked.get(2, 2), 0.00001);
+}
+
+TEST(NumericMatrix, MatrixView)
+{
+  SquareMatrix<NumericType> matrix(4);
+  for (unsigned int i = 0; i < 4; i++)
+  {
+    for (unsigned int j = 0; j < 4; j++)
+    {
+      matrix.set(i, j, i * 4 + j);
+    }
+  }
+
+  auto block = matrix.view().block(1, 2, 3, 2);
+  EXPECT_EQ(3u, block.getRowsCount());
+  EXPECT_EQ(2u, block.getColumnsCount());
+  EXPECT_EQ(6, block(0, 0));
+  EXPECT_EQ(15, block(2, 1));
+
+  auto column = block.columnView(1);
+  EXPECT_EQ(11, column(1, 0));
+
+  auto row = block.rowView(2);
+  row(0, 0) = -1;
+  EXPECT_EQ(-1, matrix.get(3, 2));
+}
+
+TEST(NumericMatrix, SimdKernelsAllIsas)
+{
+  const size_t matrixSize = 101;
+  SquareMatrix<NumericType> reference(matrixSize);
+  fillRandom(reference, 6);
+  simd::setIsa(simd::ISA_SCALAR);
+  reference.luBlocked(16);
+
+  for (int isa = simd::ISA_SSE2; isa <= simd::detectIsa(); isa++)
+  {
+    EXPECT_EQ(isa, simd::setIsa(static_cast<simd::Isa>(isa)));
+
+    SquareMatrix<NumericType> matrix(matrixSize);
+    fillRandom(matrix, 6);
+    matrix.luBlocked(16);
+    EXPECT_EQ(reference.getPivots(), matrix.getPivots());
+    for (unsigned int i = 0; i < matrixSize; i++)
+    {
+      for (unsigned int j = 0; j < matrixSize; j++)
+      {
+        EXPECT_NEAR(reference.get(i, j), matrix.get(i, j), 1e-10);
+      }
+    }
+
+    // The first maximum wins, as in the scalar search
+    std::vector<float> values(70);
+    for (unsigned int i = 0; i < values.size(); i++)
+    {
+      values[i] = static_cast<float>(i % 7) - 3;
+    }
+    values[0] = 0;
+    EXPECT_EQ(6u, simd::iamax(values.size(), values.data(), 1));
+    EXPECT_EQ(2u, simd::iamax(values.size() / 3, values.data(), 3));
+  }
+  simd::setIsa(simd::detectIsa());
+}
+
+TEST(NumericMatrix, PackedMultiply)
+{
+  // Edges in every direction and two blocks along the inner dimension
+  const unsigned int m = 131;
+  const unsigned int n = 97;
+  const unsigned int k = 263;
+  std::mt19937 generator(17);
+  std::uniform_real_distribution<NumericType> distribution(-1.0, 1.0);
+
+  NumericMatrix<NumericType> A(m, k);
+  NumericMatrix<NumericType> B(k, n);
+  NumericMatrix<NumericType> C(m, n);
+  for (unsigned int i = 0; i < m*k; i++)
+  {
+    A.getDataPtr()[i] = distribution(generator);
+  }
+  for (unsigned int i = 0; i < k*n; i++)
+  {
+    B.getDataPtr()[i] = distribution(generator);
+  }
+  for (unsigned int i = 0; i < m*n; i++)
+  {
+    C.getDataPtr()[i] = distribution(generator);
+  }
+
+  NumericMatrix<NumericType> serial(C);
+  NumericMatrix<NumericType> parallel(C);
+  multiply(serial, A, B, 0.5, 2.0);
+  WorkStealingPool pool(3);
+  multiply(parallel, A, B, 0.5, 2.0, pool);
+  for (unsigned int i = 0; i < m; i++)
+  {
+    for (unsigned int j = 0; j < n; j++)
+    {
+      NumericType expected = 2.0*C.get(i, j);
+      for (unsigned int l = 0; l < k; l++)
+      {
+        expected += 0.5*A.get(i, l)*B.get(l, j);
+      }
+      EXPECT_NEAR(expected, serial.get(i, j), 1e-12);
+      EXPECT_NEAR(serial.get(i, j), parallel.get(i, j), 1e-12);
+    }
+  }
+  EXPECT_THROW(multiply(C, B, A), Matrix_Errors);
+
+  // The blocked inverse runs its products through the packed kernel
+  const unsigned int matrixSize = 300;
+  SquareMatrix<NumericType> original(matrixSize);
+  fillRandom(original, 17);
+  SquareMatrix<NumericType> inverse(original);
+  inverse.lu();
+  inverse.invert();
+  SquareMatrix<NumericType> identity(matrixSize);
+  multiply(identity, original, inverse);
+  for (unsigned int i = 0; i < matrixSize; i++)
+  {
+    for (unsigned int j = 0; j < matrixSize; j++)
+    {
+      EXPECT_NEAR(i == j ? 1.0 : 0.0, identity.get(i, j), 1e-9);
+    }
+  }
+}
+
+TEST(NumericMatrix, FixedMatchesDynamic)
+{
+  const unsigned int matrixSize = 6;
+  SquareMatrix<NumericType> reference(matrixSize);
+  fillRandom(reference, 7);
+  FixedSquareMatrix<NumericType, matrixSize> matrix(matrixSize);
+  matrix.setData(reference.getDataPtr(), matrixSize*matrixSize);
+
+  reference.lu();
+  matrix.lu();
+  for (unsigned int i = 0; i < matrixSize; i++)
+  {
+    EXPECT_EQ(reference.getPivots()[i], matrix.getPivots()[i]);
+    for (unsigned int j = 0; j < matrixSize; j++)
+    {
+      EXPECT_NEAR(reference.get(i, j), matrix.get(i, j), 1e-12);
+    }
+  }
+
+  std::vector<NumericType> b(matrixSize);
+  std::iota(b.begin(), b.end(), 1.0);
+  std::vector<NumericType> expected = reference.solve(b);
+  std::vector<NumericType> x = matrix.solve(b);
+  for (unsigned int i = 0; i < matrixSize; i++)
+  {
+    EXPECT_NEAR(expected[i], x[i], 1e-10);
+  }
+
+  FixedSquareMatrix<NumericType, matrixSize> inverse = matrix.getInverse();
+  SquareMatrix<NumericType> expectedInverse = reference.getInverse();
+  for (unsigned int i = 0; i < matrixSize; i++)
+  {
+    for (unsigned int j = 0; j < matrixSize; j++)
+    {
+      EXPECT_NEAR(expectedInverse.get(i, j), inverse.get(i, j), 1e-10);
+    }
+  }
+
+  EXPECT_THROW((FixedSquareMatrix<NumericType, 3>(4)), Matrix_Errors);
+}
+
+constexpr FixedSquareMatrix<NumericType, 2, CheckedAccess> fixedInverse2()
+{
+  FixedSquareMatrix<NumericType, 2, CheckedAccess> matrix;
+  matrix.set(0, 0, 1);
+  matrix.set(0, 1, 2);
+  matrix.set(1, 0, 4);
+  matrix.set(1, 1, 2);
+  matrix.lu();
+  return matrix.getInverse();
+}
+
+TEST(NumericMatrix, FixedConstexpr)
+{
+  // Evaluated by the compiler
+  constexpr FixedSquareMatrix<NumericType, 2, CheckedAccess> inverse = fixedInverse2();
+  static_assert(inverse.get(0, 0) == -1.0/3, "wrong fixed inverse");
+  static_assert(inverse.get(0, 1) == 1.0/3, "wrong fixed inverse");
+  static_assert(inverse.get(1, 0) == 2.0/3, "wrong fixed inverse");
+  static_assert(inverse.get(1, 1) == -1.0/6, "wrong fixed inverse");
+  EXPECT_EQ(2u, inverse.getSize());
+}
+
+TEST(NumericMatrix, BatchedMatchesSquareMatrix)
+{
+  const unsigned int matrixSize = 5;
+  const size_t count = 37;
+  std::vector<SquareMatrix<NumericType> *> matrices;
+  for (size_t b = 0; b < count; b++)
+  {
+    matrices.push_back(new SquareMatrix<NumericType>(matrixSize));
+    fillRandom(*matrices.back(), 100 + b);
+  }
+
+  for (int isa = simd::ISA_SCALAR; isa <= simd::detectIsa(); isa++)
+  {
+    simd::setIsa(static_cast<simd::Isa>(isa));
+    BatchedSquareMatrix<NumericType> batch(matrixSize, count);
+    for (size_t b = 0; b < count; b++)
+    {
+      batch.setMatrix(b, matrices[b]->getDataPtr());
+    }
+    WorkStealingPool pool(2);
+    if (isa % 2)
+      batch.luParallel(pool);
+    else
+      batch.lu();
+    BatchedSquareMatrix<NumericType> inverse = batch.getInverseParallel(pool);
+
+    for (size_t b = 0; b < count; b++)
+    {
+      SquareMatrix<NumericType> reference(matrixSize);
+      reference.setData(matrices[b]->getDataPtr(), matrixSize*matrixSize);
+      reference.lu();
+      EXPECT_EQ(reference.getPivots(), batch.getPivots(b));
+      SquareMatrix<NumericType> expectedInverse = reference.getInverse();
+      for (unsigned int i = 0; i < matrixSize; i++)
+      {
+        for (unsigned int j = 0; j < matrixSize; j++)
+        {
+          EXPECT_NEAR(expectedInverse.get(i, j), inverse.get(b, i, j), 1e-9);
+        }
+      }
+    }
+  }
+  simd::setIsa(simd::detectIsa());
+
+  for (size_t b = 0; b < count; b++)
+  {
+    delete matrices[b];
+  }
+}
+
+TEST(NumericMatrix, Allocators)
+{
+  const unsigned int matrixSize = 200;
+  SquareMatrix<NumericType> aligned(matrixSize);
+  EXPECT_EQ(0u, reinterpret_cast<uintptr_t>(aligned.getDataPtr()) % matrixAlignment);
+
+  // Every block above 0 bytes is mapped with huge pages
+  HugePageAllocator hugePages(0);
+  SquareMatrix<NumericType> matrix(matrixSize, hugePages);
+  EXPECT_EQ(0u, reinterpret_cast<uintptr_t>(matrix.getDataPtr()) % matrixAlignment);
+  fillRandom(aligned, 8);
+  fillRandom(matrix, 8);
+  aligned.lu();
+  matrix.lu();
+  EXPECT_EQ(aligned.getPivots(), matrix.getPivots());
+
+  // Chunks are merged once the arena is empty, then it stops allocating
+  ScratchArena arena;
+  for (int iteration = 0; iteration < 3; iteration++)
+  {
+    const size_t allocations = defaultMatrixAllocator().getAllocationsCount();
+    void *a = arena.allocate(ScratchArena::defaultChunkSize);
+    void *b = arena.allocate(3*ScratchArena::defaultChunkSize);
+    void *c = arena.allocate(100);
+    EXPECT_EQ(0u, reinterpret_cast<uintptr_t>(c) % matrixAlignment);
+    arena.deallocate(c, 100);
+    arena.deallocate(b, 3*ScratchArena::defaultChunkSize);
+    arena.deallocate(a, ScratchArena::defaultChunkSize);
+    if (iteration > 0)
+    {
+      EXPECT_EQ(allocations, defaultMatrixAllocator().getAllocationsCount());
+    }
+  }
+
+  // Steady state loop of inversions without heap allocations
+  SquareMatrix<NumericType> source(matrixSize, scratchMatrixAllocator());
+  fillRandom(source, 9);
+  SquareMatrix<NumericType> work(matrixSize, scratchMatrixAllocator());
+  size_t allocations = 0;
+  for (int iteration = 0; iteration < 5; iteration++)
+  {
+    if (iteration == 2)
+    {
+      allocations = defaultMatrixAllocator().getAllocationsCount();
+    }
+    work.setData(source.getDataPtr(), matrixSize*matrixSize);
+    work.lu(INDIRECT_ROWS);
+    SquareMatrix<NumericType> inverse = work.getInverse();
+    EXPECT_EQ(&scratchMatrixAllocator(), &inverse.getAllocator());
+  }
+  EXPECT_EQ(allocations, defaultMatrixAllocator().getAllocationsCount());
+}
+
+TEST(NumericMatrix, CopyAndMove)
+{
+  const unsigned int matrixSize = 7;
+  SquareMatrix<NumericType> matrix(matrixSize);
+  fillRandom(matrix, 10);
+  matrix.lu();
+
+  SquareMatrix<NumericType> copy(matrix);
+  EXPECT_NE(matrix.getDataPtr(), copy.getDataPtr());
+  EXPECT_EQ(matrix.getPivots(), copy.getPivots());
+  EXPECT_EQ(0, memcmp(matrix.getDataPtr(), copy.getDataPtr(), matrixSize*matrixSize*sizeof(NumericType)));
+
+  NumericType *data = copy.getDataPtr();
+  std::vector<SquareMatrix<NumericType>> matrices;
+  matrices.push_back(std::move(copy));
+  EXPECT_EQ(data, matrices[0].getDataPtr());
+  EXPECT_EQ(0u, copy.getSize());
+  // A moved-from matrix is 0x0 and still usable
+  copy.lu();
+  copy.lu(INDIRECT_ROWS);
+  EXPECT_TRUE(copy.getPivots().empty());
+
+  SquareMatrix<NumericType> other(3);
+  other = matrices[0];
+  EXPECT_EQ(matrixSize, other.getSize());
+  EXPECT_EQ(matrix.get(3, 4), other.get(3, 4));
+  other = SquareMatrix<NumericType>(2);
+  EXPECT_EQ(2u, other.getSize());
+}
+
+TEST(NumericMatrix, MatrixExpressions)
+{
+  const unsigned int rows = 37;
+  const unsigned int cols = 23;
+  std::mt19937 generator(16);
+  std::uniform_real_distribution<NumericType> distribution(-1.0, 1.0);
+
+  NumericMatrix<NumericType> A(rows, cols);
+  NumericMatrix<NumericType> B(rows, cols);
+  NumericMatrix<NumericType> x(cols, 2);
+  NumericMatrix<NumericType> b(rows, 2);
+  for (unsigned int i = 0; i < rows; i++)
+  {
+    for (unsigned int j = 0; j < cols; j++)
+    {
+      A.set(i, j, distribution(generator));
+      B.set(i, j, distribution(generator));
+    }
+    b.set(i, 0, distribution(generator));
+    b.set(i, 1, distribution(generator));
+  }
+  for (unsigned int i = 0; i < cols; i++)
+  {
+    x.set(i, 0, distribution(generator));
+    x.set(i, 1, distribution(generator));
+  }
+
+  // The residual only allocates its result
+  AlignedAllocator allocator;
+  NumericMatrix<NumericType> R(A*x - b, allocator);
+  EXPECT_EQ(1u, allocator.getAllocationsCount());
+  ASSERT_EQ(rows, R.getRowsCount());
+  ASSERT_EQ(2u, R.getColumnsCount());
+  for (unsigned int i = 0; i < rows; i++)
+  {
+    for (unsigned int j = 0; j < 2; j++)
+    {
+      NumericType expected = -b.get(i, j);
+      for (unsigned int k = 0; k < cols; k++)
+      {
+        expected += A.get(i, k)*x.get(k, j);
+      }
+      EXPECT_NEAR(expected, R.get(i, j), 1e-12);
+    }
+  }
+
+  // Element-wise chains, transposes and products nested in them
+  NumericMatrix<NumericType> C = 2.0*A - B*0.5 + A;
+  SquareMatrix<NumericType> G = transpose(A)*B + 2*(transpose(B)*A);
+  for (unsigned int i = 0; i < rows; i++)
+  {
+    for (unsigned int j = 0; j < cols; j++)
+    {
+      EXPECT_NEAR(3*A.get(i, j) - 0.5*B.get(i, j), C.get(i, j), 1e-14);
+    }
+  }
+  for (unsigned int i = 0; i < cols; i++)
+  {
+    for (unsigned int j = 0; j < cols; j++)
+    {
+      NumericType expected = 0.0;
+      for (unsigned int k = 0; k < rows; k++)
+      {
+        expected += A.get(k, i)*B.get(k, j) + 2*B.get(k, i)*A.get(k, j);
+      }
+      EXPECT_NEAR(expected, G.get(i, j), 1e-12);
+    }
+  }
+
+  // Assignments that read their destination, and size errors
+  NumericMatrix<NumericType> D(A);
+  D = D + B;
+  EXPECT_NEAR(A.get(3, 4) + B.get(3, 4), D.get(3, 4), 1e-15);
+  G = G*G - transpose(G);
+  SquareMatrix<NumericType> H = transpose(A)*B + 2*(transpose(B)*A);
+  NumericMatrix<NumericType> expectedG = H*H - transpose(H);
+  EXPECT_NEAR(expectedG.get(5, 7), G.get(5, 7), 1e-12);
+  D = transpose(A);
+  EXPECT_EQ(cols, D.getRowsCount());
+  EXPECT_EQ(A.get(4, 3), D.get(3, 4));
+  EXPECT_THROW(A + x, Matrix_Errors);
+  EXPECT_THROW(A*A, Matrix_Errors);
+  EXPECT_THROW(SquareMatrix<NumericType> S(A + B), Matrix_Errors);
+}
+
+TEST(NumericMatrix, InverseVariants)
+{
+  const unsigned int matrixSize = 70;
+  SquareMatrix<NumericType> original(matrixSize);
+  fillRandom(original, 11);
+  SquareMatrix<NumericType> matrix(original);
+  matrix.luBlocked(16);
+  const SquareMatrix<NumericType> factorization(matrix);
+
+  SquareMatrix<NumericType> inverse = matrix.getInverse();
+  EXPECT_EQ(0, memcmp(factorization.getDataPtr(), matrix.getDataPtr(), matrixSize*matrixSize*sizeof(NumericType)));
+
+  SquareMatrix<NumericType> out(matrixSize);
+  matrix.getInverse(out);
+  matrix.invert();
+  EXPECT_TRUE(matrix.getPivots().empty());
+
+  // A * A-1 = I
+  for (unsigned int i = 0; i < matrixSize; i++)
+  {
+    for (unsigned int j = 0; j < matrixSize; j++)
+    {
+      NumericType sum = 0;
+      for (unsigned int k = 0; k < matrixSize; k++)
+      {
+        sum += original.get(i, k)*inverse.get(k, j);
+      }
+      EXPECT_NEAR(i == j ? 1 : 0, sum, 1e-10);
+      EXPECT_EQ(inverse.get(i, j), out.get(i, j));
+      EXPECT_EQ(inverse.get(i, j), matrix.get(i, j));
+    }
+  }
+
+  SquareMatrix<NumericType> wrongSize(3);
+  EXPECT_THROW(factorization.getInverse(wrongSize), Matrix_Errors);
+}
+
+TEST(NumericMatrix, LURecursiveMatchesLU)
+{
+  for (unsigned int matrixSize : {1u, 5u, 16u, 17u, 137u})
+  {
+    SquareMatrix<NumericType> reference(matrixSize);
+    fillRandom(reference, 12);
+    SquareMatrix<NumericType> matrix(reference);
+    reference.lu();
+    matrix.luRecursive();
+    EXPECT_EQ(reference.getPivots(), matrix.getPivots());
+    for (unsigned int i = 0; i < matrixSize; i++)
+    {
+      for (unsigned int j = 0; j < matrixSize; j++)
+      {
+        EXPECT_NEAR(reference.get(i, j), matrix.get(i, j), 1e-10);
+      }
+    }
+  }
+}
+
+TEST(NumericMatrix, SymmetricFactorizations)
+{
+  const unsigned int matrixSize = 50;
+  std::mt19937 generator(15);
+  std::uniform_real_distribution<NumericType> distribution(-1.0, 1.0);
+
+  // Positive definite B'B + nI and indefinite B + B' with a zero diagonal,
+  // which forces 2x2 pivots
+  SquareMatrix<NumericType> B(matrixSize);
+  for (unsigned int i = 0; i < matrixSize; i++)
+  {
+    for (unsigned int j = 0; j < matrixSize; j++)
+    {
+      B.set(i, j, distribution(generator));
+    }
+  }
+  SquareMatrix<NumericType> spd(matrixSize);
+  SquareMatrix<NumericType> indefinite(matrixSize);
+  for (unsigned int i = 0; i < matrixSize; i++)
+  {
+    for (unsigned int j = 0; j < matrixSize; j++)
+    {
+      NumericType sum = (i == j) ? matrixSize : 0.0;
+      for (unsigned int k = 0; k < matrixSize; k++)
+      {
+        sum += B.get(k, i)*B.get(k, j);
+      }
+      spd.set(i, j, sum);
+      indefinite.set(i, j, (i == j) ? 0.0 : B.get(i, j) + B.get(j, i));
+    }
+  }
+  EXPECT_TRUE(spd.isSymmetric());
+  EXPECT_TRUE(indefinite.isSymmetric());
+  EXPECT_FALSE(B.isSymmetric());
+
+  SquareMatrix<NumericType> notPositive(indefinite);
+  EXPECT_THROW(notPositive.cholesky(), Matrix_Errors);
+
+  std::vector<NumericType> b(matrixSize);
+  std::iota(b.begin(), b.end(), 1.0);
+  SquareMatrix<NumericType> *matrices[] = { &spd, &indefinite };
+  for (unsigned int c = 0; c < 2; c++)
+  {
+    SquareMatrix<NumericType> luFactors(*matrices[c]);
+    SquareMatrix<NumericType> symmetricFactors(*matrices[c]);
+    luFactors.lu();
+    if (c == 0)
+    {
+      symmetricFactors.cholesky();
+      EXPECT_EQ(CHOLESKY_FACTORIZATION, symmetricFactors.getFactorization());
+    }
+    else
+    {
+      symmetricFactors.ldlt();
+      EXPECT_EQ(LDLT_FACTORIZATION, symmetricFactors.getFactorization());
+      EXPECT_LT(symmetricFactors.getSymmetricPivots()[0], 0);
+    }
+
+    std::vector<NumericType> expected = luFactors.solve(b);
+    std::vector<NumericType> x = symmetricFactors.solve(b);
+    NumericMatrix<NumericType> X(matrixSize, 2);
+    for (unsigned int i = 0; i < matrixSize; i++)
+    {
+      X.set(i, 0, b[i]);
+      X.set(i, 1, 2*b[i]);
+    }
+    symmetricFactors.solve(X);
+    for (unsigned int i = 0; i < matrixSize; i++)
+    {
+      EXPECT_NEAR(expected[i], x[i], 1e-8*std::max(1.0, std::abs(expected[i])));
+      EXPECT_NEAR(x[i], X.get(i, 0), 1e-10*std::max(1.0, std::abs(x[i])));
+      EXPECT_NEAR(2*x[i], X.get(i, 1), 1e-10*std::max(1.0, std::abs(x[i])));
+    }
+
+    SquareMatrix<NumericType> expectedInverse = luFactors.getInverse();
+    SquareMatrix<NumericType> inverse = symmetricFactors.getInverse();
+    for (unsigned int i = 0; i < matrixSize; i++)
+    {
+      for (unsigned int j = 0; j < matrixSize; j++)
+      {
+        EXPECT_NEAR(expectedInverse.get(i, j), inverse.get(i, j), 1e-8);
+      }
+    }
+  }
+}
+
+TEST(NumericMatrix, LowRankUpdates)
+{
+  const unsigned int matrixSize = 60;
+  std::mt19937 generator(31);
+  std::uniform_real_distribution<NumericType> distribution(-1.0, 1.0);
+  SquareMatrix<NumericType> original(matrixSize);
+  fillRandom(original, 31);
+  SquareMatrix<NumericType> factors(original);
+  factors.lu();
+  EXPECT_EQ(0u, factors.getUpdateCount());
+
+  // Every update is checked against a factorization of the updated matrix
+  std::vector<NumericType> b(matrixSize);
+  for (unsigned int i = 0; i < matrixSize; i++)
+  {
+    b[i] = distribution(generator);
+  }
+  auto expectSameSolution = [&]() {
+    SquareMatrix<NumericType> fresh(original);
+    fresh.lu();
+    const std::vector<NumericType> expected = fresh.solve(b);
+    const std::vector<NumericType> x = factors.solve(b);
+    for (unsigned int i = 0; i < matrixSize; i++)
+    {
+      EXPECT_NEAR(expected[i], x[i], 1e-9);
+    }
+  };
+
+  std::vector<NumericType> x(matrixSize);
+  std::vector<NumericType> y(matrixSize);
+  for (unsigned int i = 0; i < matrixSize; i++)
+  {
+    x[i] = 0.1*distribution(generator);
+    y[i] = 0.1*distribution(generator);
+  }
+  factors.update(x, y);
+  for (unsigned int i = 0; i < matrixSize; i++)
+  {
+    for (unsigned int j = 0; j < matrixSize; j++)
+    {
+      original.set(i, j, original.get(i, j)+x[i]*y[j]);
+    }
+  }
+  expectSameSolution();
+  EXPECT_EQ(1u, factors.getUpdateCount());
+
+  const unsigned int rank = 3;
+  NumericMatrix<NumericType> X(matrixSize, rank);
+  NumericMatrix<NumericType> Y(matrixSize, rank);
+  for (unsigned int i = 0; i < matrixSize*rank; i++)
+  {
+    X.getDataPtr()[i] = 0.1*distribution(generator);
+    Y.getDataPtr()[i] = 0.1*distribution(generator);
+  }
+  factors.update(X, Y);
+  for (unsigned int i = 0; i < matrixSize; i++)
+  {
+    for (unsigned int j = 0; j < matrixSize; j++)
+    {
+      for (unsigned int r = 0; r < rank; r++)
+      {
+        original.set(i, j, original.get(i, j)+X.get(i, r)*Y.get(j, r));
+      }
+    }
+  }
+  expectSameSolution();
+  EXPECT_EQ(1u+rank, factors.getUpdateCount());
+
+  std::vector<NumericType> values(matrixSize);
+  for (unsigned int i = 0; i < matrixSize; i++)
+  {
+    values[i] = distribution(generator);
+  }
+  factors.replaceRow(7, values);
+  for (unsigned int j = 0; j < matrixSize; j++)
+  {
+    original.set(7, j, values[j]);
+  }
+  expectSameSolution();
+  factors.replaceColumn(11, values);
+  for (unsigned int i = 0; i < matrixSize; i++)
+  {
+    original.set(i, 11, values[i]);
+  }
+  expectSameSolution();
+
+  // A zero pivot without interchanges: factorized again with pivoting
+  SquareMatrix<NumericType> small(4);
+  small.setZero();
+  for (unsigned int i = 0; i < 4; i++)
+  {
+    small.set(i, i, 1.0);
+  }
+  small.set(0, 1, 1.0);
+  small.set(1, 0, 1.0);
+  small.set(1, 1, 2.0);
+  small.lu();
+  small.update({-1.0, 0.0, 0.0, 0.0}, {1.0, 0.0, 0.0, 0.0});
+  EXPECT_EQ(0u, small.getUpdateCount());
+  EXPECT_EQ(1u, small.getPivots()[0]);
+  const std::vector<NumericType> solution = small.solve({1.0, 3.0, 1.0, 1.0});
+  for (unsigned int i = 0; i < 4; i++)
+  {
+    EXPECT_NEAR(1.0, solution[i], 1e-14);
+  }
+
+  small.ldlt();
+  EXPECT_THROW(small.update(x, y), Matrix_Errors);
+}
+
+TEST(NumericMatrix, MixedPrecisionRefinement)
+{
+  const unsigned int matrixSize = 100;
+  SquareMatrix<NumericType> matrix(matrixSize);
+  fillRandom(matrix, 13);
+  std::vector<NumericType> b(matrixSize);
+  std::iota(b.begin(), b.end(), 1.0);
+
+  MixedPrecisionSolver<> solver(matrix);
+  std::vector<NumericType> x;
+  RefinementInfo info = solver.solve(b, x);
+  EXPECT_FALSE(info.fellBack);
+  EXPECT_GT(info.iterations, 0u);
+  EXPECT_LT(info.backwardError, 1e-15);
+
+  SquareMatrix<NumericType> reference(matrix);
+  reference.lu();
+  std::vector<NumericType> expected = reference.solve(b);
+  for (unsigned int i = 0; i < matrixSize; i++)
+  {
+    EXPECT_NEAR(expected[i], x[i], 1e-10*std::abs(expected[i]));
+  }
+
+  // Hilbert matrix: far too ill conditioned for a float factorization
+  const unsigned int hilbertSize = 10;
+  SquareMatrix<NumericType> hilbert(hilbertSize);
+  for (unsigned int i = 0; i < hilbertSize; i++)
+  {
+    for (unsigned int j = 0; j < hilbertSize; j++)
+    {
+      hilbert.set(i, j, 1.0/(i+j+1));
+    }
+  }
+  MixedPrecisionSolver<> hilbertSolver(hilbert);
+  info = hilbertSolver.solve(std::vector<NumericType>(hilbertSize, 1.0), x);
+  EXPECT_TRUE(info.fellBack);
+  EXPECT_TRUE(hilbertSolver.hasFallenBack());
+  EXPECT_LT(info.backwardError, 1e-15);
+}
+
+TEST(NumericMatrix, SparseLU)
+{
+  // Convection-diffusion on a 15 x 15 grid, plus a row needing a pivot
+  const unsigned int grid = 15;
+  const unsigned int matrixSize = grid*grid;
+  std::vector<Triplet<NumericType>> triplets;
+  for (unsigned int i = 0; i < grid; i++)
+  {
+    for (unsigned int j = 0; j < grid; j++)
+    {
+      const unsigned int row = i*grid+j;
+      triplets.push_back({row, row, row == 7 ? 0.0 : 4.0});
+      if (i > 0) triplets.push_back({row, row-grid, -1.5});
+      if (i+1 < grid) triplets.push_back({row, row+grid, -0.5});
+      if (j > 0) triplets.push_back({row, row-1, -1.0});
+      if (j+1 < grid) triplets.push_back({row, row+1, -1.0});
+    }
+  }
+  triplets.push_back({3, 3, 0.5});
+  SparseMatrix<NumericType> sparse(matrixSize, matrixSize, triplets);
+  EXPECT_EQ(4.5, sparse.get(3, 3));
+  EXPECT_EQ(0.0, sparse.get(0, 2));
+
+  CsrStorage<NumericType> csr = sparse.toCsr();
+  EXPECT_EQ(sparse.getNonZerosCount(), csr.values.size());
+  EXPECT_EQ(3u, csr.rowPointers[1]);
+  EXPECT_EQ(-1.0, csr.values[1]);
+
+  SquareMatrix<NumericType> dense(matrixSize);
+  dense.setZero();
+  for (const Triplet<NumericType> &t : triplets)
+  {
+    dense.set(t.row, t.col, dense.get(t.row, t.col)+t.value);
+  }
+  dense.lu();
+  std::vector<NumericType> b(matrixSize);
+  std::iota(b.begin(), b.end(), 1.0);
+  std::vector<NumericType> expected = dense.solve(b);
+
+  SparseLU<NumericType> natural;
+  natural.analyze(sparse, NATURAL_ORDERING);
+  natural.factorize(sparse);
+  SparseLU<NumericType> lu;
+  lu.analyze(sparse);
+  lu.factorize(sparse);
+  EXPECT_LT(lu.getNonZerosCount(), natural.getNonZerosCount());
+
+  std::vector<NumericType> x = lu.solve(b);
+  std::vector<NumericType> y = natural.solve(b);
+  for (unsigned int i = 0; i < matrixSize; i++)
+  {
+    EXPECT_NEAR(expected[i], x[i], 1e-10);
+    EXPECT_NEAR(expected[i], y[i], 1e-10);
+  }
+
+  // New values on the same pattern
+  for (NumericType &value : sparse.getValues())
+  {
+    value *= 2;
+  }
+  lu.refactor(sparse);
+  NumericMatrix<NumericType> B(matrixSize, 2);
+  for (unsigned int i = 0; i < matrixSize; i++)
+  {
+    B.set(i, 0, b[i]);
+    B.set(i, 1, 2*b[i]);
+  }
+  lu.solve(B);
+  for (unsigned int i = 0; i < matrixSize; i++)
+  {
+    EXPECT_NEAR(expected[i]/2, B.get(i, 0), 1e-10);
+    EXPECT_NEAR(expected[i], B.get(i, 1), 1e-10);
+  }
+
+  SparseMatrix<NumericType> singular(2, 2, {{0, 0, 1.0}, {1, 0, 1.0}});
+  SparseLU<NumericType> singularLU;
+  EXPECT_THROW(singularLU.factorize(singular), Matrix_Errors);
+}
+
+TEST(NumericMatrix, BandMatrix)
+{
+  const unsigned int matrixSize = 60;
+  std::mt19937 generator(14);
+  std::uniform_real_distribution<NumericType> distribution(-1.0, 1.0);
+
+  // (lower, upper) bands: pivoted path, and tridiagonal with and without
+  // diagonal dominance
+  const unsigned int bands[][2] = { {3, 2}, {1, 1}, {1, 1} };
+  for (unsigned int c = 0; c < 3; c++)
+  {
+    SquareMatrix<NumericType> dense(matrixSize);
+    dense.setZero();
+    for (unsigned int i = 0; i < matrixSize; i++)
+    {
+      for (unsigned int j = 0; j < matrixSize; j++)
+      {
+        if (i <= j+bands[c][0] && j <= i+bands[c][1])
+        {
+          dense.set(i, j, distribution(generator));
+        }
+      }
+      if (c == 1)
+      {
+        dense.set(i, i, 3.0);
+      }
+    }
+
+    Bandwidth bw = detectBandwidth(dense);
+    EXPECT_EQ(bands[c][0], bw.lower);
+    EXPECT_EQ(bands[c][1], bw.upper);
+    BandMatrix<NumericType> band = BandMatrix<NumericType>::fromDense(dense);
+    EXPECT_EQ(dense.get(5, 4), band.get(5, 4));
+    EXPECT_EQ(0.0, band.get(0, 10));
+    EXPECT_THROW(band.set(0, 10, 1.0), Matrix_Errors);
+
+    std::vector<NumericType> b(matrixSize);
+    std::iota(b.begin(), b.end(), 1.0);
+    dense.lu();
+    band.lu();
+    std::vector<NumericType> expected = dense.solve(b);
+    std::vector<NumericType> x = band.solve(b);
+
+    NumericMatrix<NumericType> B(matrixSize, 2);
+    for (unsigned int i = 0; i < matrixSize; i++)
+    {
+      B.set(i, 0, b[i]);
+      B.set(i, 1, -b[i]);
+    }
+    band.solve(B);
+    for (unsigned int i = 0; i < matrixSize; i++)
+    {
+      EXPECT_NEAR(expected[i], x[i], 1e-8*std::max(1.0, std::abs(expected[i])));
+      EXPECT_EQ(x[i], B.get(i, 0));
+      EXPECT_EQ(-x[i], B.get(i, 1));
+    }
+    if (c == 1)
+    {
+      // Thomas algorithm, no interchanges
+      for (unsigned int i = 0; i < matrixSize; i++)
+      {
+        EXPECT_EQ(i, band.getPivots()[i]);
+      }
+    }
+  }
+
+  // Weakly dominant but singular: both paths detect it
+  for (unsigned int upper = 1; upper <= 2; upper++)
+  {
+    BandMatrix<NumericType> singular(2, 1, upper);
+    singular.set(0, 0, 1.0);
+    singular.set(0, 1, 1.0);
+    singular.set(1, 0, 1.0);
+    singular.set(1, 1, 1.0);
+    EXPECT_THROW(singular.lu(), Matrix_Errors);
+  }
+}
+
+TEST(NumericMatrix, Instrumentation)
+{
+  const unsigned int matrixSize = 50;
+  SquareMatrix<NumericType> matrix(matrixSize);
+  fillRandom(matrix, 19);
+  std::vector<InstrumentationReport> reports;
+  const int observer = instrumentation::addObserver([&reports](const InstrumentationReport &report) {
+    reports.push_back(report);
+  });
+
+  matrix.lu();
+  matrix.solve(std::vector<NumericType>(matrixSize, 1.0));
+  if (instrumentation::enabled)
+  {
+    // One report per outermost operation, with the phases of its kernels
+    ASSERT_EQ(2u, reports.size());
+    EXPECT_STREQ("lu", reports[0].operation);
+    EXPECT_EQ(matrixSize, reports[0].size);
+    EXPECT_EQ(matrixSize-1, reports[0].phases[PHASE_PIVOT_SEARCH].calls);
+    EXPECT_EQ(matrixSize-1, reports[0].phases[PHASE_ELIMINATION].calls);
+    uint64_t flops = 0;
+    for (uint64_t m = 1; m < matrixSize; m++)
+    {
+      flops += m*(2*m+1);
+    }
+    EXPECT_EQ(flops, reports[0].phases[PHASE_ELIMINATION].flops);
+    EXPECT_EQ(0u, reports[0].phases[PHASE_FORWARD_SUBSTITUTION].calls);
+    EXPECT_STREQ("solve", reports[1].operation);
+    EXPECT_EQ(1u, reports[1].phases[PHASE_FORWARD_SUBSTITUTION].calls);
+    EXPECT_EQ(1u, reports[1].phases[PHASE_BACKWARD_SUBSTITUTION].calls);
+    EXPECT_EQ(0u, reports[1].phases[PHASE_ELIMINATION].calls);
+    EXPECT_GE(instrumentation::getTotals().phases[PHASE_ELIMINATION].calls, matrixSize-1);
+  }
+  else
+  {
+    EXPECT_TRUE(reports.empty());
+    EXPECT_FALSE(instrumentation::enableHardwareCounters(true));
+  }
+
+  instrumentation::removeObserver(observer);
+  reports.clear();
+  matrix.luBlocked();
+  EXPECT_TRUE(reports.empty());
+}
+
+TEST(NumericMatrix, BinaryMatrixFile)
+{
+  const unsigned int matrixSize = 40;
+  const std::string path = ::testing::TempDir()+"vlu_matrix.bin";
+  SquareMatrix<NumericType> matrix(matrixSize);
+  fillRandom(matrix, 23);
+  const std::vector<NumericType> b(matrixSize, 1.0);
+  matrix.luBlocked(16);
+  saveMatrix(path, matrix);
+
+  // The mapped factorization solves without factorizing again
+  {
+    SquareMatrix<NumericType> mapped = mapSquareMatrix<NumericType>(path);
+    EXPECT_TRUE(mapped.isExternal());
+    EXPECT_EQ(LU_FACTORIZATION, mapped.getFactorization());
+    EXPECT_EQ(matrix.getPivots(), mapped.getPivots());
+    EXPECT_EQ(0u, reinterpret_cast<uintptr_t>(mapped.getDataPtr())%matrixAlignment);
+    const std::vector<NumericType> expected = matrix.solve(b);
+    const std::vector<NumericType> x = mapped.solve(b);
+    for (unsigned int i = 0; i < matrixSize; i++)
+    {
+      EXPECT_EQ(expected[i], x[i]);
+    }
+
+    // Copies own their memory, the file is not modified by the mapping
+    SquareMatrix<NumericType> copy(mapped);
+    EXPECT_FALSE(copy.isExternal());
+    mapped.setZero();
+  }
+  SquareMatrix<NumericType> reloaded = mapSquareMatrix<NumericType>(path);
+  EXPECT_EQ(matrix.get(3, 5), reloaded.get(3, 5));
+
+  SquareMatrix<NumericType> symmetric(3);
+  NumericType values[] = {4, 1, 2, 1, -3, 0, 2, 0, 1};
+  symmetric.setData(values, 9);
+  symmetric.ldlt();
+  saveMatrix(path, symmetric);
+  SquareMatrix<NumericType> mappedLdlt = mapSquareMatrix<NumericType>(path);
+  EXPECT_EQ(symmetric.getSymmetricPivots(), mappedLdlt.getSymmetricPivots());
+  EXPECT_NEAR(1.0, mappedLdlt.solve({7, -2, 3})[0], 1e-12);
+
+  NumericMatrix<float> rectangular(3, 5);
+  for (unsigned int i = 0; i < 15; i++)
+  {
+    rectangular.getDataPtr()[i] = i;
+  }
+  saveMatrix(path, rectangular);
+  EXPECT_EQ(FILE_FLOAT32, readMatrixFileHeader(path).elementType);
+  NumericMatrix<float> mappedFloat = mapMatrix<float>(path);
+  EXPECT_EQ(5u, mappedFloat.getColumnsCount());
+  EXPECT_EQ(13.0f, mappedFloat.get(2, 3));
+  EXPECT_THROW(mapMatrix<double>(path), Matrix_Errors);
+  EXPECT_THROW(mapSquareMatrix<float>(path), Matrix_Errors);
+  EXPECT_THROW(mapMatrix<double>(path+".missing"), Matrix_Errors);
+  std::remove(path.c_str());
+}
+
+TEST(NumericMatrix, BinaryMatrixStream)
+{
+  SquareMatrix<NumericType> factors(5);
+  fillRandom(factors, 5);
+  factors.lu();
+  NumericMatrix<NumericType> rectangular(2, 3);
+  for (unsigned int i = 0; i < 6; i++)
+  {
+    rectangular.getDataPtr()[i] = i;
+  }
+
+  // Files written one after the other are read back in turn
+  std::stringstream stream;
+  saveMatrix(stream, factors);
+  saveMatrix(stream, rectangular);
+  const NumericMatrix<NumericType> first = readMatrix<NumericType>(stream);
+  const NumericMatrix<NumericType> second = readMatrix<NumericType>(stream);
+  EXPECT_EQ(std::char_traits<char>::eof(), stream.peek());
+  ASSERT_EQ(5u, first.getRowsCount());
+  ASSERT_EQ(5u, first.getColumnsCount());
+  for (unsigned int i = 0; i < 25; i++)
+  {
+    EXPECT_EQ(factors.getDataPtr()[i], first.getDataPtr()[i]);
+  }
+  ASSERT_EQ(2u, second.getRowsCount());
+  ASSERT_EQ(3u, second.getColumnsCount());
+  EXPECT_EQ(5.0, second.get(1, 2));
+
+  std::stringstream shortened(stream.str().substr(0, 4200));
+  EXPECT_THROW(readMatrix<NumericType>(shortened), Matrix_Errors);
+  std::stringstream text("%%MatrixMarket matrix array real general\n1 1\n1\n");
+  EXPECT_THROW(readMatrix<NumericType>(text), Matrix_Errors);
+
+  // Comments go after the banner and are skipped when reading
+  std::stringstream market;
+  writeMatrixMarket(market, rectangular, "first line\nsecond line");
+  EXPECT_NE(std::string::npos, market.str().find("\n%second line\n"));
+  const NumericMatrix<NumericType> read = readMatrixMarket<NumericType>(market);
+  EXPECT_EQ(5.0, read.get(1, 2));
+}
+
+TEST(NumericMatrix, MatrixMarket)
+{
+  std::istringstream coordinate(
+    "%%MatrixMarket matrix coordinate real symmetric\n"
+    "% lower triangle only\n"
+    "3 3 4\n"
+    "1 1 4.0\n"
+    "2 1 1.0\n"
+    "3 1 2.0\n"
+    "2 2 -3.0\n");
+  SquareMatrix<NumericType> dense = readSquareMatrixMarket<NumericType>(coordinate);
+  EXPECT_EQ(2.0, dense.get(0, 2));
+  EXPECT_EQ(2.0, dense.get(2, 0));
+  EXPECT_EQ(0.0, dense.get(2, 2));
+  EXPECT_TRUE(dense.isSymmetric());
+
+  std::istringstream skew(
+    "%%MatrixMarket matrix coordinate integer skew-symmetric\n"
+    "2 2 1\n"
+    "2 1 5\n");
+  SparseMatrix<NumericType> sparse = readSparseMatrixMarket<NumericType>(skew);
+  EXPECT_EQ(2u, sparse.getNonZerosCount());
+  EXPECT_EQ(-5.0, sparse.get(0, 1));
+
+  // Array files are column-major
+  NumericMatrix<NumericType> rectangular(2, 3);
+  for (unsigned int i = 0; i < 6; i++)
+  {
+    rectangular.getDataPtr()[i] = 1.0/(i+1);
+  }
+  std::stringstream array;
+  writeMatrixMarket(array, rectangular);
+  NumericMatrix<NumericType> read = readMatrixMarket<NumericType>(array);
+  ASSERT_EQ(2u, read.getRowsCount());
+  ASSERT_EQ(3u, read.getColumnsCount());
+  for (unsigned int i = 0; i < 6; i++)
+  {
+    EXPECT_EQ(rectangular.getDataPtr()[i], read.getDataPtr()[i]);
+  }
+
+  std::istringstream complex("%%MatrixMarket matrix coordinate complex general\n1 1 1\n1 1 1 0\n");
+  EXPECT_THROW(readMatrixMarket<NumericType>(complex), Matrix_Errors);
+  std::istringstream truncated("%%MatrixMarket matrix coordinate real general\n2 2 2\n1 1 1\n");
+  EXPECT_THROW(readMatrixMarket<NumericType>(truncated), Matrix_Errors);
+  std::istringstream outOfRange("%%MatrixMarket matrix coordinate real general\n2 2 1\n3 1 1\n");
+  EXPECT_THROW(readMatrixMarket<NumericType>(outOfRange), Matrix_Errors);
+}
+
+TEST(NumericMatrix, BoundedQueue)
+{
+  const unsigned int count = 1000;
+  BoundedQueue<unsigned int> queue(4);
+  std::atomic<size_t> largest(0);
+  std::thread producer([&]() {
+    for (unsigned int i = 0; i < count; i++)
+    {
+      EXPECT_TRUE(queue.push(i));
+      largest = std::max<size_t>(largest, queue.size());
+    }
+    queue.close();
+  });
+  unsigned int value;
+  unsigned int expected = 0;
+  while (queue.pop(value))
+  {
+    EXPECT_EQ(expected, value);
+    expected++;
+  }
+  producer.join();
+  EXPECT_EQ(count, expected);
+  EXPECT_LE(largest, queue.getCapacity());
+  EXPECT_FALSE(queue.push(0));
+}
+
 int main(int argc, char *argv[])
 {
   ::testing::InitGoogleTest(&argc, argv);